@@ -1,13 +1,28 @@
 #include "Bus.h"
 
+#include <atomic>
+
 #include "cpu.h"
 
-Bus::Bus() {}
+Bus::Bus() : ram{} {}
 Bus::~Bus() {}
 
 void Bus::write(uint16_t address, uint16_t value) {
   if (address >= 0 && address <= 0xffff) {
-    ram[address] = value;
+    if (uint8_t trap = trap_page[address / MMIO_PAGE_SIZE]) {
+      if (trap & TRAP_WATCH) watcher.access(watcher.context, address, true);
+      if (const MmioRange* device = findDevice(address)) {
+        device->write(device->context, address - device->begin, value);
+        return;
+      }
+    }
+    if (shared) {
+      std::atomic_ref<uint16_t>(ram[address])
+          .store(value, std::memory_order_relaxed);
+    } else {
+      ram[address] = value;
+    }
+    if (track_dirty) markDirty(address);
   } else {
     raiseError("Address: " + std::to_string(address) + " out of range");
   }
@@ -15,6 +30,16 @@ void Bus::write(uint16_t address, uint16_t value) {
 
 uint16_t Bus::read(uint16_t address) {
   if (address >= 0 && address <= 0xffff) {
+    if (uint8_t trap = trap_page[address / MMIO_PAGE_SIZE]) {
+      if (trap & TRAP_WATCH) watcher.access(watcher.context, address, false);
+      if (const MmioRange* device = findDevice(address)) {
+        return device->read(device->context, address - device->begin);
+      }
+    }
+    if (shared) {
+      return std::atomic_ref<uint16_t>(ram[address])
+          .load(std::memory_order_relaxed);
+    }
     return ram[address];
   } else {
     raiseError("Address: " + std::to_string(address) + " out of range");
@@ -22,4 +47,33 @@ uint16_t Bus::read(uint16_t address) {
   return 0;
 };
 
-void Bus::connectToCPU(CPU* c) { cpu = c; }
\ No newline at end of file
+bool Bus::mapDevice(const MmioRange& range) {
+  if (range.begin > range.end || range.begin <= ROM_END) return false;
+  for (const MmioRange& other : mmio) {
+    if (range.begin <= other.end && other.begin <= range.end) return false;
+  }
+  mmio.push_back(range);
+  for (uint32_t page = range.begin / MMIO_PAGE_SIZE;
+       page <= range.end / MMIO_PAGE_SIZE; page++) {
+    trap_page[page] |= TRAP_DEVICE;
+  }
+  return true;
+}
+
+// the lock word lives in RAM, so the image and debuggers still see it
+static uint16_t spinlockRead(void* context, uint16_t offset) {
+  return std::atomic_ref<uint16_t>(static_cast<Bus*>(context)->ram[SPINLOCK])
+      .exchange(1, std::memory_order_acquire);
+}
+
+// releasing the lock publishes the writes made while holding it
+static void spinlockWrite(void* context, uint16_t offset, uint16_t value) {
+  std::atomic_ref<uint16_t>(static_cast<Bus*>(context)->ram[SPINLOCK])
+      .store(value, std::memory_order_release);
+}
+
+void Bus::enableSpinlock() {
+  mapDevice({SPINLOCK, SPINLOCK, this, spinlockRead, spinlockWrite});
+}
+
+void Bus::connectToCPU(CPU* c) { cpus.push_back(c); }
\ No newline at end of file
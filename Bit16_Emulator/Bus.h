@@ -2,6 +2,8 @@
 
 #include <stdint.h>
 
+#include <vector>
+
 #include "../common/common.h"
 #include "cpu.h"
 
@@ -17,19 +19,110 @@
 #define RAM_END 0xfdfd
 
 #define KEYBOARD 0xfdfe
+#define SPINLOCK 0xfdff
+#define IRQ_PENDING 0xfe00
+#define DEVICE_BEGIN 0xfe01
+#define DEVICE_END 0xfeff
+#define STACK_BEGIN 0xff00
+#define STACK_END 0xffff
+
+// memory is tracked for restoring in pages of this many words
+#define DIRTY_PAGE_SIZE 256
+// pages of this many words are trapped when a device is mapped into them or
+// a debugger watches them
+#define MMIO_PAGE_SIZE 256
 
 class CPU;
+
+// A memory-mapped device: reads and writes of [begin, end] go to it instead
+// of RAM, with the offset from begin
+struct MmioRange {
+  uint16_t begin;
+  uint16_t end;
+  void* context;
+  uint16_t (*read)(void* context, uint16_t offset);
+  void (*write)(void* context, uint16_t offset, uint16_t value);
+};
+
+// Debugger watchpoints: told of every access to a watched page before it is
+// made, with write false for reads
+struct BusWatcher {
+  void* context = nullptr;
+  void (*access)(void* context, uint16_t address, bool write) = nullptr;
+};
+
 class Bus {
  public:
   Bus();
   ~Bus();
 
-  // Devices connected to the bus
-  CPU* cpu;
+  // CPUs connected to the bus, one per core
+  std::vector<CPU*> cpus;
   uint16_t ram[TOTAL_SIZE];
 
   void connectToCPU(CPU* cpu);
 
   void write(uint16_t address, uint16_t value);
   uint16_t read(uint16_t address);
+
+  // Shared between cores on host threads, every word is read and written
+  // atomically. Writes by one core are only ordered for the others by the
+  // spinlock or by the end of a quantum (see multiCore.h).
+  void setShared(bool enabled) { shared = enabled; }
+  // Maps the spinlock register at SPINLOCK: a read returns the old value and
+  // sets it to 1, so reading 0 means the lock was taken; writing 0 releases it
+  void enableSpinlock();
+
+  // false if the range overlaps ROM or a device mapped before
+  bool mapDevice(const MmioRange& range);
+  const MmioRange* findDevice(uint16_t address) const {
+    if (!(trap_page[address / MMIO_PAGE_SIZE] & TRAP_DEVICE)) return nullptr;
+    for (const MmioRange& range : mmio) {
+      if (address >= range.begin && address <= range.end) return &range;
+    }
+    return nullptr;
+  }
+  // reads of devices have side effects, so they must not be repeated or
+  // skipped
+  bool isDevice(uint16_t address) const {
+    return findDevice(address) != nullptr;
+  }
+
+  // The watcher must be set before pages are watched. Accesses to unwatched
+  // pages cost no more than before.
+  void setWatcher(const BusWatcher& bus_watcher) { watcher = bus_watcher; }
+  void watchPage(uint16_t page, bool enabled) {
+    if (enabled) {
+      trap_page[page] |= TRAP_WATCH;
+    } else {
+      trap_page[page] &= ~TRAP_WATCH;
+    }
+  }
+
+  // With tracking on, write() records the pages it touches, so that a caller
+  // restoring memory between runs only copies those back
+  void trackDirtyPages(bool enabled) { track_dirty = enabled; }
+  void markDirty(uint16_t address) {
+    uint16_t page = address / DIRTY_PAGE_SIZE;
+    if (!dirty[page]) {
+      dirty[page] = true;
+      dirty_pages.push_back(page);
+    }
+  }
+  const std::vector<uint16_t>& dirtyPages() const { return dirty_pages; }
+  void clearDirtyPages() {
+    for (uint16_t page : dirty_pages) dirty[page] = false;
+    dirty_pages.clear();
+  }
+
+ private:
+  bool shared = false;
+  std::vector<MmioRange> mmio;
+  enum : uint8_t { TRAP_DEVICE = 1, TRAP_WATCH = 2 };
+  // what reads and writes of each page have to look at besides RAM
+  uint8_t trap_page[TOTAL_SIZE / MMIO_PAGE_SIZE] = {};
+  BusWatcher watcher;
+  bool track_dirty = false;
+  bool dirty[TOTAL_SIZE / DIRTY_PAGE_SIZE] = {};
+  std::vector<uint16_t> dirty_pages;
 };
\ No newline at end of file
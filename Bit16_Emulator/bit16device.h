@@ -0,0 +1,60 @@
+#ifndef BIT16DEVICE_H
+#define BIT16DEVICE_H
+
+/* ABI for device plugins. A plugin is a shared object exporting
+ * bit16_device_plugin(); the emulator loads it with dlopen and maps it over a
+ * range of memory words (emu --device). Guest reads and writes of the range
+ * call read and write with the offset into it, and tick is called between
+ * instructions. A device raises its IRQ line through the host, which sets the
+ * line's bit in the word at 0xFE00 on the next tick; the guest clears it by
+ * writing the word back.
+ *
+ * The same plugin can run in a separate process, fed through a shared-memory
+ * ring (--device ...,remote). Guest writes are then queued without waiting,
+ * and guest reads return the last values the device process published, which
+ * it gets by calling read after every batch of writes and ticks. Plugins meant
+ * for remote use must therefore have reads without side effects. */
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* version 2 added next_event, version 1 plugins still load */
+#define BIT16_DEVICE_ABI_VERSION 2
+
+typedef struct bit16_device_host {
+  void* context;
+  /* safe to call from any callback of the device */
+  void (*raise_irq)(void* context);
+} bit16_device_host;
+
+typedef struct bit16_device_ops {
+  uint32_t abi_version; /* BIT16_DEVICE_ABI_VERSION */
+  const char* name;
+  /* size is the number of words mapped, args the text after arg= or "".
+   * host stays valid until destroy. NULL fails loading. */
+  void* (*create)(const bit16_device_host* host, uint16_t size,
+                  const char* args);
+  void (*destroy)(void* device);
+  uint16_t (*read)(void* device, uint16_t offset);
+  void (*write)(void* device, uint16_t offset, uint16_t value);
+  /* guest cycles so far, may be NULL */
+  void (*tick)(void* device, uint64_t cycles);
+  /* The first guest cycle a tick would do something in, e.g. raise an IRQ,
+   * or UINT64_MAX if none is scheduled. While the guest waits on memory, the
+   * emulator skips ahead to it instead of ticking through the cycles before.
+   * May be NULL, the guest then runs every cycle. Not used remote. */
+  uint64_t (*next_event)(void* device);
+} bit16_device_ops;
+
+/* calls into a device are serialized, also when several cores share it */
+#define BIT16_DEVICE_ENTRY "bit16_device_plugin"
+typedef const bit16_device_ops* (*bit16_device_entry)(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BIT16DEVICE_H */
@@ -0,0 +1,587 @@
+// bit16-conformance: differential testing of the emulator's execution
+// engines against a reference model
+//
+// Each case is a random machine state and a random instruction stream, drawn
+// from the ISA tables in common.h. The reference model below is written
+// straight from docs/spec.txt and shares no code with the CPU. It follows the
+// revised JMPN and PUSH/POP (CHANGES FROM THE FIRST DRAFT there), so it checks
+// that every engine implements that reading, not the reading itself. It is
+// stepped in lockstep with every engine, and the registers, PC, SP, cycle count
+// and the word stored by each instruction are compared after every step. All
+// the memory either side wrote is compared at the end of the case. A failing
+// case is shrunk to a minimal program before it is reported.
+//
+// Cases are numbered and derived from the seed, so a failure is reproduced
+// with --seed S --case N.
+#include <getopt.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Bus.h"
+#include "cpu.h"
+
+namespace {
+
+struct Case {
+  std::array<uint16_t, 8> regs{};
+  uint16_t pc = 0, sp = 0xffff;
+  std::vector<uint16_t> program;  // at pc
+  std::vector<uint16_t> data;     // at 0, reachable with imm8 addresses
+};
+
+struct State {
+  std::array<uint16_t, 8> regs{};
+  uint16_t pc = 0, sp = 0;
+  uint64_t cycles = 0;
+  bool halted = false;
+};
+
+// Pages of memory written since the last restore, so that a case only
+// clears what the previous one touched
+class PageSet {
+ public:
+  void mark(uint16_t address) {
+    uint16_t page = address / DIRTY_PAGE_SIZE;
+    if (!marked[page]) {
+      marked[page] = true;
+      pages.push_back(page);
+    }
+  }
+  const std::vector<uint16_t>& list() const { return pages; }
+  void clear() {
+    for (uint16_t page : pages) marked[page] = false;
+    pages.clear();
+  }
+
+ private:
+  bool marked[TOTAL_SIZE / DIRTY_PAGE_SIZE] = {};
+  std::vector<uint16_t> pages;
+};
+
+// The reference model. Deliberately plain: every field is extracted by hand
+// and every opcode spelled out, following docs/spec.txt. The SR i/o and
+// memory bank bits are not modelled, as in the CPU.
+class Reference {
+ public:
+  Reference() : memory(TOTAL_SIZE, 0) {}
+
+  void load(const Case& c) {
+    for (uint16_t page : written.list()) {
+      std::fill_n(memory.begin() + page * DIRTY_PAGE_SIZE, DIRTY_PAGE_SIZE, 0);
+    }
+    written.clear();
+    for (size_t i = 0; i < c.data.size(); i++) store(i, c.data[i]);
+    for (size_t i = 0; i < c.program.size(); i++) {
+      store(uint16_t(c.pc + i), c.program[i]);
+    }
+    state = State();
+    state.regs = c.regs;
+    state.pc = c.pc;
+    state.sp = c.sp;
+  }
+
+  // executes one instruction, stored says which word it wrote if any
+  void step() {
+    stored = false;
+    if (state.halted) return;
+    uint16_t word = memory[state.pc];
+    unsigned opcode = word >> 12;
+    bool immediate = (word >> 11) & 1;
+    unsigned x = (word >> 8) & 7;  // first register (z-bits)
+    unsigned y = (word >> 5) & 7;  // second register
+    uint16_t imm8 = word & 0xff;
+    uint16_t* r = state.regs.data();
+    uint16_t& hl = r[6];
+    uint16_t& f = r[7];
+    uint16_t operand = immediate ? imm8 : r[y];
+    state.cycles += cycle_cost[opcode];
+    uint16_t next = state.pc + 1;
+
+    switch (opcode) {
+      case 0x0:  // NOP
+        break;
+      case 0x1:  // HALT, PC stays on it
+        state.halted = true;
+        return;
+      case 0x2:  // MW
+        r[x] = operand;
+        break;
+      case 0x3:  // MWL
+        hl = uint16_t((hl & 0xff00) | imm8);
+        break;
+      case 0x4:  // MWH
+        hl = uint16_t((hl & 0x00ff) | (imm8 << 8));
+        break;
+      case 0x5:  // LW
+        r[x] = memory[operand];
+        break;
+      case 0x6:  // SW [imm8], x or SW [x], y
+        store(immediate ? imm8 : r[x], immediate ? r[x] : r[y]);
+        break;
+      case 0x7:    // ADD
+      case 0x8:    // SUB
+      case 0x9:    // AND
+      case 0xa:    // ADDC
+      case 0xb: {  // NOT
+        uint32_t a = r[x], b = operand, result;
+        if (opcode == 0x7) result = a + b;
+        if (opcode == 0x8) result = a - b;  // carry is the borrow
+        if (opcode == 0x9) result = a & b;
+        if (opcode == 0xa) result = a + b + (f & 1);
+        if (opcode == 0xb) result = ~b & 0xffff;
+        uint16_t value = uint16_t(result);
+        f = uint16_t((value == 0) << 2 | (value >> 15) << 1 |
+                     (result > 0xffff));
+        r[x] = value;
+        break;
+      }
+      case 0xc:    // JMPZ
+      case 0xd: {  // JMPN
+        uint16_t value = immediate ? imm8 : r[x];
+        if (opcode == 0xc ? value == 0 : value >> 15) {
+          state.cycles += 1;
+          next = hl;
+        }
+        break;
+      }
+      case 0xe:  // PUSH, [SP--]
+        store(state.sp, immediate ? imm8 : r[x]);
+        state.sp--;
+        break;
+      case 0xf:  // POP, [++SP]
+        state.sp++;
+        r[x] = memory[state.sp];
+        break;
+    }
+    state.pc = next;
+  }
+
+  State state;
+  std::vector<uint16_t> memory;
+  PageSet written;
+  bool stored = false;
+  uint16_t stored_address = 0, stored_value = 0;
+
+ private:
+  // docs/spec.txt, TIMING; a taken jump adds one
+  static constexpr uint8_t cycle_cost[16] = {2, 2, 3, 3, 3, 4, 4, 3,
+                                             3, 3, 3, 3, 3, 3, 4, 4};
+
+  void store(uint16_t address, uint16_t value) {
+    memory[address] = value;
+    written.mark(address);
+    stored = true;
+    stored_address = address;
+    stored_value = value;
+  }
+};
+
+class Engine {
+ public:
+  virtual ~Engine() = default;
+  virtual const char* name() const = 0;
+  virtual void load(const Case& c) = 0;
+  // executes one or more instructions and returns how many
+  virtual uint64_t step() = 0;
+  virtual State state() const = 0;
+  // true when it is waiting on memory nothing in the case can change
+  virtual bool idle() = 0;
+  virtual const uint16_t* memory() const = 0;
+  virtual const std::vector<uint16_t>& writtenPages() const = 0;
+};
+
+// the interpreter in cpu.cpp, optionally with idle-loop fast-forwarding
+class CpuEngine : public Engine {
+ public:
+  explicit CpuEngine(bool fast_forward) : fast_forward(fast_forward) {
+    bus.connectToCPU(&cpu);
+    cpu.connectToBus(&bus);
+    bus.trackDirtyPages(true);
+  }
+
+  const char* name() const override {
+    return fast_forward ? "cpu+fast-forward" : "cpu";
+  }
+
+  void load(const Case& c) override {
+    for (uint16_t page : bus.dirtyPages()) {
+      std::fill_n(bus.ram + page * DIRTY_PAGE_SIZE, DIRTY_PAGE_SIZE, 0);
+    }
+    bus.clearDirtyPages();
+    for (size_t i = 0; i < c.data.size(); i++) bus.write(i, c.data[i]);
+    for (size_t i = 0; i < c.program.size(); i++) {
+      bus.write(uint16_t(c.pc + i), c.program[i]);
+    }
+    cpu.reset();
+    cpu.setFastForward(fast_forward);
+    for (const RegisterInfo& reg : register_set) {
+      cpu.set_value(reg.code, c.regs[reg.code]);
+    }
+    cpu.setPC(c.pc);
+    cpu.setSP(c.sp);
+    halted = false;
+  }
+
+  uint64_t step() override {
+    if (halted) return 0;
+    halted = !cpu.run();
+    return 1 + cpu.takeSkippedInstructions();
+  }
+
+  State state() const override {
+    State s;
+    for (const RegisterInfo& reg : register_set) {
+      s.regs[reg.code] = cpu.get_value(reg.code);
+    }
+    s.pc = cpu.getPC();
+    s.sp = cpu.getSP();
+    s.cycles = cpu.getCycles();
+    s.halted = halted;
+    return s;
+  }
+
+  bool idle() override { return cpu.idle(); }
+  const uint16_t* memory() const override { return bus.ram; }
+  const std::vector<uint16_t>& writtenPages() const override {
+    return bus.dirtyPages();
+  }
+
+ private:
+  bool fast_forward;
+  Bus bus;
+  CPU cpu;
+  bool halted = false;
+};
+
+std::vector<std::unique_ptr<Engine>> makeEngines() {
+  std::vector<std::unique_ptr<Engine>> engines;
+  engines.push_back(std::make_unique<CpuEngine>(false));
+  engines.push_back(std::make_unique<CpuEngine>(true));
+  return engines;
+}
+
+// random operands for the form of each opcode in instruction_set
+uint16_t randomInstruction(std::mt19937_64& rng) {
+  // an arbitrary word now and then covers encodings the assembler never
+  // produces, and HALT is rare so that programs get somewhere
+  if (rng() % 16 == 0) return uint16_t(rng());
+  uint8_t opcode;
+  do {
+    opcode = rng() % instruction_set.size();
+  } while (opcode == OP_HALT && rng() % 8);
+  auto reg = [&] { return InstructionParams(rng() % 8, 0, false); };
+  auto imm = [&] { return InstructionParams(0, rng() % 256, true); };
+  auto either = [&] { return rng() % 2 ? imm() : reg(); };
+  InstructionParams p1, p2;
+  switch (instruction_set[opcode].type) {
+    case NoParams:
+      break;
+    case Register_only:
+      p1 = reg();
+      break;
+    case Immediate_only:
+      p1 = imm();
+      break;
+    case Register_Immediate_only:
+      p1 = either();
+      break;
+    case ALL_1:
+      p1 = reg();
+      p2 = either();
+      break;
+    case ALL_SW:
+      p1 = either();
+      p2 = reg();
+      break;
+  }
+  return encode(opcode, p1, p2);
+}
+
+Case randomCase(uint64_t seed, uint64_t index, size_t max_length) {
+  std::mt19937_64 rng(seed ^ (index * 0x9e3779b97f4a7c15ull));
+  Case c;
+  for (uint16_t& reg : c.regs) reg = uint16_t(rng());
+  c.pc = 0x100 + rng() % 0xfe00;
+  c.sp = rng() % 4 ? 0xffff - rng() % 16 : uint16_t(rng());
+  c.program.resize(1 + rng() % max_length);
+  for (uint16_t& word : c.program) word = randomInstruction(rng);
+  // point HL into the program so that jumps mostly land on code
+  if (rng() % 2) c.regs[REG_HL] = c.pc + rng() % c.program.size();
+  c.data.resize(rng() % 32);
+  for (uint16_t& word : c.data) word = uint16_t(rng());
+  return c;
+}
+
+std::string stateString(const State& s) {
+  std::ostringstream out;
+  for (const RegisterInfo& reg : register_set) {
+    out << reg.name << "=" << hexstr(s.regs[reg.code]) << " ";
+  }
+  out << "PC=" << hexstr(s.pc) << " SP=" << hexstr(s.sp)
+      << " cycles=" << s.cycles << (s.halted ? " halted" : "");
+  return out.str();
+}
+
+std::string diffStates(const State& expected, const State& actual) {
+  std::ostringstream out;
+  for (const RegisterInfo& reg : register_set) {
+    if (expected.regs[reg.code] != actual.regs[reg.code]) {
+      out << " " << reg.name << " " << hexstr(expected.regs[reg.code])
+          << " != " << hexstr(actual.regs[reg.code]);
+    }
+  }
+  if (expected.pc != actual.pc) {
+    out << " PC " << hexstr(expected.pc) << " != " << hexstr(actual.pc);
+  }
+  if (expected.sp != actual.sp) {
+    out << " SP " << hexstr(expected.sp) << " != " << hexstr(actual.sp);
+  }
+  if (expected.cycles != actual.cycles) {
+    out << " cycles " << expected.cycles << " != " << actual.cycles;
+  }
+  if (expected.halted != actual.halted) {
+    out << (expected.halted ? " engine did not halt" : " engine halted");
+  }
+  return out.str();
+}
+
+// One thread's reference and engines. check() returns an empty string when
+// every engine agrees with the reference on the case.
+class Checker {
+ public:
+  Checker() : engines(makeEngines()) {}
+
+  std::string check(const Case& c) {
+    uint64_t max_steps = 4 * c.program.size() + 16;
+    for (auto& engine : engines) {
+      reference.load(c);
+      engine->load(c);
+      uint64_t steps = 0;
+      while (steps < max_steps && !reference.state.halted) {
+        uint64_t count = engine->step();
+        for (uint64_t i = 0; i < count; i++) reference.step();
+        steps += count;
+        std::string diff = diffStates(reference.state, engine->state());
+        uint16_t address = reference.stored_address;
+        if (reference.stored &&
+            engine->memory()[address] != reference.stored_value) {
+          diff += " [" + hexstr(address) + "] " +
+                  hexstr(reference.stored_value) +
+                  " != " + hexstr(engine->memory()[address]);
+        }
+        if (!diff.empty()) {
+          return std::string(engine->name()) + " after " +
+                 std::to_string(steps) + " instructions:" + diff;
+        }
+        if (engine->idle()) break;
+      }
+      std::string diff = diffMemory(*engine);
+      if (!diff.empty()) return std::string(engine->name()) + ": " + diff;
+    }
+    return "";
+  }
+
+ private:
+  std::string diffMemory(const Engine& engine) {
+    for (const std::vector<uint16_t>* pages :
+         {&reference.written.list(), &engine.writtenPages()}) {
+      for (uint16_t page : *pages) {
+        for (uint32_t i = 0; i < DIRTY_PAGE_SIZE; i++) {
+          uint32_t address = page * DIRTY_PAGE_SIZE + i;
+          if (reference.memory[address] != engine.memory()[address]) {
+            return "memory [" + hexstr(address) + "] " +
+                   hexstr(reference.memory[address]) +
+                   " != " + hexstr(engine.memory()[address]);
+          }
+        }
+      }
+    }
+    return "";
+  }
+
+  Reference reference;
+  std::vector<std::unique_ptr<Engine>> engines;
+};
+
+// Greedy shrinking: drop instructions, then simplify the words and the state
+// that are left, for as long as the case keeps failing
+Case shrink(Case c, Checker& checker) {
+  auto fails = [&](const Case& candidate) {
+    return !candidate.program.empty() && !checker.check(candidate).empty();
+  };
+  auto simplify = [&](uint16_t& value, uint16_t simpler) {
+    if (value == simpler) return false;
+    uint16_t old = value;
+    value = simpler;
+    if (fails(c)) return true;
+    value = old;
+    return false;
+  };
+  bool progress = true;
+  while (progress) {
+    progress = false;
+    for (size_t i = c.program.size(); i-- > 0;) {
+      Case candidate = c;
+      candidate.program.erase(candidate.program.begin() + i);
+      if (fails(candidate)) {
+        c = candidate;
+        progress = true;
+      }
+    }
+    while (!c.data.empty()) {
+      Case candidate = c;
+      candidate.data.pop_back();
+      if (!fails(candidate)) break;
+      c = candidate;
+      progress = true;
+    }
+    for (uint16_t& word : c.program) {
+      // NOP, then the same instruction without its immediate
+      progress |= simplify(word, 0);
+      progress |= simplify(word, word & 0xff00);
+    }
+    for (uint16_t& word : c.data) progress |= simplify(word, 0);
+    for (uint16_t& reg : c.regs) progress |= simplify(reg, 0);
+  }
+  return c;
+}
+
+void printCase(const Case& c) {
+  State initial;
+  initial.regs = c.regs;
+  initial.pc = c.pc;
+  initial.sp = c.sp;
+  std::cerr << "  initial: " << stateString(initial) << std::endl;
+  for (size_t i = 0; i < c.data.size(); i++) {
+    std::cerr << "  data " << hexstr(i) << ": " << hexstr(c.data[i])
+              << std::endl;
+  }
+  for (size_t i = 0; i < c.program.size(); i++) {
+    std::cerr << "  " << hexstr(c.pc + i) << ": " << hexstr(c.program[i])
+              << "  " << disassemble(c.program[i]) << std::endl;
+  }
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  uint64_t cases = 1000000;
+  uint64_t seed = 1;
+  unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+  size_t max_length = 32;
+  std::optional<uint64_t> single_case;
+
+  static struct option longOptions[] = {
+      {"cases", required_argument, 0, 'n'},
+      {"seed", required_argument, 0, 's'},
+      {"jobs", required_argument, 0, 'j'},
+      {"max-length", required_argument, 0, 'm'},
+      {"case", required_argument, 0, 'c'},
+      {"help", no_argument, 0, 'h'},
+      {0, 0, 0, 0}};
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "n:s:j:m:c:h", longOptions, NULL)) !=
+         -1) {
+    switch (opt) {
+      case 'n':
+      case 's':
+      case 'j':
+      case 'm':
+      case 'c': {
+        char* end;
+        uint64_t value = std::strtoull(optarg, &end, 0);
+        if (!isdigit(optarg[0]) || *end != '\0') {
+          std::cerr << "Invalid integer value: " << optarg << std::endl;
+          return 1;
+        }
+        if (opt == 'n') cases = value;
+        if (opt == 's') seed = value;
+        if (opt == 'j') threads = std::max<uint64_t>(value, 1);
+        if (opt == 'm') max_length = std::max<uint64_t>(value, 1);
+        if (opt == 'c') single_case = value;
+        break;
+      }
+      case 'h':
+        std::cout << "Usage: " << argv[0] << " [options]" << std::endl;
+        std::cout << "Options:" << std::endl;
+        std::cout << "  -n, --cases N            Random cases to run "
+                     "(default 1000000)"
+                  << std::endl;
+        std::cout << "  -s, --seed N             Seed the cases derive from "
+                     "(default 1)"
+                  << std::endl;
+        std::cout << "  -j, --jobs N             Threads (default: all cores)"
+                  << std::endl;
+        std::cout << "  -m, --max-length N       Longest program (default 32)"
+                  << std::endl;
+        std::cout << "  -c, --case N             Only run case N" << std::endl;
+        std::cout << "  -h, --help               Display help message"
+                  << std::endl;
+        return 0;
+      default:
+        std::cerr << "Use '" << argv[0] << " --help' for usage." << std::endl;
+        return 1;
+    }
+  }
+
+  uint64_t first = single_case ? *single_case : 0;
+  uint64_t last = single_case ? *single_case + 1 : cases;
+  std::atomic<uint64_t> next(first);
+  std::atomic<bool> failed(false);
+  std::mutex report_lock;
+  uint64_t failed_case = 0;
+  std::string failure;
+
+  auto start = std::chrono::steady_clock::now();
+  auto worker = [&]() {
+    Checker checker;
+    // claim cases in blocks to keep the counter off the hot path
+    constexpr uint64_t BLOCK = 256;
+    while (!failed) {
+      uint64_t begin = next.fetch_add(BLOCK);
+      if (begin >= last) break;
+      for (uint64_t i = begin; i < std::min(begin + BLOCK, last); i++) {
+        std::string result = checker.check(randomCase(seed, i, max_length));
+        if (result.empty()) continue;
+        std::lock_guard<std::mutex> guard(report_lock);
+        if (!failed || i < failed_case) {
+          failed = true;
+          failed_case = i;
+          failure = result;
+        }
+        break;
+      }
+    }
+  };
+  std::vector<std::thread> pool;
+  for (unsigned i = 0; i < threads; i++) pool.emplace_back(worker);
+  for (std::thread& thread : pool) thread.join();
+  std::chrono::duration<double> seconds =
+      std::chrono::steady_clock::now() - start;
+
+  if (failed) {
+    Checker checker;
+    Case minimal = shrink(randomCase(seed, failed_case, max_length), checker);
+    std::cerr << "case " << failed_case << " (seed " << seed
+              << ") failed: " << failure << std::endl;
+    std::cerr << "shrunk to: " << checker.check(minimal) << std::endl;
+    printCase(minimal);
+    return 1;
+  }
+  std::cerr << (last - first) << " cases passed in " << seconds.count()
+            << " s on " << threads << " threads" << std::endl;
+  return 0;
+}
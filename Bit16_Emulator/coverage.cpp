@@ -0,0 +1,83 @@
+#include "coverage.h"
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <map>
+#include <sstream>
+
+#include "Bus.h"
+
+bool mergeCoverage(const std::string& file_name, std::vector<uint8_t>& map) {
+  using namespace binary_io;
+  int fd = open(file_name.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd < 0) return false;
+  if (flock(fd, LOCK_EX) != 0) {
+    close(fd);
+    return false;
+  }
+
+  // an empty file is a fresh one, anything else has to be a coverage file
+  std::string contents;
+  char buffer[4096];
+  ssize_t n;
+  while ((n = read(fd, buffer, sizeof(buffer))) > 0) contents.append(buffer, n);
+  bool ok = n == 0;
+  if (ok && !contents.empty()) {
+    std::istringstream in(contents);
+    char magic[sizeof(COVERAGE_MAGIC)];
+    ok = in.read(magic, sizeof(magic)) &&
+         std::string(magic, sizeof(magic)) ==
+             std::string(COVERAGE_MAGIC, sizeof(COVERAGE_MAGIC)) &&
+         get<uint16_t>(in) == COVERAGE_VERSION &&
+         get<uint32_t>(in) == ROM_SIZE;
+    for (uint32_t address = 0; ok && address < ROM_SIZE; address++) {
+      map[ROM_BEGIN + address] |= get<uint8_t>(in);
+    }
+    ok = ok && bool(in);
+  }
+
+  if (ok) {
+    std::ostringstream out;
+    out.write(COVERAGE_MAGIC, sizeof(COVERAGE_MAGIC));
+    put<uint16_t>(out, COVERAGE_VERSION);
+    put<uint32_t>(out, ROM_SIZE);
+    out.write(reinterpret_cast<const char*>(map.data() + ROM_BEGIN), ROM_SIZE);
+    std::string data = out.str();
+    ok = pwrite(fd, data.data(), data.size(), 0) == ssize_t(data.size()) &&
+         ftruncate(fd, data.size()) == 0;
+  }
+  flock(fd, LOCK_UN);
+  close(fd);
+  return ok;
+}
+
+bool writeLcov(const std::string& file_name, const DebugInfo& debug,
+               const std::vector<uint8_t>& map) {
+  std::ofstream out(file_name);
+  if (!out.is_open()) return false;
+  for (size_t file = 0; file < debug.files.size(); file++) {
+    // a line is hit if any word it emitted was executed
+    std::map<uint32_t, bool> lines;
+    for (const DebugRange& range : debug.ranges) {
+      if (range.file != file || (range.flags & DEBUG_PADDING)) continue;
+      bool hit = false;
+      for (uint32_t i = 0; i < range.length; i++) {
+        hit = hit || map[(range.address + i) & 0xffff];
+      }
+      lines[range.line] = lines[range.line] || hit;
+    }
+
+    size_t lines_hit = 0;
+    out << "TN:\nSF:" << debug.files[file] << "\n";
+    for (const auto& [line, hit] : lines) {
+      out << "DA:" << line << "," << hit << "\n";
+      lines_hit += hit;
+    }
+    out << "LH:" << lines_hit << "\nLF:" << lines.size()
+        << "\nend_of_record\n";
+  }
+  return bool(out);
+}
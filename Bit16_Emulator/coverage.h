@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "../common/debugInfo.h"
+
+// Guest code coverage. CPU::run marks every executed address in a map with
+// one byte per word of memory, so recording costs a single store per
+// instruction. Only the ROM region is saved.
+//
+// Coverage file (.cov), little-endian:
+//   "B16V" u16 version u32 length u8 executed[length]
+
+constexpr char COVERAGE_MAGIC[4] = {'B', '1', '6', 'V'};
+constexpr uint16_t COVERAGE_VERSION = 1;
+
+// ORs the ROM part of map into file_name, creating it if needed. The file is
+// locked while it is updated, so parallel runs can merge into one file. On
+// success map holds the merged coverage.
+bool mergeCoverage(const std::string& file_name, std::vector<uint8_t>& map);
+
+// lcov tracefile with a DA record for every source line that emitted code
+bool writeLcov(const std::string& file_name, const DebugInfo& debug,
+               const std::vector<uint8_t>& map);
@@ -6,191 +6,191 @@
 #include <vector>
 
 #include "Bus.h"
+#include "memoryChecker.h"
 
-CPU::CPU() {}
+CPU::CPU() { reset(); }
+
+void CPU::reset() {
+  for (uint16_t& reg : regs) reg = 0;
+  PC = 0;
+  SP = 0xffff;
+  cycles = 0;
+  skipped_instructions = 0;
+  wake();
+}
 
 void CPU::setLoadingAddr(int load_address) { PC = load_address; }
 
+// reg <- a op b, updates the zero/negative/carry flags in F
+uint16_t CPU::alu(uint8_t opcode, uint16_t a, uint16_t b) {
+  AluResult result = executeAlu(opcode, a, b, regs[REG_F]);
+  regs[REG_F] = result.flags;
+  return result.value;
+}
+
 bool CPU::executeInstruction(uint16_t current_ins) {
-  int opcode = current_ins >> 4;  // Extract the 4-bit opcode
-  bool select = current_ins & 0x800;
+  // field extraction is generated from the ISA layout in common.h
+  DecodedInstruction ins = decode(current_ins);
+  uint16_t src = ins.select ? ins.imm8 : get_value(ins.reg2);
+  cycles += instruction_set[ins.opcode].cycles;
 
-  switch (opcode) {
-    case 0x0:  // NOP
-      PC++;
+  switch (ins.opcode) {
+    case OP_NOP:
       break;
-    case 0x1:  // HALT
+    case OP_HALT:
       return false;
+    case OP_MW:  // MW reg, reg/imm8
+      set_value(ins.reg1, src);
       break;
-    case 0x2: {  // MW reg, reg/imm8
-      uint8_t reg = current_ins & 0x700;
-      if (select) {
-        uint8_t imm8 = current_ins & 0xFF;
-        set_value(reg, imm8);
-      } else {
-        uint8_t reg2 = current_ins & 0xe0;
-        set_value(reg, get_value(reg2));
-      }
-      PC++;
-      break;
-    }
-    case 0x3: {  // MWL imm8
-      uint8_t imm8 = current_ins & 0xFF;
-      HL = (HL >> 8) << 8 + imm8;
-      PC++;
+    case OP_MWL:  // MWL imm8
+      regs[REG_HL] = (regs[REG_HL] & 0xff00) | ins.imm8;
       break;
-    }
-    case 0x4: {  // MWH imm8
-      uint8_t imm8 = current_ins & 0xFF;
-      HL = HL & 0xFF + imm8 << 8;
-      PC++;
+    case OP_MWH:  // MWH imm8
+      regs[REG_HL] = (regs[REG_HL] & 0x00ff) | (ins.imm8 << 8);
       break;
-    }
-    case 0x5: {  // LW reg, [HL/imm8]
-      uint8_t reg = current_ins & 0x700;
-      if (select) {
-        uint8_t imm8 = current_ins & 0xFF;
-        set_value(reg, bus->read(imm8));
-      } else {
-        uint8_t reg2 = current_ins & 0xe0;
-        set_value(reg, bus->read(get_value(reg2)));
-      }
+    case OP_LW:  // LW reg, [HL/imm8]
+      set_value(ins.reg1, bus->read(src));
       break;
-    }
-    case 0x6: {  // SW [HL/imm8], reg
-      uint8_t reg = current_ins & 0xe0;
-      if (select) {
-        uint8_t imm8 = current_ins & 0xFF;
-        bus->write(imm8, get_value(reg));
+    case OP_SW:  // SW [HL/imm8], reg
+      if (ins.select) {
+        bus->write(ins.imm8, get_value(ins.reg1));
       } else {
-        uint8_t reg2 = current_ins & 0x700;
-        bus->write(reg2, get_value(reg2));
+        bus->write(get_value(ins.reg1), get_value(ins.reg2));
       }
       break;
-    }
-    case 0x7: {  // ADD reg, reg/imm8
-      if (select) {
-      } else {
-        uint8_t reg = current_ins & 0x700;
-        uint8_t imm8 = current_ins & 0xFF;
-        set_value(reg, bus->read(HL + imm8));
+    case OP_ADD:  // ADD reg, reg/imm8
+    case OP_SUB:  // SUB reg, reg/imm8
+    case OP_AND:  // AND reg, reg/imm8
+    case OP_ADDC:  // ADDC reg, reg/imm8
+    case OP_NOT:  // NOT reg, reg/imm8
+      set_value(ins.reg1, alu(ins.opcode, get_value(ins.reg1), src));
+      break;
+    case OP_JMPZ:  // JMPZ reg/imm8
+    case OP_JMPN: {  // JMPN reg/imm8
+      uint16_t value = ins.select ? ins.imm8 : get_value(ins.reg1);
+      bool taken = ins.opcode == OP_JMPZ ? value == 0 : (value & 0x8000);
+      if (taken) {
+        uint16_t tail = PC;
+        PC = regs[REG_HL];
+        cycles += JUMP_TAKEN_CYCLES;
+        if (fast_forward && PC <= tail) onBackwardJump(PC, tail);
+        return true;
       }
       break;
     }
-    case 0x8: {  // SUB reg, reg/imm8
-      if (select) {
-      } else {
-        uint8_t reg = current_ins & 0x700;
-        uint8_t imm8 = current_ins & 0xFF;
-        set_value(reg, bus->read(HL + imm8));
-      }
+    case OP_PUSH:  // PUSH reg/imm8
+      push(ins.select ? ins.imm8 : get_value(ins.reg1));
       break;
-    }
-    case 0x9: {  // AND reg, reg/imm8
-      if (select) {
-      } else {
-        uint8_t reg = current_ins & 0x700;
-        uint8_t imm8 = current_ins & 0xFF;
-        set_value(reg, bus->read(HL + imm8));
-      }
+    case OP_POP:  // POP  reg
+      set_value(ins.reg1, pop());
       break;
-    }
-    case 0xa: {  // ADDC reg, reg/imm8
-      if (select) {
-      } else {
-        uint8_t reg = current_ins & 0x700;
-        uint8_t imm8 = current_ins & 0xFF;
-        set_value(reg, bus->read(HL + imm8));
+  }
+  PC++;
+  return true;
+}
+
+bool CPU::run() {
+  if (coverage) coverage[PC] = 1;
+  uint16_t current_instruction = bus->read(PC);
+  bool continue_emulation = executeInstruction(current_instruction);
+  return continue_emulation;
+}
+
+bool CPU::runChecked() {
+  if (!checkInstruction()) return false;
+  return run();
+}
+
+// Shadow-memory checks for the instruction at PC, made before it executes so
+// that a violation stops the CPU with its state intact
+bool CPU::checkInstruction() {
+  MemoryChecker& check = *checker;
+  check.cycle++;
+  uint16_t current_ins = bus->read(PC);
+  if (!check.initialized(PC)) {
+    return check.report("executing uninitialized memory", PC, PC, current_ins);
+  }
+  DecodedInstruction ins = decode(current_ins);
+  uint16_t src = ins.select ? ins.imm8 : get_value(ins.reg2);
+  switch (ins.opcode) {
+    case OP_LW:
+      if (!check.initialized(src)) {
+        return check.report("read of uninitialized memory", src, PC,
+                            current_ins);
       }
       break;
-    }
-    case 0xb: {  // NOT reg, reg/imm8
-      if (select) {
-      } else {
-        uint8_t reg = current_ins & 0x700;
-        uint8_t imm8 = current_ins & 0xFF;
-        set_value(reg, bus->read(HL + imm8));
+    case OP_SW: {
+      uint16_t address = ins.select ? ins.imm8 : get_value(ins.reg1);
+      if (address <= ROM_END) {
+        return check.report("write to ROM", address, PC, current_ins);
       }
+      check.setInitialized(address);
       break;
     }
-    case 0xc: {  // JMPZ reg/imm8
-      if (select) {
-      } else {
-        uint8_t reg = current_ins & 0x700;
-        uint8_t imm8 = current_ins & 0xFF;
-        set_value(reg, bus->read(HL + imm8));
+    case OP_PUSH:
+      if (SP < STACK_BEGIN) {
+        return check.report("stack overflow, push to", SP, PC, current_ins);
       }
+      check.setInitialized(SP);
       break;
-    }
-    case 0xd: {  // JMPN reg/imm8
-      if (select) {
-      } else {
-        uint8_t reg = current_ins & 0x700;
-        uint8_t imm8 = current_ins & 0xFF;
-        set_value(reg, bus->read(HL + imm8));
+    case OP_POP:
+      if (SP == STACK_END) {
+        return check.report("stack underflow, pop at", SP, PC, current_ins);
       }
-      break;
-    }
-    case 0xe: {  // PUSH reg/imm8
-      if (select) {
-        uint8_t imm8 = current_ins & 0xFF;
-
-        push(imm8);
-      } else {
-        uint8_t reg = current_ins & 0x700;
-        push(bus->read(reg));
+      if (!check.initialized(SP + 1)) {
+        return check.report("read of uninitialized memory", SP + 1, PC,
+                            current_ins);
       }
-      PC++;
       break;
-    }
-    case 0xf: {  // POP  reg
-      uint8_t reg = current_ins & 0x700;
-      uint16_t value = pop();
-      set_value(reg, value);
-      PC++;
-      break;
-    }
-    default:
-      std::cerr << "Unkown Instruction" << std::endl;
-      dumpRegisters();
-      exit(1);
   }
   return true;
 }
 
-bool CPU::run() {
-  uint16_t current_instruction = bus->read(PC);
-  bool continue_emulation = executeInstruction(current_instruction);
-  return continue_emulation;
-}
-
-std::string hexstr(uint16_t n) {
-  std::stringstream ss;
-  ss << std::hex << std::setw(4) << std::setfill('0') << n;
-  return ss.str();
-}
-
 void CPU::dumpRegisters() {
-  std::cout << "A: " << hexstr(A) << " B: " << hexstr(B) << " C: " << hexstr(C)
-            << " D: " << hexstr(D) << " E: " << hexstr(E)
-            << " HL: " << hexstr(HL) << "\n";
-  std::cout << "Flag: " << hexstr(flag) << "\n";
-  std::cout << "PC: " << hexstr(PC) << "\n";
-  std::cout << "SR: " << hexstr(SR) << std::endl;
+  for (const RegisterInfo& reg : register_set) {
+    std::cout << reg.name << ": " << hexstr(regs[reg.code]) << " ";
+  }
+  std::cout << "\n";
+  std::cout << "PC: " << hexstr(PC) << " SP: " << hexstr(SP) << std::endl;
 }
 
-void CPU::push(uint16_t value) { bus->write((1 << 16) | SP--, value); }
-
-uint16_t CPU::pop() { return bus->read(((1 << 16) | SP++) + 1); }
+void CPU::push(uint16_t value) { bus->write(SP--, value); }
 
+uint16_t CPU::pop() { return bus->read(++SP); }
 void CPU::print() { std::cout << "asdfadsf" << std::endl; }
 
 void CPU::connectToBus(Bus* bus1) { bus = bus1; }
 
+// used by devices, which may write anywhere
 void CPU::write(uint16_t address, uint16_t value) {
+  if (checker) checker->setInitialized(address);
   bus->write(address, value);
 }
 
 uint16_t CPU::read(uint16_t address) { return bus->read(address); }
 
-CPU::~CPU() { delete bus; }
\ No newline at end of file
+CPU::~CPU() {}
+
+void tickDevices(CPU& cpu, std::vector<Device*>& devices) {
+  for (auto& device : devices) {
+    // Execute a portion of the device's logic during each cycle
+    device->tick(*device, cpu);
+
+    // Check if the device triggered an interrupt
+    if (device->interrupt) {
+      // Handle interrupt
+      if (device->verbose) {
+        std::cout << "Interrupt from " << device->name
+                  << "! Data: " << device->interruptData << std::endl;
+      }
+      device->send(*device, cpu);
+      device->receive(*device, cpu, -1);
+      // Reset interrupt flag and data
+      device->interrupt = 0;
+      device->interruptData = -1;
+    }
+
+    // Increment the cycle counter for interleaved execution
+    device->cycles++;
+  }
+}
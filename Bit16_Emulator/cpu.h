@@ -4,7 +4,10 @@
 #include <iostream>
 #include <string>
 #include <vector>
+
+#include "../common/common.h"
 class Bus;
+class MemoryChecker;
 class CPU {
  public:
   const uint16_t MAX_DEVICES = 256;
@@ -15,9 +18,13 @@ class CPU {
   }
 
   CPU();
+  // registers to 0, SP to 0xffff and the cycle count to 0
+  void reset();
   void setLoadingAddr(int);
   void dumpRegisters();
   bool run();
+  // run() behind the shadow-memory checks of the attached MemoryChecker
+  bool runChecked();
   void push(uint16_t);
   uint16_t pop();
   void print();
@@ -26,70 +33,107 @@ class CPU {
   uint16_t read(uint16_t);
   ~CPU();
 
-  void set_value(uint8_t reg, uint8_t value) {
-    switch (reg) {
-      case 0x0:
-        A = value;
-        break;
-      case 0x1:
-        B = value;
-        break;
-      case 0x2:
-        C = value;
-        break;
-      case 0x3:
-        D = value;
-        break;
-      case 0x4:
-        E = value;
-        break;
-      case 0x5:
-        HL = value;
-        break;
-      case 0x6:
-        flag = value;
-      default:
-        break;
-    }
-  }
+  // registers are addressed by the codes in register_set (common.h)
+  void set_value(uint8_t reg, uint16_t value) { regs[reg & REG_MASK] = value; }
+
+  uint16_t get_value(uint8_t reg) const { return regs[reg & REG_MASK]; }
+  uint16_t getPC() const { return PC; }
+  uint16_t getSP() const { return SP; }
+  void setPC(uint16_t value) { PC = value; }
+  void setSP(uint16_t value) { SP = value; }
+  // guest clock cycles so far, from the costs in instruction_set (common.h)
+  uint64_t getCycles() const { return cycles; }
+  void addCycles(uint64_t count) { cycles += count; }
+
+  // one byte per word of memory, see coverage.h; nullptr disables coverage
+  void setCoverageMap(uint8_t* map) { coverage = map; }
+  void setChecker(MemoryChecker* memory_checker) { checker = memory_checker; }
 
-  uint16_t get_value(uint8_t reg) {
-    switch (reg) {
-      case 0x0:
-        return A;
-      case 0x1:
-        return B;
-      case 0x2:
-        return C;
-      case 0x3:
-        return D;
-      case 0x4:
-        return E;
-      case 0x5:
-        return HL;
-      case 0x6:
-        return flag;
-      default:
-        return 0;
-    }
+  // idle-loop fast-forwarding, see idleLoop.cpp
+  void setFastForward(bool enabled) { fast_forward = enabled; }
+  // true while the CPU waits in a polling loop on memory that has not changed
+  bool idle() { return waiting && stillWaiting(); }
+  // idle in a loop that reads no memory at all, which only wake() ends
+  bool waitingForever() const { return waiting && watch.empty(); }
+  // Skips the iterations of the loop waited in that end before cycle, where
+  // something may next change the memory it reads. False if the CPU is not at
+  // the loop's head or not even one iteration fits.
+  bool skipIdleUntil(uint64_t cycle);
+  // forget the loop being fast-forwarded or waited in, for when something
+  // other than the guest changed its registers or code
+  void wake() {
+    waiting = false;
+    loop = Loop();
+  }
+  // instructions of side-effect free loops that were skipped over, their
+  // cycles are already in getCycles()
+  uint64_t takeSkippedInstructions() {
+    uint64_t count = skipped_instructions;
+    skipped_instructions = 0;
+    return count;
   }
 
  private:
-  uint16_t A, B, C, D, E, SR, HL, flag;
+  uint16_t regs[register_set.size()];
   uint16_t PC, SP;
+  uint64_t cycles = 0;
+  uint8_t* coverage = nullptr;
+  MemoryChecker* checker = nullptr;
+
+  // the innermost loop seen last, from its head to the jump back at its tail
+  struct Loop {
+    uint16_t head = 0, tail = 0;
+    bool analyzed = false;
+    bool pure = false;          // only register moves and ALU operations
+    bool reads_memory = false;  // pure apart from LW
+    bool seen = false;          // head_regs holds the previous iteration
+    std::vector<DecodedInstruction> body;
+    uint32_t cycles = 0;  // one iteration, jumping back
+    uint16_t head_regs[register_set.size()];
+  };
+  enum LoopExit { LOOP_AGAIN, LOOP_EXIT, LOOP_ELSEWHERE };
+  bool fast_forward = false;
+  bool waiting = false;
+  Loop loop;
+  // (address, value) of every word the waiting loop reads
+  std::vector<std::pair<uint16_t, uint16_t>> watch;
+  uint64_t skipped_instructions = 0;
   bool executeInstruction(uint16_t);
+  bool checkInstruction();
+  void onBackwardJump(uint16_t head, uint16_t tail);
+  void analyzeLoop(uint16_t head, uint16_t tail);
+  LoopExit runLoopBody(uint16_t* r,
+                       std::vector<std::pair<uint16_t, uint16_t>>* reads);
+  void fastForwardPure();
+  bool stillWaiting();
+  uint16_t alu(uint8_t, uint16_t, uint16_t);
 };
 
+// A device keeps all of its state in its Device, so that every emulator
+// instance can have its own
 struct Device {
   int id;
   std::string name;
   int interrupt;
   int interruptData;
   int cycles;
+  bool verbose;  // trace ticks and transfers
 
   // Function pointers for device-specific operations
-  void (*tick)(CPU&);
-  int (*send)(CPU&);
-  void (*receive)(CPU&, int);
-  void (*destroy)(CPU&);
+  void (*tick)(Device&, CPU&);
+  int (*send)(Device&, CPU&);
+  void (*receive)(Device&, CPU&, int);
+  void (*destroy)(Device&, CPU&);
+  // The guest cycle of the device's next scheduled event, such as a timer
+  // expiring, or one of the values below. nullptr if it cannot tell.
+  uint64_t (*nextEvent)(Device&, CPU&);
+  void* data;  // device-specific state
 };
+
+// Device::nextEvent when nothing is scheduled, and when the device waits for
+// input from the host instead of the guest clock
+constexpr uint64_t NO_DEVICE_EVENT = UINT64_MAX;
+constexpr uint64_t HOST_DEVICE_EVENT = UINT64_MAX - 1;
+
+// one cycle of every device, handling the interrupts they raise
+void tickDevices(CPU& cpu, std::vector<Device*>& devices);
@@ -1,65 +1,204 @@
 #include <getopt.h>
 
+#include <algorithm>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <memory>
 #include <string>
 #include <vector>
 
+#include "../common/image.h"
 #include "Bus.h"
+#include "coverage.h"
 #include "cpu.h"
+#include "gdbStub.h"
 #include "kbd.h"
+#include "memoryChecker.h"
+#include "multiCore.h"
+#include "perfCounters.h"
+#include "plugin.h"
+#include "romWatcher.h"
 #include "screen.h"
+#include "throttle.h"
+#include "trace.h"
 
-// Emulation cycle function
-bool emulateCycle(CPU& cpu, std::vector<Device*>& devices, int& cycle) {
-  for (auto& device : devices) {
-    // Execute a portion of the device's logic during each cycle
-    device->tick(cpu);
+// Emulation cycle function. The checked variant is a separate instantiation
+// so that the unchecked loop carries no trace of the checker. trace may be
+// nullptr.
+template <bool Checked>
+bool emulateCycle(CPU& cpu, std::vector<Device*>& devices,
+                  Throttle& throttle, uint64_t max_cycles,
+                  uint64_t& instructions, TraceWriter* trace) {
+  tickDevices(cpu, devices);
+  if (throttle.waitWhileIdle(cpu, devices, max_cycles)) return true;
+  if (trace) trace->record(cpu.getPC(), cpu.read(cpu.getPC()));
+  bool continue_emulation = Checked ? cpu.runChecked() : cpu.run();
+  instructions += 1 + cpu.takeSkippedInstructions();
+  return continue_emulation;
+}
+
+// Patches the rewritten ROM in between two instructions, keeping RAM and the
+// registers
+void reloadRom(CPU& cpu, Bus& bus, RomWatcher& watcher) {
+  uint32_t changes;
+  std::string error;
+  if (!watcher.reload(bus, changes, error)) {
+    std::cerr << "Cannot reload the ROM: " << error << std::endl;
+    return;
+  }
+  // a loop decoded for fast-forwarding or waited in may cover patched words
+  if (changes) cpu.wake();
+  std::cerr << "Reloaded the ROM, " << changes << " words changed"
+            << std::endl;
+}
 
-    // Check if the device triggered an interrupt
-    if (device->interrupt) {
-      // Handle interrupt
-      std::cout << "Interrupt from " << device->name
-                << "! Data: " << device->interruptData << std::endl;
-      device->send(cpu);
-      device->receive(cpu, -1);
-      // Reset interrupt flag and data
-      device->interrupt = 0;
-      device->interruptData = -1;
+// Host counters split by phase and guest opcode, from sampled cycles
+struct PerfStats {
+  PerfSample devices;
+  std::array<PerfSample, instruction_set.size()> opcodes;
+  std::array<uint64_t, instruction_set.size()> opcode_samples{};
+  uint64_t samples = 0;
+};
+
+// emulateCycle with the device and CPU phases counted separately. The CPU
+// phase is attributed to the opcode about to execute. The cost of reading the
+// counters is taken off every phase.
+bool emulateCycleSampled(CPU& cpu, std::vector<Device*>& devices,
+                         Throttle& throttle, uint64_t max_cycles,
+                         uint64_t& instructions, TraceWriter* trace,
+                         bool checked, PerfCounters& perf,
+                         const PerfSample& overhead, PerfStats& stats) {
+  PerfSample before = perf.read();
+  tickDevices(cpu, devices);
+  if (throttle.waitWhileIdle(cpu, devices, max_cycles)) return true;
+  if (trace) trace->record(cpu.getPC(), cpu.read(cpu.getPC()));
+  uint8_t opcode = decode(cpu.read(cpu.getPC())).opcode;
+  PerfSample between = perf.read();
+  bool continue_emulation = checked ? cpu.runChecked() : cpu.run();
+  PerfSample after = perf.read();
+  instructions += 1 + cpu.takeSkippedInstructions();
+
+  stats.devices += between - before - overhead;
+  stats.opcodes[opcode] += after - between - overhead;
+  stats.opcode_samples[opcode]++;
+  stats.samples++;
+  return continue_emulation;
+}
+
+void printPerfReport(const PerfCounters& perf, const PerfSample& total,
+                     uint64_t guest_instructions, const PerfStats& stats) {
+  auto ratio = [](uint64_t a, uint64_t b) { return b ? double(a) / b : 0.0; };
+  std::cerr << std::fixed << std::setprecision(2);
+  std::cerr << "Host counters over " << guest_instructions
+            << " guest instructions:" << std::endl;
+  for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+    std::cerr << "  " << std::left << std::setw(14) << perf_counter_names[i]
+              << std::right;
+    if (!perf.available(PerfCounter(i))) {
+      std::cerr << "not supported" << std::endl;
+      continue;
     }
+    std::cerr << std::setw(14) << total.value[i] << "  "
+              << ratio(total.value[i], guest_instructions)
+              << " per guest instruction" << std::endl;
+  }
+  std::cerr << "  host IPC      "
+            << ratio(total.value[PERF_INSTRUCTIONS], total.value[PERF_CYCLES])
+            << std::endl;
+  if (stats.samples == 0) return;
 
-    // Increment the cycle counter for interleaved execution
-    device->cycles++;
+  // averages per sampled cycle
+  std::cerr << "Sampled " << stats.samples << " cycles, per sample:"
+            << std::endl;
+  std::cerr << "  " << std::left << std::setw(8) << "phase" << std::right
+            << std::setw(10) << "samples";
+  for (const char* name : perf_counter_names) {
+    std::cerr << std::setw(14) << name;
+  }
+  std::cerr << std::endl;
+  auto row = [&](const std::string& name, uint64_t samples,
+                 const PerfSample& sample) {
+    std::cerr << "  " << std::left << std::setw(8) << name << std::right
+              << std::setw(10) << samples;
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+      std::cerr << std::setw(14) << ratio(sample.value[i], samples);
+    }
+    std::cerr << std::endl;
+  };
+  row("devices", stats.samples, stats.devices);
+  for (const OpcodeInfo& info : instruction_set) {
+    if (stats.opcode_samples[info.opcode] == 0) continue;
+    row(std::string(info.mnemonic), stats.opcode_samples[info.opcode],
+        stats.opcodes[info.opcode]);
   }
-  bool continue_emulation = cpu.run();
-  return continue_emulation;
 }
 
 int main(int argc, char* argv[]) {
   std::string input_file_name;
 
   int load_address = 0;
+  bool load_address_given = false;
+  bool disassemble_only = false;
+  std::string coverage_file_name, lcov_file_name;
+  bool perf_report = false;
+  int perf_sample_interval = 0;
+  bool check_memory = false;
+  bool fast_forward = true;
+  uint64_t max_cycles = 1000000000;
+  uint64_t clock_hz = 0;
+  bool unthrottled = false;
+  bool verbose = false;
+  unsigned cores = 1;
+  uint64_t quantum = 1000;
+  bool spinlock = false;
+  std::vector<std::string> plugin_specs;
+  std::string trace_file_name;
+  std::string gdb_address;
+  bool watch_rom = false;
 
   static struct option longOptions[] = {
       {"input-file", required_argument, 0, 'i'},
       {"load-address", required_argument, 0, 'l'},
+      {"disassemble", no_argument, 0, 'd'},
+      {"coverage", required_argument, 0, 'c'},
+      {"lcov", required_argument, 0, 'L'},
+      {"perf", no_argument, 0, 'p'},
+      {"perf-sample", required_argument, 0, 'P'},
+      {"check", no_argument, 0, 'k'},
+      {"no-fast-forward", no_argument, 0, 'F'},
+      {"max-cycles", required_argument, 0, 'm'},
+      {"clock-hz", required_argument, 0, 'H'},
+      {"unthrottled", no_argument, 0, 'u'},
+      {"verbose", no_argument, 0, 'v'},
+      {"cores", required_argument, 0, 'n'},
+      {"quantum", required_argument, 0, 'q'},
+      {"spinlock", no_argument, 0, 's'},
+      {"device", required_argument, 0, 'D'},
+      {"trace", required_argument, 0, 't'},
+      {"gdb", required_argument, 0, 'g'},
+      {"watch", no_argument, 0, 'w'},
       {"help", no_argument, 0, 'h'},
       {0, 0, 0, 0}};
 
   int opt;
-  while ((opt = getopt_long(argc, argv, "i:l:h", longOptions, NULL)) != -1) {
+  while ((opt = getopt_long(argc, argv, "i:l:dc:L:pP:kFm:H:uvn:q:sD:t:g:wh",
+                            longOptions, NULL)) != -1) {
     switch (opt) {
       case 'i':
         input_file_name = std::string(optarg);
         if (input_file_name.substr(input_file_name.find_last_of('.') + 1) !=
-            "bin") {
-          std::cerr << "ROM file should be of type .bin" << std::endl;
+                "bin" &&
+            input_file_name.substr(input_file_name.find_last_of('.') + 1) !=
+                "img") {
+          std::cerr << "ROM file should be of type .bin or .img" << std::endl;
           return 1;
         }
         break;
       case 'l':
         if (isdigit(optarg[0]) || (optarg[0] == '-' && isdigit(optarg[1]))) {
           load_address = std::atoi(optarg);  // Convert optarg to an integer
+          load_address_given = true;
           if (load_address > ROM_END) {
             std::cerr << "Load address should be less than " << ROM_END
                       << std::endl;
@@ -72,16 +211,154 @@ int main(int argc, char* argv[]) {
           return 1;
         }
         break;
+      case 'd':
+        disassemble_only = true;
+        break;
+      case 'c':
+        coverage_file_name = optarg;
+        break;
+      case 'L':
+        lcov_file_name = optarg;
+        break;
+      case 'p':
+        perf_report = true;
+        break;
+      case 'k':
+        check_memory = true;
+        break;
+      case 'F':
+        fast_forward = false;
+        break;
+      case 'm':
+      case 'H': {
+        char* end;
+        uint64_t value = std::strtoull(optarg, &end, 0);
+        if (!isdigit(optarg[0]) || *end != '\0' || value == 0) {
+          std::cerr << "Invalid cycle count: " << optarg << std::endl;
+          std::cerr << "Usage: -" << char(opt)
+                    << (opt == 'm' ? ", --max-cycles N" : ", --clock-hz HZ")
+                    << " (POSITIVE INTEGER VALUE)" << std::endl;
+          return 1;
+        }
+        (opt == 'm' ? max_cycles : clock_hz) = value;
+        break;
+      }
+      case 'u':
+        unthrottled = true;
+        break;
+      case 'v':
+        verbose = true;
+        break;
+      case 'n':
+        if (isdigit(optarg[0]) && std::atoi(optarg) >= 1 &&
+            std::atoi(optarg) <= STACK_END - STACK_BEGIN + 1) {
+          cores = std::atoi(optarg);
+        } else {
+          std::cerr << "Invalid core count: " << optarg << std::endl;
+          std::cerr << "Usage: -n, --cores N (1 TO 256)" << std::endl;
+          return 1;
+        }
+        break;
+      case 'q':
+        if (isdigit(optarg[0]) && std::strtoull(optarg, NULL, 0) > 0) {
+          quantum = std::strtoull(optarg, NULL, 0);
+        } else {
+          std::cerr << "Invalid quantum: " << optarg << std::endl;
+          std::cerr << "Usage: -q, --quantum CYCLES (POSITIVE INTEGER VALUE)"
+                    << std::endl;
+          return 1;
+        }
+        break;
+      case 's':
+        spinlock = true;
+        break;
+      case 'D':
+        plugin_specs.push_back(optarg);
+        break;
+      case 't':
+        trace_file_name = optarg;
+        break;
+      case 'g':
+        gdb_address = optarg;
+        break;
+      case 'w':
+        watch_rom = true;
+        break;
+      case 'P':
+        if (isdigit(optarg[0]) && std::atoi(optarg) > 0) {
+          perf_sample_interval = std::atoi(optarg);
+          perf_report = true;
+        } else {
+          std::cerr << "Invalid sample interval: " << optarg << std::endl;
+          std::cerr << "Usage: -P, --perf-sample N (POSITIVE INTEGER VALUE)"
+                    << std::endl;
+          return 1;
+        }
+        break;
       case 'h':
         // Display help menu
         std::cout << "Usage: " << argv[0] << "   [options] input_file(s)..."
                   << std::endl;
         std::cout << "Options:" << std::endl;
-        std::cout << "  -i, --input-file FILE    Specify input .bin ROM file"
+        std::cout << "  -i, --input-file FILE    Specify input .bin/.img ROM "
+                     "file"
                   << std::endl;
         std::cout
             << "  -l, --load-address  ADDRESS    Specify start address in ROM"
             << std::endl;
+        std::cout << "  -d, --disassemble        Print the ROM listing and exit"
+                  << std::endl;
+        std::cout << "  -c, --coverage FILE      Merge the executed ROM "
+                     "addresses into FILE"
+                  << std::endl;
+        std::cout << "  -L, --lcov FILE          Write lcov coverage using the "
+                     "ROM's .dbg file"
+                  << std::endl;
+        std::cout << "  -p, --perf               Report host hardware counters "
+                     "for the run"
+                  << std::endl;
+        std::cout << "  -P, --perf-sample N      Also break them down by phase "
+                     "and opcode, sampling one in N cycles"
+                  << std::endl;
+        std::cout << "  -k, --check              Stop on reads of unwritten "
+                     "memory, ROM writes and stack overflow"
+                  << std::endl;
+        std::cout << "  -F, --no-fast-forward    Execute idle and delay loops "
+                     "instruction by instruction"
+                  << std::endl;
+        std::cout << "  -m, --max-cycles N       Stop after N guest clock "
+                     "cycles (default 1000000000)"
+                  << std::endl;
+        std::cout << "  -H, --clock-hz HZ        Run the guest clock at HZ in "
+                     "real time"
+                  << std::endl;
+        std::cout << "  -u, --unthrottled        Run as fast as possible and "
+                     "report the guest clock rate"
+                  << std::endl;
+        std::cout << "  -v, --verbose            Trace every cycle and device "
+                     "tick"
+                  << std::endl;
+        std::cout << "  -n, --cores N            Run N CPUs on the shared bus, "
+                     "one host thread each"
+                  << std::endl;
+        std::cout << "  -q, --quantum CYCLES     Cycles the cores run between "
+                     "synchronizing (default 1000)"
+                  << std::endl;
+        std::cout << "  -s, --spinlock           Map the test-and-set spinlock "
+                     "register at 0xFDFF"
+                  << std::endl;
+        std::cout << "  -D, --device SPEC        Load a device plugin, "
+                     "PATH@BASE:SIZE[,irq=N][,remote][,arg=TEXT]"
+                  << std::endl;
+        std::cout << "  -t, --trace FILE         Write every executed "
+                     "instruction for bit16-pipeline, implies -F"
+                  << std::endl;
+        std::cout << "  -g, --gdb PORT|unix:PATH Wait for a GDB remote "
+                     "protocol client before running"
+                  << std::endl;
+        std::cout << "  -w, --watch              Patch the ROM into memory "
+                     "whenever its file is rewritten"
+                  << std::endl;
         std::cout << "  -h, --help               Display help message"
                   << std::endl;
         return 0;
@@ -91,6 +368,33 @@ int main(int argc, char* argv[]) {
     }
   }
 
+  if (cores > 1 && (check_memory || perf_report || !trace_file_name.empty() ||
+                    !coverage_file_name.empty() || !lcov_file_name.empty())) {
+    std::cerr << "--check, --perf, --trace and coverage need a single core"
+              << std::endl;
+    return 1;
+  }
+  if (!gdb_address.empty() &&
+      (cores > 1 || check_memory || perf_report || !trace_file_name.empty())) {
+    std::cerr << "--gdb needs a single core and cannot be combined with "
+                 "--check, --perf or --trace"
+              << std::endl;
+    return 1;
+  }
+  if (watch_rom && (cores > 1 || !gdb_address.empty())) {
+    std::cerr << "--watch needs a single core and cannot be combined with "
+                 "--gdb"
+              << std::endl;
+    return 1;
+  }
+  // skipped loop iterations would be missing from the trace
+  if (!trace_file_name.empty()) fast_forward = false;
+  if (unthrottled && clock_hz) {
+    std::cerr << "--unthrottled cannot be combined with --clock-hz"
+              << std::endl;
+    return 1;
+  }
+
   Bus bus = Bus();
   CPU cpu = CPU();
 
@@ -101,17 +405,65 @@ int main(int argc, char* argv[]) {
 
   cpu.setLoadingAddr(load_address);
 
-  std::ifstream binaryFile(input_file_name, std::ios::in | std::ios::binary);
+  MemoryChecker checker;
+  if (check_memory) cpu.setChecker(&checker);
+  cpu.setFastForward(fast_forward);
+  if (spinlock) bus.enableSpinlock();
 
-  if (binaryFile.is_open()) {
-    binaryFile.read((char*)(bus.ram), 32768 * 2);
+  if (isImageFile(input_file_name)) {
+    // segmented image: each segment is read straight into memory
+    bool has_entry;
+    uint16_t entry;
+    std::vector<std::pair<uint16_t, uint32_t>> loaded;
+    if (!loadImage(input_file_name, bus.ram, has_entry, entry, &loaded)) {
+      std::cerr << "Malformed ROM image " << input_file_name << std::endl;
+      return 1;
+    }
+    // segments may preload RAM as well as ROM
+    for (const auto& [address, length] : loaded) {
+      checker.setInitialized(address, address + length);
+    }
+    if (has_entry && !load_address_given) cpu.setLoadingAddr(entry);
+  } else {
+    std::ifstream binaryFile(input_file_name, std::ios::in | std::ios::binary);
+
+    if (binaryFile.is_open()) {
+      binaryFile.read((char*)(bus.ram), 32768 * 2);
+    }
+  }
+
+  if (disassemble_only) {
+    int last = ROM_END;
+    while (last > ROM_BEGIN && bus.ram[last] == 0) last--;
+    for (int address = ROM_BEGIN; address <= last; address++) {
+      std::cout << hexstr(address) << ": " << hexstr(bus.ram[address]) << "  "
+                << disassemble(bus.ram[address]) << "\n";
+    }
+    return 0;
   }
 
   std::vector<Device*> devices;
 
   std::cout << "Adding devices..." << std::endl;
-  devices.push_back(createKeyboardDevice());
-  devices.push_back(createScreenDevice());
+  devices.push_back(createKeyboardDevice(verbose));
+  devices.push_back(createScreenDevice(verbose));
+  for (const std::string& spec : plugin_specs) {
+    std::string error;
+    Device* device =
+        loadPluginDevice(spec, bus, devices.size() + 1, verbose, error);
+    if (!device) {
+      std::cerr << "Cannot load device " << spec << ": " << error << std::endl;
+      return 1;
+    }
+    devices.push_back(device);
+  }
+  if (!plugin_specs.empty()) {
+    // device registers and the IRQ word are never uninitialized memory
+    checker.setInitialized(IRQ_PENDING);
+    for (uint32_t address = ROM_END + 1; address < TOTAL_SIZE; address++) {
+      if (bus.isDevice(address)) checker.setInitialized(address);
+    }
+  }
 
   if (devices.size() > cpu.MAX_DEVICES) {
     raiseError(std::to_string(cpu.MAX_DEVICES) + " Device limit exceeded");
@@ -122,17 +474,156 @@ int main(int argc, char* argv[]) {
     std::cout << device->id << " " << device->name << std::endl;
   }
 
-  int cycle = 0;
+  // coverage is recorded over all of memory but only ROM addresses are kept
+  std::vector<uint8_t> coverage_map;
+  bool coverage = !coverage_file_name.empty() || !lcov_file_name.empty();
+  if (coverage) {
+    coverage_map.assign(TOTAL_SIZE, 0);
+    cpu.setCoverageMap(coverage_map.data());
+  }
+
+  PerfCounters perf;
+  PerfStats perf_stats;
+  PerfSample perf_overhead, perf_start;
+  if (perf_report) {
+    if (!perf.open()) {
+      std::cerr << "Cannot read host counters: " << perf.error() << std::endl;
+      return 1;
+    }
+    perf.enable();
+    perf_overhead = perf.readOverhead();
+    perf_start = perf.read();
+  }
+
+  // a trace is only opened by now so that a failed load leaves no file
+  std::unique_ptr<TraceWriter> trace;
+  if (!trace_file_name.empty()) {
+    trace = std::make_unique<TraceWriter>();
+    if (!trace->open(trace_file_name)) {
+      std::cerr << "Cannot write " << trace_file_name << std::endl;
+      return 1;
+    }
+  }
+
+  RomWatcher rom_watcher;
+  if (watch_rom) {
+    std::string error;
+    if (!rom_watcher.open(input_file_name, error)) {
+      std::cerr << "Cannot watch " << input_file_name << ": " << error
+                << std::endl;
+      return 1;
+    }
+  }
+
+  uint64_t instructions = 0;
   bool continue_emulation = true;
+  Throttle throttle(clock_hz);
+  // the guest starts once the debugger is attached
+  std::unique_ptr<GdbStub> gdb;
+  if (!gdb_address.empty()) {
+    gdb = std::make_unique<GdbStub>(cpu, bus, devices, throttle);
+    std::string error;
+    if (!gdb->listen(gdb_address, error)) {
+      std::cerr << "Cannot listen for a debugger on " << gdb_address << ": "
+                << error << std::endl;
+      return 1;
+    }
+  }
+  throttle.start(cpu.getCycles());
 
-  while (cycle < 1000000000 && continue_emulation) {
-    std::cout << "Emulation Cycle " << cycle + 1 << std::endl;
-    continue_emulation = emulateCycle(cpu, devices, cycle);
+  // the cores share one clock, so the run took as long as the busiest one
+  uint64_t guest_cycles = 0;
+  if (cores > 1) {
+    std::vector<CoreStats> stats =
+        runMultiCore(bus, cpu, devices, cores, quantum, max_cycles,
+                     fast_forward, throttle);
+    for (size_t core = 0; core < stats.size(); core++) {
+      std::cout << "Core " << core << ": " << stats[core].instructions
+                << " instructions, " << stats[core].cycles << " cycles"
+                << (stats[core].halted ? ", halted" : "") << std::endl;
+      instructions += stats[core].instructions;
+      guest_cycles = std::max(guest_cycles, stats[core].cycles);
+    }
+  } else {
+    // runs on as usual if the debugger detaches
+    if (gdb) {
+      continue_emulation = gdb->serve(max_cycles, fast_forward, instructions);
+    }
+    // a threshold rather than a multiple, as fast-forwarding and the debugger
+    // advance instructions by more than one at a time
+    uint64_t next_sample = instructions;
+    while (cpu.getCycles() < max_cycles && continue_emulation) {
+      if (verbose) {
+        std::cout << "Emulation Cycle " << instructions + 1 << std::endl;
+      }
+      if (perf_sample_interval && instructions >= next_sample) {
+        next_sample = instructions + perf_sample_interval;
+        continue_emulation = emulateCycleSampled(
+            cpu, devices, throttle, max_cycles, instructions, trace.get(),
+            check_memory, perf, perf_overhead, perf_stats);
+      } else if (check_memory) {
+        continue_emulation =
+            emulateCycle<true>(cpu, devices, throttle, max_cycles,
+                               instructions, trace.get());
+      } else {
+        continue_emulation =
+            emulateCycle<false>(cpu, devices, throttle, max_cycles,
+                                instructions, trace.get());
+      }
+      throttle.pace(cpu.getCycles());
+      if (watch_rom && rom_watcher.changed()) reloadRom(cpu, bus, rom_watcher);
+    }
+    guest_cycles = cpu.getCycles();
+  }
+  if (checker.failed()) std::cerr << checker.error() << std::endl;
+  if (trace && !trace->close()) {
+    std::cerr << "Failed to write " << trace_file_name << std::endl;
+    return 1;
+  }
+
+  if (perf_report) {
+    PerfSample total = perf.read() - perf_start;
+    perf.disable();
+    printPerfReport(perf, total, instructions, perf_stats);
+  }
+  if (unthrottled || clock_hz) {
+    std::cerr << std::fixed << std::setprecision(3) << guest_cycles
+              << " guest cycles, " << instructions << " instructions in "
+              << throttle.elapsedSeconds() << " s: "
+              << throttle.guestHz(guest_cycles) / 1e6 << " MHz";
+    if (throttle.overruns()) {
+      std::cerr << ", fell behind " << throttle.overruns() << " times";
+    }
+    std::cerr << std::endl;
   }
 
   for (auto& device : devices) {
-    device->destroy(cpu);
+    device->destroy(*device, cpu);
   }
 
+  if (!coverage_file_name.empty() &&
+      !mergeCoverage(coverage_file_name, coverage_map)) {
+    std::cerr << "Failed to merge coverage into " << coverage_file_name
+              << std::endl;
+    return 1;
+  }
+  if (!lcov_file_name.empty()) {
+    // the .dbg written by `asm -d` next to the ROM
+    std::string debug_file_name =
+        input_file_name.substr(0, input_file_name.find_last_of('.')) + ".dbg";
+    DebugInfo debug;
+    if (!readDebugInfo(debug_file_name, debug)) {
+      std::cerr << "lcov export needs " << debug_file_name
+                << " (assemble with -d)" << std::endl;
+      return 1;
+    }
+    if (!writeLcov(lcov_file_name, debug, coverage_map)) {
+      std::cerr << "Failed to write " << lcov_file_name << std::endl;
+      return 1;
+    }
+  }
+
+  if (checker.failed()) return 2;
+
   return 0;
 }
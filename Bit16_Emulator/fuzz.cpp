@@ -0,0 +1,520 @@
+// bit16-fuzz: coverage-guided fuzzing of a guest program
+//
+// Every case runs in-process on one Bus/CPU. The case is a sequence of words
+// that replaces the start of RAM, is typed on the keyboard, or replaces the
+// ROM's words, depending on --target. Edges between consecutive guest PCs
+// are counted in a map, and a case that reaches a new edge, or an edge a new
+// number of times, joins the corpus.
+//
+// Between cases only the memory pages the previous case wrote are copied
+// back from a snapshot taken after loading the ROM, and timeouts are counted
+// in guest cycles, so a case costs little more than the instructions it
+// runs. With --check, shadow-memory violations are findings; a crash of the
+// emulator itself leaves the case that caused it in the output directory.
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "../common/image.h"
+#include "Bus.h"
+#include "cpu.h"
+#include "kbd.h"
+#include "memoryChecker.h"
+#include "screen.h"
+
+namespace {
+
+using Case = std::vector<uint16_t>;
+
+enum Target { TARGET_RAM, TARGET_KEYS, TARGET_ROM };
+enum Outcome { CASE_HALT, CASE_IDLE, CASE_TIMEOUT, CASE_CHECK_FAILED };
+
+constexpr uint32_t EDGE_MAP_SIZE = 0x10000;
+
+// hit counts are compared in power-of-two buckets, so that a loop running a
+// few more times is not new coverage
+uint8_t bucket(uint8_t hits) {
+  if (hits <= 3) return hits == 3 ? 4 : hits;
+  if (hits <= 7) return 8;
+  if (hits <= 15) return 16;
+  if (hits <= 31) return 32;
+  if (hits <= 127) return 64;
+  return 128;
+}
+
+// the case being run, for the crash handler
+const Case* running_case = nullptr;
+char crash_path[4096] = "";
+
+void onCrash(int signal) {
+  if (running_case && crash_path[0]) {
+    int fd = open(crash_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+      // host byte order, which matches the case files on little-endian hosts
+      ssize_t ignored = write(fd, running_case->data(),
+                              running_case->size() * sizeof(uint16_t));
+      (void)ignored;
+      close(fd);
+    }
+  }
+  ::signal(signal, SIG_DFL);
+  raise(signal);
+}
+
+class Harness {
+ public:
+  Harness(Target target, uint64_t timeout, uint64_t key_interval, bool check)
+      : target(target),
+        timeout(timeout),
+        key_interval(key_interval),
+        check(check),
+        trace(EDGE_MAP_SIZE),
+        seen(EDGE_MAP_SIZE) {
+    bus.connectToCPU(&cpu);
+    cpu.connectToBus(&bus);
+    cpu.setFastForward(true);
+    if (check) cpu.setChecker(&checker);
+    devices.push_back(createKeyboardDevice(false));
+    devices.push_back(createScreenDevice(false));
+  }
+
+  ~Harness() {
+    for (Device* device : devices) {
+      device->destroy(*device, cpu);
+      delete device;
+    }
+  }
+
+  bool load(const std::string& file_name) {
+    if (isImageFile(file_name)) {
+      bool has_entry;
+      std::vector<std::pair<uint16_t, uint32_t>> loaded;
+      if (!loadImage(file_name, bus.ram, has_entry, entry, &loaded)) {
+        return false;
+      }
+      if (!has_entry) entry = 0;
+      for (const auto& [address, length] : loaded) {
+        pristine_checker.setInitialized(address, address + length);
+      }
+    } else {
+      std::ifstream in(file_name, std::ios::binary);
+      if (!in.is_open()) return false;
+      in.read(reinterpret_cast<char*>(bus.ram), ROM_SIZE * sizeof(uint16_t));
+      entry = 0;
+    }
+    snapshot.assign(bus.ram, bus.ram + TOTAL_SIZE);
+    bus.trackDirtyPages(true);
+    return true;
+  }
+
+  // the ROM's words up to the last non-zero one
+  Case romWords() const {
+    uint32_t length = ROM_END + 1;
+    while (length > 1 && snapshot[length - 1] == 0) length--;
+    return Case(snapshot.begin(), snapshot.begin() + length);
+  }
+
+  Outcome run(const Case& input) {
+    reset();
+    apply(input);
+    running_case = &input;
+    Outcome outcome = check ? execute<true>(input) : execute<false>(input);
+    running_case = nullptr;
+    return outcome;
+  }
+
+  // folds the last run into the coverage seen so far, true if it added any
+  bool newCoverage() {
+    bool found = false;
+    for (uint16_t edge : touched) {
+      uint8_t bits = bucket(trace[edge]);
+      if (bits & ~seen[edge]) {
+        if (!seen[edge]) edge_count++;
+        seen[edge] |= bits;
+        found = true;
+      }
+    }
+    return found;
+  }
+
+  uint32_t edges() const { return edge_count; }
+  uint16_t pc() const { return cpu.getPC(); }
+  const std::string& checkError() const { return checker.error(); }
+
+ private:
+  void reset() {
+    for (uint16_t page : bus.dirtyPages()) {
+      uint32_t begin = uint32_t(page) * DIRTY_PAGE_SIZE;
+      std::copy_n(snapshot.begin() + begin, DIRTY_PAGE_SIZE, bus.ram + begin);
+    }
+    bus.clearDirtyPages();
+    cpu.reset();
+    cpu.setPC(entry);
+    if (check) checker = pristine_checker;
+    for (uint16_t edge : touched) trace[edge] = 0;
+    touched.clear();
+  }
+
+  void apply(const Case& input) {
+    if (target == TARGET_KEYS) return;
+    uint32_t begin = target == TARGET_RAM ? RAM_BEGIN : ROM_BEGIN;
+    uint32_t size = target == TARGET_RAM ? RAM_SIZE : ROM_SIZE;
+    uint32_t count = std::min<uint32_t>(input.size(), size);
+    for (uint32_t i = 0; i < count; i++) {
+      bus.ram[begin + i] = input[i];
+      bus.markDirty(begin + i);
+    }
+    if (check) checker.setInitialized(begin, begin + count);
+  }
+
+  template <bool Checked>
+  Outcome execute(const Case& input) {
+    uint16_t previous = 0;
+    size_t next_key = 0;
+    uint64_t next_key_cycle = 0;
+    while (cpu.getCycles() < timeout) {
+      uint16_t pc = cpu.getPC();
+      uint16_t edge = pc ^ previous;
+      previous = pc >> 1;
+      uint8_t& hits = trace[edge];
+      if (hits == 0) touched.push_back(edge);
+      if (hits != 255) hits++;
+
+      tickDevices(cpu, devices);
+      // a key arrives when the program waits for one, or after an interval
+      if (target == TARGET_KEYS && next_key < input.size() &&
+          (cpu.idle() || cpu.getCycles() >= next_key_cycle)) {
+        cpu.write(KEYBOARD, input[next_key++]);
+        next_key_cycle = cpu.getCycles() + key_interval;
+      }
+      // nothing else will change the memory it polls
+      if (cpu.idle()) return CASE_IDLE;
+      if (!(Checked ? cpu.runChecked() : cpu.run())) {
+        return Checked && checker.failed() ? CASE_CHECK_FAILED : CASE_HALT;
+      }
+      cpu.takeSkippedInstructions();
+    }
+    return CASE_TIMEOUT;
+  }
+
+  Target target;
+  uint64_t timeout;
+  uint64_t key_interval;
+  bool check;
+  Bus bus;
+  CPU cpu;
+  std::vector<Device*> devices;
+  MemoryChecker checker, pristine_checker;
+  std::vector<uint16_t> snapshot;
+  uint16_t entry = 0;
+  std::vector<uint8_t> trace;  // hit counts of the current run
+  std::vector<uint16_t> touched;
+  std::vector<uint8_t> seen;  // buckets reached by any run
+  uint32_t edge_count = 0;
+};
+
+class Mutator {
+ public:
+  Mutator(uint64_t seed, size_t max_length)
+      : rng(seed), max_length(max_length) {}
+
+  // a stack of 2 to 16 random mutations, like AFL's havoc stage
+  Case mutate(const Case& parent, const std::vector<Case>& corpus) {
+    Case child = parent;
+    int count = 2 << (rng() % 4);
+    for (int i = 0; i < count; i++) mutateOnce(child, corpus);
+    if (child.empty()) child.push_back(uint16_t(rng()));
+    return child;
+  }
+
+  size_t pick(size_t size) { return rng() % size; }
+
+ private:
+  void mutateOnce(Case& c, const std::vector<Case>& corpus) {
+    static constexpr uint16_t interesting[] = {0,      1,      0x7f,  0x80,
+                                               0xff,   0x100,  0x7fff, 0x8000,
+                                               0xfdfe, 0xff00, 0xffff};
+    if (c.empty()) {
+      c.push_back(uint16_t(rng()));
+      return;
+    }
+    uint16_t& word = c[rng() % c.size()];
+    switch (rng() % 9) {
+      case 0:
+        word ^= 1 << (rng() % 16);
+        break;
+      case 1:
+        word = uint16_t(rng());
+        break;
+      case 2:
+        word ^= (rng() % 255 + 1) << (rng() % 2 ? 8 : 0);
+        break;
+      case 3:
+        word += rng() % 2 ? rng() % 35 + 1 : -(rng() % 35 + 1);
+        break;
+      case 4:
+        word = interesting[rng() % std::size(interesting)];
+        break;
+      case 5:
+        // a different opcode with the same operands
+        word = (word & 0x0fff) | (rng() % 16) << OPCODE_SHIFT;
+        break;
+      case 6:
+        if (c.size() < max_length) {
+          c.insert(c.begin() + rng() % (c.size() + 1), uint16_t(rng()));
+        }
+        break;
+      case 7:
+        if (c.size() > 1) c.erase(c.begin() + rng() % c.size());
+        break;
+      case 8: {
+        // splice in a run of words from another corpus entry
+        const Case& other = corpus[rng() % corpus.size()];
+        if (other.empty()) break;
+        size_t from = rng() % other.size();
+        size_t length = rng() % (other.size() - from) + 1;
+        size_t to = rng() % c.size();
+        if (to >= max_length) break;
+        length = std::min(length, max_length - to);
+        if (to + length > c.size()) c.resize(to + length);
+        std::copy_n(other.begin() + from, length, c.begin() + to);
+        break;
+      }
+    }
+  }
+
+  std::mt19937_64 rng;
+  size_t max_length;
+};
+
+bool readCase(const std::string& file_name, Case& c) {
+  std::ifstream in(file_name, std::ios::binary);
+  if (!in.is_open()) return false;
+  c.clear();
+  while (in.peek() != EOF) c.push_back(binary_io::get<uint16_t>(in));
+  return true;
+}
+
+bool writeCase(const std::string& file_name, const Case& c) {
+  std::ofstream out(file_name, std::ios::binary);
+  for (uint16_t word : c) binary_io::put<uint16_t>(out, word);
+  return bool(out);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  std::string input_file_name, output_dir, corpus_dir;
+  Target target = TARGET_RAM;
+  uint64_t timeout = 100000;
+  uint64_t key_interval = 1000;
+  uint64_t runs = 0;
+  uint64_t seed = 1;
+  size_t max_length = 256;
+  bool check = false;
+
+  static struct option longOptions[] = {
+      {"input-file", required_argument, 0, 'i'},
+      {"target", required_argument, 0, 'T'},
+      {"output", required_argument, 0, 'o'},
+      {"corpus", required_argument, 0, 'C'},
+      {"timeout", required_argument, 0, 't'},
+      {"key-interval", required_argument, 0, 'K'},
+      {"runs", required_argument, 0, 'n'},
+      {"seed", required_argument, 0, 's'},
+      {"max-length", required_argument, 0, 'm'},
+      {"check", no_argument, 0, 'k'},
+      {"help", no_argument, 0, 'h'},
+      {0, 0, 0, 0}};
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "i:T:o:C:t:K:n:s:m:kh", longOptions,
+                            NULL)) != -1) {
+    switch (opt) {
+      case 'i':
+        input_file_name = optarg;
+        break;
+      case 'T':
+        if (std::string(optarg) == "ram") {
+          target = TARGET_RAM;
+        } else if (std::string(optarg) == "keys") {
+          target = TARGET_KEYS;
+        } else if (std::string(optarg) == "rom") {
+          target = TARGET_ROM;
+        } else {
+          std::cerr << "Unknown target: " << optarg << " (ram, keys or rom)"
+                    << std::endl;
+          return 1;
+        }
+        break;
+      case 'o':
+        output_dir = optarg;
+        break;
+      case 'C':
+        corpus_dir = optarg;
+        break;
+      case 't':
+      case 'K':
+      case 'n':
+      case 's':
+      case 'm': {
+        char* end;
+        uint64_t value = std::strtoull(optarg, &end, 0);
+        if (!isdigit(optarg[0]) || *end != '\0') {
+          std::cerr << "Invalid integer value: " << optarg << std::endl;
+          return 1;
+        }
+        if (opt == 't') timeout = value;
+        if (opt == 'K') key_interval = value;
+        if (opt == 'n') runs = value;
+        if (opt == 's') seed = value;
+        if (opt == 'm') max_length = std::max<uint64_t>(value, 1);
+        break;
+      }
+      case 'k':
+        check = true;
+        break;
+      case 'h':
+        std::cout << "Usage: " << argv[0] << " -i ROM [options]" << std::endl;
+        std::cout << "Options:" << std::endl;
+        std::cout << "  -i, --input-file FILE    .bin/.img ROM to fuzz"
+                  << std::endl;
+        std::cout << "  -T, --target WHAT        Mutate ram (start of RAM), "
+                     "keys (keyboard input) or rom"
+                  << std::endl;
+        std::cout << "  -o, --output DIR         Save the corpus and findings "
+                     "under DIR"
+                  << std::endl;
+        std::cout << "  -C, --corpus DIR         Seed cases, one file of "
+                     "little-endian words each"
+                  << std::endl;
+        std::cout << "  -t, --timeout CYCLES     Guest cycles per case "
+                     "(default 100000)"
+                  << std::endl;
+        std::cout << "  -K, --key-interval N     Cycles between keys when the "
+                     "program is not waiting (default 1000)"
+                  << std::endl;
+        std::cout << "  -n, --runs N             Stop after N cases (default: "
+                     "never)"
+                  << std::endl;
+        std::cout << "  -s, --seed N             Random seed (default 1)"
+                  << std::endl;
+        std::cout << "  -m, --max-length WORDS   Longest case (default 256)"
+                  << std::endl;
+        std::cout << "  -k, --check              Report shadow-memory "
+                     "violations as findings"
+                  << std::endl;
+        std::cout << "  -h, --help               Display help message"
+                  << std::endl;
+        return 0;
+      default:
+        std::cerr << "Use '" << argv[0] << " --help' for usage." << std::endl;
+        return 1;
+    }
+  }
+  if (input_file_name.empty()) {
+    std::cerr << "No ROM given, use -i FILE" << std::endl;
+    return 1;
+  }
+
+  Harness harness(target, timeout, key_interval, check);
+  if (!harness.load(input_file_name)) {
+    std::cerr << "Cannot load ROM " << input_file_name << std::endl;
+    return 1;
+  }
+
+  if (!output_dir.empty()) {
+    std::error_code error;
+    std::filesystem::create_directories(output_dir + "/queue", error);
+    std::filesystem::create_directories(output_dir + "/crashes", error);
+    if (error) {
+      std::cerr << "Cannot create " << output_dir << ": " << error.message()
+                << std::endl;
+      return 1;
+    }
+    std::string path = output_dir + "/crashes/emulator-crash";
+    if (path.size() < sizeof(crash_path)) {
+      std::strcpy(crash_path, path.c_str());
+    }
+    for (int signal : {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT}) {
+      ::signal(signal, onCrash);
+    }
+  }
+
+  std::vector<Case> seeds;
+  if (!corpus_dir.empty()) {
+    std::error_code error;
+    for (const auto& entry :
+         std::filesystem::directory_iterator(corpus_dir, error)) {
+      Case c;
+      if (entry.is_regular_file() && readCase(entry.path().string(), c)) {
+        seeds.push_back(c);
+      }
+    }
+  }
+  if (seeds.empty()) {
+    seeds.push_back(target == TARGET_ROM ? harness.romWords() : Case(16, 0));
+  }
+  for (const Case& c : seeds) max_length = std::max(max_length, c.size());
+
+  Mutator mutator(seed, max_length);
+  std::vector<Case> corpus;
+  std::set<uint16_t> finding_pcs;
+  uint64_t executions = 0, timeouts = 0;
+
+  auto report = [&](const Case& c, Outcome outcome) {
+    executions++;
+    if (outcome == CASE_TIMEOUT) timeouts++;
+    if (outcome == CASE_CHECK_FAILED &&
+        finding_pcs.insert(harness.pc()).second) {
+      std::cerr << harness.checkError() << std::endl;
+      if (!output_dir.empty()) {
+        writeCase(output_dir + "/crashes/check-" + hexstr(harness.pc()), c);
+      }
+    }
+    if (harness.newCoverage() || corpus.empty()) {
+      if (!output_dir.empty()) {
+        std::ostringstream name;
+        name << output_dir << "/queue/id-" << std::setw(6)
+             << std::setfill('0') << corpus.size();
+        writeCase(name.str(), c);
+      }
+      corpus.push_back(c);
+    }
+  };
+  for (const Case& c : seeds) report(c, harness.run(c));
+
+  using Clock = std::chrono::steady_clock;
+  Clock::time_point start = Clock::now(), last_status = start;
+  auto status = [&]() {
+    std::chrono::duration<double> seconds = Clock::now() - start;
+    std::cerr << "execs " << executions << " ("
+              << uint64_t(executions / seconds.count()) << "/s), corpus "
+              << corpus.size() << ", edges "
+              << harness.edges() << ", findings " << finding_pcs.size()
+              << ", timeouts " << timeouts << std::endl;
+  };
+  while (runs == 0 || executions < runs) {
+    Case child = mutator.mutate(corpus[mutator.pick(corpus.size())], corpus);
+    report(child, harness.run(child));
+    if ((executions & 0xfff) == 0 &&
+        Clock::now() - last_status > std::chrono::seconds(1)) {
+      last_status = Clock::now();
+      status();
+    }
+  }
+  status();
+  return finding_pcs.empty() ? 0 : 2;
+}
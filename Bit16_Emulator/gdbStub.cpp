@@ -0,0 +1,542 @@
+#include "gdbStub.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+namespace {
+
+// the general registers, then SP and PC
+constexpr size_t REGISTER_COUNT = register_set.size() + 2;
+constexpr size_t REG_SP_NUMBER = register_set.size();
+constexpr size_t REG_PC_NUMBER = register_set.size() + 1;
+// instructions run between looking for an interrupt from the debugger
+constexpr uint32_t POLL_INTERVAL = 1 << 16;
+// bytes in a packet, as told to the debugger in qSupported
+constexpr size_t PACKET_SIZE = 0x4000;
+
+int hexDigit(int c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+// a hexadecimal number of up to 32 bits at pos, false if there is none
+bool parseHex(const std::string& text, size_t& pos, uint32_t& value) {
+  size_t start = pos;
+  value = 0;
+  while (pos < text.size() && hexDigit(text[pos]) >= 0) {
+    if (value >> 28) return false;
+    value = value << 4 | hexDigit(text[pos++]);
+  }
+  return pos != start;
+}
+
+// "ADDRESS,N" and what follows it
+bool parseRange(const std::string& text, size_t& pos, uint32_t& address,
+                uint32_t& length) {
+  if (!parseHex(text, pos, address) || pos == text.size() ||
+      text[pos++] != ',') {
+    return false;
+  }
+  return parseHex(text, pos, length) && address <= 0xffff;
+}
+
+void appendHexByte(std::string& out, uint8_t byte) {
+  static constexpr char digits[] = "0123456789abcdef";
+  out += digits[byte >> 4];
+  out += digits[byte & 0xf];
+}
+
+// words go low byte first, as in the ROM files
+void appendWord(std::string& out, uint16_t word) {
+  appendHexByte(out, word & 0xff);
+  appendHexByte(out, word >> 8);
+}
+
+bool parseWord(const std::string& text, size_t pos, uint16_t& word) {
+  if (pos + 4 > text.size()) return false;
+  int digits[4];
+  for (int i = 0; i < 4; i++) {
+    digits[i] = hexDigit(text[pos + i]);
+    if (digits[i] < 0) return false;
+  }
+  word = (digits[0] << 4 | digits[1]) | (digits[2] << 4 | digits[3]) << 8;
+  return true;
+}
+
+std::string targetDescription() {
+  std::string xml =
+      "<?xml version=\"1.0\"?>"
+      "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+      "<target version=\"1.0\"><feature name=\"org.bit16.core\">";
+  for (const RegisterInfo& info : register_set) {
+    std::string name(info.name);
+    std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+    xml += "<reg name=\"" + name + "\" bitsize=\"16\" type=\"" +
+           (info.code == REG_HL ? "data_ptr" : "uint16") + "\"/>";
+  }
+  xml +=
+      "<reg name=\"sp\" bitsize=\"16\" type=\"data_ptr\"/>"
+      "<reg name=\"pc\" bitsize=\"16\" type=\"code_ptr\"/>"
+      "</feature></target>";
+  return xml;
+}
+
+}  // namespace
+
+GdbStub::GdbStub(CPU& cpu, Bus& bus, std::vector<Device*>& devices,
+                 Throttle& throttle)
+    : cpu(cpu), bus(bus), devices(devices), throttle(throttle) {}
+
+GdbStub::~GdbStub() {
+  if (client >= 0) close(client);
+  if (server >= 0) close(server);
+  if (!unix_path.empty()) unlink(unix_path.c_str());
+}
+
+bool GdbStub::listen(const std::string& address, std::string& error) {
+  if (address.rfind("unix:", 0) == 0) {
+    sockaddr_un local = {};
+    local.sun_family = AF_UNIX;
+    std::string path = address.substr(5);
+    if (path.empty() || path.size() >= sizeof(local.sun_path)) {
+      error = "invalid socket path";
+      return false;
+    }
+    path.copy(local.sun_path, path.size());
+    // a socket left behind by an earlier run
+    struct stat status;
+    if (stat(path.c_str(), &status) == 0 && S_ISSOCK(status.st_mode)) {
+      unlink(path.c_str());
+    }
+    server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server < 0 ||
+        bind(server, reinterpret_cast<sockaddr*>(&local), sizeof(local)) < 0) {
+      error = strerror(errno);
+      return false;
+    }
+    unix_path = path;
+  } else {
+    char* end;
+    unsigned long port = std::strtoul(address.c_str(), &end, 10);
+    if (!isdigit(address[0]) || *end != '\0' || port == 0 || port > 0xffff) {
+      error = "expected a port or unix:PATH";
+      return false;
+    }
+    sockaddr_in local = {};
+    local.sin_family = AF_INET;
+    local.sin_port = htons(port);
+    local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    server = socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1;
+    if (server < 0 ||
+        setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) <
+            0 ||
+        bind(server, reinterpret_cast<sockaddr*>(&local), sizeof(local)) < 0) {
+      error = strerror(errno);
+      return false;
+    }
+  }
+  if (::listen(server, 1) < 0) {
+    error = strerror(errno);
+    return false;
+  }
+  std::cout << "Waiting for a debugger on " << address << "..." << std::endl;
+  do {
+    client = accept(server, nullptr, nullptr);
+  } while (client < 0 && errno == EINTR);
+  if (client < 0) {
+    error = strerror(errno);
+    return false;
+  }
+  // replies are small and the debugger waits for each of them
+  int nodelay = 1;
+  if (unix_path.empty()) {
+    setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+  }
+  std::cout << "Debugger attached" << std::endl;
+  return true;
+}
+
+int GdbStub::receive() {
+  if (input_pos == input.size()) {
+    char buffer[4096];
+    ssize_t received;
+    do {
+      received = recv(client, buffer, sizeof(buffer), 0);
+    } while (received < 0 && errno == EINTR);
+    if (received <= 0) return -1;
+    input.assign(buffer, received);
+    input_pos = 0;
+  }
+  return static_cast<unsigned char>(input[input_pos++]);
+}
+
+bool GdbStub::readPacket(std::string& packet) {
+  while (true) {
+    // acknowledgements and stray interrupts are skipped
+    int c;
+    do {
+      c = receive();
+      if (c < 0) return false;
+    } while (c != '$');
+    packet.clear();
+    uint8_t sum = 0;
+    while ((c = receive()) != '#') {
+      if (c < 0) return false;
+      packet += char(c);
+      sum += c;
+    }
+    int high = receive(), low = receive();
+    if (low < 0) return false;
+    bool valid = hexDigit(high) >= 0 && hexDigit(low) >= 0 &&
+                 (hexDigit(high) << 4 | hexDigit(low)) == sum;
+    if (acknowledge && send(client, valid ? "+" : "-", 1, MSG_NOSIGNAL) != 1) {
+      return false;
+    }
+    if (valid) return true;
+  }
+}
+
+bool GdbStub::sendPacket(const std::string& data) {
+  std::string packet = "$" + data + "#";
+  uint8_t sum = 0;
+  for (char c : data) sum += c;
+  appendHexByte(packet, sum);
+  size_t sent = 0;
+  while (sent < packet.size()) {
+    ssize_t count = send(client, packet.data() + sent, packet.size() - sent,
+                         MSG_NOSIGNAL);
+    if (count < 0 && errno == EINTR) continue;
+    if (count <= 0) return false;
+    sent += count;
+  }
+  return true;
+}
+
+bool GdbStub::interrupted() {
+  while (true) {
+    if (input_pos == input.size()) {
+      pollfd readable = {client, POLLIN, 0};
+      if (poll(&readable, 1, 0) <= 0) return false;
+    }
+    // a closed connection stops the guest as well
+    int c = receive();
+    if (c < 0 || c == 0x03) return true;
+  }
+}
+
+bool GdbStub::serve(uint64_t max_cycles, bool fast_forward,
+                    uint64_t& instructions) {
+  this->max_cycles = max_cycles;
+  this->fast_forward = fast_forward;
+  this->instructions = &instructions;
+  bus.setWatcher({this, onAccess});
+
+  std::string packet;
+  while (readPacket(packet)) {
+    if (packet == "k") return false;
+    bool go = false, step = false, detach = false;
+    std::string reply = handle(packet, go, step, detach);
+    if (go) reply = resume(step);
+    if (!sendPacket(reply) || detach) break;
+    if (reply == "W00") return false;
+  }
+
+  // the guest runs on without the debugger
+  breakpoints.reset();
+  breakpoint_count = 0;
+  watchpoints.clear();
+  updateWatches();
+  cpu.setFastForward(fast_forward);
+  close(client);
+  client = -1;
+  return true;
+}
+
+std::string GdbStub::handle(const std::string& packet, bool& resume,
+                            bool& step, bool& detach) {
+  if (packet.empty()) return "";
+  size_t pos = 1;
+  uint32_t number;
+  switch (packet[0]) {
+    case '?':
+      return last_stop;
+    case 'g':
+      return readRegisters();
+    case 'G': {
+      uint16_t values[REGISTER_COUNT];
+      if (packet.size() != 1 + REGISTER_COUNT * 4) return "E01";
+      for (size_t i = 0; i < REGISTER_COUNT; i++) {
+        if (!parseWord(packet, 1 + i * 4, values[i])) return "E01";
+      }
+      for (size_t i = 0; i < register_set.size(); i++) {
+        cpu.set_value(i, values[i]);
+      }
+      cpu.setSP(values[REG_SP_NUMBER]);
+      cpu.setPC(values[REG_PC_NUMBER]);
+      cpu.wake();
+      return "OK";
+    }
+    case 'p':
+      if (!parseHex(packet, pos, number) || number >= REGISTER_COUNT) {
+        return "E01";
+      }
+      return readRegisters().substr(number * 4, 4);
+    case 'P': {
+      uint16_t value;
+      if (!parseHex(packet, pos, number) || number >= REGISTER_COUNT ||
+          pos == packet.size() || packet[pos] != '=' ||
+          !parseWord(packet, pos + 1, value)) {
+        return "E01";
+      }
+      if (number == REG_SP_NUMBER) {
+        cpu.setSP(value);
+      } else if (number == REG_PC_NUMBER) {
+        cpu.setPC(value);
+      } else {
+        cpu.set_value(number, value);
+      }
+      cpu.wake();
+      return "OK";
+    }
+    case 'm':
+      return readMemory(packet.substr(1));
+    case 'M':
+      return writeMemory(packet.substr(1));
+    case 'c':
+    case 's':
+      // optionally resuming somewhere else
+      if (packet.size() > 1) {
+        if (!parseHex(packet, pos, number) || number > 0xffff) return "E01";
+        cpu.setPC(number);
+      }
+      resume = true;
+      step = packet[0] == 's';
+      return "";
+    case 'Z':
+    case 'z':
+      return setPoint(packet.substr(1), packet[0] == 'Z');
+    case 'D':
+      detach = true;
+      return "OK";
+    case 'H':
+    case 'T':
+      // the only thread
+      return "OK";
+    case 'q':
+      if (packet.rfind("qSupported", 0) == 0) {
+        std::string reply = "PacketSize=";
+        appendHexByte(reply, PACKET_SIZE >> 8);
+        appendHexByte(reply, PACKET_SIZE & 0xff);
+        return reply +
+               ";qXfer:features:read+;swbreak+;hwbreak+;QStartNoAckMode+";
+      }
+      if (packet == "qAttached") return "1";
+      if (packet == "qC") return "QC1";
+      if (packet == "qfThreadInfo") return "m1";
+      if (packet == "qsThreadInfo") return "l";
+      if (packet.rfind("qXfer:features:read:target.xml:", 0) == 0) {
+        uint32_t offset, length;
+        pos = packet.find_last_of(':') + 1;
+        if (!parseHex(packet, pos, offset) || pos == packet.size() ||
+            packet[pos++] != ',' || !parseHex(packet, pos, length)) {
+          return "E01";
+        }
+        std::string xml = targetDescription();
+        if (offset >= xml.size()) return "l";
+        std::string part = xml.substr(offset, length);
+        return (offset + part.size() == xml.size() ? "l" : "m") + part;
+      }
+      return "";
+    case 'Q':
+      if (packet == "QStartNoAckMode") {
+        acknowledge = false;
+        return "OK";
+      }
+      return "";
+    default:
+      return "";
+  }
+}
+
+std::string GdbStub::readRegisters() {
+  std::string reply;
+  for (size_t i = 0; i < register_set.size(); i++) {
+    appendWord(reply, cpu.get_value(i));
+  }
+  appendWord(reply, cpu.getSP());
+  appendWord(reply, cpu.getPC());
+  return reply;
+}
+
+// "ADDRESS,N": N words, cut short at the end of memory
+std::string GdbStub::readMemory(const std::string& args) {
+  size_t pos = 0;
+  uint32_t address, length;
+  if (!parseRange(args, pos, address, length) || pos != args.size()) {
+    return "E01";
+  }
+  length = std::min<uint32_t>({length, TOTAL_SIZE - address,
+                               (PACKET_SIZE - 4) / 4});
+  std::string reply;
+  for (uint32_t i = 0; i < length; i++) appendWord(reply, bus.ram[address + i]);
+  return reply;
+}
+
+// "ADDRESS,N:DATA"
+std::string GdbStub::writeMemory(const std::string& args) {
+  size_t pos = 0;
+  uint32_t address, length;
+  if (!parseRange(args, pos, address, length) || pos == args.size() ||
+      args[pos++] != ':' || args.size() - pos != length * 4 ||
+      length > TOTAL_SIZE - address) {
+    return "E01";
+  }
+  for (uint32_t i = 0; i < length; i++) {
+    uint16_t word;
+    if (!parseWord(args, pos + i * 4, word)) return "E01";
+    bus.ram[address + i] = word;
+  }
+  // the guest may be waiting on, or fast-forwarding, what was changed
+  cpu.wake();
+  return "OK";
+}
+
+// "TYPE,ADDRESS,KIND": breakpoints (types 0 and 1) ignore KIND, watchpoints
+// (write 2, read 3, access 4) cover KIND words
+std::string GdbStub::setPoint(const std::string& args, bool insert) {
+  size_t pos = 0;
+  uint32_t type, address, kind;
+  if (!parseHex(args, pos, type) || pos == args.size() ||
+      args[pos++] != ',' || !parseRange(args, pos, address, kind) ||
+      type > 4) {
+    return "E01";
+  }
+  if (type <= 1) {
+    if (breakpoints[address] != insert) {
+      breakpoints[address] = insert;
+      if (insert) {
+        breakpoint_count++;
+      } else {
+        breakpoint_count--;
+      }
+    }
+    return "OK";
+  }
+  static constexpr Watch types[] = {WATCH_WRITE, WATCH_READ, WATCH_ACCESS};
+  Watchpoint watchpoint = {
+      uint16_t(address),
+      uint16_t(std::clamp<uint32_t>(kind, 1, TOTAL_SIZE - address)),
+      types[type - 2]};
+  auto same = [&](const Watchpoint& other) {
+    return other.address == watchpoint.address &&
+           other.length == watchpoint.length && other.type == watchpoint.type;
+  };
+  if (insert) {
+    watchpoints.push_back(watchpoint);
+  } else {
+    auto found = std::find_if(watchpoints.begin(), watchpoints.end(), same);
+    if (found == watchpoints.end()) return "E01";
+    watchpoints.erase(found);
+  }
+  updateWatches();
+  return "OK";
+}
+
+void GdbStub::updateWatches() {
+  std::fill(std::begin(watched), std::end(watched), 0);
+  for (const Watchpoint& watchpoint : watchpoints) {
+    for (uint32_t i = 0; i < watchpoint.length; i++) {
+      watched[watchpoint.address + i] |= watchpoint.type;
+    }
+  }
+  for (uint32_t page = 0; page < TOTAL_SIZE / MMIO_PAGE_SIZE; page++) {
+    const uint8_t* words = watched + page * MMIO_PAGE_SIZE;
+    bus.watchPage(page, std::any_of(words, words + MMIO_PAGE_SIZE,
+                                    [](uint8_t bits) { return bits != 0; }));
+  }
+}
+
+void GdbStub::onAccess(void* context, uint16_t address, bool write) {
+  GdbStub& stub = *static_cast<GdbStub*>(context);
+  if (!write && stub.fetch_pending && address == stub.cpu.getPC()) {
+    stub.fetch_pending = false;
+    return;
+  }
+  uint8_t bits = stub.watched[address];
+  if (!(bits & (WATCH_ACCESS | (write ? WATCH_WRITE : WATCH_READ))) ||
+      stub.watch_hit) {
+    return;
+  }
+  stub.watch_hit = true;
+  stub.hit_address = address;
+  stub.hit_type = bits & WATCH_ACCESS ? WATCH_ACCESS
+                  : write             ? WATCH_WRITE
+                                      : WATCH_READ;
+}
+
+std::string GdbStub::resume(bool step) {
+  bool debugging = step || breakpoint_count || !watchpoints.empty();
+  // fast-forwarding would skip over breakpoints, watched accesses and steps
+  cpu.setFastForward(fast_forward && !debugging);
+  cpu.wake();
+  last_stop = debugging ? run<true>(step) : run<false>(false);
+  return last_stop;
+}
+
+// The plain run loop of emu.cpp, polling the debugger for interrupts. Only
+// the Debugging instantiation looks at breakpoints and watchpoints.
+template <bool Debugging>
+std::string GdbStub::run(bool step) {
+  // a breakpoint at the PC the guest resumes from has been reported already
+  bool resuming = true;
+  uint32_t until_poll = POLL_INTERVAL;
+  while (true) {
+    if (cpu.getCycles() >= max_cycles) return "S18";  // SIGXCPU
+    if (Debugging && !resuming && breakpoints[cpu.getPC()]) {
+      return "T05swbreak:;";
+    }
+    resuming = false;
+    tickDevices(cpu, devices);
+    if (!Debugging && throttle.waitWhileIdle(cpu, devices, max_cycles)) {
+      throttle.pace(cpu.getCycles());
+      if (interrupted()) return "S02";
+      continue;
+    }
+    if (Debugging) {
+      fetch_pending = true;
+      watch_hit = false;
+    }
+    if (!cpu.run()) return "W00";
+    *instructions += 1 + cpu.takeSkippedInstructions();
+    throttle.pace(cpu.getCycles());
+    if (Debugging) {
+      if (watch_hit) {
+        std::string reply = hit_type == WATCH_ACCESS  ? "T05awatch:"
+                            : hit_type == WATCH_WRITE ? "T05watch:"
+                                                      : "T05rwatch:";
+        appendHexByte(reply, hit_address >> 8);
+        appendHexByte(reply, hit_address & 0xff);
+        return reply + ";";
+      }
+      if (step) return "S05";
+    }
+    if (--until_poll == 0) {
+      until_poll = POLL_INTERVAL;
+      if (interrupted()) return "S02";
+    }
+  }
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <bitset>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "Bus.h"
+#include "cpu.h"
+#include "throttle.h"
+
+// GDB remote serial protocol stub, for gdb or any other RSP client.
+//
+// Addresses are word addresses and memory lengths count words, each sent
+// low byte first. The registers are A, B, C, D, E, SR, HL, F, SP and PC, 16
+// bits each, described to the client by target.xml. Memory reads and writes
+// from the debugger go straight to RAM, bypassing devices.
+//
+// Breakpoints are a bitmap of PCs and watchpoints trap whole pages of the Bus,
+// both only looked at while some are set: continuing without any runs the
+// guest as fast as the plain run loop, fast-forwarding included.
+class GdbStub {
+ public:
+  GdbStub(CPU& cpu, Bus& bus, std::vector<Device*>& devices,
+          Throttle& throttle);
+  ~GdbStub();
+
+  // Waits for a debugger to connect to address, a TCP port on localhost or
+  // unix:PATH
+  bool listen(const std::string& address, std::string& error);
+  // Runs the guest under the debugger. Returns true if the debugger detached
+  // or went away with the guest still running, false if the guest halted or
+  // was killed.
+  bool serve(uint64_t max_cycles, bool fast_forward, uint64_t& instructions);
+
+ private:
+  enum Watch : uint8_t { WATCH_READ = 1, WATCH_WRITE = 2, WATCH_ACCESS = 4 };
+  struct Watchpoint {
+    uint16_t address;
+    uint16_t length;
+    Watch type;
+  };
+
+  CPU& cpu;
+  Bus& bus;
+  std::vector<Device*>& devices;
+  Throttle& throttle;
+  int server = -1, client = -1;
+  std::string unix_path;
+  std::string input;  // received, from input_pos on not yet parsed
+  size_t input_pos = 0;
+  bool acknowledge = true;
+  std::string last_stop = "S05";
+
+  uint64_t max_cycles = 0;
+  bool fast_forward = true;
+  uint64_t* instructions = nullptr;
+
+  std::bitset<TOTAL_SIZE> breakpoints;
+  size_t breakpoint_count = 0;
+  std::vector<Watchpoint> watchpoints;
+  uint8_t watched[TOTAL_SIZE] = {};  // Watch bits of every word
+  // the fetch of the instruction being stepped, not a watched read
+  bool fetch_pending = false;
+  bool watch_hit = false;
+  uint16_t hit_address = 0;
+  Watch hit_type = WATCH_READ;
+
+  // -1 once the connection is closed
+  int receive();
+  bool readPacket(std::string& packet);
+  bool sendPacket(const std::string& data);
+  // true if the debugger sent an interrupt (^C)
+  bool interrupted();
+
+  std::string handle(const std::string& packet, bool& resume, bool& step,
+                     bool& detach);
+  std::string readRegisters();
+  std::string readMemory(const std::string& args);
+  std::string writeMemory(const std::string& args);
+  std::string setPoint(const std::string& args, bool insert);
+  void updateWatches();
+  static void onAccess(void* context, uint16_t address, bool write);
+
+  // a stop reply, "W00" when the guest halted
+  std::string resume(bool step);
+  template <bool Debugging>
+  std::string run(bool step);
+};
@@ -0,0 +1,525 @@
+// bit16-gen: random valid programs for benchmarking and stress testing
+//
+// Programs are drawn from the ISA tables in common.h with a configurable
+// instruction mix, loop nesting, memory footprint and branch density, and are
+// written as .asm source or as a .bin ROM. A generated program always halts:
+// - every loop counts up to 0 in a RAM word that its body cannot reach
+// - conditional branches only skip forward
+// - loads and stores through HL stay in a data window that is filled before
+//   the first loop, and immediate loads read ROM, so --check stays quiet
+// - pushes and pops balance within every block
+// The same seed and options give the same program.
+//
+// Kernels are preset options that keep one part of the emulator busy for a
+// long time: the ALU, memory accesses, the stack or jumps.
+#include <getopt.h>
+
+#include <array>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Bus.h"
+
+namespace {
+
+// loop counters, one per nesting level, then the data window
+constexpr uint16_t COUNTER_BASE = RAM_BEGIN;
+constexpr int MAX_DEPTH = 16;
+constexpr uint16_t DATA_BEGIN = COUNTER_BASE + MAX_DEPTH;
+constexpr uint32_t MAX_FOOTPRINT = RAM_END - DATA_BEGIN + 1;
+// words a program may push at once, well inside the stack window
+constexpr int MAX_PUSHED = 64;
+// registers the random instructions work on. HL is kept for jump targets and
+// pointers, SR for the i/o and bank bits and F for the flags.
+constexpr std::array<uint8_t, 5> work_registers = {0, 1, 2, 3, 4};
+constexpr uint8_t REG_B = 1, REG_C = 2, REG_D = 3;
+
+struct Options {
+  std::array<uint32_t, instruction_set.size()> mix{};
+  uint32_t length = 16;    // statements per block
+  uint32_t depth = 2;      // loop nesting
+  uint32_t count = 10;     // iterations of every loop
+  uint32_t branches = 10;  // percent of statements that branch forward
+  uint32_t footprint = 256;
+};
+
+Options defaultOptions() {
+  Options options;
+  options.mix.fill(1);
+  options.mix[OP_HALT] = 0;
+  return options;
+}
+
+// the kernels, on top of the defaults
+bool applyKernel(const std::string& name, Options& options) {
+  options.mix.fill(0);
+  options.length = 32;
+  options.depth = 3;
+  options.count = 200;
+  options.branches = 0;
+  if (name == "alu") {
+    for (uint8_t opcode : {OP_MW, OP_ADD, OP_SUB, OP_AND, OP_ADDC, OP_NOT}) {
+      options.mix[opcode] = 1;
+    }
+  } else if (name == "memory") {
+    options.mix[OP_LW] = 4;
+    options.mix[OP_SW] = 4;
+    options.mix[OP_ADD] = 1;
+    options.footprint = 8192;
+  } else if (name == "stack") {
+    options.mix[OP_PUSH] = 2;
+    options.mix[OP_POP] = 2;
+    options.mix[OP_ADD] = 1;
+  } else if (name == "jump") {
+    options.mix[OP_ADD] = 1;
+    options.mix[OP_SUB] = 1;
+    options.mix[OP_JMPZ] = 1;
+    options.mix[OP_JMPN] = 1;
+    options.length = 16;
+    options.branches = 50;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// "MNEMONIC=WEIGHT,...", instructions left out keep their weight
+bool parseMix(const std::string& text, Options& options) {
+  std::stringstream stream(text);
+  std::string entry;
+  while (std::getline(stream, entry, ',')) {
+    size_t equals = entry.find('=');
+    if (equals == std::string::npos) return false;
+    std::string mnemonic = entry.substr(0, equals);
+    for (char& c : mnemonic) c = toupper(c);
+    char* end;
+    unsigned long weight = std::strtoul(entry.c_str() + equals + 1, &end, 0);
+    if (!isdigit(entry[equals + 1]) || *end != '\0' || weight > 1000000) {
+      return false;
+    }
+    bool found = false;
+    for (const OpcodeInfo& info : instruction_set) {
+      if (info.mnemonic == mnemonic && info.opcode != OP_HALT) {
+        options.mix[info.opcode] = weight;
+        found = true;
+      }
+    }
+    if (!found) return false;
+  }
+  return true;
+}
+
+class Generator {
+ public:
+  Generator(const Options& options, uint64_t seed)
+      : options(options), rng(seed) {}
+
+  void generate() {
+    // the data window is filled first, so no load reads unwritten memory
+    if (options.footprint) {
+      loadRegister(REG_C, DATA_BEGIN);
+      loadRegister(REG_D, DATA_BEGIN + options.footprint);
+      define("fill");
+      emit(OP_SW, reg(REG_C), reg(REG_C));
+      emit(OP_ADD, reg(REG_C), imm(1));
+      emit(OP_MW, reg(REG_B), reg(REG_C));
+      emit(OP_SUB, reg(REG_B), reg(REG_D));
+      jump(OP_JMPN, REG_B, "fill");
+    }
+    block(0, options.length);
+    emit(OP_HALT);
+  }
+
+  // false if the program does not fit in ROM
+  bool resolve() {
+    std::map<std::string, uint32_t> addresses;
+    uint32_t address = 0;
+    for (const Item& item : items) {
+      if (!item.label.empty()) {
+        addresses[item.label] = address;
+      } else {
+        address++;
+      }
+    }
+    if (address > ROM_SIZE) return false;
+    for (Item& item : items) {
+      if (item.target.empty()) continue;
+      uint16_t target = addresses[item.target];
+      item.word = Instruction(item.high ? OP_MWH : OP_MWL,
+                              imm(item.high ? target >> 8 : target & 0xff))
+                      .word;
+    }
+    size = address;
+    return true;
+  }
+
+  uint32_t words() const { return size; }
+
+  void writeSource(std::ostream& out, const std::string& header) const {
+    out << "; " << header << "\n";
+    for (const Item& item : items) {
+      if (!item.label.empty()) {
+        out << item.label << ":\n";
+      } else if (!item.target.empty()) {
+        out << "    " << (item.high ? "MWH hi(" : "MWL lo(") << item.target
+            << ")\n";
+      } else {
+        out << "    " << disassemble(item.word) << "\n";
+      }
+    }
+  }
+
+  void writeBinary(std::ostream& out) const {
+    for (const Item& item : items) {
+      if (!item.label.empty()) continue;
+      // little-endian, as the assembler writes it
+      char bytes[2] = {char(item.word & 0xff), char(item.word >> 8)};
+      out.write(bytes, 2);
+    }
+  }
+
+ private:
+  // a label definition, an instruction, or MWH/MWL of a label's address
+  struct Item {
+    std::string label;
+    uint16_t word = 0;
+    std::string target;
+    bool high = false;
+  };
+
+  Options options;
+  std::mt19937_64 rng;
+  std::vector<Item> items;
+  uint32_t size = 0;
+  int labels = 0;
+  int pushed = 0;  // words on the stack at this point of the program
+  int floor = 0;   // of them, those pushed before the current block
+
+  static InstructionParams reg(uint8_t r) { return {r, 0, false}; }
+  static InstructionParams imm(uint8_t value) { return {0, value, true}; }
+
+  uint32_t random(uint32_t n) { return rng() % n; }
+  uint8_t workRegister() {
+    return work_registers[random(work_registers.size())];
+  }
+  InstructionParams source() {
+    return random(2) ? imm(rng()) : reg(workRegister());
+  }
+
+  void emit(uint8_t opcode, InstructionParams p1 = InstructionParams(),
+            InstructionParams p2 = InstructionParams()) {
+    items.push_back({"", Instruction(opcode, p1, p2).word, "", false});
+  }
+  void define(const std::string& label) {
+    items.push_back({label, 0, "", false});
+  }
+  std::string newLabel(const std::string& prefix) {
+    return prefix + "_" + std::to_string(labels++);
+  }
+
+  void loadHL(uint16_t value) {
+    emit(OP_MWH, imm(value >> 8));
+    emit(OP_MWL, imm(value & 0xff));
+  }
+  void loadRegister(uint8_t r, uint16_t value) {
+    loadHL(value);
+    emit(OP_MW, reg(r), reg(REG_HL));
+  }
+  // JMPZ/JMPN on register cond to label
+  void jump(uint8_t opcode, uint8_t cond, const std::string& label) {
+    items.push_back({"", 0, label, true});
+    items.push_back({"", 0, label, false});
+    emit(opcode, reg(cond));
+  }
+
+  uint16_t dataAddress() { return DATA_BEGIN + random(options.footprint); }
+
+  // length statements, with the loop of the next level at a random place.
+  // What the block pushes it pops again.
+  void block(uint32_t level, uint32_t length) {
+    uint32_t loop_at = level < options.depth ? random(length + 1) : UINT32_MAX;
+    int outer_floor = floor;
+    floor = pushed;
+    for (uint32_t i = 0; i <= length; i++) {
+      if (i == loop_at) loop(level);
+      if (i == length) break;
+      if (random(100) < options.branches) {
+        branch();
+      } else {
+        instruction(pickOpcode());
+      }
+    }
+    for (; pushed > floor; pushed--) emit(OP_POP, reg(workRegister()));
+    floor = outer_floor;
+  }
+
+  // counts from -count up to 0, jumping back while the counter is negative
+  void loop(uint32_t level) {
+    uint16_t counter = COUNTER_BASE + level;
+    std::string head = newLabel("loop");
+    loadRegister(REG_B, -options.count);
+    loadHL(counter);
+    emit(OP_SW, reg(REG_HL), reg(REG_B));
+    define(head);
+    block(level + 1, options.length);
+    loadHL(counter);
+    emit(OP_LW, reg(REG_B), reg(REG_HL));
+    emit(OP_ADD, reg(REG_B), imm(1));
+    emit(OP_SW, reg(REG_HL), reg(REG_B));
+    jump(OP_JMPN, REG_B, head);
+  }
+
+  // skips a short block when a register is zero or negative
+  void branch() {
+    // the JMPZ and JMPN weights of the mix, even if both are 0
+    uint32_t jz = options.mix[OP_JMPZ], jn = options.mix[OP_JMPN];
+    if (jz + jn == 0) jz = jn = 1;
+    uint8_t opcode = random(jz + jn) < jz ? OP_JMPZ : OP_JMPN;
+    std::string skip = newLabel("skip");
+    jump(opcode, workRegister(), skip);
+    int outer_floor = floor;
+    floor = pushed;
+    uint32_t length = 1 + random(std::max(1u, options.length / 4));
+    for (uint32_t i = 0; i < length; i++) instruction(pickOpcode());
+    for (; pushed > floor; pushed--) emit(OP_POP, reg(workRegister()));
+    floor = outer_floor;
+    define(skip);
+  }
+
+  // by weight, among the instructions that are not jumps
+  uint8_t pickOpcode() {
+    uint64_t total = 0;
+    for (uint8_t opcode = 0; opcode < instruction_set.size(); opcode++) {
+      if (opcode != OP_JMPZ && opcode != OP_JMPN) total += options.mix[opcode];
+    }
+    uint64_t pick = rng() % total;
+    for (uint8_t opcode = 0; opcode < instruction_set.size(); opcode++) {
+      if (opcode == OP_JMPZ || opcode == OP_JMPN) continue;
+      if (pick < options.mix[opcode]) return opcode;
+      pick -= options.mix[opcode];
+    }
+    return OP_NOP;
+  }
+
+  // one instruction of opcode, with whatever it needs to stay valid
+  void instruction(uint8_t opcode) {
+    // a pop needs something pushed by this block, a push room on the stack
+    if (opcode == OP_POP && pushed == floor) opcode = OP_PUSH;
+    if (opcode == OP_PUSH && pushed == MAX_PUSHED) opcode = OP_POP;
+    switch (instruction_set[opcode].type) {
+      case NoParams:
+        emit(opcode);
+        return;
+      case Immediate_only:  // MWL/MWH only clobber HL
+        emit(opcode, imm(rng()));
+        return;
+      default:
+        break;
+    }
+    switch (opcode) {
+      case OP_LW:
+        if (random(4) == 0 || options.footprint == 0) {
+          emit(OP_LW, reg(workRegister()), imm(rng()));  // from ROM
+        } else {
+          loadHL(dataAddress());
+          emit(OP_LW, reg(workRegister()), reg(REG_HL));
+        }
+        return;
+      case OP_SW:
+        if (options.footprint == 0) {
+          emit(OP_NOP);
+          return;
+        }
+        loadHL(dataAddress());
+        emit(OP_SW, reg(REG_HL), reg(workRegister()));
+        return;
+      case OP_PUSH:
+        emit(OP_PUSH, source());
+        pushed++;
+        return;
+      case OP_POP:
+        emit(OP_POP, reg(workRegister()));
+        pushed--;
+        return;
+      default:  // MW and the ALU
+        emit(opcode, reg(workRegister()), source());
+        return;
+    }
+  }
+};
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  std::string output_file_name, kernel, mix;
+  uint64_t seed = 1;
+  std::optional<uint32_t> length, depth, count, branches, footprint;
+
+  static struct option longOptions[] = {
+      {"output", required_argument, 0, 'o'},
+      {"seed", required_argument, 0, 's'},
+      {"kernel", required_argument, 0, 'k'},
+      {"mix", required_argument, 0, 'x'},
+      {"length", required_argument, 0, 'n'},
+      {"depth", required_argument, 0, 'l'},
+      {"count", required_argument, 0, 'c'},
+      {"branches", required_argument, 0, 'b'},
+      {"memory", required_argument, 0, 'M'},
+      {"help", no_argument, 0, 'h'},
+      {0, 0, 0, 0}};
+
+  // upper bounds of the numeric options, 0 where 0 is allowed
+  auto number = [&](const char* text, uint64_t max, uint64_t& value) {
+    char* end;
+    value = std::strtoull(text, &end, 0);
+    return isdigit(text[0]) && *end == '\0' && value <= max;
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "o:s:k:x:n:l:c:b:M:h", longOptions,
+                            NULL)) != -1) {
+    uint64_t value;
+    switch (opt) {
+      case 'o':
+        output_file_name = optarg;
+        break;
+      case 's':
+        if (!number(optarg, UINT64_MAX, seed)) {
+          std::cerr << "Invalid seed: " << optarg << std::endl;
+          return 1;
+        }
+        break;
+      case 'k':
+        kernel = optarg;
+        break;
+      case 'x':
+        mix += (mix.empty() ? "" : ",") + std::string(optarg);
+        break;
+      case 'n':
+      case 'l':
+      case 'c':
+      case 'b':
+      case 'M': {
+        uint64_t max = opt == 'n'   ? 4096
+                       : opt == 'l' ? MAX_DEPTH
+                       : opt == 'c' ? 0x8000
+                       : opt == 'b' ? 100
+                                    : MAX_FOOTPRINT;
+        if (!number(optarg, max, value) ||
+            (value == 0 && (opt == 'n' || opt == 'c'))) {
+          std::cerr << "Invalid value for -" << char(opt) << ": " << optarg
+                    << " (up to " << max << ")" << std::endl;
+          return 1;
+        }
+        (opt == 'n'   ? length
+         : opt == 'l' ? depth
+         : opt == 'c' ? count
+         : opt == 'b' ? branches
+                      : footprint) = value;
+        break;
+      }
+      case 'h':
+        std::cout << "Usage: " << argv[0] << " [options]" << std::endl;
+        std::cout << "Options:" << std::endl;
+        std::cout << "  -o, --output FILE        Write .asm source or a .bin "
+                     "ROM (default: source to stdout)"
+                  << std::endl;
+        std::cout << "  -s, --seed N             Seed of the program "
+                     "(default 1)"
+                  << std::endl;
+        std::cout << "  -k, --kernel NAME        Preset for a long-running "
+                     "alu, memory, stack or jump kernel"
+                  << std::endl;
+        std::cout << "  -x, --mix LIST           Instruction weights, "
+                     "MNEMONIC=N,... (default 1 each, repeatable)"
+                  << std::endl;
+        std::cout << "  -n, --length N           Statements per block "
+                     "(default 16)"
+                  << std::endl;
+        std::cout << "  -l, --depth N            Loop nesting (default 2)"
+                  << std::endl;
+        std::cout << "  -c, --count N            Iterations of every loop "
+                     "(default 10)"
+                  << std::endl;
+        std::cout << "  -b, --branches PERCENT   Statements that branch "
+                     "forward (default 10)"
+                  << std::endl;
+        std::cout << "  -M, --memory WORDS       Data window loads and stores "
+                     "use (default 256)"
+                  << std::endl;
+        std::cout << "  -h, --help               Display help message"
+                  << std::endl;
+        return 0;
+      default:
+        std::cerr << "Use '" << argv[0] << " --help' for usage." << std::endl;
+        return 1;
+    }
+  }
+
+  Options options = defaultOptions();
+  if (!kernel.empty() && !applyKernel(kernel, options)) {
+    std::cerr << "Unknown kernel: " << kernel << std::endl;
+    std::cerr << "Usage: -k, --kernel alu|memory|stack|jump" << std::endl;
+    return 1;
+  }
+  if (!mix.empty() && !parseMix(mix, options)) {
+    std::cerr << "Invalid instruction mix: " << mix << std::endl;
+    std::cerr << "Usage: -x, --mix MNEMONIC=WEIGHT,... (HALT ends the "
+                 "program and cannot be weighted)"
+              << std::endl;
+    return 1;
+  }
+  if (length) options.length = *length;
+  if (depth) options.depth = *depth;
+  if (count) options.count = *count;
+  if (branches) options.branches = *branches;
+  if (footprint) options.footprint = *footprint;
+  bool straight = false;
+  for (uint8_t opcode = 0; opcode < instruction_set.size(); opcode++) {
+    if (opcode != OP_JMPZ && opcode != OP_JMPN && options.mix[opcode]) {
+      straight = true;
+    }
+  }
+  if (!straight) {
+    std::cerr << "The instruction mix needs a weight on an instruction other "
+                 "than JMPZ and JMPN"
+              << std::endl;
+    return 1;
+  }
+
+  Generator generator(options, seed);
+  generator.generate();
+  if (!generator.resolve()) {
+    std::cerr << "The program does not fit in ROM, use a smaller -n or -l"
+              << std::endl;
+    return 1;
+  }
+
+  std::string header = "bit16-gen";
+  for (int i = 1; i < argc; i++) header += std::string(" ") + argv[i];
+  bool binary = output_file_name.size() > 4 &&
+                output_file_name.substr(output_file_name.size() - 4) == ".bin";
+  if (output_file_name.empty()) {
+    generator.writeSource(std::cout, header);
+    return 0;
+  }
+  std::ofstream out(output_file_name, std::ios::binary);
+  if (binary) {
+    generator.writeBinary(out);
+  } else {
+    generator.writeSource(out, header);
+  }
+  if (!out) {
+    std::cerr << "Failed to write " << output_file_name << std::endl;
+    return 1;
+  }
+  std::cerr << generator.words() << " words written to " << output_file_name
+            << std::endl;
+  return 0;
+}
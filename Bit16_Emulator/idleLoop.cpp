@@ -0,0 +1,180 @@
+// Idle-loop detection and fast-forwarding
+//
+// Guest programs wait by spinning: a delay loop counting a register down, or
+// a loop polling a memory-mapped device word. Both are recognised when their
+// jump back is taken, if the loop is a short straight line of register moves,
+// ALU operations and LW ending in that jump:
+//
+// - A loop without LW depends on registers alone, so it is run to its end on
+//   a copy of the register file without touching the bus or the devices. The
+//   clock cycles of the iterations it took are added to the CPU's.
+// - A loop with LW whose registers come back to the same values at its head
+//   can only make progress once one of the words it reads changes. The CPU
+//   stays idle until then, which lets the emulator skip its iterations up to
+//   the next device event, or sleep instead of spinning (see throttle.h).
+#include "Bus.h"
+#include "cpu.h"
+
+namespace {
+
+constexpr size_t MAX_LOOP_LENGTH = 32;
+// pure loops are run in chunks so that one that never ends cannot hang the
+// emulator, it is picked up again at its next jump back
+constexpr uint32_t MAX_FAST_FORWARD_ITERATIONS = 1 << 20;
+
+}  // namespace
+
+void CPU::onBackwardJump(uint16_t head, uint16_t tail) {
+  if (!loop.analyzed || loop.head != head || loop.tail != tail) {
+    analyzeLoop(head, tail);
+  }
+  if (loop.pure) {
+    fastForwardPure();
+  } else if (loop.reads_memory) {
+    if (loop.seen &&
+        std::equal(std::begin(regs), std::end(regs), loop.head_regs)) {
+      // a fixed point: confirm it against memory and wait on what it reads
+      uint16_t r[register_set.size()];
+      std::copy(std::begin(regs), std::end(regs), r);
+      watch.clear();
+      waiting = runLoopBody(r, &watch) == LOOP_AGAIN &&
+                std::equal(std::begin(regs), std::end(regs), r);
+    }
+    std::copy(std::begin(regs), std::end(regs), loop.head_regs);
+    loop.seen = true;
+  }
+}
+
+void CPU::analyzeLoop(uint16_t head, uint16_t tail) {
+  loop = Loop();
+  loop.head = head;
+  loop.tail = tail;
+  loop.analyzed = true;
+  if (tail - head + 1u > MAX_LOOP_LENGTH) return;
+  bool side_effects = false;
+  for (uint32_t pc = head; pc <= tail; pc++) {
+    DecodedInstruction ins = decode(bus->read(pc));
+    switch (ins.opcode) {
+      case OP_NOP:
+      case OP_MW:
+      case OP_MWL:
+      case OP_MWH:
+      case OP_ADD:
+      case OP_SUB:
+      case OP_AND:
+      case OP_ADDC:
+      case OP_NOT:
+        break;
+      case OP_LW:
+        loop.reads_memory = true;
+        break;
+      case OP_JMPZ:
+      case OP_JMPN:
+        // the only jump is the one back to the head
+        side_effects = side_effects || pc != tail;
+        break;
+      default:  // HALT, SW, PUSH, POP
+        side_effects = true;
+        break;
+    }
+    loop.body.push_back(ins);
+    loop.cycles += instruction_set[ins.opcode].cycles;
+  }
+  loop.cycles += JUMP_TAKEN_CYCLES;
+  if (side_effects) loop.reads_memory = false;
+  loop.pure = !side_effects && !loop.reads_memory;
+}
+
+// One iteration on the register file r, the same as executeInstruction would
+// do. reads collects the words LW loads, if given.
+CPU::LoopExit CPU::runLoopBody(
+    uint16_t* r, std::vector<std::pair<uint16_t, uint16_t>>* reads) {
+  for (const DecodedInstruction& ins : loop.body) {
+    uint16_t src = ins.select ? ins.imm8 : r[ins.reg2];
+    switch (ins.opcode) {
+      case OP_MW:
+        r[ins.reg1] = src;
+        break;
+      case OP_MWL:
+        r[REG_HL] = (r[REG_HL] & 0xff00) | ins.imm8;
+        break;
+      case OP_MWH:
+        r[REG_HL] = (r[REG_HL] & 0x00ff) | (ins.imm8 << 8);
+        break;
+      case OP_LW: {
+        if (bus->isDevice(src)) return LOOP_ELSEWHERE;
+        uint16_t value = bus->read(src);
+        if (reads) reads->push_back(std::make_pair(src, value));
+        r[ins.reg1] = value;
+        break;
+      }
+      case OP_ADD:
+      case OP_SUB:
+      case OP_AND:
+      case OP_ADDC:
+      case OP_NOT: {
+        AluResult result = executeAlu(ins.opcode, r[ins.reg1], src, r[REG_F]);
+        r[REG_F] = result.flags;
+        r[ins.reg1] = result.value;
+        break;
+      }
+      case OP_JMPZ:
+      case OP_JMPN: {
+        uint16_t value = ins.select ? ins.imm8 : r[ins.reg1];
+        bool taken = ins.opcode == OP_JMPZ ? value == 0 : (value & 0x8000);
+        if (!taken) return LOOP_EXIT;
+        return r[REG_HL] == loop.head ? LOOP_AGAIN : LOOP_ELSEWHERE;
+      }
+    }
+  }
+  return LOOP_ELSEWHERE;
+}
+
+// Called at the head of a pure loop: run it on the registers until it exits
+void CPU::fastForwardPure() {
+  uint16_t r[register_set.size()];
+  std::copy(std::begin(regs), std::end(regs), r);
+  for (uint32_t i = 0; i < MAX_FAST_FORWARD_ITERATIONS; i++) {
+    LoopExit exit = runLoopBody(r, nullptr);
+    if (exit == LOOP_ELSEWHERE) return;  // leave it to the interpreter
+    if (exit == LOOP_AGAIN && std::equal(r, std::end(r), regs)) {
+      // nothing changes from one iteration to the next, it never exits
+      watch.clear();
+      waiting = true;
+      return;
+    }
+    skipped_instructions += loop.body.size();
+    std::copy(std::begin(r), std::end(r), regs);
+    if (exit == LOOP_EXIT) {
+      cycles += loop.cycles - JUMP_TAKEN_CYCLES;
+      PC = loop.tail + 1;
+      return;
+    }
+    cycles += loop.cycles;
+  }
+}
+
+bool CPU::stillWaiting() {
+  for (const auto& [address, value] : watch) {
+    if (bus->read(address) != value) {
+      waiting = false;
+      loop.seen = false;
+      return false;
+    }
+  }
+  return true;
+}
+
+// Nothing the loop reads changes in the skipped iterations, and the devices
+// would have ticked through them without an event, so the clock and the
+// instruction count end up where running them would have left them
+bool CPU::skipIdleUntil(uint64_t cycle) {
+  if (!waiting || PC != loop.head || cycle <= cycles + loop.cycles) {
+    return false;
+  }
+  // the last one ends before cycle, the device ticks at cycle itself
+  uint64_t count = (cycle - cycles - 1) / loop.cycles;
+  cycles += count * loop.cycles;
+  skipped_instructions += count * loop.body.size();
+  return true;
+}
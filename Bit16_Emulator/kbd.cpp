@@ -10,16 +10,12 @@
 #endif
 #include "kbd.h"
 
-static int id = 2;
-static std::string name = "Keyboard";
-static int interrupt = 0;
-static int interruptData = -1;
-//   int cycles;
-
 // Keyboard specific functions
-static void keyboardTick(CPU& cpu) {
-  std::cout << "Keyboard ticking..." << std::endl;
+static void keyboardTick(Device& device, CPU& cpu) {
+  if (device.verbose) std::cout << "Keyboard ticking..." << std::endl;
 #ifdef _WIN32
+  int& interrupt = device.interrupt;
+  int& interruptData = device.interruptData;
   if (GetAsyncKeyState(VK_SPACE) & 0x8000) {
     interrupt = 1;
     interruptData = 32;  // space
@@ -51,36 +47,49 @@ static void keyboardTick(CPU& cpu) {
 #endif
 }
 
-static int keyboardSend(CPU& cpu) {
-  cpu.write(KEYBOARD, interruptData);
-  return interruptData;
+static int keyboardSend(Device& device, CPU& cpu) {
+  cpu.write(KEYBOARD, device.interruptData);
+  return device.interruptData;
+}
+
+static void keyboardReceive(Device& device, CPU& cpu, int data) {
+  if (device.verbose) {
+    std::cout << "Received data on the keyboard: " << data << std::endl;
+  }
 }
 
-static void keyboardReceive(CPU& cpu, int data) {
-  std::cout << "Received data on the keyboard: " << data << std::endl;
+// keys are polled from the host, only on Windows so far
+static uint64_t keyboardNextEvent(Device& device, CPU& cpu) {
+#ifdef _WIN32
+  return HOST_DEVICE_EVENT;
+#else
+  return NO_DEVICE_EVENT;
+#endif
 }
 
-static void keyboardDestroy(CPU& cpu) {
+static void keyboardDestroy(Device& device, CPU& cpu) {
 #ifdef __linux__
   // endwin();
 #endif
-  interrupt = 0;
-  interruptData = -1;
-  std::cout << "Keyboard destroyed." << std::endl;
+  device.interrupt = 0;
+  device.interruptData = -1;
+  if (device.verbose) std::cout << "Keyboard destroyed." << std::endl;
 }
 
-Device* createKeyboardDevice() {
+Device* createKeyboardDevice(bool verbose) {
   // initscr();
   // cbreak();
   // noecho();
   // nodelay(stdscr, TRUE);
-  return new Device{.id = id,
-                    .name = name,
-                    .interrupt = interrupt,
-                    .interruptData = interruptData,
+  return new Device{.id = 2,
+                    .name = "Keyboard",
+                    .interrupt = 0,
+                    .interruptData = -1,
                     .cycles = 0,
+                    .verbose = verbose,
                     .tick = keyboardTick,
                     .send = keyboardSend,
                     .receive = keyboardReceive,
-                    .destroy = keyboardDestroy};
+                    .destroy = keyboardDestroy,
+                    .nextEvent = keyboardNextEvent};
 }
@@ -1,4 +1,4 @@
 #pragma once
 #include "cpu.h"
 
-Device* createKeyboardDevice();
\ No newline at end of file
+Device* createKeyboardDevice(bool verbose);
\ No newline at end of file
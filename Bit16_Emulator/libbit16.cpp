@@ -0,0 +1,185 @@
+// libbit16: the emulator behind a C API, see libbit16.h
+#include "libbit16.h"
+
+#include <algorithm>
+#include <fstream>
+#include <mutex>
+#include <new>
+
+#include "../common/image.h"
+#include "Bus.h"
+#include "cpu.h"
+#include "kbd.h"
+#include "screen.h"
+
+struct bit16_machine {
+  std::mutex lock;
+  Bus bus;
+  CPU cpu;
+  std::vector<Device*> devices;
+  // scratch for bit16_run, one bit per address
+  std::vector<bool> breakpoints;
+
+  bit16_machine() {
+    bus.connectToCPU(&cpu);
+    cpu.connectToBus(&bus);
+    cpu.setFastForward(true);
+    devices.push_back(createKeyboardDevice(false));
+    devices.push_back(createScreenDevice(false));
+  }
+  ~bit16_machine() {
+    for (Device* device : devices) {
+      device->destroy(*device, cpu);
+      delete device;
+    }
+  }
+};
+
+namespace {
+
+bool inRange(uint16_t address, size_t count) {
+  return count <= TOTAL_SIZE - size_t(address);
+}
+
+}  // namespace
+
+extern "C" {
+
+bit16_machine* bit16_create(void) {
+  return new (std::nothrow) bit16_machine();
+}
+
+void bit16_destroy(bit16_machine* machine) { delete machine; }
+
+void bit16_reset(bit16_machine* machine) {
+  std::lock_guard<std::mutex> guard(machine->lock);
+  std::fill(std::begin(machine->bus.ram), std::end(machine->bus.ram), 0);
+  machine->cpu.reset();
+}
+
+int bit16_load_image(bit16_machine* machine, const char* path) {
+  std::lock_guard<std::mutex> guard(machine->lock);
+  std::string file_name(path);
+  if (isImageFile(file_name)) {
+    bool has_entry;
+    uint16_t entry;
+    if (!loadImage(file_name, machine->bus.ram, has_entry, entry)) {
+      return BIT16_ERROR_FORMAT;
+    }
+    if (has_entry) machine->cpu.setPC(entry);
+  } else {
+    // flat ROM, read the same way as the emulator does
+    std::ifstream in(file_name, std::ios::binary);
+    if (!in.is_open()) return BIT16_ERROR_IO;
+    in.read(reinterpret_cast<char*>(machine->bus.ram),
+            ROM_SIZE * sizeof(uint16_t));
+    if (in.bad()) return BIT16_ERROR_IO;
+  }
+  machine->cpu.wake();
+  return BIT16_OK;
+}
+
+int bit16_read_memory(bit16_machine* machine, uint16_t address,
+                      uint16_t* words, size_t count) {
+  if (!inRange(address, count)) return BIT16_ERROR_RANGE;
+  std::lock_guard<std::mutex> guard(machine->lock);
+  std::copy_n(machine->bus.ram + address, count, words);
+  return BIT16_OK;
+}
+
+int bit16_write_memory(bit16_machine* machine, uint16_t address,
+                       const uint16_t* words, size_t count) {
+  if (!inRange(address, count)) return BIT16_ERROR_RANGE;
+  std::lock_guard<std::mutex> guard(machine->lock);
+  std::copy_n(words, count, machine->bus.ram + address);
+  // the write may have replaced the code of a loop being fast-forwarded
+  machine->cpu.wake();
+  return BIT16_OK;
+}
+
+void bit16_get_registers(bit16_machine* machine, uint16_t* registers) {
+  std::lock_guard<std::mutex> guard(machine->lock);
+  for (const RegisterInfo& reg : register_set) {
+    registers[reg.code] = machine->cpu.get_value(reg.code);
+  }
+  registers[BIT16_REG_PC] = machine->cpu.getPC();
+  registers[BIT16_REG_SP] = machine->cpu.getSP();
+}
+
+void bit16_set_registers(bit16_machine* machine, const uint16_t* registers) {
+  std::lock_guard<std::mutex> guard(machine->lock);
+  for (const RegisterInfo& reg : register_set) {
+    machine->cpu.set_value(reg.code, registers[reg.code]);
+  }
+  machine->cpu.setPC(registers[BIT16_REG_PC]);
+  machine->cpu.setSP(registers[BIT16_REG_SP]);
+  machine->cpu.wake();
+}
+
+uint64_t bit16_cycles(bit16_machine* machine) {
+  std::lock_guard<std::mutex> guard(machine->lock);
+  return machine->cpu.getCycles();
+}
+
+int bit16_run(bit16_machine* machine, uint64_t max_cycles,
+              const bit16_stop_conditions* stop, bit16_run_result* result) {
+  if (stop && stop->breakpoint_count && !stop->breakpoints) {
+    return BIT16_ERROR_ARGUMENT;
+  }
+  std::lock_guard<std::mutex> guard(machine->lock);
+  CPU& cpu = machine->cpu;
+  bool has_breakpoints = stop && stop->breakpoint_count;
+  bool stop_on_idle = stop && stop->stop_on_idle;
+  if (has_breakpoints) {
+    machine->breakpoints.assign(TOTAL_SIZE, false);
+    for (size_t i = 0; i < stop->breakpoint_count; i++) {
+      machine->breakpoints[stop->breakpoints[i]] = true;
+    }
+    // a fast-forwarded loop would run past breakpoints inside it
+    cpu.setFastForward(false);
+  }
+
+  uint64_t start = cpu.getCycles();
+  uint64_t end = max_cycles > UINT64_MAX - start ? UINT64_MAX
+                                                 : start + max_cycles;
+  uint64_t instructions = 0;
+  int reason = BIT16_STOP_CYCLES;
+  uint16_t start_pc = cpu.getPC();
+  bool resumed = true;
+  while (cpu.getCycles() < end) {
+    uint16_t pc = cpu.getPC();
+    if (has_breakpoints && machine->breakpoints[pc] &&
+        !(resumed && pc == start_pc)) {
+      reason = BIT16_STOP_BREAKPOINT;
+      break;
+    }
+    resumed = false;
+    tickDevices(cpu, machine->devices);
+    if (cpu.idle()) {
+      // nothing else can write memory while the lock is held
+      if (stop_on_idle) {
+        reason = BIT16_STOP_IDLE;
+      } else {
+        cpu.addCycles(end - cpu.getCycles());
+      }
+      break;
+    }
+    if (!cpu.run()) {
+      reason = BIT16_STOP_HALT;
+      instructions++;
+      break;
+    }
+    instructions += 1 + cpu.takeSkippedInstructions();
+  }
+  if (has_breakpoints) cpu.setFastForward(true);
+
+  if (result) {
+    result->reason = reason;
+    result->cycles = cpu.getCycles() - start;
+    result->instructions = instructions;
+    result->pc = cpu.getPC();
+  }
+  return BIT16_OK;
+}
+
+}  // extern "C"
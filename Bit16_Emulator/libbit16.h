@@ -0,0 +1,84 @@
+#ifndef LIBBIT16_H
+#define LIBBIT16_H
+
+/* C API for embedding the emulator, e.g. from test harnesses or Python
+ * through ctypes. Every call on a machine takes its lock, so one machine may
+ * be shared between threads; separate machines run fully in parallel.
+ * Memory and registers are transferred in bulk, and bit16_run executes until
+ * a stop condition without calling back into the host. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct bit16_machine bit16_machine;
+
+/* return codes */
+#define BIT16_OK 0
+#define BIT16_ERROR_RANGE -1  /* address range outside the 64K words */
+#define BIT16_ERROR_IO -2     /* file could not be read */
+#define BIT16_ERROR_FORMAT -3 /* malformed .img */
+#define BIT16_ERROR_ARGUMENT -4
+
+/* register file for bit16_get_registers/bit16_set_registers: the codes of
+ * the ISA (A=0 .. F=7) followed by PC and SP */
+#define BIT16_REG_PC 8
+#define BIT16_REG_SP 9
+#define BIT16_REGISTER_COUNT 10
+
+/* why bit16_run returned */
+#define BIT16_STOP_CYCLES 0     /* max_cycles reached */
+#define BIT16_STOP_HALT 1       /* HALT executed, PC is left on it */
+#define BIT16_STOP_BREAKPOINT 2 /* PC reached a breakpoint */
+#define BIT16_STOP_IDLE 3       /* polling memory only the host can change */
+
+typedef struct bit16_stop_conditions {
+  /* addresses to stop at before executing them. The instruction at PC when
+   * bit16_run is called never stops, so a run can resume from one. */
+  const uint16_t* breakpoints;
+  size_t breakpoint_count;
+  /* nonzero returns BIT16_STOP_IDLE instead of running out the cycles */
+  int stop_on_idle;
+} bit16_stop_conditions;
+
+typedef struct bit16_run_result {
+  int reason;
+  uint64_t cycles;       /* guest clock cycles of this run */
+  uint64_t instructions; /* including fast-forwarded ones */
+  uint16_t pc;
+} bit16_run_result;
+
+/* an empty machine with the keyboard and screen attached, NULL if out of
+ * memory */
+bit16_machine* bit16_create(void);
+void bit16_destroy(bit16_machine* machine);
+/* clears memory and registers, SP back to 0xFFFF and the cycle count to 0 */
+void bit16_reset(bit16_machine* machine);
+
+/* loads a .img (segments, entry point) or a flat .bin ROM from path */
+int bit16_load_image(bit16_machine* machine, const char* path);
+
+int bit16_read_memory(bit16_machine* machine, uint16_t address,
+                      uint16_t* words, size_t count);
+int bit16_write_memory(bit16_machine* machine, uint16_t address,
+                       const uint16_t* words, size_t count);
+
+/* BIT16_REGISTER_COUNT values */
+void bit16_get_registers(bit16_machine* machine, uint16_t* registers);
+void bit16_set_registers(bit16_machine* machine, const uint16_t* registers);
+
+uint64_t bit16_cycles(bit16_machine* machine);
+
+/* runs for at most max_cycles guest cycles; stop may be NULL, result may be
+ * NULL */
+int bit16_run(bit16_machine* machine, uint64_t max_cycles,
+              const bit16_stop_conditions* stop, bit16_run_result* result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBBIT16_H */
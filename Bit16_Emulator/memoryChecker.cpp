@@ -0,0 +1,22 @@
+#include "memoryChecker.h"
+
+#include "Bus.h"
+
+MemoryChecker::MemoryChecker() {
+  setInitialized(ROM_BEGIN, ROM_END + 1);
+  setInitialized(RAM_END + 1, STACK_BEGIN);
+}
+
+void MemoryChecker::setInitialized(uint32_t begin, uint32_t end) {
+  for (uint32_t address = begin; address < end; address++) {
+    setInitialized(uint16_t(address));
+  }
+}
+
+bool MemoryChecker::report(const std::string& what, uint16_t address,
+                           uint16_t pc, uint16_t instruction) {
+  message = "check: " + what + " " + hexstr(address) + " at PC " +
+            hexstr(pc) + " (" + disassemble(instruction) + "), cycle " +
+            std::to_string(cycle);
+  return false;
+}
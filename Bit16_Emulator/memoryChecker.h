@@ -0,0 +1,34 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+
+// Shadow memory for --check: one bit per word of memory recording whether it
+// has been written. Only the checked run path (CPU::runChecked) consults it,
+// so an emulator without --check does not pay for it.
+class MemoryChecker {
+ public:
+  // ROM and the device registers count as initialized from the start
+  MemoryChecker();
+
+  bool initialized(uint16_t address) const {
+    return bits[address >> 6] >> (address & 63) & 1;
+  }
+  void setInitialized(uint16_t address) {
+    bits[address >> 6] |= uint64_t(1) << (address & 63);
+  }
+  void setInitialized(uint32_t begin, uint32_t end);
+
+  // records a violation and returns false, the CPU stops on it
+  bool report(const std::string& what, uint16_t address, uint16_t pc,
+              uint16_t instruction);
+  bool failed() const { return !message.empty(); }
+  const std::string& error() const { return message; }
+
+  uint64_t cycle = 0;  // instructions checked so far
+
+ private:
+  std::array<uint64_t, 0x10000 / 64> bits{};
+  std::string message;
+};
@@ -0,0 +1,76 @@
+#include "multiCore.h"
+
+#include <algorithm>
+#include <barrier>
+#include <memory>
+#include <thread>
+
+std::vector<CoreStats> runMultiCore(Bus& bus, CPU& boot,
+                                    std::vector<Device*>& devices,
+                                    unsigned cores, uint64_t quantum,
+                                    uint64_t max_cycles, bool fast_forward,
+                                    Throttle& throttle) {
+  bus.setShared(true);
+  std::vector<std::unique_ptr<CPU>> extra;
+  std::vector<CPU*> cpus = {&boot};
+  uint16_t stack_share = (STACK_END - STACK_BEGIN + 1) / cores;
+  for (unsigned core = 1; core < cores; core++) {
+    extra.push_back(std::make_unique<CPU>());
+    CPU& cpu = *extra.back();
+    cpu.connectToBus(&bus);
+    bus.connectToCPU(&cpu);
+    cpu.setPC(boot.getPC());
+    cpu.setSP(STACK_END - core * stack_share);
+    cpu.set_value(REG_A, core);
+    cpus.push_back(&cpu);
+  }
+  for (CPU* cpu : cpus) cpu->setFastForward(fast_forward);
+
+  // the end of the current quantum, only changed between quanta
+  uint64_t quantum_end = std::min(quantum, max_cycles);
+  bool stop = false;
+  auto next_quantum = [&]() noexcept {
+    tickDevices(boot, devices);
+    throttle.pace(quantum_end);
+    stop = quantum_end >= max_cycles;
+    quantum_end = std::min(quantum_end + quantum, max_cycles);
+  };
+  std::barrier sync(cores, next_quantum);
+
+  std::vector<CoreStats> stats(cores);
+  auto run_core = [&](unsigned core) {
+    CPU& cpu = *cpus[core];
+    CoreStats& own = stats[core];
+    while (true) {
+      while (cpu.getCycles() < quantum_end) {
+        if (cpu.idle()) {
+          // only another core can wake it, and not before the next quantum
+          // is guaranteed to show its writes
+          cpu.addCycles(quantum_end - cpu.getCycles());
+          break;
+        }
+        if (!cpu.run()) {
+          own.halted = true;
+          break;
+        }
+        own.instructions += 1 + cpu.takeSkippedInstructions();
+      }
+      own.cycles = cpu.getCycles();
+      if (own.halted) {
+        sync.arrive_and_drop();
+        return;
+      }
+      sync.arrive_and_wait();
+      if (stop) return;
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (unsigned core = 1; core < cores; core++) {
+    threads.emplace_back(run_core, core);
+  }
+  run_core(0);
+  for (std::thread& thread : threads) thread.join();
+  bus.setShared(false);
+  return stats;
+}
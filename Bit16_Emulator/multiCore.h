@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "Bus.h"
+#include "cpu.h"
+#include "throttle.h"
+
+// Several CPUs on one Bus, each with its own registers and host thread.
+//
+// Cores run independently for a quantum of guest cycles and then wait for
+// each other, so none gets more than a quantum ahead. Shared-memory rules:
+// - every word access is atomic, a core never sees half a write
+// - a core's writes become visible to the others in order at the latest at
+//   the end of the quantum; before that, only the spinlock register orders
+//   them (see Bus::enableSpinlock)
+// Devices are ticked once per quantum, with core 0's CPU.
+//
+// Core n starts at the boot CPU's PC with A = n, and with SP at the top of
+// its own share of the stack window.
+struct CoreStats {
+  uint64_t cycles = 0;
+  uint64_t instructions = 0;
+  bool halted = false;
+};
+
+// boot is core 0 and must already be connected to bus and loaded
+std::vector<CoreStats> runMultiCore(Bus& bus, CPU& boot,
+                                    std::vector<Device*>& devices,
+                                    unsigned cores, uint64_t quantum,
+                                    uint64_t max_cycles, bool fast_forward,
+                                    Throttle& throttle);
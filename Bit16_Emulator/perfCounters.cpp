@@ -0,0 +1,100 @@
+#include "perfCounters.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+static int openCounter(uint64_t config, int group_fd) {
+  perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = config;
+  attr.disabled = group_fd == -1;  // the group follows its leader
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_GROUP;
+  return syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+#endif
+
+bool PerfCounters::open() {
+#ifdef __linux__
+  constexpr uint64_t configs[PERF_COUNTER_COUNT] = {
+      PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+      PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_HW_CACHE_MISSES};
+  fds[PERF_CYCLES] = openCounter(configs[PERF_CYCLES], -1);
+  if (fds[PERF_CYCLES] < 0) {
+    error_message = std::string("perf_event_open: ") + strerror(errno);
+    if (errno == EACCES || errno == EPERM) {
+      error_message += " (see /proc/sys/kernel/perf_event_paranoid)";
+    } else if (errno == ENOENT || errno == EOPNOTSUPP) {
+      error_message += " (no hardware counters on this host)";
+    }
+    return false;
+  }
+  for (int i = PERF_CYCLES + 1; i < PERF_COUNTER_COUNT; i++) {
+    fds[i] = openCounter(configs[i], fds[PERF_CYCLES]);
+  }
+  return true;
+#else
+  error_message = "hardware counters are only supported on Linux";
+  return false;
+#endif
+}
+
+PerfCounters::~PerfCounters() {
+#ifdef __linux__
+  for (int fd : fds) {
+    if (fd >= 0) close(fd);
+  }
+#endif
+}
+
+void PerfCounters::enable() {
+#ifdef __linux__
+  ioctl(fds[PERF_CYCLES], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+}
+
+void PerfCounters::disable() {
+#ifdef __linux__
+  ioctl(fds[PERF_CYCLES], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+#endif
+}
+
+PerfSample PerfCounters::read() {
+  PerfSample sample;
+#ifdef __linux__
+  // PERF_FORMAT_GROUP: the number of counters, then their values in the order
+  // they were opened
+  uint64_t data[1 + PERF_COUNTER_COUNT] = {};
+  if (::read(fds[PERF_CYCLES], data, sizeof(data)) <= 0) return sample;
+  int next = 1;
+  for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+    if (fds[i] >= 0 && next <= int(data[0])) sample.value[i] = data[next++];
+  }
+#endif
+  return sample;
+}
+
+PerfSample PerfCounters::readOverhead() {
+  PerfSample overhead;
+  overhead.value.fill(UINT64_MAX);
+  for (int i = 0; i < 32; i++) {
+    PerfSample first = read();
+    PerfSample delta = read() - first;
+    for (int j = 0; j < PERF_COUNTER_COUNT; j++) {
+      overhead.value[j] = std::min(overhead.value[j], delta.value[j]);
+    }
+  }
+  return overhead;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+
+// Host hardware counters around the emulator loop, read as one group through
+// perf_event_open (Linux only). Counters the host does not support are left
+// out and read as zero.
+enum PerfCounter {
+  PERF_CYCLES,
+  PERF_INSTRUCTIONS,
+  PERF_BRANCH_MISSES,
+  PERF_CACHE_MISSES,
+  PERF_COUNTER_COUNT
+};
+
+constexpr std::array<const char*, PERF_COUNTER_COUNT> perf_counter_names = {
+    "cycles", "instructions", "branch-misses", "cache-misses"};
+
+struct PerfSample {
+  std::array<uint64_t, PERF_COUNTER_COUNT> value{};
+
+  PerfSample& operator+=(const PerfSample& other) {
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++) value[i] += other.value[i];
+    return *this;
+  }
+  // saturates, so that subtracting the read overhead never wraps
+  PerfSample operator-(const PerfSample& other) const {
+    PerfSample result;
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+      result.value[i] =
+          value[i] > other.value[i] ? value[i] - other.value[i] : 0;
+    }
+    return result;
+  }
+};
+
+class PerfCounters {
+ public:
+  ~PerfCounters();
+  // false if the host or its perf_event_paranoid setting does not allow
+  // counting, error() says why
+  bool open();
+  const std::string& error() const { return error_message; }
+  bool available(PerfCounter counter) const { return fds[counter] >= 0; }
+  void enable();
+  void disable();
+  PerfSample read();
+  // smallest cost of a read() as seen by the counters themselves
+  PerfSample readOverhead();
+
+ private:
+  std::array<int, PERF_COUNTER_COUNT> fds = {-1, -1, -1, -1};
+  std::string error_message;
+};
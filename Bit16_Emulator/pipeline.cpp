@@ -0,0 +1,570 @@
+// bit16-pipeline: timing model of a pipelined Bit16 for design-space
+// exploration
+//
+// Replays an instruction trace written by the emulator (emu --trace, see
+// trace.h) through an in-order pipeline with fetch, decode, execute and
+// memory stages, and reports CPI, where the stall cycles come from and which
+// instructions stall most. The unpipelined circuit, timed by the cycle table
+// in common.h, is the baseline.
+//
+// Per instruction the model computes the cycle it enters each stage from the
+// previous instruction's stages, the registers it waits for and the memory
+// port. That is a few dozen operations, so one pass over a trace can feed
+// every configuration of a sweep.
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../common/common.h"
+#include "Bus.h"
+#include "trace.h"
+
+namespace {
+
+struct Config {
+  bool forwarding = false;  // results bypass the register file
+  int ports = 1;            // 1: fetch and data accesses share memory
+  bool resolve_in_decode = false;
+  uint32_t memory_latency = 1;  // cycles a memory access holds its stage
+
+  std::string describe() const {
+    return std::string(forwarding ? "forwarding" : "no forwarding") + ", " +
+           std::to_string(ports) + (ports == 1 ? " memory port" : " ports") +
+           ", jumps in " + (resolve_in_decode ? "decode" : "execute") +
+           ", memory latency " + std::to_string(memory_latency);
+  }
+};
+
+enum Stall {
+  STALL_HL,
+  STALL_FLAGS,
+  STALL_SP,
+  STALL_REGISTER,
+  STALL_JUMP,
+  STALL_FETCH_PORT,
+  STALL_MEMORY,
+  STALL_KINDS,
+  STALL_NONE = STALL_KINDS
+};
+
+constexpr std::array<const char*, STALL_KINDS> stall_names = {
+    "data hazard on HL", "data hazard on F",  "data hazard on SP",
+    "data hazard, other", "taken jump",       "fetch blocked by data access",
+    "memory access"};
+
+// SP is not addressable, it gets the register bit after F
+constexpr int SP_BIT = register_set.size();
+
+// registers as bit masks over the register codes plus SP
+struct Usage {
+  uint16_t reads = 0;
+  uint16_t writes = 0;
+  uint16_t loads = 0;  // written with a word read from memory
+  bool memory = false;
+  bool jump = false;
+};
+
+constexpr Usage usage(uint16_t word) {
+  DecodedInstruction ins = decode(word);
+  uint16_t reg1 = 1 << ins.reg1, reg2 = ins.select ? 0 : 1 << ins.reg2;
+  uint16_t hl = 1 << REG_HL, flags = 1 << REG_F, sp = 1 << SP_BIT;
+  Usage use;
+  switch (ins.opcode) {
+    case OP_MW:
+      use.reads = reg2;
+      use.writes = reg1;
+      break;
+    case OP_MWL:
+    case OP_MWH:
+      use.reads = use.writes = hl;
+      break;
+    case OP_LW:
+      use.reads = reg2;
+      use.writes = use.loads = reg1;
+      use.memory = true;
+      break;
+    case OP_SW:
+      use.reads = ins.select ? reg1 : reg1 | 1 << ins.reg2;
+      use.memory = true;
+      break;
+    case OP_ADD:
+    case OP_SUB:
+    case OP_AND:
+      use.reads = reg1 | reg2;
+      use.writes = reg1 | flags;
+      break;
+    case OP_ADDC:
+      use.reads = reg1 | reg2 | flags;
+      use.writes = reg1 | flags;
+      break;
+    case OP_NOT:
+      use.reads = reg2;
+      use.writes = reg1 | flags;
+      break;
+    case OP_JMPZ:
+    case OP_JMPN:
+      use.reads = (ins.select ? 0 : reg1) | hl;
+      use.jump = true;
+      break;
+    case OP_PUSH:
+      use.reads = (ins.select ? 0 : reg1) | sp;
+      use.writes = sp;
+      use.memory = true;
+      break;
+    case OP_POP:
+      use.reads = sp;
+      use.writes = reg1 | sp;
+      use.loads = reg1;
+      use.memory = true;
+      break;
+  }
+  return use;
+}
+
+Stall hazardKind(int reg) {
+  if (reg == REG_HL) return STALL_HL;
+  if (reg == REG_F) return STALL_FLAGS;
+  if (reg == SP_BIT) return STALL_SP;
+  return STALL_REGISTER;
+}
+
+// The unpipelined circuit, as the emulator counts cycles
+struct Circuit {
+  uint64_t cycles = 0;
+
+  void step(uint16_t word, bool taken) {
+    cycles += instruction_set[word >> OPCODE_SHIFT].cycles +
+              (taken ? JUMP_TAKEN_CYCLES : 0);
+  }
+};
+
+// In-order pipeline F D E M. An instruction leaves a stage only when the next
+// one is free, operands are read at the start of E (D for jumps resolved
+// there) and results are written back at the end of M. Jumps are predicted
+// not taken.
+//
+// Every instruction after the first finishes at least a cycle after the one
+// before it. Cycles beyond that are its stalls, charged to the constraint
+// that delayed it: a register it waited for, the jump before it (charged to
+// the jump), the memory port, or its own memory access latency.
+class Pipeline {
+ public:
+  Pipeline(const Config& config, bool per_pc)
+      : config(config), pc_stalls(per_pc ? TOTAL_SIZE : 0) {}
+
+  void step(uint16_t pc, const Usage& use, bool taken) {
+    Stall cause = STALL_NONE;
+    uint16_t blame = pc;
+
+    // fetch, once the previous instruction moved on to decode
+    uint64_t f = d;
+    if (redirect > f) {
+      f = redirect;
+      cause = STALL_JUMP;
+      blame = redirect_pc;
+    }
+    if (config.ports == 1) {
+      // data accesses win the shared port, oldest first
+      for (size_t i = 0; i < data_accesses.size(); i++) {
+        const Access& access = data_accesses[(next_access + i) % 4];
+        if (f >= access.begin && f < access.end) {
+          f = access.end;
+          cause = STALL_FETCH_PORT;
+          blame = pc;
+        }
+      }
+    }
+
+    uint64_t new_d = std::max(f + 1, e);
+    if (e >= f + 1) cause = STALL_NONE;
+    uint64_t new_e = std::max(new_d + 1, m);
+    if (m >= new_d + 1) cause = STALL_NONE;
+
+    uint64_t operands = 0;
+    Stall hazard = STALL_NONE;
+    for (uint16_t reads = use.reads; reads; reads &= reads - 1) {
+      int reg = __builtin_ctz(reads);
+      if (ready[reg] > operands) {
+        operands = ready[reg];
+        hazard = hazardKind(reg);
+      }
+    }
+    // a forwarded value reaches decode a cycle after execute would use it
+    if (use.jump && config.resolve_in_decode && config.forwarding &&
+        operands) {
+      operands++;
+    }
+    if (operands > new_e) {
+      new_e = operands;
+      cause = hazard;
+      blame = pc;
+    }
+
+    uint64_t occupancy = use.memory ? config.memory_latency : 1;
+    uint64_t new_m = std::max(new_e + 1, m + m_occupancy);
+    if (m + m_occupancy >= new_e + 1) cause = STALL_NONE;
+    uint64_t new_done = new_m + occupancy;
+
+    if (instructions == 0) {
+      start = f;
+    } else {
+      uint64_t stall = new_done - done - 1;
+      uint64_t own = occupancy - 1;
+      charge(STALL_MEMORY, pc, own);
+      charge(cause == STALL_NONE ? STALL_MEMORY : cause, blame, stall - own);
+    }
+    instructions++;
+    if (!pc_stalls.empty()) pc_stalls[pc].executions++;
+
+    for (uint16_t writes = use.writes; writes; writes &= writes - 1) {
+      int reg = __builtin_ctz(writes);
+      bool bypass = config.forwarding && !(use.loads & 1 << reg);
+      ready[reg] = bypass ? new_e + 1 : new_done;
+    }
+    if (use.memory) {
+      data_accesses[next_access] = {new_m, new_m + occupancy};
+      next_access = (next_access + 1) % 4;
+    }
+    if (taken) {
+      redirect = config.resolve_in_decode ? new_e : new_e + 1;
+      redirect_pc = pc;
+      taken_jumps++;
+    }
+    d = new_d;
+    e = new_e;
+    m = new_m;
+    m_occupancy = occupancy;
+    done = new_done;
+  }
+
+  struct PcStalls {
+    uint64_t executions = 0;
+    std::array<uint64_t, STALL_KINDS> cycles{};
+    uint64_t total() const {
+      uint64_t sum = 0;
+      for (uint64_t count : cycles) sum += count;
+      return sum;
+    }
+  };
+
+  const Config& configuration() const { return config; }
+  uint64_t cycles() const { return done - start; }
+  uint64_t instructionCount() const { return instructions; }
+  uint64_t takenJumps() const { return taken_jumps; }
+  const std::array<uint64_t, STALL_KINDS>& stalls() const { return totals; }
+  const std::vector<PcStalls>& stallsByPc() const { return pc_stalls; }
+
+ private:
+  void charge(Stall kind, uint16_t pc, uint64_t count) {
+    if (!count) return;
+    totals[kind] += count;
+    if (!pc_stalls.empty()) pc_stalls[pc].cycles[kind] += count;
+  }
+
+  struct Access {
+    uint64_t begin = 0, end = 0;
+  };
+
+  Config config;
+  // stage entry cycles of the previous instruction
+  uint64_t d = 0, e = 0, m = 0, m_occupancy = 1, done = 0;
+  uint64_t start = 0;
+  uint64_t redirect = 0;
+  uint16_t redirect_pc = 0;
+  // cycle from which execute can use each register
+  std::array<uint64_t, SP_BIT + 1> ready{};
+  // the last data accesses, enough to cover every fetch still to come
+  std::array<Access, 4> data_accesses{};
+  size_t next_access = 0;
+  uint64_t instructions = 0;
+  uint64_t taken_jumps = 0;
+  std::array<uint64_t, STALL_KINDS> totals{};
+  std::vector<PcStalls> pc_stalls;
+};
+
+struct Trace {
+  const uint8_t* data = nullptr;
+  size_t size = 0;
+  size_t records = 0;
+
+  uint16_t pc(size_t i) const { return word(TRACE_HEADER_SIZE + 4 * i); }
+  uint16_t instruction(size_t i) const {
+    return word(TRACE_HEADER_SIZE + 4 * i + 2);
+  }
+  uint16_t word(size_t offset) const {
+    return data[offset] | data[offset + 1] << 8;
+  }
+};
+
+bool mapTrace(const std::string& file_name, Trace& trace, std::string& error) {
+  int fd = open(file_name.c_str(), O_RDONLY);
+  struct stat info;
+  if (fd < 0 || fstat(fd, &info) != 0) {
+    error = "cannot read " + file_name;
+    if (fd >= 0) close(fd);
+    return false;
+  }
+  trace.size = info.st_size;
+  if (trace.size >= TRACE_HEADER_SIZE) {
+    void* data = mmap(nullptr, trace.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+      trace.data = static_cast<const uint8_t*>(data);
+      madvise(data, trace.size, MADV_SEQUENTIAL);
+    }
+  }
+  close(fd);
+  if (!trace.data || memcmp(trace.data, TRACE_MAGIC, sizeof(TRACE_MAGIC)) ||
+      trace.word(sizeof(TRACE_MAGIC)) != TRACE_VERSION ||
+      (trace.size - TRACE_HEADER_SIZE) % TRACE_RECORD_SIZE) {
+    error = file_name + " is not a bit16 trace";
+    return false;
+  }
+  trace.records = (trace.size - TRACE_HEADER_SIZE) / TRACE_RECORD_SIZE;
+  return true;
+}
+
+using UsageTable = std::array<Usage, TOTAL_SIZE>;
+
+// circuit may be nullptr
+void replay(const Trace& trace, const UsageTable& usages, Pipeline* pipeline,
+            Circuit* circuit) {
+  for (size_t i = 0; i < trace.records; i++) {
+    uint16_t pc = trace.pc(i);
+    uint16_t word = trace.instruction(i);
+    const Usage& use = usages[word];
+    // the last record has no successor and counts as falling through
+    bool taken = use.jump && i + 1 < trace.records &&
+                 trace.pc(i + 1) != uint16_t(pc + 1);
+    if (circuit) circuit->step(word, taken);
+    pipeline->step(pc, use, taken);
+  }
+}
+
+void printReport(const Pipeline& pipeline, const Circuit& circuit,
+                 size_t top) {
+  uint64_t instructions = pipeline.instructionCount();
+  uint64_t cycles = pipeline.cycles();
+  auto per = [](uint64_t a, uint64_t b) { return b ? double(a) / b : 0.0; };
+  std::cout << std::fixed << std::setprecision(3);
+  std::cout << pipeline.configuration().describe() << std::endl;
+  std::cout << instructions << " instructions, " << pipeline.takenJumps()
+            << " taken jumps" << std::endl;
+  std::cout << "Pipelined:   " << cycles << " cycles, CPI "
+            << per(cycles, instructions) << std::endl;
+  std::cout << "Unpipelined: " << circuit.cycles << " cycles, CPI "
+            << per(circuit.cycles, instructions) << ", speedup "
+            << per(circuit.cycles, cycles) << "x" << std::endl;
+
+  uint64_t stalled = 0;
+  for (uint64_t count : pipeline.stalls()) stalled += count;
+  std::cout << "Stall cycles: " << stalled << std::endl;
+  for (int kind = 0; kind < STALL_KINDS; kind++) {
+    uint64_t count = pipeline.stalls()[kind];
+    if (!count) continue;
+    std::cout << "  " << std::left << std::setw(30) << stall_names[kind]
+              << std::right << std::setw(12) << count << std::setw(9)
+              << std::setprecision(1) << 100 * per(count, stalled) << "%"
+              << std::setprecision(3) << std::endl;
+  }
+
+  const std::vector<Pipeline::PcStalls>& by_pc = pipeline.stallsByPc();
+  std::vector<uint16_t> pcs;
+  for (uint32_t pc = 0; pc < by_pc.size(); pc++) {
+    if (by_pc[pc].total()) pcs.push_back(pc);
+  }
+  size_t shown = std::min(top, pcs.size());
+  std::partial_sort(pcs.begin(), pcs.begin() + shown, pcs.end(),
+                    [&](uint16_t a, uint16_t b) {
+                      return by_pc[a].total() > by_pc[b].total();
+                    });
+  if (shown) std::cout << "Most stalled instructions:" << std::endl;
+  for (size_t i = 0; i < shown; i++) {
+    const Pipeline::PcStalls& stalls = by_pc[pcs[i]];
+    std::cout << "  " << hexstr(pcs[i]) << std::setw(12) << stalls.total()
+              << " cycles over " << stalls.executions << " executions:";
+    for (int kind = 0; kind < STALL_KINDS; kind++) {
+      if (stalls.cycles[kind]) {
+        std::cout << " " << stall_names[kind] << " " << stalls.cycles[kind]
+                  << ";";
+      }
+    }
+    std::cout << std::endl;
+  }
+}
+
+void printSweep(const std::vector<Pipeline>& pipelines,
+                const Circuit& circuit) {
+  std::cout << std::fixed << std::setprecision(3);
+  std::cout << "Unpipelined: " << circuit.cycles << " cycles" << std::endl;
+  std::cout << std::left << std::setw(66) << "configuration" << std::right
+            << std::setw(14) << "cycles" << std::setw(8) << "CPI"
+            << std::setw(9) << "speedup" << std::endl;
+  for (const Pipeline& pipeline : pipelines) {
+    double cycles = pipeline.cycles();
+    std::cout << std::left << std::setw(66)
+              << pipeline.configuration().describe() << std::right
+              << std::setw(14) << pipeline.cycles() << std::setw(8)
+              << cycles / std::max<uint64_t>(1, pipeline.instructionCount())
+              << std::setw(8) << circuit.cycles / std::max(1.0, cycles) << "x"
+              << std::endl;
+  }
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  std::string input_file_name;
+  Config config;
+  bool sweep = false;
+  size_t top = 10;
+
+  static struct option longOptions[] = {
+      {"input-file", required_argument, 0, 'i'},
+      {"forwarding", no_argument, 0, 'f'},
+      {"ports", required_argument, 0, 'p'},
+      {"resolve", required_argument, 0, 'r'},
+      {"memory-latency", required_argument, 0, 'l'},
+      {"sweep", no_argument, 0, 'S'},
+      {"top", required_argument, 0, 't'},
+      {"help", no_argument, 0, 'h'},
+      {0, 0, 0, 0}};
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "i:fp:r:l:St:h", longOptions, NULL)) !=
+         -1) {
+    switch (opt) {
+      case 'i':
+        input_file_name = optarg;
+        break;
+      case 'f':
+        config.forwarding = true;
+        break;
+      case 'r':
+        if (std::string(optarg) != "decode" &&
+            std::string(optarg) != "execute") {
+          std::cerr << "Invalid stage: " << optarg << std::endl;
+          std::cerr << "Usage: -r, --resolve decode|execute" << std::endl;
+          return 1;
+        }
+        config.resolve_in_decode = std::string(optarg) == "decode";
+        break;
+      case 'S':
+        sweep = true;
+        break;
+      case 'p':
+      case 'l':
+      case 't': {
+        char* end;
+        uint64_t value = std::strtoull(optarg, &end, 0);
+        if (!isdigit(optarg[0]) || *end != '\0' || value == 0 ||
+            (opt == 'p' && value > 2) || value > 1000000) {
+          std::cerr << "Invalid value: " << optarg << std::endl;
+          return 1;
+        }
+        if (opt == 'p') config.ports = value;
+        if (opt == 'l') config.memory_latency = value;
+        if (opt == 't') top = value;
+        break;
+      }
+      case 'h':
+        std::cout << "Usage: " << argv[0] << " [options] trace_file"
+                  << std::endl;
+        std::cout << "Options:" << std::endl;
+        std::cout << "  -i, --input-file FILE    Trace written by emu --trace"
+                  << std::endl;
+        std::cout << "  -f, --forwarding         Bypass results to execute"
+                  << std::endl;
+        std::cout << "  -p, --ports N            Memory ports, 1 shared by "
+                     "fetch and data or 2 (default 1)"
+                  << std::endl;
+        std::cout << "  -r, --resolve STAGE      Stage where jumps are "
+                     "resolved, decode or execute (default execute)"
+                  << std::endl;
+        std::cout << "  -l, --memory-latency N   Cycles of a data access "
+                     "(default 1)"
+                  << std::endl;
+        std::cout << "  -S, --sweep              Compare every forwarding, "
+                     "port and resolve setting"
+                  << std::endl;
+        std::cout << "  -t, --top N              Instructions listed by stall "
+                     "cycles (default 10)"
+                  << std::endl;
+        std::cout << "  -h, --help               Display help message"
+                  << std::endl;
+        return 0;
+      default:
+        std::cerr << "Use '" << argv[0] << " --help' for usage." << std::endl;
+        return 1;
+    }
+  }
+  if (input_file_name.empty() && optind < argc) input_file_name = argv[optind];
+  if (input_file_name.empty()) {
+    std::cerr << "No trace file given" << std::endl;
+    return 1;
+  }
+
+  Trace trace;
+  std::string error;
+  if (!mapTrace(input_file_name, trace, error)) {
+    std::cerr << error << std::endl;
+    return 1;
+  }
+
+  std::vector<Pipeline> pipelines;
+  if (sweep) {
+    for (bool forwarding : {false, true}) {
+      for (int ports : {1, 2}) {
+        for (bool resolve_in_decode : {false, true}) {
+          Config swept = config;
+          swept.forwarding = forwarding;
+          swept.ports = ports;
+          swept.resolve_in_decode = resolve_in_decode;
+          pipelines.emplace_back(swept, false);
+        }
+      }
+    }
+  } else {
+    pipelines.emplace_back(config, true);
+  }
+
+  static UsageTable usages;
+  for (uint32_t word = 0; word < TOTAL_SIZE; word++) usages[word] = usage(word);
+
+  // configurations are independent, each replays the trace on its own thread
+  auto start = std::chrono::steady_clock::now();
+  Circuit circuit;
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < pipelines.size(); i++) {
+    threads.emplace_back(replay, std::cref(trace), std::cref(usages),
+                         &pipelines[i], nullptr);
+  }
+  replay(trace, usages, &pipelines[0], &circuit);
+  for (std::thread& thread : threads) thread.join();
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  if (sweep) {
+    printSweep(pipelines, circuit);
+  } else {
+    printReport(pipelines[0], circuit, top);
+  }
+  std::cerr << std::fixed << std::setprecision(1) << trace.records
+            << " instructions x " << pipelines.size() << " configurations in "
+            << elapsed.count() << " s, "
+            << trace.records * pipelines.size() /
+                   std::max(elapsed.count(), 1e-9) / 1e6
+            << " M/s" << std::endl;
+  return 0;
+}
@@ -0,0 +1,380 @@
+#include "plugin.h"
+
+#include <dlfcn.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <thread>
+
+#include "bit16device.h"
+
+namespace {
+
+struct PluginSpec {
+  std::string path;
+  uint16_t begin;
+  uint16_t size;
+  int irq = -1;
+  bool remote = false;
+  std::string args;
+};
+
+bool parseNumber(const std::string& text, unsigned long max,
+                 unsigned long& value) {
+  if (text.empty() || !isdigit(text[0])) return false;
+  char* end;
+  value = std::strtoul(text.c_str(), &end, 0);
+  return *end == '\0' && value <= max;
+}
+
+bool parseSpec(const std::string& spec, PluginSpec& parsed,
+               std::string& error) {
+  size_t options = spec.find(',');
+  std::string head = spec.substr(0, options);
+  size_t at = head.rfind('@');
+  size_t colon = head.find(':', at == std::string::npos ? 0 : at);
+  unsigned long begin, size;
+  if (at == std::string::npos || colon == std::string::npos ||
+      !parseNumber(head.substr(at + 1, colon - at - 1), 0xffff, begin) ||
+      !parseNumber(head.substr(colon + 1), 0xffff, size) || size == 0 ||
+      begin + size > TOTAL_SIZE) {
+    error = "expected PATH@BASE:SIZE inside the 64K words";
+    return false;
+  }
+  parsed.path = head.substr(0, at);
+  parsed.begin = begin;
+  parsed.size = size;
+
+  while (options != std::string::npos) {
+    size_t next = spec.find(',', options + 1);
+    std::string option = spec.substr(options + 1, next - options - 1);
+    unsigned long irq;
+    if (option.rfind("arg=", 0) == 0) {
+      parsed.args = spec.substr(options + 5);
+      break;
+    } else if (option == "remote") {
+      parsed.remote = true;
+    } else if (option.rfind("irq=", 0) == 0 &&
+               parseNumber(option.substr(4), 15, irq)) {
+      parsed.irq = irq;
+    } else {
+      error = "unknown option " + option;
+      return false;
+    }
+    options = next;
+  }
+  return true;
+}
+
+// Single producer, single consumer queue of guest writes
+struct WriteRing {
+  static constexpr uint32_t SIZE = 1024;
+  struct Write {
+    uint16_t offset;
+    uint16_t value;
+  };
+  std::atomic<uint32_t> head{0};
+  std::atomic<uint32_t> tail{0};
+  Write writes[SIZE];
+
+  bool push(Write write) {
+    uint32_t at = head.load(std::memory_order_relaxed);
+    if (at - tail.load(std::memory_order_acquire) == SIZE) return false;
+    writes[at % SIZE] = write;
+    head.store(at + 1, std::memory_order_release);
+    return true;
+  }
+  bool pop(Write& write) {
+    uint32_t at = tail.load(std::memory_order_relaxed);
+    if (at == head.load(std::memory_order_acquire)) return false;
+    write = writes[at % SIZE];
+    tail.store(at + 1, std::memory_order_release);
+    return true;
+  }
+};
+
+// Mapped shared between the emulator and the device process. Everything is a
+// lock-free atomic, so it works across the two address spaces.
+struct RemoteShared {
+  enum State { STARTING, READY, FAILED };
+  std::atomic<int> state{STARTING};
+  std::atomic<bool> closed{false};
+  std::atomic<uint64_t> cycles{0};    // guest clock, drives tick
+  std::atomic<uint32_t> irqs{0};      // raised since the emulator looked
+  std::atomic<uint32_t> dropped{0};   // writes lost to a full ring
+  WriteRing ring;
+  std::atomic<uint16_t> registers[TOTAL_SIZE];  // as last read by the device
+};
+
+// behind Device::data
+struct Plugin {
+  void* library = nullptr;
+  const bit16_device_ops* ops = nullptr;
+  int irq = -1;
+  // serializes calls into the device, and pushes into the ring, between cores
+  std::mutex lock;
+
+  // in process
+  void* device = nullptr;
+  bit16_device_host host{};
+  std::atomic<bool> irq_raised{false};
+
+  // out of process
+  RemoteShared* shared = nullptr;
+  pid_t child = -1;
+};
+
+void raiseIrq(void* context) {
+  static_cast<Plugin*>(context)->irq_raised.store(true);
+}
+
+uint16_t localRead(void* context, uint16_t offset) {
+  Plugin& plugin = *static_cast<Plugin*>(context);
+  std::lock_guard<std::mutex> guard(plugin.lock);
+  return plugin.ops->read(plugin.device, offset);
+}
+
+void localWrite(void* context, uint16_t offset, uint16_t value) {
+  Plugin& plugin = *static_cast<Plugin*>(context);
+  std::lock_guard<std::mutex> guard(plugin.lock);
+  plugin.ops->write(plugin.device, offset, value);
+}
+
+void localTick(Device& device, CPU& cpu) {
+  Plugin& plugin = *static_cast<Plugin*>(device.data);
+  if (plugin.ops->tick) {
+    std::lock_guard<std::mutex> guard(plugin.lock);
+    plugin.ops->tick(plugin.device, cpu.getCycles());
+  }
+  if (plugin.irq_raised.exchange(false)) {
+    device.interrupt = 1;
+    device.interruptData = plugin.irq;
+  }
+}
+
+uint64_t localNextEvent(Device& device, CPU& cpu) {
+  Plugin& plugin = *static_cast<Plugin*>(device.data);
+  // an IRQ raised outside tick is delivered on the next one
+  if (plugin.irq_raised.load()) return cpu.getCycles();
+  std::lock_guard<std::mutex> guard(plugin.lock);
+  return plugin.ops->next_event(plugin.device);
+}
+
+// never waits for the device process: reads see its last published values
+// and writes are queued, or dropped if it is a whole ring behind
+uint16_t remoteRead(void* context, uint16_t offset) {
+  Plugin& plugin = *static_cast<Plugin*>(context);
+  return plugin.shared->registers[offset].load(std::memory_order_acquire);
+}
+
+void remoteWrite(void* context, uint16_t offset, uint16_t value) {
+  Plugin& plugin = *static_cast<Plugin*>(context);
+  std::lock_guard<std::mutex> guard(plugin.lock);
+  if (!plugin.shared->ring.push({offset, value})) {
+    plugin.shared->dropped.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+void remoteTick(Device& device, CPU& cpu) {
+  Plugin& plugin = *static_cast<Plugin*>(device.data);
+  plugin.shared->cycles.store(cpu.getCycles(), std::memory_order_relaxed);
+  if (plugin.shared->irqs.load(std::memory_order_relaxed) &&
+      plugin.shared->irqs.exchange(0)) {
+    device.interrupt = 1;
+    device.interruptData = plugin.irq;
+  }
+}
+
+void remoteRaiseIrq(void* context) {
+  static_cast<RemoteShared*>(context)->irqs.fetch_add(1);
+}
+
+// the device process: applies queued writes, ticks when the guest clock has
+// moved, and republishes the registers after each batch
+[[noreturn]] void serveRemote(Plugin& plugin, const PluginSpec& spec) {
+  prctl(PR_SET_PDEATHSIG, SIGTERM);
+  RemoteShared& shared = *plugin.shared;
+  const bit16_device_ops& ops = *plugin.ops;
+  plugin.host = {&shared, remoteRaiseIrq};
+  void* device = ops.create(&plugin.host, spec.size, spec.args.c_str());
+  if (!device) {
+    shared.state.store(RemoteShared::FAILED);
+    _exit(1);
+  }
+
+  uint64_t ticked = 0;
+  bool changed = true;
+  while (!shared.closed.load(std::memory_order_acquire)) {
+    WriteRing::Write write;
+    while (shared.ring.pop(write)) {
+      ops.write(device, write.offset, write.value);
+      changed = true;
+    }
+    uint64_t cycles = shared.cycles.load(std::memory_order_relaxed);
+    if (ops.tick && cycles != ticked) {
+      ops.tick(device, cycles);
+      ticked = cycles;
+      changed = true;
+    }
+    if (changed) {
+      for (uint16_t offset = 0; offset < spec.size; offset++) {
+        shared.registers[offset].store(ops.read(device, offset),
+                                       std::memory_order_release);
+      }
+      shared.state.store(RemoteShared::READY);
+      changed = false;
+    } else {
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+  }
+  ops.destroy(device);
+  _exit(0);
+}
+
+bool startRemote(Plugin& plugin, const PluginSpec& spec, std::string& error) {
+  void* memory = mmap(nullptr, sizeof(RemoteShared), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    error = "cannot map shared memory";
+    return false;
+  }
+  plugin.shared = new (memory) RemoteShared();
+
+  std::cout.flush();
+  plugin.child = fork();
+  if (plugin.child < 0) {
+    error = "cannot start the device process";
+    return false;
+  }
+  if (plugin.child == 0) serveRemote(plugin, spec);
+
+  // the registers have to be published before the guest reads them
+  while (plugin.shared->state.load() == RemoteShared::STARTING) {
+    if (waitpid(plugin.child, nullptr, WNOHANG) != 0) break;
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  if (plugin.shared->state.load() != RemoteShared::READY) {
+    waitpid(plugin.child, nullptr, 0);
+    plugin.child = -1;
+    error = "the device process failed to create the device";
+    return false;
+  }
+  return true;
+}
+
+void stopRemote(Plugin& plugin) {
+  if (plugin.child > 0) {
+    plugin.shared->closed.store(true, std::memory_order_release);
+    waitpid(plugin.child, nullptr, 0);
+  }
+  if (plugin.shared) munmap(plugin.shared, sizeof(RemoteShared));
+}
+
+int pluginSend(Device& device, CPU& cpu) {
+  Plugin& plugin = *static_cast<Plugin*>(device.data);
+  if (plugin.irq >= 0) {
+    cpu.write(IRQ_PENDING, cpu.read(IRQ_PENDING) | 1 << plugin.irq);
+  }
+  return device.interruptData;
+}
+
+void pluginReceive(Device& device, CPU& cpu, int data) {
+  if (device.verbose) {
+    std::cout << "Interrupt handled for " << device.name << std::endl;
+  }
+}
+
+void pluginDestroy(Device& device, CPU& cpu) {
+  Plugin* plugin = static_cast<Plugin*>(device.data);
+  if (plugin->shared) {
+    uint32_t dropped = plugin->shared->dropped.load();
+    if (dropped) {
+      std::cerr << device.name << ": " << dropped
+                << " writes dropped, the device process fell behind"
+                << std::endl;
+    }
+    stopRemote(*plugin);
+  } else if (plugin->device) {
+    plugin->ops->destroy(plugin->device);
+  }
+  if (plugin->library) dlclose(plugin->library);
+  delete plugin;
+  device.data = nullptr;
+  if (device.verbose) std::cout << device.name << " destroyed." << std::endl;
+}
+
+}  // namespace
+
+Device* loadPluginDevice(const std::string& spec, Bus& bus, int id,
+                         bool verbose, std::string& error) {
+  PluginSpec parsed;
+  if (!parseSpec(spec, parsed, error)) return nullptr;
+
+  Plugin* plugin = new Plugin();
+  plugin->irq = parsed.irq;
+  auto fail = [&](const std::string& message) -> Device* {
+    error = message;
+    if (plugin->shared) {
+      stopRemote(*plugin);
+    } else if (plugin->device) {
+      plugin->ops->destroy(plugin->device);
+    }
+    if (plugin->library) dlclose(plugin->library);
+    delete plugin;
+    return nullptr;
+  };
+
+  plugin->library = dlopen(parsed.path.c_str(), RTLD_NOW | RTLD_LOCAL);
+  if (!plugin->library) return fail(dlerror());
+  auto entry = reinterpret_cast<bit16_device_entry>(
+      dlsym(plugin->library, BIT16_DEVICE_ENTRY));
+  if (!entry) return fail("no " BIT16_DEVICE_ENTRY " in " + parsed.path);
+  plugin->ops = entry();
+  if (!plugin->ops || plugin->ops->abi_version < 1 ||
+      plugin->ops->abi_version > BIT16_DEVICE_ABI_VERSION) {
+    return fail(parsed.path + " was built for another device ABI version");
+  }
+
+  MmioRange range{parsed.begin, uint16_t(parsed.begin + parsed.size - 1),
+                  plugin, localRead, localWrite};
+  if (parsed.remote) {
+    if (!startRemote(*plugin, parsed, error)) return fail(error);
+    range.read = remoteRead;
+    range.write = remoteWrite;
+  } else {
+    plugin->host = {plugin, raiseIrq};
+    plugin->device = plugin->ops->create(&plugin->host, parsed.size,
+                                         parsed.args.c_str());
+    if (!plugin->device) return fail(parsed.path + " failed to create");
+  }
+  if (!bus.mapDevice(range)) {
+    return fail("range overlaps ROM or another device");
+  }
+  // the device process ticks on its own time, so it cannot tell
+  uint64_t (*nextEvent)(Device&, CPU&) = nullptr;
+  if (!parsed.remote && plugin->ops->abi_version >= 2 &&
+      plugin->ops->next_event) {
+    nextEvent = localNextEvent;
+  }
+
+  return new Device{.id = id,
+                    .name = plugin->ops->name,
+                    .interrupt = 0,
+                    .interruptData = -1,
+                    .cycles = 0,
+                    .verbose = verbose,
+                    .tick = parsed.remote ? remoteTick : localTick,
+                    .send = pluginSend,
+                    .receive = pluginReceive,
+                    .destroy = pluginDestroy,
+                    .nextEvent = nextEvent,
+                    .data = plugin};
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <string>
+
+#include "Bus.h"
+#include "cpu.h"
+
+// Device plugins (see bit16device.h), given on the command line as
+//   PATH@BASE:SIZE[,irq=N][,remote][,arg=TEXT]
+// BASE and SIZE count words. N is the bit of IRQ_PENDING the device raises,
+// 0 to 15; without irq= its interrupts are ignored. remote runs the device in
+// a child process. arg= takes the rest of the spec and is passed to create.
+//
+// The device is mapped into bus; nullptr and error are returned if the plugin
+// cannot be loaded or created, or its range overlaps ROM or another device.
+Device* loadPluginDevice(const std::string& spec, Bus& bus, int id,
+                         bool verbose, std::string& error);
@@ -0,0 +1,75 @@
+// Sample device plugin: a periodic timer, see bit16device.h.
+//
+// Registers:
+//   0 PERIOD   guest cycles between expiries, 0 stops the timer. Writing it
+//              restarts the count from the current cycle.
+//   1 COUNT    expiries so far, one IRQ is raised for each
+//
+// arg= sets the initial period. Reads have no side effects, so the timer can
+// also run remote.
+#include <cstdlib>
+
+#include "../bit16device.h"
+
+namespace {
+
+struct Timer {
+  const bit16_device_host* host;
+  uint16_t period;
+  uint16_t count = 0;
+  uint64_t now = 0;
+  uint64_t next;
+};
+
+void* create(const bit16_device_host* host, uint16_t size, const char* args) {
+  if (size < 2) return nullptr;
+  Timer* timer = new Timer{host, uint16_t(std::strtoul(args, nullptr, 0))};
+  timer->next = timer->period;
+  return timer;
+}
+
+void destroy(void* device) { delete static_cast<Timer*>(device); }
+
+uint16_t read(void* device, uint16_t offset) {
+  Timer& timer = *static_cast<Timer*>(device);
+  switch (offset) {
+    case 0:
+      return timer.period;
+    case 1:
+      return timer.count;
+    default:
+      return 0;
+  }
+}
+
+void write(void* device, uint16_t offset, uint16_t value) {
+  Timer& timer = *static_cast<Timer*>(device);
+  if (offset == 0) {
+    timer.period = value;
+    timer.next = timer.now + value;
+  }
+}
+
+void tick(void* device, uint64_t cycles) {
+  Timer& timer = *static_cast<Timer*>(device);
+  timer.now = cycles;
+  if (!timer.period) return;
+  // the guest clock may jump, e.g. over an idle loop
+  while (timer.next <= cycles) {
+    timer.count++;
+    timer.next += timer.period;
+    timer.host->raise_irq(timer.host->context);
+  }
+}
+
+uint64_t nextEvent(void* device) {
+  Timer& timer = *static_cast<Timer*>(device);
+  return timer.period ? timer.next : UINT64_MAX;
+}
+
+const bit16_device_ops ops = {BIT16_DEVICE_ABI_VERSION, "Timer", create,
+                              destroy, read, write, tick, nextEvent};
+
+}  // namespace
+
+extern "C" const bit16_device_ops* bit16_device_plugin(void) { return &ops; }
@@ -0,0 +1,91 @@
+#include "romWatcher.h"
+
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <vector>
+
+#include "../common/image.h"
+
+RomWatcher::~RomWatcher() {
+  if (thread.joinable()) {
+    close(stop[1]);
+    thread.join();
+  }
+  if (stop[0] >= 0) close(stop[0]);
+  if (inotify >= 0) close(inotify);
+}
+
+bool RomWatcher::open(const std::string& file_name, std::string& error) {
+  this->file_name = file_name;
+  std::filesystem::path path(file_name);
+  base_name = path.filename().string();
+  // the directory is watched, as assemblers and editors may replace the file
+  // by renaming a new one over it
+  std::string directory =
+      path.has_parent_path() ? path.parent_path().string() : ".";
+  inotify = inotify_init1(IN_CLOEXEC);
+  if (inotify < 0 ||
+      inotify_add_watch(inotify, directory.c_str(),
+                        IN_CLOSE_WRITE | IN_MOVED_TO) < 0 ||
+      pipe(stop) < 0) {
+    error = strerror(errno);
+    return false;
+  }
+  thread = std::thread(&RomWatcher::watch, this);
+  return true;
+}
+
+void RomWatcher::watch() {
+  alignas(inotify_event) char buffer[4096];
+  while (true) {
+    pollfd fds[2] = {{inotify, POLLIN, 0}, {stop[0], POLLIN, 0}};
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) continue;
+      return;
+    }
+    if (fds[1].revents) return;
+    ssize_t length = read(inotify, buffer, sizeof(buffer));
+    for (ssize_t offset = 0; offset < length;) {
+      const inotify_event* event =
+          reinterpret_cast<const inotify_event*>(buffer + offset);
+      if (event->len && base_name == event->name) {
+        pending.store(true, std::memory_order_release);
+      }
+      offset += sizeof(inotify_event) + event->len;
+    }
+  }
+}
+
+bool RomWatcher::reload(Bus& bus, uint32_t& changes, std::string& error) {
+  // loaded the same way as at startup, ROM words a new image leaves out are 0
+  std::vector<uint16_t> memory(TOTAL_SIZE, 0);
+  if (isImageFile(file_name)) {
+    bool has_entry;
+    uint16_t entry;
+    if (!loadImage(file_name, memory.data(), has_entry, entry)) {
+      error = "malformed ROM image";
+      return false;
+    }
+  } else {
+    std::ifstream in(file_name, std::ios::binary);
+    if (!in.is_open()) {
+      error = "cannot open " + file_name;
+      return false;
+    }
+    in.read(reinterpret_cast<char*>(memory.data()), ROM_SIZE * 2);
+  }
+  changes = 0;
+  for (uint32_t address = ROM_BEGIN; address <= ROM_END; address++) {
+    if (bus.ram[address] != memory[address]) {
+      bus.ram[address] = memory[address];
+      changes++;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <thread>
+
+#include "Bus.h"
+
+// Hot reloading of the ROM file for --watch. A thread of its own waits on
+// inotify for the file to be rewritten or replaced, so the run loop only
+// looks at a flag between instructions and reloads from there.
+class RomWatcher {
+ public:
+  ~RomWatcher();
+  // starts watching the .bin or .img file_name
+  bool open(const std::string& file_name, std::string& error);
+  // true once for every time the file was rewritten since the last call
+  bool changed() {
+    return pending.load(std::memory_order_relaxed) &&
+           pending.exchange(false, std::memory_order_acquire);
+  }
+  // Copies the ROM words that differ in the file into bus. RAM is left as it
+  // is, image segments outside ROM included. changes is the number of words
+  // patched.
+  bool reload(Bus& bus, uint32_t& changes, std::string& error);
+
+ private:
+  void watch();
+
+  std::string file_name, base_name;
+  int inotify = -1;
+  int stop[2] = {-1, -1};  // a pipe, closed to end the thread
+  std::thread thread;
+  std::atomic<bool> pending{false};
+};
@@ -2,43 +2,43 @@
 
 #include <iostream>
 
-#include "CPU.h"
-
-static int id = 2;
-static std::string name = "Screen";
-static int interrupt = 0;
-static int interruptData = -1;
-//   int cycles;
+#include "cpu.h"
 
 // screen specific functions
-static void screenTick(CPU& cpu) {
-  std::cout << "screen ticking..." << std::endl;
-  if (/* Some condition */ 1 == 1) {
-    interrupt = 1;
-    interruptData = 24;  // Example data
-  }
+static void screenTick(Device& device, CPU& cpu) {
+  if (device.verbose) std::cout << "screen ticking..." << std::endl;
+  // no input to report yet, interrupts are raised by setting
+  // device.interrupt and device.interruptData
 }
 
-static int screenSend(CPU& cpu) { return interruptData; }
+static int screenSend(Device& device, CPU& cpu) { return device.interruptData; }
+
+static void screenReceive(Device& device, CPU& cpu, int data) {
+  if (device.verbose) {
+    std::cout << "Received data on the screen: " << data << std::endl;
+  }
+}
 
-static void screenReceive(CPU& cpu, int data) {
-  std::cout << "Received data on the screen: " << data << std::endl;
+static uint64_t screenNextEvent(Device& device, CPU& cpu) {
+  return NO_DEVICE_EVENT;
 }
 
-static void screenDestroy(CPU& cpu) {
-  interrupt = 0;
-  interruptData = -1;
-  std::cout << "screen destroyed." << std::endl;
+static void screenDestroy(Device& device, CPU& cpu) {
+  device.interrupt = 0;
+  device.interruptData = -1;
+  if (device.verbose) std::cout << "screen destroyed." << std::endl;
 }
 
-Device* createScreenDevice() {
-  return new Device{.id = id,
-                    .name = name,
-                    .interrupt = interrupt,
-                    .interruptData = interruptData,
+Device* createScreenDevice(bool verbose) {
+  return new Device{.id = 2,
+                    .name = "Screen",
+                    .interrupt = 0,
+                    .interruptData = -1,
                     .cycles = 0,
+                    .verbose = verbose,
                     .tick = screenTick,
                     .send = screenSend,
                     .receive = screenReceive,
-                    .destroy = screenDestroy};
+                    .destroy = screenDestroy,
+                    .nextEvent = screenNextEvent};
 }
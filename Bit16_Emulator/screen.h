@@ -1,4 +1,4 @@
 #pragma once
 
 #include "cpu.h"
-Device* createScreenDevice();
\ No newline at end of file
+Device* createScreenDevice(bool verbose);
\ No newline at end of file
@@ -0,0 +1,79 @@
+#include "throttle.h"
+
+#include <algorithm>
+#include <thread>
+
+#include "cpu.h"
+
+namespace {
+
+// a slice is this much guest time, short enough for interactive programs and
+// long enough to keep the number of sleeps low
+constexpr std::chrono::milliseconds SLICE(10);
+// a guest further behind than this does not try to catch up, which would run
+// it flat out for a while after a host stall
+constexpr std::chrono::milliseconds MAX_LAG(100);
+
+}  // namespace
+
+Throttle::Throttle(uint64_t hz)
+    : hz(hz), slice_cycles(std::max<uint64_t>(1, hz * SLICE.count() / 1000)) {}
+
+void Throttle::start(uint64_t guest_cycles) {
+  start_time = epoch = Clock::now();
+  start_cycles = epoch_cycles = guest_cycles;
+  next_check = throttled() ? guest_cycles + slice_cycles : UINT64_MAX;
+}
+
+void Throttle::sleepUntilDue(uint64_t guest_cycles) {
+  // the guest time as a host deadline, from an absolute origin so that
+  // rounding and oversleeping do not accumulate
+  auto guest_time = std::chrono::duration_cast<Clock::duration>(
+      std::chrono::duration<double>(double(guest_cycles - epoch_cycles) / hz));
+  Clock::time_point due = epoch + guest_time;
+  Clock::time_point now = Clock::now();
+  if (now < due) {
+    std::this_thread::sleep_until(due);
+  } else if (now - due > MAX_LAG) {
+    overrun_count++;
+    epoch = now;
+    epoch_cycles = guest_cycles;
+  }
+  next_check = guest_cycles + slice_cycles;
+}
+
+bool Throttle::waitWhileIdle(CPU& cpu, std::vector<Device*>& devices,
+                             uint64_t max_cycles) {
+  if (!cpu.idle()) return false;
+  uint64_t until = max_cycles;
+  bool host_input = false;
+  // a loop that reads no memory waits for nothing the devices can do
+  if (!cpu.waitingForever()) {
+    for (Device* device : devices) {
+      if (!device->nextEvent) return false;
+      uint64_t event = device->nextEvent(*device, cpu);
+      if (event == HOST_DEVICE_EVENT) {
+        host_input = true;
+      } else {
+        until = std::min(until, event);
+      }
+    }
+  }
+  if (throttled()) {
+    until = std::min(until,
+                     cpu.getCycles() + std::max<uint64_t>(1, hz / 1000));
+  } else if (host_input && until == max_cycles) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    return true;
+  }
+  return cpu.skipIdleUntil(until);
+}
+
+double Throttle::elapsedSeconds() const {
+  return std::chrono::duration<double>(Clock::now() - start_time).count();
+}
+
+double Throttle::guestHz(uint64_t guest_cycles) const {
+  double seconds = elapsedSeconds();
+  return seconds > 0 ? (guest_cycles - start_cycles) / seconds : 0;
+}
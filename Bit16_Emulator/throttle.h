@@ -0,0 +1,55 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+class CPU;
+struct Device;
+
+// Real-time pacing for --clock-hz. The emulator runs a slice of guest cycles
+// flat out, then sleeps until the monotonic clock catches up with the guest
+// clock, so there is one sleep per slice rather than one per instruction.
+class Throttle {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  // hz == 0 runs unthrottled and only measures
+  explicit Throttle(uint64_t hz);
+  void start(uint64_t guest_cycles);
+  bool throttled() const { return hz != 0; }
+  // cheap enough to call after every instruction: it only looks at the host
+  // clock once the guest is a slice past the last check
+  void pace(uint64_t guest_cycles) {
+    if (guest_cycles >= next_check) sleepUntilDue(guest_cycles);
+  }
+  // While the CPU polls memory nothing has written to, the iterations of its
+  // loop up to the next device event are skipped instead of run, see
+  // idleLoop.cpp. False if the CPU is not idle or has to run the next
+  // instruction, for one because a device cannot tell when its next event is.
+  //
+  // Throttled, the clock moves on by at most a millisecond at a time and pace
+  // does the sleeping. Unthrottled, guest time means nothing to the host: the
+  // clock moves straight on to the event, or to max_cycles if there is none,
+  // and only a wait on input from the host sleeps, a millisecond at a time.
+  bool waitWhileIdle(CPU& cpu, std::vector<Device*>& devices,
+                     uint64_t max_cycles);
+  // host time since start() and guest cycles per second over it
+  double elapsedSeconds() const;
+  double guestHz(uint64_t guest_cycles) const;
+  // times the guest fell more than MAX_LAG behind and was let go
+  uint64_t overruns() const { return overrun_count; }
+
+ private:
+  void sleepUntilDue(uint64_t guest_cycles);
+
+  uint64_t hz;
+  uint64_t slice_cycles;
+  Clock::time_point start_time;
+  uint64_t start_cycles = 0;
+  // guest time origin, moved forward when the host could not keep up
+  Clock::time_point epoch;
+  uint64_t epoch_cycles = 0;
+  uint64_t next_check = UINT64_MAX;
+  uint64_t overrun_count = 0;
+};
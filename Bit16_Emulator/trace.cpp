@@ -0,0 +1,26 @@
+#include "trace.h"
+
+TraceWriter::~TraceWriter() { close(); }
+
+bool TraceWriter::open(const std::string& file_name) {
+  file = fopen(file_name.c_str(), "wb");
+  if (!file) return false;
+  uint8_t header[TRACE_HEADER_SIZE] = {
+      TRACE_MAGIC[0], TRACE_MAGIC[1], TRACE_MAGIC[2], TRACE_MAGIC[3],
+      TRACE_VERSION & 0xff, TRACE_VERSION >> 8};
+  failed = fwrite(header, 1, sizeof(header), file) != sizeof(header);
+  return !failed;
+}
+
+void TraceWriter::flush() {
+  if (file && fwrite(buffer, 1, used, file) != used) failed = true;
+  used = 0;
+}
+
+bool TraceWriter::close() {
+  if (!file) return !failed;
+  flush();
+  if (fclose(file) != 0) failed = true;
+  file = nullptr;
+  return !failed;
+}
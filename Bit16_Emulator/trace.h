@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Instruction trace (.b16t) written by the emulator with --trace and replayed
+// by bit16-pipeline. Little-endian:
+//   "B16T" u16 version, then for every executed instruction: u16 pc u16 word
+// Whether a jump was taken follows from the pc of the next record.
+
+constexpr char TRACE_MAGIC[4] = {'B', '1', '6', 'T'};
+constexpr uint16_t TRACE_VERSION = 1;
+constexpr size_t TRACE_HEADER_SIZE = sizeof(TRACE_MAGIC) + sizeof(uint16_t);
+constexpr size_t TRACE_RECORD_SIZE = 4;
+
+class TraceWriter {
+ public:
+  ~TraceWriter();
+  bool open(const std::string& file_name);
+  // buffered, so it can be called for every instruction
+  void record(uint16_t pc, uint16_t word) {
+    uint8_t* out = buffer + used;
+    out[0] = pc & 0xff;
+    out[1] = pc >> 8;
+    out[2] = word & 0xff;
+    out[3] = word >> 8;
+    used += TRACE_RECORD_SIZE;
+    if (used == sizeof(buffer)) flush();
+  }
+  // false if any write failed
+  bool close();
+
+ private:
+  void flush();
+
+  FILE* file = nullptr;
+  bool failed = false;
+  size_t used = 0;
+  uint8_t buffer[TRACE_RECORD_SIZE << 14];
+};
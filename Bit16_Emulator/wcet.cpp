@@ -0,0 +1,200 @@
+// bit16-wcet: best and worst case cycle counts of routines in a ROM
+//
+// Runs the analysis of `asm -W` (see common/wcet.h) on an assembled .bin or
+// .img. A ROM carries no .bound/.budget annotations, so loop bounds and
+// budgets are given on the command line, by label if the .dbg written by
+// `asm -d` is next to the ROM.
+#include <getopt.h>
+
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "../common/common.h"
+#include "../common/debugInfo.h"
+#include "../common/image.h"
+#include "../common/wcet.h"
+
+namespace {
+
+bool loadRom(const std::string& file_name, WcetProgram& program,
+             uint16_t& entry) {
+  if (isImageFile(file_name)) {
+    bool has_entry;
+    std::vector<std::pair<uint16_t, uint32_t>> loaded;
+    if (!loadImage(file_name, program.memory.data(), has_entry, entry,
+                   &loaded)) {
+      return false;
+    }
+    if (!has_entry) entry = 0;
+    for (const auto& [address, length] : loaded) {
+      std::fill_n(program.code.begin() + address, length, true);
+    }
+    return true;
+  }
+  std::ifstream in(file_name, std::ios::binary);
+  if (!in.is_open()) return false;
+  in.read(reinterpret_cast<char*>(program.memory.data()),
+          program.memory.size() * sizeof(uint16_t));
+  std::fill_n(program.code.begin(), in.gcount() / sizeof(uint16_t), true);
+  entry = 0;
+  return true;
+}
+
+// "NAME:VALUE" where NAME is a label or an address. VALUE is optional if
+// fallback is not 0.
+bool parseSpec(const WcetProgram& program, const std::string& spec,
+               uint16_t& address, uint64_t& value, uint64_t fallback) {
+  size_t colon = spec.find(':');
+  std::string name = spec.substr(0, colon);
+  if (colon == std::string::npos) {
+    if (!fallback) return false;
+    value = fallback;
+  } else {
+    char* end;
+    value = std::strtoull(spec.c_str() + colon + 1, &end, 0);
+    if (!isdigit(spec[colon + 1]) || *end != '\0' || value == 0) return false;
+  }
+  for (const auto& [label_address, label] : program.labels) {
+    if (label == name) {
+      address = label_address;
+      return true;
+    }
+  }
+  char* end;
+  unsigned long number = std::strtoul(name.c_str(), &end, 0);
+  if (name.empty() || !isdigit(name[0]) || *end != '\0' || number > 0xffff) {
+    return false;
+  }
+  address = number;
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  std::string input_file_name, debug_file_name;
+  std::vector<std::string> routine_specs, bound_specs;
+
+  static struct option longOptions[] = {
+      {"input-file", required_argument, 0, 'i'},
+      {"debug-info", required_argument, 0, 'g'},
+      {"routine", required_argument, 0, 'r'},
+      {"bound", required_argument, 0, 'b'},
+      {"help", no_argument, 0, 'h'},
+      {0, 0, 0, 0}};
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "i:g:r:b:h", longOptions, NULL)) !=
+         -1) {
+    switch (opt) {
+      case 'i':
+        input_file_name = optarg;
+        break;
+      case 'g':
+        debug_file_name = optarg;
+        break;
+      case 'r':
+        routine_specs.push_back(optarg);
+        break;
+      case 'b':
+        bound_specs.push_back(optarg);
+        break;
+      case 'h':
+        std::cout << "Usage: " << argv[0] << " [options] rom_file"
+                  << std::endl;
+        std::cout << "Options:" << std::endl;
+        std::cout << "  -i, --input-file FILE    .bin/.img ROM to analyse"
+                  << std::endl;
+        std::cout << "  -g, --debug-info FILE    Labels from FILE (default: "
+                     "the ROM's .dbg file)"
+                  << std::endl;
+        std::cout << "  -r, --routine NAME[:N]   Analyse the routine at label "
+                     "or address NAME, fail over N cycles (repeatable, "
+                     "default: the entry point)"
+                  << std::endl;
+        std::cout << "  -b, --bound NAME:N       The loop with its head at "
+                     "NAME runs it at most N times (repeatable)"
+                  << std::endl;
+        std::cout << "  -h, --help               Display help message"
+                  << std::endl;
+        return 0;
+      default:
+        std::cerr << "Use '" << argv[0] << " --help' for usage." << std::endl;
+        return 1;
+    }
+  }
+  if (input_file_name.empty() && optind < argc) input_file_name = argv[optind];
+  if (input_file_name.empty()) {
+    std::cerr << "No ROM file given" << std::endl;
+    return 1;
+  }
+
+  WcetProgram program;
+  uint16_t entry;
+  if (!loadRom(input_file_name, program, entry)) {
+    std::cerr << "Failed to load " << input_file_name << std::endl;
+    return 1;
+  }
+  bool default_debug = debug_file_name.empty();
+  if (default_debug) {
+    debug_file_name =
+        input_file_name.substr(0, input_file_name.find_last_of('.')) + ".dbg";
+  }
+  if (!default_debug || std::filesystem::exists(debug_file_name)) {
+    DebugInfo debug;
+    if (!readDebugInfo(debug_file_name, debug)) {
+      std::cerr << "Failed to read " << debug_file_name << std::endl;
+      return 1;
+    }
+    for (const DebugLabel& label : debug.labels) {
+      program.labels.emplace(label.address, label.name);
+    }
+  }
+
+  for (const std::string& spec : bound_specs) {
+    uint16_t address;
+    uint64_t bound;
+    if (!parseSpec(program, spec, address, bound, 0)) {
+      std::cerr << "Invalid loop bound: " << spec << std::endl;
+      std::cerr << "Usage: -b, --bound LABEL|ADDRESS:N" << std::endl;
+      return 1;
+    }
+    program.bounds[address] = bound;
+  }
+  std::vector<std::pair<uint16_t, uint64_t>> routines;
+  for (const std::string& spec : routine_specs) {
+    uint16_t address;
+    uint64_t budget;
+    // UINT64_MAX stands for no budget
+    if (!parseSpec(program, spec, address, budget, UINT64_MAX)) {
+      std::cerr << "Invalid routine: " << spec << std::endl;
+      std::cerr << "Usage: -r, --routine LABEL|ADDRESS[:BUDGET]" << std::endl;
+      return 1;
+    }
+    routines.push_back(
+        std::make_pair(address, budget == UINT64_MAX ? 0 : budget));
+  }
+  if (routines.empty()) routines.push_back(std::make_pair(entry, 0));
+
+  WcetAnalyzer analyzer(program);
+  int status = 0;
+  for (const auto& [address, budget] : routines) {
+    try {
+      const WcetResult& result = analyzer.analyze(address);
+      std::cout << formatWcet(program, address, result, budget);
+      if (budget && result.worst > budget) {
+        std::cerr << program.describe(address) << " can take "
+                  << result.worst << " cycles, over its budget of " << budget
+                  << std::endl;
+        status = 1;
+      }
+    } catch (const WcetError& e) {
+      std::cerr << e.what() << std::endl;
+      return 1;
+    }
+  }
+  return status;
+}
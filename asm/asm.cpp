@@ -4,27 +4,24 @@
 #include <getopt.h>
 
 #include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
 #include <regex>
 #include <set>
+#include <string_view>
+#include <thread>
 
 #include "assemblyParser.h"
 
-AssemblyParser::AssemblyParser(const std::string& file_name) {
-  std::cout << "Processing " << file_name << "..." << std::endl;
-  std::ifstream file(file_name, std::ios_base::binary | std::ios_base::in);
-  if (!file.is_open()) {
+// The source is never loaded as a whole, both passes read it a line at a time
+AssemblyParser::AssemblyParser(const std::string& file_name)
+    : input(file_name), source_path(file_name) {
+  if (!input.is_open()) {
     raiseError("Failed to open " + file_name);
   }
-  using Iterator = std::istreambuf_iterator<char>;
-  std::string content(Iterator{file}, Iterator{});
-  if (!file) {
-    raiseError("Failed to read " + file_name);
-  }
-  if (file.is_open()) file.close();
-  file_content = content;
-  current_input = content;
   int index = file_name.find('.');
   std::string temp = file_name.substr(0, index);
   this->file_name = temp;
@@ -40,472 +37,591 @@ std::string trim(std::string s) {
   return s;
 }
 
-// main parser
-void AssemblyParser::parseFile() {
-  skip();
-  std::vector<std::string> lines;
-  std::istringstream input_stream(current_input);
-  std::string line;
+namespace {
 
-  int label_index = 0;
-  int line_index = 0;
-  while (std::getline(input_stream, line, '\n')) {
-    line_index++;
-    line = trim(line);
-    if (line.size() > 0) {
-      if (line[line.size() - 1] == ':') {
-        labels[line.substr(0, line.length() - 1)] = label_index;
-      } else if (line[0] == '.') {
-        std::vector<std::string> instruction_line;
-        std::regex space_regex("^\\s+");
-        line = std::regex_replace(line, space_regex, " ");
-        std::string s = "";
-        for (int i = 0; i < line.size(); i++) {
-          if (line[i] != ' ') {
-            s += line[i];
-          } else {
-            instruction_line.push_back(s);
-            s = "";
-          }
-        }
-        if (s != "") instruction_line.push_back(s);
-
-        if (instruction_line[0] != ".org" || instruction_line.size() != 2) {
-          raiseError(file_name + ".asm Line: " + std::to_string(line_index) +
-                     +" Unknown Directive: " + line);
-        }
-        uint16_t address = stringToImm16(
-            instruction_line[1],
-            file_name + ".asm Line: " + std::to_string(line_index) +
-                +" Invalid Address: " + instruction_line[1]);
-        label_index = address;
-
-      } else if (line[0] == '@') {
-        label_index += 2;
-      } else if (line.substr(0, 4) == "const") {
-        std::vector<std::string> instruction_line;
-        std::string s;
-        for (int i = 0; i < line.size(); i++) {
-          if (line[i] != ' ') {
-            s += line[i];
-          } else {
-            instruction_line.push_back(s);
-            s = "";
-          }
-        }
-        if (s != "") instruction_line.push_back(s);
-        if (instruction_line[0] != "const" || instruction_line.size() != 3)
-          raiseError(file_name + ".asm Line: " + std::to_string(line_index) +
-                     +" Unknown Syntax: " + line);
+// strip leading and trailing spaces
+std::string strip(std::string_view s) {
+  size_t first = s.find_first_not_of(" \t");
+  if (first == std::string_view::npos) return "";
+  size_t last = s.find_last_not_of(" \t");
+  return std::string(s.substr(first, last - first + 1));
+}
 
-        constants[instruction_line[1]] = stringToImm8(
-            instruction_line[2],
-            file_name + ".asm Line: " + std::to_string(line_index) +
-                +" Invalid Constant: " + instruction_line[2]);
+// first word of a line and the rest
+std::pair<std::string, std::string> splitWord(const std::string& line) {
+  size_t end = line.find_first_of(" \t");
+  if (end == std::string::npos) return {line, ""};
+  return {line.substr(0, end), strip(std::string_view(line).substr(end))};
+}
 
-        label_index += 1;
-      } else {
-        label_index += 1;
-      }
+// operands are separated by commas outside parentheses
+std::vector<std::string> splitOperands(const std::string& text) {
+  std::vector<std::string> operands;
+  if (text.empty()) return operands;
+  int depth = 0;
+  size_t start = 0;
+  for (size_t i = 0; i <= text.size(); i++) {
+    if (i == text.size() || (text[i] == ',' && depth == 0)) {
+      operands.push_back(
+          strip(std::string_view(text).substr(start, i - start)));
+      start = i + 1;
+    } else if (text[i] == '(') {
+      depth++;
+    } else if (text[i] == ')') {
+      depth--;
     }
   }
-  input_stream.clear();
-  input_stream.seekg(0);
-  line_index = 0;
+  return operands;
+}
 
-  while (std::getline(input_stream, line, '\n')) {
-    line_index++;
-    line = trim(line);
-    if (line.size() > 0) {
-      if (line[0] == '@') {
-        std::string label = line.substr(1);
-        if (labels.find(label) == labels.end()) {
-          raiseError(file_name + ".asm Line: " + std::to_string(line_index) +
-                     +" Unknown Label: " + label);
-        }
-        label_index = labels[label];
-        uint8_t msb = static_cast<uint8_t>(label_index >> 8);
+bool isPseudo(const std::string& mnemonic) {
+  return mnemonic == "JMP" || mnemonic == "JZ" || mnemonic == "JN" ||
+         mnemonic == "CALL" || mnemonic == "RET" || mnemonic == "LI";
+}
 
-        uint8_t lsb = static_cast<uint8_t>(label_index & 0xFF);
-        InstructionType type = instruction_set.at("MWH");
-        uint8_t opcode = opcode_set.at("MWH");
+// pseudo_forms bits
+constexpr uint8_t LONG_VALUE = 0x1;   // HL load or LI needs the long form
+constexpr uint8_t LONG_RETURN = 0x2;  // CALL pushes its return through HL
 
-        InstructionType type1 = instruction_set.at("MWL");
-        uint8_t opcode1 = opcode_set.at("MWL");
+constexpr int MAX_LAYOUT_ROUNDS = 32;
 
-        instructions.push_back(Instruction("MWH", opcode, type,
-                                           InstructionParams(0, msb, 1),
-                                           InstructionParams()));
+}  // namespace
 
-        instructions.push_back(Instruction("MWL", opcode1, type1,
-                                           InstructionParams(0, lsb, 1),
-                                           InstructionParams()));
+ExprValue AssemblyParser::lookupSymbol(std::string_view name, bool final) {
+  uint32_t id = symbols.find(name);
+  if (id != SymbolTable::NONE) {
+    const Symbol& symbol = symbols[id];
+    if (!final && (id >= defined.size() || !defined[id])) forward_refs = true;
+    if (symbol.is_constant) return ExprValue{symbol.value};
+    if (symbol.is_label) {
+      return ExprValue{symbol.address,
+                       labels_move ? id : SymbolTable::NONE};
+    }
+    if (symbol.is_extern) return ExprValue{0, id};
+  }
+  if (final) throw ExpressionError("Unknown Symbol: " + std::string(name));
+  forward_refs = true;
+  return ExprValue{};
+}
 
-        lines.push_back(line);
-        continue;
-      } else if (line[line.size() - 1] == ':') {
-        continue;
-      } else if (line[0] == '.') {
-        std::vector<std::string> instruction_line;
-        std::regex space_regex("^\\s+");
-        line = std::regex_replace(line, space_regex, " ");
-        std::string s = "";
-        for (int i = 0; i < line.size(); i++) {
-          if (line[i] != ' ') {
-            s += line[i];
-          } else {
-            instruction_line.push_back(s);
-            s = "";
-          }
-        }
-        if (s != "") instruction_line.push_back(s);
+ExprValue AssemblyParser::evaluate(const std::string& text, uint32_t line,
+                                   bool final) {
+  try {
+    return ExpressionParser(
+               text,
+               [&](std::string_view name) { return lookupSymbol(name, final); },
+               final)
+        .parse();
+  } catch (const ExpressionError& e) {
+    raiseError(file_name + ".asm Line: " + std::to_string(line) + " " +
+               e.what());
+  }
+  return ExprValue{};
+}
 
-        if (instruction_line[0] != ".org" || instruction_line.size() != 2) {
-          raiseError(file_name + ".asm Line: " + std::to_string(line_index) +
-                     +" Unknown Directive: " + line);
-        }
-        uint16_t address;
-        if (constants.find(instruction_line[1]) != constants.end()) {
-          address = constants[instruction_line[1]];
-        } else {
-          address = stringToImm16(
-              instruction_line[1],
-              file_name + ".asm Line: " + std::to_string(line_index) +
-                  +" Invalid Address: " + instruction_line[1]);
-        }
-        int current_ins = instructions.size();
-        if (address < current_ins) {
-          raiseError(file_name + ".asm Line: " + std::to_string(line_index) +
-                     +" Address: " + std::to_string(address) +
-                     " is less than current number of instructions: " +
-                     std::to_string(current_ins));
-        }
-        for (int i = 0; i < (address - current_ins); i++) {
-          instructions.push_back(Instruction("NOP", opcode_set.at("NOP"),
-                                             instruction_set.at("NOP")));
-        }
+int64_t AssemblyParser::evaluateRange(const std::string& text, uint32_t line,
+                                      int64_t min, int64_t max,
+                                      const std::string& message) {
+  ExprValue value = evaluate(text, line, true);
+  if (value.movable()) {
+    raiseError(file_name + ".asm Line: " + std::to_string(line) +
+               " Label address is not known before linking or -O: " + text +
+               " (use @label, JMP, CALL or LI HL)");
+  }
+  if (value.value < min || value.value > max) raiseError(message);
+  return value.value;
+}
 
-        continue;
+void AssemblyParser::defineSymbol(uint32_t id, uint32_t line) {
+  if (id >= defined.size()) defined.resize(symbols.size(), false);
+  if (defined[id]) {
+    raiseError(file_name + ".asm Line: " + std::to_string(line) +
+               " Symbol already defined: " + std::string(symbols[id].name));
+  }
+  defined[id] = true;
+}
+
+// HL <- value, one MW when it fits in a byte. A movable label is loaded with
+// a relocated MWH/MWL pair like @label, or with -O alone a fixed up MW.
+void AssemblyParser::emitLoadHL(uint32_t line, ExprValue value,
+                                bool long_form) {
+  if (value.movable()) {
+    if (stream) {
+      raiseError(file_name + ".asm Undefined reference to " +
+                 std::string(symbols[value.symbol].name) +
+                 " (assemble with -r and link with bit16-ld)");
+    }
+    (long_form ? label_refs : byte_refs)
+        .push_back(std::make_pair(position(), value.symbol));
+  }
+  uint16_t word = value.value;
+  if (!long_form) {
+    emit(line, Instruction(OP_MW, InstructionParams(REG_HL, 0, 0),
+                           InstructionParams(0, word, 1)));
+    return;
+  }
+  emit(line, Instruction(OP_MWH, InstructionParams(0, word >> 8, 1)),
+       value.movable());
+  emit(line, Instruction(OP_MWL, InstructionParams(0, word & 0xff, 1)),
+       value.movable());
+}
+
+// Pseudo-instructions, lowered to the shortest sequence their operand values
+// allow:
+//   JMP target      HL <- target, JMPZ 0
+//   JZ reg, target  HL <- target, JMPZ reg
+//   JN reg, target  HL <- target, JMPN reg
+//   CALL target     push the return address (PUSH imm8 if it fits, else
+//                   through HL), HL <- target, JMPZ 0
+//   RET             POP HL, JMPZ 0
+//   LI reg, value   MW reg, value / NOT reg, ~value for 0xFF00-0xFFFF,
+//                   else through HL. LI may overwrite F and HL.
+// where HL <- v is MW HL, v if v fits in a byte, else MWH/MWL. A label that
+// fits in a byte keeps fitting with -O, which only moves labels down, but
+// not in an object, which the linker can place anywhere.
+//
+// Pass 1 (final false) widens the forms of the pseudo-instruction to what
+// its operand values need and returns its size, pass 2 emits it in those
+// forms.
+size_t AssemblyParser::lowerPseudo(const std::string& mnemonic,
+                                   const std::vector<std::string>& operands,
+                                   uint32_t line, uint16_t address,
+                                   bool final) {
+  std::string where = file_name + ".asm Line: " + std::to_string(line) + " ";
+  size_t index = pseudo_count++;
+  if (index == pseudo_forms.size()) pseudo_forms.push_back(0);
+  uint8_t& forms = pseudo_forms[index];
+  auto widen = [&](uint8_t form, bool needed) {
+    if (!needed || (forms & form)) return;
+    if (final) raiseError(where + "Layout changed between passes");
+    forms |= form;
+  };
+  auto params = [&](size_t count, const std::string& kinds) {
+    if (operands.size() != count) {
+      raiseError(where + mnemonic + " takes " + kinds +
+                 ", found: " + std::to_string(operands.size()));
+    }
+  };
+  auto reg = [&](const std::string& text) {
+    uint8_t bit = regToBit(text);
+    if (bit == REG_INVALID) {
+      raiseError(where + mnemonic + " expects a register, found: " + text);
+    }
+    return bit;
+  };
+  auto value16 = [&](const std::string& text) {
+    ExprValue value = evaluate(text, line, final);
+    if (value.value < -0x8000 || value.value > 0xffff) {
+      if (final) raiseError(where + "Value out of range: " + text);
+      value.value = 0;
+    }
+    value.value &= 0xffff;
+    return value;
+  };
+  auto byte = [&](const ExprValue& value) {
+    return value.value <= 0xff &&
+           (!value.movable() ||
+            (!labels_relocate && symbols[value.symbol].is_label));
+  };
+  auto loadSize = [&]() { return forms & LONG_VALUE ? 2 : 1; };
+
+  if (mnemonic == "RET") {
+    params(0, "no params");
+    if (final) {
+      emit(line, Instruction(OP_POP, InstructionParams(REG_HL, 0, 0)));
+      emit(line, Instruction(OP_JMPZ, InstructionParams(0, 0, 1)));
+    }
+    return 2;
+  }
+  if (mnemonic == "JMP" || mnemonic == "JZ" || mnemonic == "JN") {
+    bool conditional = mnemonic != "JMP";
+    params(conditional ? 2 : 1,
+           conditional ? "2 params (register, target)" : "1 param (target)");
+    uint8_t tested = conditional ? reg(operands[0]) : 0;
+    if (conditional && tested == REG_HL) {
+      raiseError(where + mnemonic + " cannot test HL, it holds the target");
+    }
+    ExprValue target = value16(operands.back());
+    widen(LONG_VALUE, !byte(target));
+    if (final) {
+      emitLoadHL(line, target, forms & LONG_VALUE);
+      InstructionParams condition = conditional
+                                        ? InstructionParams(tested, 0, 0)
+                                        : InstructionParams(0, 0, 1);
+      emit(line, Instruction(mnemonic == "JN" ? OP_JMPN : OP_JMPZ, condition));
+    }
+    return loadSize() + 1;
+  }
+  if (mnemonic == "CALL") {
+    params(1, "1 param (target)");
+    ExprValue target = value16(operands[0]);
+    widen(LONG_VALUE, !byte(target));
+    auto size = [&]() {
+      return (forms & LONG_RETURN ? 3 : 1) + loadSize() + 1;
+    };
+    // code moved by -O or the linker returns through a label
+    uint32_t back = SymbolTable::NONE;
+    if (labels_move) {
+      back = symbols.intern(".call" + std::to_string(index));
+      symbols[back].is_label = true;
+    }
+    widen(LONG_RETURN, labels_relocate || address + size() > 0xff);
+    ExprValue ret{uint16_t(address + size()), back};
+    if (!final && labels_move) symbols[back].address = ret.value;
+    if (final) {
+      if (forms & LONG_RETURN) {
+        emitLoadHL(line, ret, true);
+        emit(line, Instruction(OP_PUSH, InstructionParams(REG_HL, 0, 0)));
+      } else {
+        if (labels_move) byte_refs.push_back(std::make_pair(position(), back));
+        emit(line, Instruction(OP_PUSH, InstructionParams(0, ret.value, 1)));
       }
-      std::vector<std::string> instruction_line;
-      std::regex space_regex("^\\s+");
-      line = std::regex_replace(line, space_regex, " ");
-      std::string s = "";
-      for (int i = 0; i < line.size(); i++) {
-        if (line[i] != ' ') {
-          s += line[i];
-        } else {
-          if (constants.find(s) != constants.end()) {
-            s = std::to_string(constants[s]);
-          }
-          instruction_line.push_back(s);
-          s = "";
-        }
+      emitLoadHL(line, target, forms & LONG_VALUE);
+      emit(line, Instruction(OP_JMPZ, InstructionParams(0, 0, 1)));
+      if (labels_move) symbols[back].target = position();
+    }
+    return size();
+  }
+  // LI
+  params(2, "2 params (register, value)");
+  uint8_t dest = reg(operands[0]);
+  ExprValue value = value16(operands[1]);
+  bool inverted = !value.movable() && value.value >= 0xff00;
+  widen(LONG_VALUE, !byte(value) && !inverted);
+  if (final) {
+    if (forms & LONG_VALUE) {
+      emitLoadHL(line, value, true);
+      if (dest != REG_HL) {
+        emit(line, Instruction(OP_MW, InstructionParams(dest, 0, 0),
+                               InstructionParams(REG_HL, 0, 0)));
       }
-      if (s != "") instruction_line.push_back(s);
-      std::string mnemonic = instruction_line[0];
-      if (instruction_set.find(mnemonic) == instruction_set.end()) {
-        raiseError(file_name + ".asm Line: " + std::to_string(line_index) +
-                   +" Unknown Instruction: " + mnemonic);
+    } else if (inverted) {
+      emit(line, Instruction(OP_NOT, InstructionParams(dest, 0, 0),
+                             InstructionParams(0, ~value.value & 0xff, 1)));
+    } else {
+      if (value.movable()) {
+        byte_refs.push_back(std::make_pair(position(), value.symbol));
       }
-      InstructionType type = instruction_set.at(mnemonic);
-      uint8_t opcode = opcode_set.at(mnemonic);
-      if (type == NoParams) {
-        if (instruction_line.size() != 1) {
-          raiseError(file_name + ".asm Line: " + std::to_string(line_index) +
-                     " " + mnemonic + " takes no params, found: " +
-                     std::to_string(instruction_line.size() - 1));
-        }
-        instructions.push_back(Instruction(mnemonic, opcode, type));
-      } else if (type == Register_only) {
-        if (instruction_line.size() != 2) {
-          raiseError(file_name + ".asm Line: " + std::to_string(line_index) +
-                     " " + mnemonic + " takes 1 param (register), found: " +
-                     std::to_string(instruction_line.size() - 1));
-        }
+      emit(line, Instruction(OP_MW, InstructionParams(dest, 0, 0),
+                             InstructionParams(0, value.value, 1)));
+    }
+  }
+  if (!(forms & LONG_VALUE)) return 1;
+  return dest == REG_HL ? 2 : 3;
+}
 
-        uint8_t bit = regToBit(instruction_line[1]);
-        if (bit == 0xff) {
-          raiseError(file_name + ".asm Line: " + std::to_string(line_index) +
-                     " " + mnemonic + " takes 1 param (register), found: " +
-                     instruction_line[1]);
-        }
-        instructions.push_back(Instruction(mnemonic, opcode, type,
-                                           InstructionParams(bit, 0, 0),
-                                           InstructionParams()));
-      } else if (type == Immediate_only) {
-        if (instruction_line.size() != 2) {
-          raiseError(file_name + ".asm Line: " + std::to_string(line_index) +
-                     " " + mnemonic +
-                     " takes 1 param (8 bit immediate), found: " +
-                     std::to_string(instruction_line.size() - 1));
-        }
-        uint8_t imm8 = stringToImm8(
-            instruction_line[1],
-            file_name + ".asm Line: " + std::to_string(line_index) + " " +
-                mnemonic + " takes 1 param (8 bit immediate), found: " +
-                instruction_line[1]);
-        instructions.push_back(Instruction(mnemonic, opcode, type,
-                                           InstructionParams(0, imm8, 1),
-                                           InstructionParams()));
-      } else if (type == Register_Immediate_only) {
-        if (instruction_line.size() != 2) {
-          raiseError(file_name + ".asm Line: " + std::to_string(line_index) +
-                     " " + mnemonic +
-                     " takes 1 param (register/8 bit immediate), found: " +
-                     std::to_string(instruction_line.size() - 1));
-        }
-        if (register_set.contains(instruction_line[1])) {
-          uint8_t bit = regToBit(instruction_line[1]);
-          if (bit == 0xff) {
-            raiseError(file_name + ".asm Line: " + std::to_string(line_index) +
-                       " " + mnemonic +
-                       " takes 1 param (register/8 bit immediate), found: " +
-                       instruction_line[1]);
-          }
-          instructions.push_back(Instruction(mnemonic, opcode, type,
-                                             InstructionParams(bit, 0, 0),
-                                             InstructionParams()));
+// Pass 1: label addresses and constant values. Sizes of pseudo-instructions
+// depend on operand values, which may be labels further down, so the pass is
+// repeated until nothing changes. Forms only ever grow, so this settles. A
+// source without forward references is done after one round.
+void AssemblyParser::layout() {
+  std::vector<std::pair<int64_t, int64_t>> before;
+  for (int round = 0; round < MAX_LAYOUT_ROUNDS; round++) {
+    std::vector<uint8_t> forms_before = pseudo_forms;
+    layoutRound();
+    if (!forward_refs) return;
+    bool settled = round > 0 && forms_before == pseudo_forms &&
+                   before.size() == symbols.size();
+    for (size_t id = 0; id < symbols.size(); id++) {
+      std::pair<int64_t, int64_t> now(symbols[id].address, symbols[id].value);
+      if (id < before.size()) {
+        settled = settled && before[id] == now;
+        before[id] = now;
+      } else {
+        before.push_back(now);
+      }
+    }
+    if (settled) return;
+  }
+  raiseError(file_name + ".asm Addresses do not settle, check the constants "
+             "and pseudo-instructions that depend on labels");
+}
 
-        } else {
-          uint8_t imm8 = stringToImm8(
-              instruction_line[1],
-              file_name + ".asm Line: " + std::to_string(line_index) + " " +
-                  mnemonic +
-                  " takes 1 param (register/8 bit immediate), found: " +
-                  instruction_line[1]);
-          instructions.push_back(Instruction(mnemonic, opcode, type,
-                                             InstructionParams(0, imm8, 1),
-                                             InstructionParams()));
-        }
-      } else if (type == ALL_1) {
-        if (instruction_line.size() != 3) {
-          raiseError(
-              file_name + ".asm Line: " + std::to_string(line_index) + " " +
-              mnemonic +
-              " takes 2 param (register, register/8 bit immediate), found: " +
-              std::to_string(instruction_line.size() - 1));
-        }
+void AssemblyParser::layoutRound() {
+  std::string line;
+  uint32_t label_index = 0;
+  uint32_t line_index = 0;
+  forward_refs = false;
+  pseudo_count = 0;
+  defined.assign(symbols.size(), false);
+  input.rewind();
+  while (input.getline(line)) {
+    line_index++;
+    skip(line);
+    line = trim(line);
+    if (line.empty()) continue;
+    std::string where =
+        file_name + ".asm Line: " + std::to_string(line_index) + " ";
+    if (line[line.size() - 1] == ':') {
+      uint32_t id =
+          symbols.intern(std::string_view(line).substr(0, line.length() - 1));
+      defineSymbol(id, line_index);
+      symbols[id].is_label = true;
+      symbols[id].address = label_index;
+      continue;
+    }
+    auto [word, rest] = splitWord(line);
+    if (line[0] == '.') {
+      bool one =
+          !rest.empty() && rest.find_first_of(" \t") == std::string::npos;
+      if (word == ".global" && one) {
+        symbols[symbols.intern(rest)].is_global = true;
+      } else if (word == ".extern" && one) {
+        symbols[symbols.intern(rest)].is_extern = true;
+      } else if ((word == ".entry" && one) ||
+                 ((word == ".bound" || word == ".budget") && !one &&
+                  !rest.empty())) {
+        // resolved in pass 2
+      } else if (word == ".org" && !rest.empty()) {
+        label_index = evaluate(rest, line_index, false).value & 0xffff;
+      } else {
+        raiseError(where + "Unknown Directive: " + line);
+      }
+    } else if (line[0] == '@') {
+      label_index += 2;
+    } else if (word == "const") {
+      auto [name, value] = splitWord(rest);
+      if (name.empty() || value.empty() || isRegister(name)) {
+        raiseError(where + "Unknown Syntax: " + line);
+      }
+      uint32_t id = symbols.intern(name);
+      if (symbols[id].is_label || symbols[id].is_extern) {
+        raiseError(where + "Symbol already defined: " + name);
+      }
+      // evaluated first, so that a constant using itself never settles
+      int64_t constant = evaluate(value, line_index, false).value;
+      defineSymbol(id, line_index);
+      symbols[id].value = constant;
+      symbols[id].is_constant = true;
+    } else if (isPseudo(word)) {
+      label_index += lowerPseudo(word, splitOperands(rest), line_index,
+                                 label_index, false);
+    } else {
+      label_index += 1;
+    }
+  }
+}
 
-        if (instruction_line[1][instruction_line[1].size() - 1] != ',') {
-          raiseError(file_name + ".asm Line: " + std::to_string(line_index) +
-                     " " + "expected ','");
-        }
-        uint8_t bit = regToBit(
-            instruction_line[1].substr(0, instruction_line[1].size() - 1));
-        if (bit == 0xff) {
-          raiseError(
-              file_name + ".asm Line: " + std::to_string(line_index) + " " +
-              mnemonic +
-              " takes 2 param (register, register/8 bit immediate), found: " +
-              instruction_line[1]);
-        }
-        if (register_set.contains(instruction_line[2])) {
-          uint8_t bit1 = regToBit(instruction_line[2]);
-          if (bit == 0xff) {
-            raiseError(file_name + ".asm Line: " + std::to_string(line_index) +
-                       " " + mnemonic +
-                       " takes 2 param (register, register/8 bit immediate), "
-                       "found: " +
-                       instruction_line[2]);
-          }
-          instructions.push_back(Instruction(mnemonic, opcode, type,
-                                             InstructionParams(bit, 0, 0),
-                                             InstructionParams(bit1, 0, 0)));
+// main parser
+void AssemblyParser::parseFile() {
+  std::string line;
+  layout();
 
+  pseudo_count = 0;
+  input.rewind();
+  uint32_t line_index = 0;
+  while (input.getline(line)) {
+    line_index++;
+    if (stream && instructions.size() >= STREAM_CHUNK) flushStream();
+    skip(line);
+    line = trim(line);
+    if (line.empty()) continue;
+    std::string where =
+        file_name + ".asm Line: " + std::to_string(line_index) + " ";
+    if (line[0] == '@') {
+      std::string label = line.substr(1);
+      uint32_t id = symbols.find(label);
+      if (id == SymbolTable::NONE ||
+          (!symbols[id].is_label && !symbols[id].is_extern)) {
+        raiseError(where + "Unknown Label: " + label);
+      }
+      // externals are filled in by the linker, see outputObject. A stream
+      // keeps no fixups, so its references have to resolve right away
+      if (stream && !symbols[id].is_label) {
+        raiseError(file_name + ".asm Undefined reference to " + label +
+                   " (assemble with -r and link with bit16-ld)");
+      }
+      if (!stream) label_refs.push_back(std::make_pair(position(), id));
+      uint16_t address = symbols[id].is_label ? symbols[id].address : 0;
+      emit(line_index,
+           Instruction(OP_MWH, InstructionParams(0, address >> 8, 1)), true);
+      emit(line_index,
+           Instruction(OP_MWL, InstructionParams(0, address & 0xff, 1)), true);
+      continue;
+    }
+    if (line[line.size() - 1] == ':') {
+      symbols[symbols.find(std::string_view(line).substr(
+                  0, line.length() - 1))]
+          .target = position();
+      continue;
+    }
+    auto [word, rest] = splitWord(line);
+    if (line[0] == '.') {
+      if (word == ".global" || word == ".extern") continue;
+      if (word == ".entry") {
+        has_entry = true;
+        uint32_t id = symbols.find(rest);
+        if (id != SymbolTable::NONE && symbols[id].is_label) {
+          entry_symbol = id;
+          entry = symbols[id].address;
         } else {
-          uint8_t imm8 = stringToImm8(
-              instruction_line[2],
-              file_name + ".asm Line: " + std::to_string(line_index) + " " +
-                  mnemonic +
-                  " takes 2 param (register, register/8 bit immediate), "
-                  "found: " +
-                  instruction_line[2]);
-          instructions.push_back(Instruction(mnemonic, opcode, type,
-                                             InstructionParams(bit, 0, 0),
-                                             InstructionParams(0, imm8, 1)));
+          entry = evaluateRange(rest, line_index, 0, 0xffff,
+                                where + "Invalid Entry: " + rest);
         }
-
-      } else {
-        if (instruction_line.size() != 3) {
-          raiseError(
-              file_name + ".asm Line: " + std::to_string(line_index) + " " +
-              mnemonic +
-              " takes 2 param (register/8 bit immediate, register), found: " +
-              std::to_string(instruction_line.size() - 1));
-        } else if (instruction_line[1][instruction_line[1].size() - 1] != ',') {
-          raiseError(file_name + ".asm Line: " + std::to_string(line_index) +
-                     " " + "expected ','");
-        }
-        uint8_t bit = regToBit(instruction_line[2]);
-        if (bit == 0xff) {
-          raiseError(
-              file_name + ".asm Line: " + std::to_string(line_index) + " " +
-              mnemonic +
-              " takes 2 param (register/8 bit immediate, register), found: " +
-              instruction_line[2]);
+        continue;
+      }
+      if (word == ".bound" || word == ".budget") {
+        // timing annotations for -W, labels may be defined further down
+        auto [label, count] = splitWord(rest);
+        uint32_t id = symbols.find(label);
+        if (id == SymbolTable::NONE || !symbols[id].is_label) {
+          raiseError(where + "Unknown Label: " + label);
         }
-        if (register_set.contains(instruction_line[1].substr(
-                0, instruction_line[1].size() - 1))) {
-          uint8_t bit1 = regToBit(
-              instruction_line[1].substr(0, instruction_line[1].size() - 1));
-          if (bit == 0xff) {
-            raiseError(file_name + ".asm Line: " + std::to_string(line_index) +
-                       " " + mnemonic +
-                       " takes 2 param (register/8 bit immediate, register), "
-                       "found: " +
-                       instruction_line[1]);
-          }
-          instructions.push_back(Instruction(mnemonic, opcode, type,
-                                             InstructionParams(bit1, 0, 0),
-                                             InstructionParams(bit, 0, 0)));
+        uint64_t value = evaluateRange(count, line_index, word == ".bound",
+                                       INT64_MAX,
+                                       word == ".bound"
+                                           ? where + "A loop bound must be "
+                                                     "at least 1: " + count
+                                           : where + "Invalid Count: " + count);
+        (word == ".bound" ? loop_bounds : budgets)
+            .push_back(std::make_pair(id, value));
+        continue;
+      }
+      // .org
+      uint16_t address = evaluateRange(rest, line_index, 0, 0xffff,
+                                       where + "Invalid Address: " + rest);
+      // the pending code belongs to the segment this .org ends
+      if (stream) flushStream();
+      uint16_t current = addressOf(position());
+      if (address < current) {
+        raiseError(where + "Address: " + std::to_string(address) +
+                   " is less than current address: " +
+                   std::to_string(current));
+      }
+      if (segments.back().first == position()) {
+        segments.back().address = address;
+      } else if (address > current) {
+        segments.push_back(Segment{address, position()});
+      }
+      continue;
+    }
+    if (word == "const") {
+      auto [name, value] = splitWord(rest);
+      symbols[symbols.find(name)].value =
+          evaluateRange(value, line_index, -0x8000, 0xffff,
+                        where + "Invalid Constant: " + value);
+      continue;
+    }
+    std::vector<std::string> operands = splitOperands(rest);
+    if (isPseudo(word)) {
+      lowerPseudo(word, operands, line_index, addressOf(position()), true);
+      continue;
+    }
 
-        } else {
-          uint8_t imm8 = stringToImm8(
-              instruction_line[1],
-              file_name + ".asm Line: " + std::to_string(line_index) + " " +
-                  mnemonic +
-                  " takes 2 param (register/8 bit immediate, register), "
-                  "found: " +
-                  instruction_line[1]);
-          instructions.push_back(Instruction(mnemonic, opcode, type,
-                                             InstructionParams(0, imm8, 1),
-                                             InstructionParams(bit, 0, 0)));
-        }
+    std::string mnemonic = word;
+    const OpcodeInfo* info = findInstruction(mnemonic);
+    if (info == nullptr) {
+      raiseError(where + "Unknown Instruction: " + mnemonic);
+    }
+    InstructionType type = info->type;
+    uint8_t opcode = info->opcode;
+    // an 8 bit operand, -128 to 255
+    auto immediate = [&](const std::string& text, const std::string& kinds) {
+      return uint8_t(evaluateRange(
+          text, line_index, -0x80, 0xff,
+          where + mnemonic + " takes " + kinds + ", found: " + text));
+    };
+    auto count = [&](size_t expected, const std::string& kinds) {
+      if (operands.size() != expected) {
+        raiseError(where + mnemonic + " takes " + kinds +
+                   ", found: " + std::to_string(operands.size()));
       }
-      lines.push_back(line);
+    };
+    auto reg = [&](const std::string& text, const std::string& kinds) {
+      uint8_t bit = regToBit(text);
+      if (bit == REG_INVALID) {
+        raiseError(where + mnemonic + " takes " + kinds + ", found: " + text);
+      }
+      return bit;
+    };
+    // register or 8 bit immediate
+    auto source = [&](const std::string& text, const std::string& kinds) {
+      if (isRegister(text)) return InstructionParams(regToBit(text), 0, 0);
+      return InstructionParams(0, immediate(text, kinds), 1);
+    };
+
+    if (type == NoParams) {
+      count(0, "no params");
+      emit(line_index, Instruction(opcode));
+    } else if (type == Register_only) {
+      std::string kinds = "1 param (register)";
+      count(1, kinds);
+      emit(line_index, Instruction(opcode, InstructionParams(
+                                               reg(operands[0], kinds), 0, 0)));
+    } else if (type == Immediate_only) {
+      std::string kinds = "1 param (8 bit immediate)";
+      count(1, kinds);
+      emit(line_index,
+           Instruction(opcode,
+                       InstructionParams(0, immediate(operands[0], kinds), 1)));
+    } else if (type == Register_Immediate_only) {
+      std::string kinds = "1 param (register/8 bit immediate)";
+      count(1, kinds);
+      emit(line_index, Instruction(opcode, source(operands[0], kinds)));
+    } else if (type == ALL_1) {
+      std::string kinds = "2 param (register, register/8 bit immediate)";
+      count(2, kinds);
+      emit(line_index,
+           Instruction(opcode, InstructionParams(reg(operands[0], kinds), 0, 0),
+                       source(operands[1], kinds)));
+    } else {
+      std::string kinds = "2 param (register/8 bit immediate, register)";
+      count(2, kinds);
+      InstructionParams address = source(operands[0], kinds);
+      emit(line_index,
+           Instruction(opcode, address,
+                       InstructionParams(reg(operands[1], kinds), 0, 0)));
     }
   }
 
-  // for (auto i : instructions) {
-  //   std::cout << i << "\n";
-  // }
-
-  // for (auto i : labels) {
-  //   std::cout << i.first << " " << i.second << "\n";
-  // }
+  if (input.failed()) {
+    raiseError("Failed to read " + file_name + ".asm");
+  }
+  if (stream) finishStream();
 }
 
-// Remove over whitespace and comments
-void AssemblyParser::skip() {
-  // std::regex space_regex("\\s+");
-  // std::regex empty_line_regex("^[ \\t]*$");
-  std::regex comment_regex(";[^\n]*");
-
-  // current_input = std::regex_replace(current_input, space_regex, "");
-  // current_input = std::regex_replace(current_input, empty_line_regex, "");
-  current_input = std::regex_replace(current_input, comment_regex, "");
-  // std::cout << current_input;
-
-  // std::smatch match;
-  // if (std::regex_search(current_input, match, space_regex)) {
-  //   // If the regex pattern is found at the beginning of the string
-  //   std::string matched_string = match.str();
-  //   std::cout << "Matched: <" << matched_string << ">" << std::endl;
-
-  //   // Remove the matched part from the input string
-  //   current_input = current_input.substr(matched_string.length());
-  // }
-  // if (std::regex_search(current_input, match, comment_regex)) {
-  //   std::string matched_string = match.str();
-  //   std::cout << "Matched1: <" << matched_string << ">" << std::endl;
-
-  //   current_input = current_input.substr(matched_string.length());
-  // }
-  // if (std::regex_search(current_input, match, mult_comments_regex)) {
-  //   std::string matched_string = match.str();
-  //   std::cout << "Matched2: <" << matched_string << ">" << std::endl;
+// Remove comments from a line
+void AssemblyParser::skip(std::string& line) {
+  size_t comment = line.find(';');
+  if (comment != std::string::npos) line.erase(comment);
+}
 
-  //   current_input = current_input.substr(matched_string.length());
-  // }
+uint16_t AssemblyParser::addressOf(size_t index) {
+  auto segment = std::upper_bound(
+      segments.begin(), segments.end(), index,
+      [](size_t i, const Segment& seg) { return i < seg.first; });
+  --segment;
+  return segment->address + (index - segment->first);
 }
 
+// Flat listing and binary, the gaps between segments are filled with NOPs
 std::pair<std::string, std::vector<uint16_t>> AssemblyParser::getCleanOutput(
     int line_nums) {
   std::string output = "";
   std::vector<uint16_t> bin;
-  for (auto i : instructions) {
-    std::string mnemonic = i.mnemonic;
-    uint8_t opcode = i.opcode;
-    InstructionType type = i.type;
-    InstructionParams param1 = i.param1;
-    InstructionParams param2 = i.param2;
-    std::string current;
-    std::string current_bin;
-
-    if (type == NoParams) {
-      current = mnemonic;
-      current_bin = std::bitset<4>(opcode).to_string() + "000000000000";
-    } else if (type == Register_only) {
-      current = mnemonic + " " + bitToReg(param1.reg);
-      current_bin = std::bitset<4>(opcode).to_string() + "0" +
-                    std::bitset<3>(param1.reg).to_string() + "00000000";
-    } else if (type == Immediate_only) {
-      current = mnemonic + " " + std::to_string(param1.imm8);
-      current_bin = std::bitset<4>(opcode).to_string() + "0000" +
-                    std::bitset<8>(param1.imm8).to_string();
-    } else if (type == Register_Immediate_only) {
-      if (!param1.choice) {
-        current = mnemonic + " " + bitToReg(param1.reg);
-        current_bin = std::bitset<4>(opcode).to_string() + "0" +
-                      std::bitset<3>(param1.reg).to_string() + "00000000";
-      } else {
-        current = mnemonic + " " + std::to_string(param1.imm8);
-        current_bin = std::bitset<4>(opcode).to_string() + "1000" +
-                      std::bitset<8>(param1.imm8).to_string();
-      }
-
-    } else if (type == ALL_1) {
-      if (!param2.choice) {
-        current =
-            mnemonic + " " + bitToReg(param1.reg) + "," + bitToReg(param2.reg);
-
-        current_bin = std::bitset<4>(opcode).to_string() + "0" +
-                      std::bitset<3>(param1.reg).to_string() +
-                      std::bitset<3>(param2.reg).to_string() + "00000";
-      } else {
-        current = mnemonic + " " + bitToReg(param1.reg) + "," +
-                  std::to_string(param2.imm8);
-        current_bin = std::bitset<4>(opcode).to_string() + "0" +
-                      std::bitset<3>(param1.reg).to_string() +
-                      std::bitset<8>(param2.imm8).to_string();
-      }
-    } else if (type == ALL_SW) {
-      if (!param1.choice) {
-        current =
-            mnemonic + " " + bitToReg(param1.reg) + "," + bitToReg(param2.reg);
-
-        current_bin = std::bitset<4>(opcode).to_string() + "0" +
-                      std::bitset<3>(param1.reg).to_string() +
-                      std::bitset<3>(param2.reg).to_string() + "00000";
-      } else {
-        current = mnemonic + " " + std::to_string(param1.imm8) + "," +
-                  bitToReg(param2.reg);
-        current_bin = std::bitset<4>(opcode).to_string() + "0" +
-                      std::bitset<3>(param1.reg).to_string() +
-                      std::bitset<8>(param2.imm8).to_string();
-      }
-    } else {
-      raiseError(mnemonic + " can't be parsed " + file_name);
+  for (size_t s = 0; s < segments.size(); s++) {
+    size_t last =
+        s + 1 < segments.size() ? segments[s + 1].first : instructions.size();
+    while (bin.size() < segments[s].address) {
+      bin.push_back(encode(OP_NOP, InstructionParams(), InstructionParams()));
+      output += "NOP\n";
+    }
+    for (size_t i = segments[s].first; i < last; i++) {
+      uint16_t result = instructions[i].word;
+      output += disassemble(result);
+      output += "\n";
+      bin.push_back(result);
     }
-
-    output += current;
-    output += "\n";
-    std::bitset<16> bitset(current_bin);
-    uint16_t result = static_cast<uint16_t>(bitset.to_ulong());
-    bin.push_back(result);
   }
 
   if (line_nums != -2) {
-    int extra = line_nums * 1024.0 * 8 / 16.0 - instructions.size();
+    int extra = line_nums * 1024.0 * 8 / 16.0 - bin.size();
     if (extra < 0)
       raiseError("Specified file size" + std::to_string(line_nums) +
                  "kiB is smaller than program size " +
-                 std::to_string(instructions.size() * 16 / 8192) + "kiB");
+                 std::to_string(bin.size() * 16 / 8192) + "kiB");
     for (int i = 0; i < extra; i++) {
-      std::bitset<16> bitset("0000000000000000");
-      uint16_t result = static_cast<uint16_t>(bitset.to_ulong());
-      bin.push_back(result);
+      bin.push_back(encode(OP_NOP, InstructionParams(), InstructionParams()));
       output += "NOP\n";
     }
   }
@@ -513,32 +629,329 @@ std::pair<std::string, std::vector<uint16_t>> AssemblyParser::getCleanOutput(
   return std::make_pair(output, bin);
 }
 
+void AssemblyParser::writeCleanFile(const std::string& listing) {
+  std::fstream cleanfile(file_name + "_clean.txt", std::fstream::out);
+  if (cleanfile.is_open()) {
+    cleanfile << listing;
+  } else {
+    raiseError("Error opening file: " + file_name + "_clean.txt");
+  }
+  cleanfile.close();
+  outputs.push_back("_clean.txt");
+}
+
+// Words of instructions [first, last), which are laid out from address on
+void AssemblyParser::addDebugWords(uint16_t address, size_t first,
+                                   size_t last) {
+  for (size_t i = first; i < last; i++, address++) {
+    debug.add(address, 0, source_lines[i].line,
+              source_lines[i].label_ref ? DEBUG_LABEL_REF : 0);
+  }
+}
+
+// Debug info for the whole program. A flat output also gets ranges for the
+// NOPs getCleanOutput pads it with.
+void AssemblyParser::outputDebugInfo(bool flat, int line_nums) {
+  uint32_t end = 0;
+  for (size_t s = 0; s < segments.size(); s++) {
+    size_t last =
+        s + 1 < segments.size() ? segments[s + 1].first : instructions.size();
+    if (flat && end < segments[s].address) {
+      debug.addPadding(end, segments[s].address - end);
+    }
+    addDebugWords(segments[s].address, segments[s].first, last);
+    end = std::max<uint32_t>(end, segments[s].address) +
+          (last - segments[s].first);
+  }
+  if (flat && line_nums != -2 && end < line_nums * 512u) {
+    debug.addPadding(end, line_nums * 512u - end);
+  }
+  writeDebugFile();
+}
+
+void AssemblyParser::writeDebugFile() {
+  debug.files = {source_path};
+  for (const Symbol& symbol : symbols) {
+    if (symbol.is_label && !symbol.name.starts_with('.')) {
+      debug.labels.push_back(DebugLabel{std::string(symbol.name),
+                                        symbol.address});
+    }
+  }
+  std::stable_sort(debug.labels.begin(), debug.labels.end(),
+                   [](const DebugLabel& a, const DebugLabel& b) {
+                     return a.address < b.address;
+                   });
+  if (!writeDebugInfo(file_name + ".dbg", debug)) {
+    raiseError("Error opening file: " + file_name + ".dbg");
+  }
+  outputs.push_back(".dbg");
+}
+
+// -W: best and worst case cycles of every routine with a .budget, or of the
+// entry point if there are none. Fails if a routine can exceed its budget.
+void AssemblyParser::analyzeTiming(std::string& report) {
+  checkResolved();
+  WcetProgram program;
+  for (size_t s = 0; s < segments.size(); s++) {
+    size_t last =
+        s + 1 < segments.size() ? segments[s + 1].first : instructions.size();
+    for (size_t i = segments[s].first; i < last; i++) {
+      program.memory[addressOf(i)] = instructions[i].word;
+      program.code[addressOf(i)] = true;
+    }
+  }
+  for (const Symbol& symbol : symbols) {
+    if (symbol.is_label && !symbol.name.starts_with('.')) {
+      program.labels.emplace(symbol.address, std::string(symbol.name));
+    }
+  }
+  for (const auto& [id, bound] : loop_bounds) {
+    program.bounds[symbols[id].address] = bound;
+  }
+  std::vector<std::pair<uint16_t, uint64_t>> routines;
+  for (const auto& [id, budget] : budgets) {
+    routines.push_back(std::make_pair(symbols[id].address, budget));
+  }
+  if (routines.empty() && !instructions.empty()) {
+    routines.push_back(std::make_pair(has_entry ? entry : addressOf(0), 0));
+  }
+
+  WcetAnalyzer analyzer(program);
+  std::string over;
+  for (const auto& [address, budget] : routines) {
+    try {
+      const WcetResult& result = analyzer.analyze(address);
+      report += formatWcet(program, address, result, budget);
+      if (budget && result.worst > budget) {
+        over += "\n" + file_name + ".asm " + program.describe(address) +
+                " can take " + std::to_string(result.worst) +
+                " cycles, over its budget of " + std::to_string(budget);
+      }
+    } catch (const WcetError& e) {
+      raiseError(file_name + ".asm " + e.what());
+    }
+  }
+  if (!over.empty()) raiseError(over.substr(1));
+}
+
+// .extern labels can only be resolved by bit16-ld
+void AssemblyParser::checkResolved() {
+  for (const auto& [index, id] : label_refs) {
+    if (!symbols[id].is_label) {
+      raiseError(file_name + ".asm Undefined reference to " +
+                 std::string(symbols[id].name) +
+                 " (assemble with -r and link with bit16-ld)");
+    }
+  }
+}
+
 void AssemblyParser::outputBinary(bool clean_file, int line_nums) {
+  checkResolved();
   std::pair<std::string, std::vector<uint16_t>> output =
       getCleanOutput(line_nums);
-  if (clean_file) {
-    std::fstream cleanfile(file_name + "_clean.txt", std::fstream::out);
-    if (cleanfile.is_open()) {
-      cleanfile << output.first;
-    } else {
-      raiseError("Error opening file: " + file_name + "_clean.txt");
-    }
-    cleanfile.close();
-  }
+  if (clean_file) writeCleanFile(output.first);
+  if (debug_info) outputDebugInfo(true, line_nums);
   std::ofstream binaryfile(file_name + ".bin", std::ios::binary);
   if (binaryfile.is_open()) {
     binaryfile.write(reinterpret_cast<const char*>(output.second.data()),
-                     output.second.size());
+                     output.second.size() * sizeof(uint16_t));
     binaryfile.close();
   } else {
     raiseError("Error opening file: " + file_name + ".bin");
   }
+  outputs.push_back(".bin");
+}
+
+// Sparse image: one record per .org segment, no padding
+void AssemblyParser::outputImage(bool clean_file) {
+  checkResolved();
+  if (clean_file) writeCleanFile(getCleanOutput(-2).first);
+  if (debug_info) outputDebugInfo(false, -2);
+
+  std::vector<ImageSegment> image;
+  for (size_t s = 0; s < segments.size(); s++) {
+    size_t last =
+        s + 1 < segments.size() ? segments[s + 1].first : instructions.size();
+    if (segments[s].first == last) continue;
+    ImageSegment segment{segments[s].address, {}};
+    segment.data.reserve(last - segments[s].first);
+    for (size_t i = segments[s].first; i < last; i++) {
+      segment.data.push_back(instructions[i].word);
+    }
+    image.push_back(std::move(segment));
+  }
+
+  if (!writeImage(file_name + ".img", image, has_entry, entry)) {
+    raiseError("Error opening file: " + file_name + ".img");
+  }
+  outputs.push_back(".img");
+}
+
+uint64_t AssemblyParser::sourceHash() {
+  uint64_t hash = hashBytes(ASSEMBLER_VERSION);
+  std::string_view chunk;
+  input.rewind();
+  while (input.getChunk(chunk)) hash = hashBytes(chunk, hash);
+  input.rewind();
+  return hash;
+}
+
+// An object built from identical source by the same assembler version with the
+// same options does not need to be reassembled, unless a listing or debug file
+// asked for alongside it is missing
+bool AssemblyParser::objectUpToDate(const std::string& options,
+                                    bool clean_file, bool debug_file) {
+  uint64_t hash;
+  return readObjectHash(file_name + ".o16", hash) &&
+         hash == buildHash(options) &&
+         (!clean_file || std::filesystem::exists(file_name + "_clean.txt")) &&
+         (!debug_file || std::filesystem::exists(file_name + ".dbg"));
+}
+
+// Emit a relocatable object: label addresses are relative to the start of the
+// file and every @label expansion gets a relocation, so that bit16-ld can place
+// the code anywhere and resolve .extern references against other objects'
+// .global labels
+void AssemblyParser::outputObject(bool clean_file,
+                                  const std::string& options) {
+  std::pair<std::string, std::vector<uint16_t>> output = getCleanOutput(-2);
+  if (clean_file) writeCleanFile(output.first);
+  // object code is flat like a .bin, addresses are relative to its start
+  if (debug_info) outputDebugInfo(true, -2);
+
+  ObjectFile obj;
+  obj.source_hash = buildHash(options);
+  obj.code = output.second;
+  std::vector<uint32_t> symbol_index(symbols.size(), SymbolTable::NONE);
+  for (uint32_t id = 0; id < symbols.size(); id++) {
+    const Symbol& sym = symbols[id];
+    std::string name(sym.name);
+    if (sym.is_label) {
+      symbol_index[id] = obj.symbols.size();
+      obj.symbols.push_back(ObjectSymbol{
+          name, sym.is_global ? SYMBOL_GLOBAL : SYMBOL_LOCAL, sym.address});
+    } else if (sym.is_extern) {
+      symbol_index[id] = obj.symbols.size();
+      obj.symbols.push_back(ObjectSymbol{name, SYMBOL_UNDEFINED, 0});
+    } else if (sym.is_global) {
+      raiseError(file_name + ".asm Global symbol " + name + " is not defined");
+    }
+  }
+  for (const auto& [index, id] : label_refs) {
+    obj.relocations.push_back(
+        ObjectRelocation{addressOf(index), symbol_index[id]});
+  }
+
+  if (!writeObject(file_name + ".o16", obj)) {
+    raiseError("Error opening file: " + file_name + ".o16");
+  }
+  outputs.push_back(".o16");
+}
+
+void AssemblyParser::startStream(bool image, bool clean_file,
+                                 int line_nums) {
+  stream = std::make_unique<Stream>();
+  stream->image = image;
+  stream->line_nums = line_nums;
+  std::string output_name = file_name + (image ? ".img" : ".bin");
+  stream->out.open(output_name, std::ios::binary);
+  if (!stream->out.is_open()) {
+    raiseError("Error opening file: " + output_name);
+  }
+  if (clean_file) {
+    stream->listing.open(file_name + "_clean.txt");
+    if (!stream->listing.is_open()) {
+      raiseError("Error opening file: " + file_name + "_clean.txt");
+    }
+  }
+  // counts and the entry point are patched in by finishStream
+  if (image) putImageHeader(stream->out, false, 0, 0);
+}
+
+// Write out the pending instructions, which all belong to the last segment
+void AssemblyParser::flushStream() {
+  if (instructions.empty()) return;
+  uint16_t start = addressOf(emitted);
+  if (stream->image &&
+      (stream->segment_count == 0 || start != stream->address)) {
+    closeStreamSegment();
+    stream->segment_header = stream->out.tellp();
+    putSegmentHeader(stream->out, start, 0);
+    stream->segment_address = start;
+    stream->segment_length = 0;
+    stream->segment_count++;
+  }
+  // the gap before a .org becomes NOPs, like in getCleanOutput
+  if (debug_info && !stream->image && stream->address < start) {
+    debug.addPadding(stream->address, start - stream->address);
+  }
+  for (; stream->address < start; stream->address++) {
+    if (!stream->image) binary_io::put<uint16_t>(stream->out, OP_NOP);
+    if (stream->listing.is_open()) stream->listing << "NOP\n";
+  }
+  for (const Instruction& ins : instructions) {
+    binary_io::put<uint16_t>(stream->out, ins.word);
+    if (stream->listing.is_open()) {
+      stream->listing << disassemble(ins.word) << "\n";
+    }
+  }
+  if (debug_info) addDebugWords(start, 0, instructions.size());
+  stream->address += instructions.size();
+  stream->segment_length += instructions.size();
+  emitted += instructions.size();
+  instructions.clear();
+  source_lines.clear();
+}
+
+void AssemblyParser::closeStreamSegment() {
+  if (stream->segment_count == 0) return;
+  std::streampos end = stream->out.tellp();
+  stream->out.seekp(stream->segment_header);
+  putSegmentHeader(stream->out, stream->segment_address,
+                   stream->segment_length);
+  stream->out.seekp(end);
 }
 
+void AssemblyParser::finishStream() {
+  flushStream();
+  if (stream->image) {
+    closeStreamSegment();
+    stream->out.seekp(0);
+    putImageHeader(stream->out, has_entry, entry, stream->segment_count);
+  } else if (stream->line_nums != -2) {
+    int extra = stream->line_nums * 1024.0 * 8 / 16.0 - stream->address;
+    if (extra < 0)
+      raiseError("Specified file size" + std::to_string(stream->line_nums) +
+                 "kiB is smaller than program size " +
+                 std::to_string(stream->address * 16 / 8192) + "kiB");
+    if (debug_info) debug.addPadding(stream->address, extra);
+    for (int i = 0; i < extra; i++) {
+      binary_io::put<uint16_t>(stream->out, OP_NOP);
+      if (stream->listing.is_open()) stream->listing << "NOP\n";
+    }
+  }
+  stream->out.close();
+  bool listing = stream->listing.is_open();
+  if (listing) stream->listing.close();
+  if (stream->out.fail() || stream->listing.fail()) {
+    raiseError("Error writing output for " + file_name + ".asm");
+  }
+  if (debug_info) writeDebugFile();
+  stream->finished = true;
+  outputs.push_back(stream->image ? ".img" : ".bin");
+  if (listing) outputs.push_back("_clean.txt");
+}
+
+// a stream cut short by an error leaves no half-written output behind
 AssemblyParser::~AssemblyParser() {
-  if (file.is_open()) file.close();
-  file_content.clear();
-  current_input.clear();
+  if (stream && !stream->finished) {
+    stream->out.close();
+    std::remove((file_name + (stream->image ? ".img" : ".bin")).c_str());
+    if (stream->listing.is_open()) {
+      stream->listing.close();
+      std::remove((file_name + "_clean.txt").c_str());
+    }
+  }
 }
 
 int main(int argc, char* argv[]) {
@@ -547,18 +960,35 @@ int main(int argc, char* argv[]) {
 
   bool outputToTerminal = false;
   bool outputCleanFile = false;
+  bool relocatable = false;
+  bool outputSparseImage = false;
+  bool optimizeOutput = false;
+  bool streamOutput = false;
+  bool timingAnalysis = false;
+  std::string cache_dir;
+  bool debugInfo = false;
   int line_nums = -2;
+  unsigned int jobs = std::thread::hardware_concurrency();
 
   static struct option longOptions[] = {
       {"input-file", required_argument, 0, 'i'},
       {"bin-size", required_argument, 0, 's'},
       {"output-terminal", no_argument, 0, 'o'},
       {"output-clean", no_argument, 0, 'c'},
+      {"relocatable", no_argument, 0, 'r'},
+      {"image", no_argument, 0, 'g'},
+      {"optimize", no_argument, 0, 'O'},
+      {"stream", no_argument, 0, 'S'},
+      {"wcet", no_argument, 0, 'W'},
+      {"cache-dir", required_argument, 0, 'C'},
+      {"debug-info", no_argument, 0, 'd'},
+      {"jobs", required_argument, 0, 'j'},
       {"help", no_argument, 0, 'h'},
       {0, 0, 0, 0}};
 
   int opt;
-  while ((opt = getopt_long(argc, argv, "i:s:och", longOptions, NULL)) != -1) {
+  while ((opt = getopt_long(argc, argv, "i:s:ocrgOSWC:dj:h", longOptions,
+                            NULL)) != -1) {
     switch (opt) {
       case 'i':
         input_file_names.push_back(optarg);
@@ -578,6 +1008,36 @@ int main(int argc, char* argv[]) {
       case 'c':
         outputCleanFile = true;
         break;
+      case 'r':
+        relocatable = true;
+        break;
+      case 'g':
+        outputSparseImage = true;
+        break;
+      case 'O':
+        optimizeOutput = true;
+        break;
+      case 'S':
+        streamOutput = true;
+        break;
+      case 'W':
+        timingAnalysis = true;
+        break;
+      case 'C':
+        cache_dir = optarg;
+        break;
+      case 'd':
+        debugInfo = true;
+        break;
+      case 'j':
+        if (isdigit(optarg[0]) && std::atoi(optarg) > 0) {
+          jobs = std::atoi(optarg);
+        } else {
+          std::cerr << "Invalid job count: " << optarg << std::endl;
+          std::cerr << "Usage: -j JOBS (POSITIVE INTEGER VALUE)" << std::endl;
+          return 1;
+        }
+        break;
       case 'h':
         // Display help menu
         std::cout << "Usage: " << argv[0] << "  [options] input_file(s)..."
@@ -592,6 +1052,30 @@ int main(int argc, char* argv[]) {
         std::cout << "  -o, --output-terminal   Output to the terminal"
                   << std::endl;
         std::cout << "  -c, --output-clean      Output clean file" << std::endl;
+        std::cout << "  -r, --relocatable       Output a relocatable .o16 "
+                     "object for bit16-ld"
+                  << std::endl;
+        std::cout << "  -g, --image             Output a sparse segmented .img "
+                     "instead of a padded .bin"
+                  << std::endl;
+        std::cout << "  -O, --optimize          Remove redundant loads, no-op "
+                     "jumps and dead code"
+                  << std::endl;
+        std::cout << "  -S, --stream            Write output while assembling, "
+                     "in bounded memory"
+                  << std::endl;
+        std::cout << "  -W, --wcet              Report best/worst case cycles "
+                     "of routines, fail over .budget"
+                  << std::endl;
+        std::cout << "  -C, --cache-dir DIR     Reuse outputs of identical "
+                     "sources and options from DIR"
+                  << std::endl;
+        std::cout << "  -d, --debug-info        Write source lines and labels "
+                     "to a .dbg file"
+                  << std::endl;
+        std::cout << "  -j, --jobs JOBS         Assemble up to JOBS files in "
+                     "parallel (default: number of cores)"
+                  << std::endl;
         std::cout << "  -h, --help              Display help message"
                   << std::endl;
         return 0;
@@ -605,12 +1089,101 @@ int main(int argc, char* argv[]) {
     std::cerr << "At least one input file name is required." << std::endl;
     return 1;
   }
+  if (relocatable && outputSparseImage) {
+    std::cerr << "-r and -g are mutually exclusive." << std::endl;
+    return 1;
+  }
+  if (streamOutput && (relocatable || optimizeOutput)) {
+    // objects and the optimizer need the whole program at once
+    std::cerr << "-S cannot be combined with -r or -O." << std::endl;
+    return 1;
+  }
+  if (timingAnalysis && (streamOutput || relocatable)) {
+    // the analysis follows jumps through the whole, linked program
+    std::cerr << "-W cannot be combined with -S or -r." << std::endl;
+    return 1;
+  }
+  std::error_code cache_error;
+  if (!cache_dir.empty() &&
+      !std::filesystem::create_directories(cache_dir, cache_error) &&
+      cache_error) {
+    std::cerr << "Cannot create cache directory " << cache_dir << ": "
+              << cache_error.message() << std::endl;
+    return 1;
+  }
+  // everything besides the source that changes what gets written, part of
+  // both cache keys and object hashes
+  std::string cache_options =
+      "s=" + std::to_string(line_nums) +
+      " c=" + std::to_string(outputCleanFile) +
+      " r=" + std::to_string(relocatable) +
+      " g=" + std::to_string(outputSparseImage) +
+      " O=" + std::to_string(optimizeOutput) +
+      " d=" + std::to_string(debugInfo);
+
+  // Every file gets its own parser, so files are handed out to a bounded pool
+  // of workers. Errors are collected per file and reported in input order so
+  // the output does not depend on scheduling.
+  std::vector<std::string> errors(input_file_names.size());
+  std::vector<std::string> notes(input_file_names.size());
+  std::vector<std::string> reports(input_file_names.size());
+  std::atomic<size_t> next_file{0};
+  auto worker = [&]() {
+    for (size_t i = next_file++; i < input_file_names.size();
+         i = next_file++) {
+      try {
+        AssemblyParser parser(input_file_names[i]);
+        if (relocatable &&
+            parser.objectUpToDate(cache_options, outputCleanFile, debugInfo)) {
+          notes[i] = " up to date";
+          continue;
+        }
+        if (debugInfo) parser.enableDebugInfo();
+        // a cache hit would skip the analysis
+        if (!cache_dir.empty() && !timingAnalysis &&
+            parser.restoreFromCache(cache_dir, cache_options)) {
+          notes[i] = " cached";
+          continue;
+        }
+        if (relocatable || optimizeOutput) parser.labelsMayMove(relocatable);
+        if (streamOutput) {
+          parser.startStream(outputSparseImage, outputCleanFile, line_nums);
+        }
+        parser.parseFile();
+        if (optimizeOutput) parser.optimize();
+        if (timingAnalysis) parser.analyzeTiming(reports[i]);
+        if (streamOutput) {
+          // already written while parsing
+        } else if (relocatable) {
+          parser.outputObject(outputCleanFile, cache_options);
+        } else if (outputSparseImage) {
+          parser.outputImage(outputCleanFile);
+        } else {
+          parser.outputBinary(outputCleanFile, line_nums);
+        }
+        if (!cache_dir.empty()) parser.storeInCache(cache_dir, cache_options);
+      } catch (const AssemblyError& e) {
+        errors[i] = e.what();
+      }
+    }
+  };
 
-  for (const std::string& file_name : input_file_names) {
-    AssemblyParser parser(file_name);
-    parser.parseFile();
-    parser.outputBinary(outputCleanFile, line_nums);
+  jobs = std::clamp<size_t>(jobs, 1, input_file_names.size());
+  std::vector<std::thread> workers;
+  for (unsigned int i = 1; i < jobs; i++) workers.emplace_back(worker);
+  worker();
+  for (std::thread& t : workers) t.join();
+
+  int status = 0;
+  for (size_t i = 0; i < input_file_names.size(); i++) {
+    std::cout << "Processing " << input_file_names[i] << "..."
+              << notes[i] << std::endl;
+    std::cout << reports[i];
+    if (!errors[i].empty()) {
+      std::cerr << errors[i] << std::endl;
+      status = 1;
+    }
   }
 
-  return 0;
+  return status;
 }
\ No newline at end of file
@@ -6,107 +6,161 @@
 #include <fstream>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <set>
+#include <stdexcept>
 #include <vector>
 
 #include "../common/common.h"
+#include "../common/debugInfo.h"
+#include "../common/image.h"
+#include "../common/object.h"
+#include "../common/wcet.h"
+#include "expression.h"
+#include "lineReader.h"
+#include "symbolTable.h"
 
-const std::set<std::string> register_set = {"A", "B",  "C",  "D",
-                                            "E", "SR", "HL", "F"};
+// part of every source fingerprint, bump when the output format changes
+constexpr std::string_view ASSEMBLER_VERSION = "bit16-asm 1";
+
+// Errors are thrown instead of exiting so that several files can be assembled
+// concurrently and a bad file does not take the others down with it
+struct AssemblyError : std::runtime_error {
+  using std::runtime_error::runtime_error;
+};
 
 class AssemblyParser {
  public:
   AssemblyParser(const std::string& file_name);
   void parseFile();
-  void skip();
+  void skip(std::string& line);
+  void startStream(bool image, bool clean_file, int line_nums);
+  void enableDebugInfo() { debug_info = true; }
+  // addresses change after assembly, so labels are only used through fixups:
+  // relocated MWH/MWL pairs, or with -O alone, which only moves labels down,
+  // also bytes of pseudo-instructions. relocatable for -r, where the linker
+  // can move them anywhere.
+  void labelsMayMove(bool relocatable) {
+    labels_move = true;
+    labels_relocate = relocatable;
+  }
   void outputBinary(bool clean_file, int line_nums);
+  void outputObject(bool clean_file, const std::string& options);
+  void outputImage(bool clean_file);
+  void optimize();
+  void analyzeTiming(std::string& report);
+  bool objectUpToDate(const std::string& options, bool clean_file,
+                      bool debug_file);
+  bool restoreFromCache(const std::string& cache_dir,
+                        const std::string& options);
+  void storeInCache(const std::string& cache_dir, const std::string& options);
   std::pair<std::string, std::vector<uint16_t>> getCleanOutput(int line_nums);
   ~AssemblyParser();
 
  private:
-  std::ifstream file;
-  std::string file_name;
-  std::string file_content, current_input;
-  std::map<std::string, uint16_t> labels;
-  std::map<std::string, uint8_t> constants;
+  LineReader input;
+  std::string file_name, source_path;
+  SymbolTable symbols;
   std::vector<Instruction> instructions;
+  // where each instruction came from, kept alongside instructions
+  struct SourceLine {
+    uint32_t line;
+    bool label_ref;
+  };
+  std::vector<SourceLine> source_lines;
+  // instructions already written out by a stream and dropped from the list,
+  // indices below count them as if they were still there
+  size_t emitted = 0;
+  // (index of the MWH instruction, symbol) for every @label expansion
+  std::vector<std::pair<uint32_t, uint32_t>> label_refs;
+  // (index, symbol) of every instruction whose imm8 is the address of a label
+  // -O may still move, see labelsMayMove
+  std::vector<std::pair<uint32_t, uint32_t>> byte_refs;
+  // .org starts a new segment at address, beginning with instruction first.
+  // Nothing is stored for the gap, it only becomes NOPs in a flat .bin
+  struct Segment {
+    uint16_t address;
+    size_t first;
+  };
+  std::vector<Segment> segments = {Segment{0, 0}};
+  // .bound and .budget annotations, (label symbol, value)
+  std::vector<std::pair<uint32_t, uint64_t>> loop_bounds, budgets;
+  bool has_entry = false;
+  bool labels_move = false;
+  bool labels_relocate = false;
+  // forms of every pseudo-instruction in source order, see lowerPseudo
+  std::vector<uint8_t> pseudo_forms;
+  size_t pseudo_count = 0;
+  // pass 1: symbols defined so far in this round, and whether an expression
+  // used a symbol before its definition
+  std::vector<char> defined;
+  bool forward_refs = false;
+  uint16_t entry = 0;
+  uint32_t entry_symbol = SymbolTable::NONE;
 
-  // convert the hexadecimal value of register to the corresponding notation
-  std::string bitToReg(uint16_t reg) {
-    if (reg == 0x0) return "A";
-    if (reg == 0x1) return "B";
-    if (reg == 0x2) return "C";
-    if (reg == 0x3) return "D";
-    if (reg == 0x4) return "E";
-    if (reg == 0x5) return "SR";
-    if (reg == 0x6) return "HL";
-    if (reg == 0x7) return "F";
-    raiseError("Unknown Register Code " + file_name);
-    return 0;
-  }
+  // Streaming output (-S): code is written as soon as it is assembled, so
+  // only the symbol table and the current chunk of instructions are kept
+  struct Stream {
+    bool image;
+    int line_nums;
+    std::ofstream out, listing;
+    uint32_t address = 0;  // next address to be written
+    // .img only: open segment and where its header is
+    uint32_t segment_count = 0, segment_length = 0;
+    uint16_t segment_address = 0;
+    std::streampos segment_header;
+    bool finished = false;
+  };
+  std::unique_ptr<Stream> stream;
+  bool debug_info = false;
+  DebugInfo debug;
+  // suffixes of the files written so far, see storeInCache
+  std::vector<std::string> outputs;
+  static constexpr size_t STREAM_CHUNK = 4096;  // instructions per write
 
-  // convert the register notation to corresponding hexadecimal value
-  uint8_t regToBit(std::string reg) {
-    if (reg == "A") return 0x0;
-    if (reg == "B") return 0x1;
-    if (reg == "C") return 0x2;
-    if (reg == "D") return 0x3;
-    if (reg == "E") return 0x4;
-    if (reg == "SR") return 0x5;
-    if (reg == "HL") return 0x6;
-    if (reg == "F") return 0x7;
-    return 0xff;  // to catch errors;
+  bool optimizePass(std::vector<char>& removed);
+  void removeInstructions(const std::vector<char>& removed);
+  uint16_t addressOf(size_t index);
+  void layout();
+  void layoutRound();
+  void defineSymbol(uint32_t id, uint32_t line);
+  ExprValue lookupSymbol(std::string_view name, bool final);
+  ExprValue evaluate(const std::string& text, uint32_t line, bool final);
+  int64_t evaluateRange(const std::string& text, uint32_t line, int64_t min,
+                        int64_t max, const std::string& message);
+  size_t lowerPseudo(const std::string& mnemonic,
+                     const std::vector<std::string>& operands, uint32_t line,
+                     uint16_t address, bool final);
+  void emitLoadHL(uint32_t line, ExprValue value, bool long_form);
+  size_t position() { return emitted + instructions.size(); }
+  void flushStream();
+  void closeStreamSegment();
+  void finishStream();
+  void checkResolved();
+  void emit(uint32_t line, const Instruction& ins, bool label_ref = false) {
+    instructions.push_back(ins);
+    source_lines.push_back(SourceLine{line, label_ref});
   }
+  void addDebugWords(uint16_t address, size_t first, size_t last);
+  void outputDebugInfo(bool flat, int line_nums);
+  void writeDebugFile();
+  void writeCleanFile(const std::string& listing);
+  uint64_t sourceHash();
+  // sourceHash together with the options that change the output
+  uint64_t buildHash(const std::string& options) {
+    return hashBytes(options, sourceHash());
+  }
+  std::string cachePath(const std::string& cache_dir,
+                        const std::string& options);
 
-  // convert string to immediate
-  uint8_t stringToImm8(std::string input, const std::string message = "") {
-    // std::istringstream iss(v);
-    // int intValue;
-    // if (iss >> intValue) {
-    //   if (intValue >= 0 && intValue <= 255) {
-    //     uint8_t uint8Value = static_cast<uint8_t>(intValue);
-    //     return uint8Value;
-    //   } else {
-    //     raiseError("Value is out of range for uint8_t");
-    //   }
-    // } else {
-    //   raiseError("Conversion from string to integer failed");
-    // }
-    // return 1;
-    try {
-      size_t pos;
-      uint8_t value = std::stoul(
-          input, &pos, 0);  // The '0' parameter allows automatic base detection
+  void raiseError(const std::string& msg) { throw AssemblyError(msg); }
 
-      if (pos == input.length()) {
-        return value;
-      } else {
-        raiseError(message);
-      }
-    } catch (const std::invalid_argument& e) {
-      raiseError(message);
-    } catch (const std::out_of_range& e) {
-      raiseError(message);
-    }
-    return 1;
+  // convert the register notation to corresponding hexadecimal value
+  uint8_t regToBit(const std::string& reg) {
+    return findRegister(reg);  // REG_INVALID to catch errors
   }
 
-  uint16_t stringToImm16(std::string input, const std::string message = "") {
-    try {
-      size_t pos;
-      uint16_t value = std::stoul(
-          input, &pos, 0);  // The '0' parameter allows automatic base detection
-
-      if (pos == input.length()) {
-        return value;
-      } else {
-        raiseError(message);
-      }
-    } catch (const std::invalid_argument& e) {
-      raiseError(message);
-    } catch (const std::out_of_range& e) {
-      raiseError(message);
-    }
-    return 1;
+  bool isRegister(const std::string& reg) {
+    return findRegister(reg) != REG_INVALID;
   }
 };
\ No newline at end of file
@@ -0,0 +1,106 @@
+// Content-addressed output cache (--cache-dir)
+//
+// An entry is keyed by the source fingerprint (source text and assembler
+// version, see sourceHash) together with the options that change the output,
+// plus the source path with -d as .dbg files name their source, and holds
+// every file written for it:
+//   "B16C" u16 version u32 file_count
+//   file: u16 suffix_length char suffix[suffix_length] u32 size char data[size]
+//
+// Entries are written to a temporary file and renamed into place, so builds
+// sharing a cache directory never see a partial entry. A missing or damaged
+// entry is a miss, and failing to store one never fails the build.
+#include <unistd.h>
+
+#include <filesystem>
+#include <thread>
+
+#include "assemblyParser.h"
+
+namespace {
+
+constexpr char CACHE_MAGIC[4] = {'B', '1', '6', 'C'};
+constexpr uint16_t CACHE_VERSION = 1;
+
+}  // namespace
+
+std::string AssemblyParser::cachePath(const std::string& cache_dir,
+                                      const std::string& options) {
+  uint64_t hash = buildHash(options);
+  if (debug_info) hash = hashBytes(source_path, hash);
+  std::ostringstream key;
+  key << std::hex << std::setw(16) << std::setfill('0') << hash;
+  return cache_dir + "/" + key.str() + ".b16c";
+}
+
+bool AssemblyParser::restoreFromCache(const std::string& cache_dir,
+                                      const std::string& options) {
+  using namespace binary_io;
+  std::ifstream in(cachePath(cache_dir, options), std::ios::binary);
+  char magic[sizeof(CACHE_MAGIC)];
+  if (!in.read(magic, sizeof(magic)) ||
+      std::string(magic, sizeof(magic)) !=
+          std::string(CACHE_MAGIC, sizeof(CACHE_MAGIC)) ||
+      get<uint16_t>(in) != CACHE_VERSION)
+    return false;
+  uint32_t file_count = get<uint32_t>(in);
+  if (!in) return false;
+  // counts of a damaged entry must not allocate more than the entry can hold:
+  // a file takes at least 6 bytes
+  std::streamoff header = in.tellg();
+  in.seekg(0, std::ios::end);
+  std::streamoff end = in.tellg();
+  in.seekg(header);
+  if (uint64_t(file_count) * 6 > uint64_t(end - header)) return false;
+  std::vector<std::pair<std::string, std::string>> files(file_count);
+  for (auto& [suffix, data] : files) {
+    suffix.resize(get<uint16_t>(in));
+    in.read(suffix.data(), suffix.size());
+    uint32_t size = get<uint32_t>(in);
+    if (!in || size > uint64_t(end - in.tellg())) return false;
+    data.resize(size);
+    in.read(data.data(), data.size());
+    if (!in) return false;
+  }
+
+  for (const auto& [suffix, data] : files) {
+    std::ofstream out(file_name + suffix, std::ios::binary);
+    if (!out.write(data.data(), data.size())) {
+      raiseError("Error opening file: " + file_name + suffix);
+    }
+  }
+  return true;
+}
+
+void AssemblyParser::storeInCache(const std::string& cache_dir,
+                                  const std::string& options) {
+  using namespace binary_io;
+  std::string path = cachePath(cache_dir, options);
+  std::string temp = path + ".tmp" + std::to_string(getpid()) + "." +
+                     std::to_string(std::hash<std::thread::id>{}(
+                         std::this_thread::get_id()));
+  {
+    std::ofstream out(temp, std::ios::binary);
+    out.write(CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    put<uint16_t>(out, CACHE_VERSION);
+    put<uint32_t>(out, outputs.size());
+    for (const std::string& suffix : outputs) {
+      std::ifstream in(file_name + suffix, std::ios::binary);
+      using Iterator = std::istreambuf_iterator<char>;
+      std::string data(Iterator{in}, Iterator{});
+      put<uint16_t>(out, suffix.size());
+      out.write(suffix.data(), suffix.size());
+      put<uint32_t>(out, data.size());
+      out.write(data.data(), data.size());
+    }
+    if (!out) {
+      out.close();
+      std::error_code error;
+      std::filesystem::remove(temp, error);
+      return;
+    }
+  }
+  std::error_code error;
+  std::filesystem::rename(temp, path, error);
+  if (error) std::filesystem::remove(temp, error);
+}
@@ -0,0 +1,208 @@
+#pragma once
+
+#include <cctype>
+#include <cstdint>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#include "symbolTable.h"
+
+// Compile-time expressions in operands, const and directives: numbers,
+// constants, labels, hi()/lo() and the C operators
+//   unary - ~ +    * / %    + -    << >>    &    ^    |
+// with C precedence, evaluated in 64 bits.
+
+struct ExpressionError : std::runtime_error {
+  using std::runtime_error::runtime_error;
+};
+
+struct ExprValue {
+  int64_t value = 0;
+  // a label whose address can still change (relocatable objects, -O) or an
+  // .extern. It can only be used as it is, through a relocated MWH/MWL pair or
+  // with -O a patched byte.
+  uint32_t symbol = SymbolTable::NONE;
+
+  bool movable() const { return symbol != SymbolTable::NONE; }
+};
+
+class ExpressionParser {
+ public:
+  using Lookup = std::function<ExprValue(std::string_view name)>;
+
+  // A tentative evaluation (not final) is made while the layout is still
+  // being worked out: it never fails on values, division by zero gives 0
+  ExpressionParser(std::string_view text, const Lookup& lookup, bool final)
+      : text(text), lookup(lookup), final(final) {}
+
+  ExprValue parse() {
+    ExprValue value = binary(1);
+    skipSpace();
+    if (pos != text.size()) {
+      fail("Unexpected '" + std::string(text.substr(pos)) + "'");
+    }
+    return value;
+  }
+
+ private:
+  std::string_view text;
+  Lookup lookup;
+  bool final;
+  size_t pos = 0;
+
+  [[noreturn]] void fail(const std::string& message) {
+    throw ExpressionError(message + " in expression: " + std::string(text));
+  }
+
+  void skipSpace() {
+    while (pos < text.size() && std::isspace((unsigned char)text[pos])) pos++;
+  }
+
+  static bool isNameChar(char c) {
+    return std::isalnum((unsigned char)c) || c == '_' || c == '.' || c == '$';
+  }
+
+  // the operator at pos and its precedence level, 0 if there is none
+  std::pair<std::string_view, int> peekOperator() {
+    static constexpr std::pair<std::string_view, int> operators[] = {
+        {"<<", 4}, {">>", 4}, {"|", 1}, {"^", 2}, {"&", 3}, {"+", 5},
+        {"-", 5},  {"*", 6},  {"/", 6}, {"%", 6}};
+    for (const auto& op : operators) {
+      if (text.substr(pos, op.first.size()) == op.first) return op;
+    }
+    return {"", 0};
+  }
+
+  void checkFixed(const ExprValue& value) {
+    if (value.movable()) {
+      fail("Label arithmetic needs fixed addresses (not available with -r "
+           "or -O)");
+    }
+  }
+
+  ExprValue binary(int min_level) {
+    ExprValue left = unary();
+    while (true) {
+      skipSpace();
+      auto [op, level] = peekOperator();
+      if (level == 0 || level < min_level) return left;
+      pos += op.size();
+      ExprValue right = binary(level + 1);
+      checkFixed(left);
+      checkFixed(right);
+      int64_t a = left.value, b = right.value;
+      switch (op[0]) {
+        case '|':
+          a |= b;
+          break;
+        case '^':
+          a ^= b;
+          break;
+        case '&':
+          a &= b;
+          break;
+        case '+':
+          a += b;
+          break;
+        case '-':
+          a -= b;
+          break;
+        case '*':
+          a *= b;
+          break;
+        case '/':
+        case '%':
+          if (b == 0) {
+            if (final) fail("Division by zero");
+            a = 0;
+          } else {
+            a = op[0] == '/' ? a / b : a % b;
+          }
+          break;
+        default:  // shifts
+          if (b < 0 || b > 63) {
+            if (final) fail("Invalid shift");
+            b = 0;
+          }
+          a = op[0] == '<' ? a << b : a >> b;
+          break;
+      }
+      left = ExprValue{a};
+    }
+  }
+
+  ExprValue unary() {
+    skipSpace();
+    if (pos < text.size() &&
+        (text[pos] == '-' || text[pos] == '~' || text[pos] == '+')) {
+      char op = text[pos++];
+      ExprValue value = unary();
+      if (op == '+') return value;
+      checkFixed(value);
+      return ExprValue{op == '-' ? -value.value : ~value.value};
+    }
+    return primary();
+  }
+
+  ExprValue primary() {
+    skipSpace();
+    if (pos == text.size()) fail("Missing value");
+    if (text[pos] == '(') {
+      pos++;
+      ExprValue value = binary(1);
+      expect(')');
+      return value;
+    }
+    if (std::isdigit((unsigned char)text[pos])) return number();
+    size_t start = pos;
+    while (pos < text.size() && isNameChar(text[pos])) pos++;
+    if (start == pos) {
+      fail("Unexpected '" + std::string(text.substr(pos)) + "'");
+    }
+    std::string_view name = text.substr(start, pos - start);
+    skipSpace();
+    if ((name == "hi" || name == "lo") && pos < text.size() &&
+        text[pos] == '(') {
+      pos++;
+      ExprValue value = binary(1);
+      expect(')');
+      checkFixed(value);
+      return ExprValue{name == "hi" ? (value.value >> 8) & 0xff
+                                    : value.value & 0xff};
+    }
+    return lookup(name);
+  }
+
+  // decimal, 0x hexadecimal, 0b binary or 0 octal
+  ExprValue number() {
+    size_t start = pos;
+    while (pos < text.size() && std::isalnum((unsigned char)text[pos])) pos++;
+    std::string digits(text.substr(start, pos - start));
+    int base = 0;
+    size_t skip = 0;
+    if (digits.size() > 2 && digits[0] == '0' &&
+        (digits[1] == 'b' || digits[1] == 'B')) {
+      base = 2;
+      skip = 2;
+    }
+    try {
+      size_t used;
+      uint64_t value = std::stoull(digits.substr(skip), &used, base);
+      if (used == digits.size() - skip && value <= INT64_MAX) {
+        return ExprValue{int64_t(value)};
+      }
+    } catch (const std::logic_error&) {
+    }
+    fail("Invalid number '" + digits + "'");
+  }
+
+  void expect(char c) {
+    skipSpace();
+    if (pos == text.size() || text[pos] != c) {
+      fail(std::string("Expected '") + c + "'");
+    }
+    pos++;
+  }
+};
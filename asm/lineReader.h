@@ -0,0 +1,65 @@
+#pragma once
+
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Reads a file line by line through a fixed-size buffer, so that no more than
+// the buffer and the current line are ever held in memory. Lines are split
+// like std::getline: a trailing newline does not start an empty last line.
+class LineReader {
+ public:
+  explicit LineReader(const std::string& file_name)
+      : file(file_name, std::ios_base::binary | std::ios_base::in),
+        buffer(BUFFER_SIZE) {}
+
+  bool is_open() const { return file.is_open(); }
+  bool failed() const { return file.bad(); }
+
+  bool getline(std::string& line) {
+    line.clear();
+    bool extracted = false;
+    while (true) {
+      if (pos == end && !fill()) return extracted;
+      extracted = true;
+      auto first = buffer.begin() + pos, last = buffer.begin() + end;
+      auto newline = std::find(first, last, '\n');
+      line.append(first, newline);
+      if (newline != last) {
+        pos = newline - buffer.begin() + 1;
+        return true;
+      }
+      pos = end;
+    }
+  }
+
+  // hands out the rest of the file a buffer at a time
+  bool getChunk(std::string_view& chunk) {
+    if (pos == end && !fill()) return false;
+    chunk = std::string_view(buffer.data() + pos, end - pos);
+    pos = end;
+    return true;
+  }
+
+  // start over from the beginning of the file, for the next pass
+  void rewind() {
+    file.clear();
+    file.seekg(0);
+    pos = end = 0;
+  }
+
+ private:
+  static constexpr size_t BUFFER_SIZE = 64 * 1024;
+  std::ifstream file;
+  std::vector<char> buffer;
+  size_t pos = 0, end = 0;
+
+  bool fill() {
+    file.read(buffer.data(), buffer.size());
+    pos = 0;
+    end = file.gcount();
+    return end > 0;
+  }
+};
@@ -0,0 +1,339 @@
+// Peephole optimizer (-O)
+//
+// Works on straight-line code between leaders (labels and .org segment
+// starts), so control can only enter a block at its first instruction. Jumps
+// are assumed to go through labels: code that jumps to hand-computed addresses
+// must not be assembled with -O, since removed instructions move everything
+// after them within their .org segment.
+#include <optional>
+
+#include "assemblyParser.h"
+
+namespace {
+
+// HL is tracked as two bytes so that MWH and MWL can be reasoned about on
+// their own
+constexpr int HL_HIGH = 8;
+constexpr int HL_LOW = 9;
+constexpr uint16_t ALL_REGISTERS = (1 << 10) - 1;
+constexpr uint16_t HL_BOTH = (1 << HL_HIGH) | (1 << HL_LOW);
+
+uint16_t registerBit(uint8_t reg) {
+  return reg == REG_HL ? HL_BOTH : 1 << reg;
+}
+
+struct Effects {
+  uint16_t reads;
+  uint16_t writes;
+  bool keep;  // touches memory, the stack or the PC, never removed as dead
+};
+
+Effects effects(const Instruction& ins) {
+  InstructionParams p1 = ins.param1(), p2 = ins.param2();
+  uint16_t reg1 = registerBit(p1.reg);
+  uint16_t src = p2.choice ? 0 : registerBit(p2.reg);
+  uint16_t flags = registerBit(REG_F);
+  // SR selects the memory bank or the ports LW and SW go to
+  uint16_t bank = registerBit(REG_SR);
+  switch (ins.opcode()) {
+    case OP_MW:
+      return {src, reg1, false};
+    case OP_MWL:
+      return {0, 1 << HL_LOW, false};
+    case OP_MWH:
+      return {0, 1 << HL_HIGH, false};
+    case OP_LW:
+      return {uint16_t(src | bank), reg1, true};
+    case OP_SW:
+      return {uint16_t((p1.choice ? 0 : reg1) | src | bank), 0, true};
+    case OP_ADD:
+    case OP_SUB:
+    case OP_AND:
+      return {uint16_t(reg1 | src), uint16_t(reg1 | flags), false};
+    case OP_ADDC:
+      return {uint16_t(reg1 | src | flags), uint16_t(reg1 | flags), false};
+    case OP_NOT:
+      return {src, uint16_t(reg1 | flags), false};
+    case OP_PUSH:
+      return {uint16_t(p1.choice ? 0 : reg1), 0, true};
+    case OP_POP:
+      return {0, reg1, true};
+    case OP_NOP:
+      return {0, 0, true};
+    default:  // HALT, JMPZ, JMPN: everything is observable afterwards
+      return {ALL_REGISTERS, 0, true};
+  }
+}
+
+// HL byte tokens, so that values from @label expansions can be compared
+// without knowing the final layout: 0-255 is a constant byte, labelToken() the
+// high/low byte of a label and UNKNOWN is unknown.
+constexpr int64_t UNKNOWN = -1;
+
+int64_t labelToken(uint32_t symbol, bool high) {
+  return 0x100 + 2 * int64_t(symbol) + (high ? 0 : 1);
+}
+
+// Known register contents within a block
+struct BlockState {
+  std::optional<uint16_t> regs[8];
+  int64_t hl_high = UNKNOWN, hl_low = UNKNOWN;
+
+  void clear() { *this = BlockState(); }
+
+  void setRegister(uint8_t reg, std::optional<uint16_t> value) {
+    regs[reg] = value;
+    if (reg == REG_HL) {
+      hl_high = value ? *value >> 8 : UNKNOWN;
+      hl_low = value ? *value & 0xff : UNKNOWN;
+    }
+  }
+
+  void setHL(bool high, int64_t token) {
+    (high ? hl_high : hl_low) = token;
+    if (hl_high >= 0 && hl_high <= 0xff && hl_low >= 0 && hl_low <= 0xff) {
+      regs[REG_HL] = hl_high << 8 | hl_low;
+    } else {
+      regs[REG_HL].reset();
+    }
+  }
+};
+
+}  // namespace
+
+// Marks removable instructions, rewrites foldable ones in place. Returns
+// whether anything changed.
+bool AssemblyParser::optimizePass(std::vector<char>& removed) {
+  size_t n = instructions.size();
+  std::vector<char> leader(n + 1, false);
+  for (const Segment& segment : segments) leader[segment.first] = true;
+  for (const Symbol& symbol : symbols) {
+    if (symbol.is_label) leader[symbol.target] = true;
+  }
+  std::map<size_t, uint32_t> ref_at, byte_at;
+  for (const auto& [index, id] : label_refs) ref_at[index] = id;
+  for (const auto& [index, id] : byte_refs) byte_at[index] = id;
+
+  bool changed = false;
+  auto remove = [&](size_t i) {
+    removed[i] = true;
+    changed = true;
+  };
+  // F is dead after i if it is overwritten before it is read in this block
+  auto flagsLive = [&](size_t i) {
+    for (size_t j = i + 1; j < n && !leader[j]; j++) {
+      if (removed[j]) continue;
+      Effects e = effects(instructions[j]);
+      if (e.reads & registerBit(REG_F)) return true;
+      if (e.writes & registerBit(REG_F)) return false;
+    }
+    return true;
+  };
+
+  // forward: constant propagation, redundant loads, folding, branches
+  BlockState state;
+  bool reachable = true;
+  for (size_t i = 0; i < n; i++) {
+    if (leader[i]) {
+      state.clear();
+      reachable = true;
+    }
+    if (!reachable) {
+      remove(i);
+      continue;
+    }
+    Instruction& ins = instructions[i];
+    InstructionParams p1 = ins.param1(), p2 = ins.param2();
+    uint8_t opcode = ins.opcode();
+
+    if (ref_at.contains(i)) {
+      // an @label expansion is kept or dropped as a whole so that its
+      // relocation stays a MWH/MWL pair
+      uint32_t id = ref_at[i];
+      if (state.hl_high == labelToken(id, true) &&
+          state.hl_low == labelToken(id, false)) {
+        remove(i);
+        remove(i + 1);
+      }
+      state.setHL(true, labelToken(id, true));
+      state.setHL(false, labelToken(id, false));
+      i++;
+      continue;
+    }
+    if (opcode == OP_MW && byte_at.contains(i)) {
+      // a label address in a byte, its high byte is the label's too
+      uint32_t id = byte_at[i];
+      if (p1.reg != REG_HL) {
+        state.setRegister(p1.reg, std::nullopt);
+      } else if (state.hl_high == labelToken(id, true) &&
+                 state.hl_low == labelToken(id, false)) {
+        remove(i);
+      } else {
+        state.setHL(true, labelToken(id, true));
+        state.setHL(false, labelToken(id, false));
+      }
+      continue;
+    }
+
+    switch (opcode) {
+      case OP_MW: {
+        std::optional<uint16_t> value =
+            p2.choice ? std::optional<uint16_t>(p2.imm8) : state.regs[p2.reg];
+        if ((!p2.choice && p2.reg == p1.reg) ||
+            (value && state.regs[p1.reg] == value)) {
+          remove(i);
+        } else {
+          state.setRegister(p1.reg, value);
+        }
+        break;
+      }
+      case OP_MWH:
+      case OP_MWL: {
+        bool high = opcode == OP_MWH;
+        if ((high ? state.hl_high : state.hl_low) == p1.imm8) {
+          remove(i);
+        } else {
+          state.setHL(high, p1.imm8);
+        }
+        break;
+      }
+      case OP_LW:
+      case OP_POP:
+        state.setRegister(p1.reg, std::nullopt);
+        break;
+      case OP_ADD:
+      case OP_SUB:
+      case OP_AND:
+      case OP_ADDC:
+      case OP_NOT: {
+        std::optional<uint16_t> a = state.regs[p1.reg];
+        std::optional<uint16_t> b =
+            p2.choice ? std::optional<uint16_t>(p2.imm8) : state.regs[p2.reg];
+        std::optional<uint16_t> flags = state.regs[REG_F];
+        if ((a || opcode == OP_NOT) && b && (flags || opcode != OP_ADDC)) {
+          AluResult result =
+              executeAlu(opcode, a.value_or(0), *b, flags.value_or(0));
+          if (result.value <= 0xff && !flagsLive(i)) {
+            // nobody looks at the flags, a plain load does the same
+            ins = Instruction(OP_MW, p1, InstructionParams(0, result.value, 1));
+            changed = true;
+          } else {
+            state.setRegister(REG_F, result.flags);
+          }
+          state.setRegister(p1.reg, result.value);
+        } else {
+          state.setRegister(REG_F, std::nullopt);
+          state.setRegister(p1.reg, std::nullopt);
+        }
+        break;
+      }
+      case OP_JMPZ:
+      case OP_JMPN: {
+        std::optional<uint16_t> value =
+            p1.choice ? std::optional<uint16_t>(p1.imm8) : state.regs[p1.reg];
+        std::optional<bool> taken;
+        if (value) {
+          taken = opcode == OP_JMPZ ? *value == 0 : (*value & 0x8000);
+        }
+        // the target is the HL value, only known symbolically for labels
+        bool to_next = false;
+        if (state.hl_high > 0xff && state.hl_low == state.hl_high + 1) {
+          const Symbol& label = symbols[(state.hl_high - 0x100) / 2];
+          to_next = label.is_label && label.target == i + 1;
+        }
+        if ((taken && !*taken) || to_next) {
+          remove(i);
+        } else if (taken) {
+          reachable = false;
+        }
+        break;
+      }
+      case OP_HALT:
+        reachable = false;
+        break;
+      default:
+        break;
+    }
+  }
+
+  // backward: drop register writes that are overwritten before being read.
+  // Everything is live at the end of a block.
+  std::set<size_t> pair_low;
+  for (const auto& [index, id] : label_refs) pair_low.insert(index + 1);
+  uint16_t live = ALL_REGISTERS;
+  for (size_t i = n; i-- > 0;) {
+    if (leader[i + 1]) live = ALL_REGISTERS;
+    if (removed[i] || pair_low.contains(i)) continue;
+    if (ref_at.contains(i)) {
+      if (!(live & HL_BOTH)) {
+        remove(i);
+        remove(i + 1);
+      }
+      live &= ~HL_BOTH;
+      continue;
+    }
+    Effects e = effects(instructions[i]);
+    if (!e.keep && !(e.writes & live)) {
+      remove(i);
+      continue;
+    }
+    live = (live & ~e.writes) | e.reads;
+  }
+
+  return changed;
+}
+
+// Compact the instruction list and lay the labels out again. Segments keep
+// their .org address and shrink from the end.
+void AssemblyParser::removeInstructions(const std::vector<char>& removed) {
+  size_t n = instructions.size();
+  std::vector<size_t> new_index(n + 1);
+  size_t kept = 0;
+  for (size_t i = 0; i < n; i++) {
+    new_index[i] = kept;
+    if (!removed[i]) {
+      source_lines[kept] = source_lines[i];
+      instructions[kept++] = std::move(instructions[i]);
+    }
+  }
+  new_index[n] = kept;
+  instructions.erase(instructions.begin() + kept, instructions.end());
+  source_lines.erase(source_lines.begin() + kept, source_lines.end());
+
+  for (Segment& segment : segments) segment.first = new_index[segment.first];
+  for (Symbol& symbol : symbols) {
+    if (!symbol.is_label) continue;
+    symbol.target = new_index[symbol.target];
+    symbol.address = addressOf(symbol.target);
+  }
+  std::vector<std::pair<uint32_t, uint32_t>> refs;
+  for (const auto& [index, id] : label_refs) {
+    if (removed[index]) continue;
+    refs.push_back(std::make_pair(new_index[index], id));
+  }
+  label_refs = refs;
+  for (const auto& [index, id] : label_refs) {
+    uint16_t address = symbols[id].is_label ? symbols[id].address : 0;
+    instructions[index].setImm8(address >> 8);
+    instructions[index + 1].setImm8(address & 0xff);
+  }
+  // labels only move down, so those addresses still fit
+  refs.clear();
+  for (const auto& [index, id] : byte_refs) {
+    if (removed[index]) continue;
+    refs.push_back(std::make_pair(new_index[index], id));
+    instructions[new_index[index]].setImm8(symbols[id].address);
+  }
+  byte_refs = refs;
+  if (entry_symbol != SymbolTable::NONE) {
+    entry = symbols[entry_symbol].address;
+  }
+}
+
+void AssemblyParser::optimize() {
+  for (int pass = 0; pass < 16; pass++) {
+    std::vector<char> removed(instructions.size(), false);
+    if (!optimizePass(removed)) break;
+    removeInstructions(removed);
+  }
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+#include "../common/common.h"
+
+// Bump allocator for symbol names, everything is freed at once with the table
+class StringArena {
+ public:
+  std::string_view store(std::string_view s) {
+    if (s.size() > left) {
+      // oversized names get a block of their own
+      size_t size = std::max(BLOCK_SIZE, s.size());
+      blocks.push_back(std::make_unique<char[]>(size));
+      if (size > BLOCK_SIZE) {
+        std::copy(s.begin(), s.end(), blocks.back().get());
+        return std::string_view(blocks.back().get(), s.size());
+      }
+      current = blocks.back().get();
+      left = size;
+    }
+    char* stored = current;
+    std::copy(s.begin(), s.end(), stored);
+    current += s.size();
+    left -= s.size();
+    return std::string_view(stored, s.size());
+  }
+
+ private:
+  static constexpr size_t BLOCK_SIZE = 64 * 1024;
+  std::vector<std::unique_ptr<char[]>> blocks;
+  char* current = nullptr;
+  size_t left = 0;
+};
+
+// Everything the assembler knows about a name. Labels, constants and
+// .global/.extern declarations share one entry per name.
+struct Symbol {
+  std::string_view name;
+  bool is_label = false;
+  bool is_constant = false;
+  bool is_global = false;
+  bool is_extern = false;
+  uint16_t address = 0;  // label address
+  int64_t value = 0;     // constant value
+  uint32_t target = 0;   // index of the instruction a label names
+};
+
+// Interned symbols: an open addressing hash table of ids into a dense vector,
+// names live in an arena. Ids are stable and assigned in order of first use.
+class SymbolTable {
+ public:
+  static constexpr uint32_t NONE = UINT32_MAX;
+
+  // returns the id of name, adding it if needed
+  uint32_t intern(std::string_view name) {
+    if ((symbols.size() + 1) * 2 > slots.size()) grow();
+    size_t mask = slots.size() - 1;
+    for (size_t i = hashBytes(name) & mask;; i = (i + 1) & mask) {
+      if (slots[i] == NONE) {
+        slots[i] = symbols.size();
+        symbols.push_back(Symbol{names.store(name)});
+        return slots[i];
+      }
+      if (symbols[slots[i]].name == name) return slots[i];
+    }
+  }
+
+  // returns NONE for unknown names
+  uint32_t find(std::string_view name) const {
+    if (slots.empty()) return NONE;
+    size_t mask = slots.size() - 1;
+    for (size_t i = hashBytes(name) & mask; slots[i] != NONE;
+         i = (i + 1) & mask) {
+      if (symbols[slots[i]].name == name) return slots[i];
+    }
+    return NONE;
+  }
+
+  Symbol& operator[](uint32_t id) { return symbols[id]; }
+  size_t size() const { return symbols.size(); }
+  std::vector<Symbol>::iterator begin() { return symbols.begin(); }
+  std::vector<Symbol>::iterator end() { return symbols.end(); }
+
+ private:
+  StringArena names;
+  std::vector<Symbol> symbols;
+  std::vector<uint32_t> slots;
+
+  void grow() {
+    slots.assign(std::max<size_t>(64, slots.size() * 2), NONE);
+    size_t mask = slots.size() - 1;
+    for (uint32_t id = 0; id < symbols.size(); id++) {
+      size_t i = hashBytes(symbols[id].name) & mask;
+      while (slots[i] != NONE) i = (i + 1) & mask;
+      slots[i] = id;
+    }
+  }
+};
@@ -1,8 +1,14 @@
 #pragma once
 #include <getopt.h>
 
+#include <array>
+#include <cstdint>
+#include <iomanip>
 #include <iostream>
-#include <map>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <utility>
 
 enum InstructionType {
   NoParams = 0,
@@ -17,65 +23,391 @@ struct InstructionParams {
   uint8_t reg;
   uint8_t imm8;
   bool choice;
-  InstructionParams() {}
-  InstructionParams(uint8_t r, uint8_t i, bool c)
+  constexpr InstructionParams() : reg(0), imm8(0), choice(false) {}
+  constexpr InstructionParams(uint8_t r, uint8_t i, bool c)
       : reg(r), imm8(i), choice(c) {}
 };
 
 // cout format for InstructionParam
 inline std::ostream& operator<<(std::ostream& os,
                                 const InstructionParams& param) {
-  os << param.choice ? param.imm8 : param.reg;
+  os << (param.choice ? +param.imm8 : +param.reg);
   return os;
 }
 
-struct Instruction {
-  std::string mnemonic;
+// ISA description shared by the assembler, the emulator and the
+// disassembler. Everything below is constexpr so that lookups compile down to
+// table accesses and encoder/decoder mismatches fail the build.
+
+struct OpcodeInfo {
+  std::string_view mnemonic;
   uint8_t opcode;
   InstructionType type;
-  InstructionParams param1;
-  InstructionParams param2;
-  Instruction(std::string m, uint8_t o, InstructionType t)
-      : mnemonic(m), opcode(o), type(t) {}
-
-  Instruction(std::string m, uint8_t o, InstructionType t, InstructionParams p1,
-              InstructionParams p2)
-      : mnemonic(m), opcode(o), type(t), param1(p1), param2(p2) {}
+  uint8_t cycles;  // clock cycles, see below
+};
+
+// Timing follows the circuit: every instruction spends two cycles on fetch
+// and decode, register and ALU operations write back in one more, and memory
+// and stack accesses take two more for the bus. A taken jump costs
+// JUMP_TAKEN_CYCLES on top of that to reload PC from HL.
+constexpr uint8_t JUMP_TAKEN_CYCLES = 1;
+
+// indexed by opcode. JMPN and the PUSH/POP encodings changed from the first
+// draft of docs/spec.txt, see the notes there
+inline constexpr std::array<OpcodeInfo, 16> instruction_set = {{
+    {"NOP", 0x0, NoParams, 2},
+    {"HALT", 0x1, NoParams, 2},
+    {"MW", 0x2, ALL_1, 3},
+    {"MWL", 0x3, Immediate_only, 3},
+    {"MWH", 0x4, Immediate_only, 3},
+    {"LW", 0x5, ALL_1, 4},
+    {"SW", 0x6, ALL_SW, 4},
+    {"ADD", 0x7, ALL_1, 3},
+    {"SUB", 0x8, ALL_1, 3},
+    {"AND", 0x9, ALL_1, 3},
+    {"ADDC", 0xa, ALL_1, 3},
+    {"NOT", 0xb, ALL_1, 3},
+    {"JMPZ", 0xc, Register_Immediate_only, 3},
+    {"JMPN", 0xd, Register_Immediate_only, 3},
+    {"PUSH", 0xe, Register_Immediate_only, 4},
+    {"POP", 0xf, Register_only, 4},
+}};
+
+constexpr uint8_t OP_NOP = 0x0;
+constexpr uint8_t OP_HALT = 0x1;
+constexpr uint8_t OP_MW = 0x2;
+constexpr uint8_t OP_MWL = 0x3;
+constexpr uint8_t OP_MWH = 0x4;
+constexpr uint8_t OP_LW = 0x5;
+constexpr uint8_t OP_SW = 0x6;
+constexpr uint8_t OP_ADD = 0x7;
+constexpr uint8_t OP_SUB = 0x8;
+constexpr uint8_t OP_AND = 0x9;
+constexpr uint8_t OP_ADDC = 0xa;
+constexpr uint8_t OP_NOT = 0xb;
+constexpr uint8_t OP_JMPZ = 0xc;
+constexpr uint8_t OP_JMPN = 0xd;
+constexpr uint8_t OP_PUSH = 0xe;
+constexpr uint8_t OP_POP = 0xf;
+
+struct RegisterInfo {
+  std::string_view name;
+  uint8_t code;
+};
+
+// indexed by register code
+inline constexpr std::array<RegisterInfo, 8> register_set = {{
+    {"A", 0x0},
+    {"B", 0x1},
+    {"C", 0x2},
+    {"D", 0x3},
+    {"E", 0x4},
+    {"SR", 0x5},
+    {"HL", 0x6},
+    {"F", 0x7},
+}};
+
+constexpr uint8_t REG_A = 0x0;
+constexpr uint8_t REG_SR = 0x5;
+constexpr uint8_t REG_HL = 0x6;
+constexpr uint8_t REG_F = 0x7;
+constexpr uint8_t REG_INVALID = 0xff;
+
+// F register bits, left-to-right: zero, negative, carry
+constexpr uint16_t FLAG_ZERO = 0x4;
+constexpr uint16_t FLAG_NEGATIVE = 0x2;
+constexpr uint16_t FLAG_CARRY = 0x1;
+
+// Field layout of an instruction word (see docs/spec.txt)
+//   [15:12] opcode  [11] imm8 select  [10:8] reg1  [7:5] reg2  [7:0] imm8
+constexpr int OPCODE_SHIFT = 12;
+constexpr uint16_t SELECT_BIT = 0x0800;
+constexpr int REG1_SHIFT = 8;
+constexpr int REG2_SHIFT = 5;
+constexpr uint16_t REG_MASK = 0x7;
+constexpr uint16_t IMM8_MASK = 0xff;
+
+// returns nullptr for unknown mnemonics
+constexpr const OpcodeInfo* findInstruction(std::string_view mnemonic) {
+  for (const OpcodeInfo& info : instruction_set) {
+    if (info.mnemonic == mnemonic) return &info;
+  }
+  return nullptr;
+}
+
+// returns REG_INVALID for unknown register names
+constexpr uint8_t findRegister(std::string_view name) {
+  for (const RegisterInfo& info : register_set) {
+    if (info.name == name) return info.code;
+  }
+  return REG_INVALID;
+}
+
+constexpr std::string_view registerName(uint8_t code) {
+  return register_set[code & REG_MASK].name;
+}
+
+struct DecodedInstruction {
+  uint8_t opcode;
+  bool select;
+  uint8_t reg1;
+  uint8_t reg2;
+  uint8_t imm8;
 };
 
+constexpr DecodedInstruction decode(uint16_t word) {
+  return {static_cast<uint8_t>(word >> OPCODE_SHIFT), (word & SELECT_BIT) != 0,
+          static_cast<uint8_t>((word >> REG1_SHIFT) & REG_MASK),
+          static_cast<uint8_t>((word >> REG2_SHIFT) & REG_MASK),
+          static_cast<uint8_t>(word & IMM8_MASK)};
+}
+
+// encode an instruction from its assembler operands, according to the operand
+// form of the opcode
+constexpr uint16_t encode(uint8_t opcode, InstructionParams param1,
+                          InstructionParams param2) {
+  uint16_t word = static_cast<uint16_t>((opcode & 0xf) << OPCODE_SHIFT);
+  auto reg1 = [](uint8_t r) {
+    return static_cast<uint16_t>((r & REG_MASK) << REG1_SHIFT);
+  };
+  auto reg2 = [](uint8_t r) {
+    return static_cast<uint16_t>((r & REG_MASK) << REG2_SHIFT);
+  };
+  switch (instruction_set[opcode & 0xf].type) {
+    case NoParams:
+      return word;
+    case Register_only:
+      return word | reg1(param1.reg);
+    case Immediate_only:
+      return word | param1.imm8;
+    case Register_Immediate_only:
+      if (param1.choice) return word | SELECT_BIT | param1.imm8;
+      return word | reg1(param1.reg);
+    case ALL_1:
+      if (param2.choice)
+        return word | SELECT_BIT | reg1(param1.reg) | param2.imm8;
+      return word | reg1(param1.reg) | reg2(param2.reg);
+    case ALL_SW:
+      // z-bits are always the register, the address goes in imm8
+      if (param1.choice)
+        return word | SELECT_BIT | reg1(param2.reg) | param1.imm8;
+      return word | reg1(param1.reg) | reg2(param2.reg);
+  }
+  return word;
+}
+
+// inverse of encode: recover the assembler operands of an instruction word
+constexpr std::pair<InstructionParams, InstructionParams> decodeParams(
+    uint16_t word) {
+  DecodedInstruction d = decode(word);
+  InstructionParams reg1(d.reg1, 0, false), reg2(d.reg2, 0, false),
+      imm(0, d.imm8, true);
+  switch (instruction_set[d.opcode].type) {
+    case NoParams:
+      return {InstructionParams(), InstructionParams()};
+    case Register_only:
+      return {reg1, InstructionParams()};
+    case Immediate_only:
+      return {InstructionParams(0, d.imm8, true), InstructionParams()};
+    case Register_Immediate_only:
+      return {d.select ? imm : reg1, InstructionParams()};
+    case ALL_1:
+      return {reg1, d.select ? imm : reg2};
+    case ALL_SW:
+      if (d.select) return {imm, reg1};
+      return {reg1, reg2};
+  }
+  return {InstructionParams(), InstructionParams()};
+}
+
+// every operand combination the assembler can produce must survive an
+// encode/decode round trip
+constexpr bool encoderMatchesDecoder() {
+  constexpr uint8_t imms[] = {0x00, 0x01, 0x5a, 0xa5, 0xff};
+  auto same = [](InstructionParams a, InstructionParams b) {
+    return a.choice == b.choice &&
+           (a.choice ? a.imm8 == b.imm8 : a.reg == b.reg);
+  };
+  for (const OpcodeInfo& info : instruction_set) {
+    for (uint8_t r1 = 0; r1 < register_set.size(); r1++) {
+      for (uint8_t r2 = 0; r2 < register_set.size(); r2++) {
+        for (uint8_t imm : imms) {
+          InstructionParams p1, p2;
+          bool uses1 = true, uses2 = false;
+          switch (info.type) {
+            case NoParams:
+              uses1 = false;
+              break;
+            case Register_only:
+              p1 = InstructionParams(r1, 0, false);
+              break;
+            case Immediate_only:
+              p1 = InstructionParams(0, imm, true);
+              break;
+            case Register_Immediate_only:
+              p1 = r2 & 1 ? InstructionParams(0, imm, true)
+                          : InstructionParams(r1, 0, false);
+              break;
+            case ALL_1:
+              uses2 = true;
+              p1 = InstructionParams(r1, 0, false);
+              p2 = imm & 1 ? InstructionParams(0, imm, true)
+                           : InstructionParams(r2, 0, false);
+              break;
+            case ALL_SW:
+              uses2 = true;
+              p1 = imm & 1 ? InstructionParams(0, imm, true)
+                           : InstructionParams(r1, 0, false);
+              p2 = InstructionParams(r2, 0, false);
+              break;
+          }
+          uint16_t word = encode(info.opcode, p1, p2);
+          auto decoded = decodeParams(word);
+          if (decode(word).opcode != info.opcode) return false;
+          if (uses1 && !same(decoded.first, p1)) return false;
+          if (uses2 && !same(decoded.second, p2)) return false;
+        }
+      }
+    }
+  }
+  return true;
+}
+
+static_assert(
+    [] {
+      for (size_t i = 0; i < instruction_set.size(); i++)
+        if (instruction_set[i].opcode != i) return false;
+      for (size_t i = 0; i < register_set.size(); i++)
+        if (register_set[i].code != i) return false;
+      return true;
+    }(),
+    "ISA tables must be indexed by opcode/register code");
+static_assert(encoderMatchesDecoder(), "ISA encoder and decoder disagree");
+
+struct AluResult {
+  uint16_t value;
+  uint16_t flags;  // new F register
+};
+
+// reg <- a op b for ADD/SUB/AND/ADDC/NOT, shared by the emulator and the
+// assembler's constant folding
+constexpr AluResult executeAlu(uint8_t opcode, uint16_t a, uint16_t b,
+                               uint16_t flags) {
+  uint32_t result;
+  switch (opcode) {
+    case OP_ADD:
+      result = uint32_t(a) + b;
+      break;
+    case OP_SUB:
+      result = uint32_t(a) - b;
+      break;
+    case OP_AND:
+      result = a & b;
+      break;
+    case OP_ADDC:
+      result = uint32_t(a) + b + (flags & FLAG_CARRY);
+      break;
+    default:  // OP_NOT
+      result = uint16_t(~b);
+      break;
+  }
+  uint16_t value = static_cast<uint16_t>(result);
+  return {value, static_cast<uint16_t>((value == 0 ? FLAG_ZERO : 0) |
+                                       (value & 0x8000 ? FLAG_NEGATIVE : 0) |
+                                       (result > 0xffff ? FLAG_CARRY : 0))};
+}
+
+// table-driven disassembler, output matches the assembler's clean listing
+inline std::string disassemble(uint16_t word) {
+  const OpcodeInfo& info = instruction_set[word >> OPCODE_SHIFT];
+  auto [param1, param2] = decodeParams(word);
+  auto operand = [](InstructionParams p) {
+    return p.choice ? std::to_string(p.imm8)
+                    : std::string(registerName(p.reg));
+  };
+  std::string text(info.mnemonic);
+  switch (info.type) {
+    case NoParams:
+      break;
+    case Register_only:
+    case Immediate_only:
+    case Register_Immediate_only:
+      text += " " + operand(param1);
+      break;
+    case ALL_1:
+    case ALL_SW:
+      text += " " + operand(param1) + "," + operand(param2);
+      break;
+  }
+  return text;
+}
+
+// Assembler IR: an instruction is kept as its encoded word (two bytes), the
+// operands are decoded again when needed
+struct Instruction {
+  uint16_t word;
+
+  constexpr Instruction(uint8_t opcode,
+                        InstructionParams param1 = InstructionParams(),
+                        InstructionParams param2 = InstructionParams())
+      : word(encode(opcode, param1, param2)) {}
+
+  constexpr uint8_t opcode() const { return word >> OPCODE_SHIFT; }
+  constexpr InstructionType type() const {
+    return instruction_set[opcode()].type;
+  }
+  constexpr InstructionParams param1() const {
+    return decodeParams(word).first;
+  }
+  constexpr InstructionParams param2() const {
+    return decodeParams(word).second;
+  }
+  constexpr void setImm8(uint8_t imm8) {
+    word = (word & ~IMM8_MASK) | imm8;
+  }
+};
+static_assert(sizeof(Instruction) == 2);
+
 // cout format for Instrucion
 inline std::ostream& operator<<(std::ostream& os, const Instruction& ins) {
-  os << ins.mnemonic << " " << ins.param1 << ", " << ins.param2 << " "
-     << ins.type;
+  os << disassemble(ins.word);
   return os;
 }
 
-const std::map<std::string, InstructionType> instruction_set = {
-    {"NOP", NoParams},
-    {"HALT", NoParams},
-    {"MW", ALL_1},
-    {"MWL", Immediate_only},
-    {"MWH", Immediate_only},
-    {"LW", ALL_1},
-    {"SW", ALL_SW},
-    {"ADD", ALL_1},
-    {"SUB", ALL_1},
-    {"AND", ALL_1},
-    {"ADDC", ALL_1},
-    {"NOT", ALL_1},
-    {"JMPZ", Register_Immediate_only},
-    {"JMPN", Register_Immediate_only},
-    {"PUSH", Register_Immediate_only},
-    {"POP", Register_only},
-};
-const std::map<std::string, uint8_t> opcode_set = {
-    {"NOP", 0x0},  {"HALT", 0x1}, {"MW", 0x2},   {"MWL", 0x3},
-    {"MWH", 0x4},  {"LW", 0x5},   {"SW", 0x6},   {"ADD", 0x7},
-    {"SUB", 0x8},  {"AND", 0x9},  {"ADDC", 0xa}, {"NOT", 0xb},
-    {"JMPZ", 0xc}, {"JMPN", 0xd}, {"PUSH", 0xe}, {"POP", 0xf},
-};
+inline std::string hexstr(uint16_t n) {
+  std::stringstream ss;
+  ss << std::hex << std::setw(4) << std::setfill('0') << n;
+  return ss.str();
+}
+
+// FNV-1a, used to fingerprint assembler inputs
+inline uint64_t hashBytes(std::string_view data,
+                          uint64_t hash = 0xcbf29ce484222325ull) {
+  for (unsigned char c : data) {
+    hash ^= c;
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+// little-endian field helpers for the object and image file formats
+namespace binary_io {
+template <typename T>
+inline void put(std::ostream& out, T value) {
+  for (size_t i = 0; i < sizeof(T); i++)
+    out.put(char((value >> (8 * i)) & 0xff));
+}
+
+template <typename T>
+inline T get(std::istream& in) {
+  T value = 0;
+  for (size_t i = 0; i < sizeof(T); i++)
+    value |= T(uint8_t(in.get())) << (8 * i);
+  return value;
+}
+}  // namespace binary_io
 
 inline void raiseError(std::string msg) {
   std::cerr << msg << std::endl;
   exit(1);
-}
\ No newline at end of file
+}
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+// Debug information (.dbg) written next to a ROM by `asm -d`, relating
+// addresses back to source lines for tracers, profilers and coverage tools.
+//
+// All fields are little-endian:
+//   "B16D" u16 version u32 file_count u32 range_count u32 label_count
+//   file: u16 name_length char name[name_length]
+//   range: u16 address u32 length u16 file u32 line u8 flags
+//   label: u16 address u16 name_length char name[name_length]
+//
+// Ranges are sorted by address and do not overlap. Each covers the words
+// emitted for one source line; padding ranges have no line.
+
+constexpr char DEBUG_MAGIC[4] = {'B', '1', '6', 'D'};
+constexpr uint16_t DEBUG_VERSION = 1;
+
+// range flags
+constexpr uint8_t DEBUG_LABEL_REF = 0x1;  // MWH/MWL pair from an @label
+constexpr uint8_t DEBUG_PADDING = 0x2;    // NOPs filling a .org gap or -s
+
+struct DebugRange {
+  uint16_t address;
+  uint32_t length;
+  uint16_t file;
+  uint32_t line;
+  uint8_t flags;
+};
+
+struct DebugLabel {
+  std::string name;
+  uint16_t address;
+};
+
+struct DebugInfo {
+  std::vector<std::string> files;
+  std::vector<DebugRange> ranges;
+  std::vector<DebugLabel> labels;
+
+  // words must be added in address order, runs from one line are merged
+  void add(uint16_t address, uint16_t file, uint32_t line, uint8_t flags) {
+    if (!ranges.empty()) {
+      DebugRange& last = ranges.back();
+      if (last.address + last.length == address && last.file == file &&
+          last.line == line && last.flags == flags) {
+        last.length++;
+        return;
+      }
+    }
+    ranges.push_back(DebugRange{address, 1, file, line, flags});
+  }
+
+  void addPadding(uint16_t address, uint32_t length) {
+    if (length > 0) {
+      ranges.push_back(DebugRange{address, length, 0, 0, DEBUG_PADDING});
+    }
+  }
+
+  // binary search for the range holding address, nullptr if there is none
+  const DebugRange* find(uint16_t address) const {
+    auto range = std::upper_bound(
+        ranges.begin(), ranges.end(), address,
+        [](uint16_t a, const DebugRange& r) { return a < r.address; });
+    if (range == ranges.begin()) return nullptr;
+    --range;
+    return address < range->address + range->length ? &*range : nullptr;
+  }
+};
+
+inline bool writeDebugInfo(const std::string& file_name,
+                           const DebugInfo& info) {
+  using namespace binary_io;
+  std::ofstream out(file_name, std::ios::binary);
+  if (!out.is_open()) return false;
+  out.write(DEBUG_MAGIC, sizeof(DEBUG_MAGIC));
+  put<uint16_t>(out, DEBUG_VERSION);
+  put<uint32_t>(out, info.files.size());
+  put<uint32_t>(out, info.ranges.size());
+  put<uint32_t>(out, info.labels.size());
+  for (const std::string& file : info.files) {
+    put<uint16_t>(out, file.size());
+    out.write(file.data(), file.size());
+  }
+  for (const DebugRange& range : info.ranges) {
+    put<uint16_t>(out, range.address);
+    put<uint32_t>(out, range.length);
+    put<uint16_t>(out, range.file);
+    put<uint32_t>(out, range.line);
+    put<uint8_t>(out, range.flags);
+  }
+  for (const DebugLabel& label : info.labels) {
+    put<uint16_t>(out, label.address);
+    put<uint16_t>(out, label.name.size());
+    out.write(label.name.data(), label.name.size());
+  }
+  return bool(out);
+}
+
+inline bool readDebugInfo(const std::string& file_name, DebugInfo& info) {
+  using namespace binary_io;
+  std::ifstream in(file_name, std::ios::binary);
+  char magic[sizeof(DEBUG_MAGIC)];
+  if (!in.read(magic, sizeof(magic)) ||
+      std::string(magic, sizeof(magic)) !=
+          std::string(DEBUG_MAGIC, sizeof(DEBUG_MAGIC)) ||
+      get<uint16_t>(in) != DEBUG_VERSION)
+    return false;
+  uint32_t file_count = get<uint32_t>(in);
+  uint32_t range_count = get<uint32_t>(in);
+  uint32_t label_count = get<uint32_t>(in);
+  if (!in) return false;
+  // counts of a damaged file must not allocate more than the file can hold:
+  // a file name takes at least 2 bytes, a range 13 and a label 4
+  std::streamoff header = in.tellg();
+  in.seekg(0, std::ios::end);
+  uint64_t remaining = uint64_t(in.tellg() - header);
+  in.seekg(header);
+  if (uint64_t(file_count) * 2 + uint64_t(range_count) * 13 +
+          uint64_t(label_count) * 4 >
+      remaining)
+    return false;
+  info.files.resize(file_count);
+  for (std::string& file : info.files) {
+    file.resize(get<uint16_t>(in));
+    in.read(file.data(), file.size());
+  }
+  info.ranges.resize(range_count);
+  for (DebugRange& range : info.ranges) {
+    range.address = get<uint16_t>(in);
+    range.length = get<uint32_t>(in);
+    range.file = get<uint16_t>(in);
+    range.line = get<uint32_t>(in);
+    range.flags = get<uint8_t>(in);
+    if (range.length > 0x10000) return false;
+  }
+  info.labels.resize(label_count);
+  for (DebugLabel& label : info.labels) {
+    label.address = get<uint16_t>(in);
+    label.name.resize(get<uint16_t>(in));
+    in.read(label.name.data(), label.name.size());
+  }
+  return bool(in);
+}
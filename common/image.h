@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+// Segmented ROM image (.img) written by the assembler and the linker and
+// loaded by the emulator. Only the words a program actually occupies are
+// stored, so a mostly empty ROM stays small.
+//
+// All fields are little-endian:
+//   "B16I" u16 version u16 flags u16 entry u32 segment_count
+//   segment: u16 address u32 length u16 data[length]
+//
+// length is in words. entry is only meaningful when IMAGE_HAS_ENTRY is set
+// in flags.
+
+constexpr char IMAGE_MAGIC[4] = {'B', '1', '6', 'I'};
+constexpr uint16_t IMAGE_VERSION = 1;
+constexpr uint16_t IMAGE_HAS_ENTRY = 0x1;
+
+struct ImageSegment {
+  uint16_t address;
+  std::vector<uint16_t> data;
+};
+
+inline bool isImageFile(const std::string& file_name) {
+  std::ifstream in(file_name, std::ios::binary);
+  char magic[sizeof(IMAGE_MAGIC)];
+  return in.read(magic, sizeof(magic)) &&
+         std::string(magic, sizeof(magic)) ==
+             std::string(IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+}
+
+// The header and segment headers are fixed-size, so a writer that does not
+// know the counts up front can write placeholders and seek back to them
+inline void putImageHeader(std::ostream& out, bool has_entry, uint16_t entry,
+                           uint32_t segment_count) {
+  using namespace binary_io;
+  out.write(IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+  put<uint16_t>(out, IMAGE_VERSION);
+  put<uint16_t>(out, has_entry ? IMAGE_HAS_ENTRY : 0);
+  put<uint16_t>(out, entry);
+  put<uint32_t>(out, segment_count);
+}
+
+inline void putSegmentHeader(std::ostream& out, uint16_t address,
+                             uint32_t length) {
+  binary_io::put<uint16_t>(out, address);
+  binary_io::put<uint32_t>(out, length);
+}
+
+inline bool writeImage(const std::string& file_name,
+                       const std::vector<ImageSegment>& segments,
+                       bool has_entry, uint16_t entry) {
+  std::ofstream out(file_name, std::ios::binary);
+  if (!out.is_open()) return false;
+  putImageHeader(out, has_entry, entry, segments.size());
+  for (const ImageSegment& segment : segments) {
+    putSegmentHeader(out, segment.address, segment.data.size());
+    for (uint16_t word : segment.data) binary_io::put<uint16_t>(out, word);
+  }
+  return bool(out);
+}
+
+// Load every segment straight into a 64K-word memory with one read per
+// segment. Segment data is stored little-endian, the same as a flat .bin, and
+// is read in place. The address and length of every segment go to loaded if
+// given. Returns false on a malformed image.
+inline bool loadImage(
+    const std::string& file_name, uint16_t* memory, bool& has_entry,
+    uint16_t& entry,
+    std::vector<std::pair<uint16_t, uint32_t>>* loaded = nullptr) {
+  using namespace binary_io;
+  std::ifstream in(file_name, std::ios::binary);
+  char magic[sizeof(IMAGE_MAGIC)];
+  if (!in.read(magic, sizeof(magic)) ||
+      std::string(magic, sizeof(magic)) !=
+          std::string(IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) ||
+      get<uint16_t>(in) != IMAGE_VERSION)
+    return false;
+  has_entry = get<uint16_t>(in) & IMAGE_HAS_ENTRY;
+  entry = get<uint16_t>(in);
+  uint32_t segment_count = get<uint32_t>(in);
+  for (uint32_t i = 0; i < segment_count && in; i++) {
+    uint32_t address = get<uint16_t>(in);
+    uint32_t length = get<uint32_t>(in);
+    // not address + length, which wraps for a length near 2^32
+    if (length > 0x10000 - address) return false;
+    if (loaded) loaded->push_back(std::make_pair(address, length));
+    in.read(reinterpret_cast<char*>(memory + address),
+            length * sizeof(uint16_t));
+  }
+  return bool(in);
+}
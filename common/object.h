@@ -0,0 +1,125 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+// Relocatable object file (.o16) shared by the assembler and bit16-ld.
+//
+// All fields are little-endian:
+//   "B16O" u16 version u64 source_hash
+//   u32 code_size u32 symbol_count u32 relocation_count
+//   u16 code[code_size]
+//   symbol: u8 binding u16 value u16 name_length char name[name_length]
+//   relocation: u32 offset u32 symbol
+//
+// Symbol values and relocation offsets are word offsets into the object's
+// code. A relocation patches the MWH/MWL pair at offset/offset + 1 with the
+// final address of its symbol. source_hash covers the source, the assembler
+// version and the options the object was assembled with.
+
+constexpr char OBJECT_MAGIC[4] = {'B', '1', '6', 'O'};
+constexpr uint16_t OBJECT_VERSION = 1;
+
+enum SymbolBinding : uint8_t {
+  SYMBOL_LOCAL = 0,
+  SYMBOL_GLOBAL = 1,
+  SYMBOL_UNDEFINED = 2
+};
+
+struct ObjectSymbol {
+  std::string name;
+  SymbolBinding binding;
+  uint16_t value;
+};
+
+struct ObjectRelocation {
+  uint32_t offset;
+  uint32_t symbol;
+};
+
+struct ObjectFile {
+  uint64_t source_hash = 0;
+  std::vector<uint16_t> code;
+  std::vector<ObjectSymbol> symbols;
+  std::vector<ObjectRelocation> relocations;
+};
+
+inline bool writeObject(const std::string& file_name, const ObjectFile& obj) {
+  using namespace binary_io;
+  std::ofstream out(file_name, std::ios::binary);
+  if (!out.is_open()) return false;
+  out.write(OBJECT_MAGIC, sizeof(OBJECT_MAGIC));
+  put<uint16_t>(out, OBJECT_VERSION);
+  put<uint64_t>(out, obj.source_hash);
+  put<uint32_t>(out, obj.code.size());
+  put<uint32_t>(out, obj.symbols.size());
+  put<uint32_t>(out, obj.relocations.size());
+  for (uint16_t word : obj.code) put<uint16_t>(out, word);
+  for (const ObjectSymbol& sym : obj.symbols) {
+    put<uint8_t>(out, sym.binding);
+    put<uint16_t>(out, sym.value);
+    put<uint16_t>(out, sym.name.size());
+    out.write(sym.name.data(), sym.name.size());
+  }
+  for (const ObjectRelocation& rel : obj.relocations) {
+    put<uint32_t>(out, rel.offset);
+    put<uint32_t>(out, rel.symbol);
+  }
+  return bool(out);
+}
+
+// reads the header only, used to check whether an object is up to date
+inline bool readObjectHash(const std::string& file_name, uint64_t& hash) {
+  using namespace binary_io;
+  std::ifstream in(file_name, std::ios::binary);
+  char magic[sizeof(OBJECT_MAGIC)];
+  if (!in.read(magic, sizeof(magic)) ||
+      std::string(magic, sizeof(magic)) !=
+          std::string(OBJECT_MAGIC, sizeof(OBJECT_MAGIC)) ||
+      get<uint16_t>(in) != OBJECT_VERSION)
+    return false;
+  hash = get<uint64_t>(in);
+  return bool(in);
+}
+
+inline bool readObject(const std::string& file_name, ObjectFile& obj) {
+  using namespace binary_io;
+  if (!readObjectHash(file_name, obj.source_hash)) return false;
+  std::ifstream in(file_name, std::ios::binary);
+  in.seekg(sizeof(OBJECT_MAGIC) + sizeof(uint16_t) + sizeof(uint64_t));
+  uint32_t code_size = get<uint32_t>(in);
+  uint32_t symbol_count = get<uint32_t>(in);
+  uint32_t relocation_count = get<uint32_t>(in);
+  if (!in) return false;
+  // counts of a damaged file must not allocate more than the file can hold:
+  // a symbol takes at least 5 bytes and a relocation 8
+  std::streamoff header = in.tellg();
+  in.seekg(0, std::ios::end);
+  uint64_t remaining = uint64_t(in.tellg() - header);
+  in.seekg(header);
+  if (code_size > 0x10000 ||
+      uint64_t(code_size) * 2 + uint64_t(symbol_count) * 5 +
+              uint64_t(relocation_count) * 8 >
+          remaining)
+    return false;
+  obj.code.resize(code_size);
+  for (uint16_t& word : obj.code) word = get<uint16_t>(in);
+  obj.symbols.resize(symbol_count);
+  for (ObjectSymbol& sym : obj.symbols) {
+    sym.binding = SymbolBinding(get<uint8_t>(in));
+    sym.value = get<uint16_t>(in);
+    sym.name.resize(get<uint16_t>(in));
+    if (!in) return false;
+    in.read(sym.name.data(), sym.name.size());
+  }
+  obj.relocations.resize(relocation_count);
+  for (ObjectRelocation& rel : obj.relocations) {
+    rel.offset = get<uint32_t>(in);
+    rel.symbol = get<uint32_t>(in);
+  }
+  return bool(in);
+}
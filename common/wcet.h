@@ -0,0 +1,622 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <iomanip>
+#include <map>
+#include <optional>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "common.h"
+
+// Static timing analysis of routines, used by `asm -W` and bit16-wcet.
+//
+// Code is followed from a routine's entry with register contents tracked as
+// constants where they are known, which resolves the targets of jumps set up
+// with MWH/MWL (an @label). Costs are the instruction_set cycles plus
+// JUMP_TAKEN_CYCLES for taken jumps, the same as the emulator counts.
+//
+// - A jump through an HL that is not known returns from the routine.
+// - A jump made while the last PUSH was of a known HL or an immediate is a
+//   call: the target is analysed as a routine of its own and execution goes on
+//   at the pushed address with every register unknown.
+// - Every loop needs a bound, the most times its head runs each time the loop
+//   is entered. The worst case runs every loop that often, the best case once.
+// - Loops have to be entered through their head (no jumps into the middle).
+
+struct WcetError : std::runtime_error {
+  using std::runtime_error::runtime_error;
+};
+
+struct WcetProgram {
+  std::vector<uint16_t> memory = std::vector<uint16_t>(0x10000);
+  std::vector<char> code = std::vector<char>(0x10000, false);
+  std::map<uint16_t, uint64_t> bounds;  // loop head address -> bound
+  std::map<uint16_t, std::string> labels;
+
+  std::string describe(uint16_t address) const {
+    auto label = labels.find(address);
+    std::string hex = "0x" + hexstr(address);
+    return label == labels.end() ? hex : label->second + " (" + hex + ")";
+  }
+};
+
+// consecutive words on the worst case path that run equally often
+struct WcetRun {
+  uint16_t first, last;
+  uint64_t count;
+  uint64_t cycles;  // including the routines called from the run
+};
+
+struct WcetResult {
+  uint64_t best = 0, worst = 0;
+  std::vector<WcetRun> path;  // in address order
+  std::vector<std::string> notes;
+};
+
+class WcetAnalyzer {
+ public:
+  explicit WcetAnalyzer(const WcetProgram& program) : program(program) {}
+
+  // results are kept, so routines called from several places are analysed
+  // once. Throws WcetError.
+  const WcetResult& analyze(uint16_t entry) {
+    auto found = results.find(entry);
+    if (found != results.end()) return found->second;
+    if (!active.insert(entry).second) {
+      throw WcetError("recursive call to " + program.describe(entry));
+    }
+    try {
+      WcetResult result = solve(buildGraph(entry));
+      active.erase(entry);
+      return results[entry] = std::move(result);
+    } catch (...) {
+      active.erase(entry);
+      throw;
+    }
+  }
+
+ private:
+  // known register contents, HL as two bytes for MWH and MWL
+  struct State {
+    std::optional<uint16_t> regs[8];
+    std::optional<uint8_t> hl_high, hl_low;
+    std::optional<uint16_t> pushed;  // HL at the last PUSH if known
+
+    bool operator==(const State&) const = default;
+
+    std::optional<uint16_t> get(uint8_t reg) const {
+      if (reg != REG_HL) return regs[reg];
+      if (!hl_high || !hl_low) return std::nullopt;
+      return uint16_t(*hl_high << 8 | *hl_low);
+    }
+
+    void set(uint8_t reg, std::optional<uint16_t> value) {
+      if (reg != REG_HL) {
+        regs[reg] = value;
+      } else if (value) {
+        hl_high = *value >> 8;
+        hl_low = *value & 0xff;
+      } else {
+        hl_high.reset();
+        hl_low.reset();
+      }
+    }
+
+    void join(const State& other) {
+      auto meet = [](auto& a, const auto& b) {
+        if (a != b) a.reset();
+      };
+      for (int i = 0; i < 8; i++) meet(regs[i], other.regs[i]);
+      meet(hl_high, other.hl_high);
+      meet(hl_low, other.hl_low);
+      meet(pushed, other.pushed);
+    }
+  };
+
+  static constexpr int32_t EXIT = -1;
+
+  struct Edge {
+    int32_t to;  // node, or EXIT for a return or HALT
+    uint64_t best, worst;
+  };
+
+  struct Graph {
+    std::vector<uint16_t> address;  // ascending
+    std::vector<std::vector<Edge>> out;
+    int32_t entry;
+    std::vector<std::string> notes;
+  };
+
+  struct Step {
+    bool exit;
+    uint16_t pc;
+    State state;
+    uint64_t best, worst;
+  };
+
+  // where control can go after the instruction at pc
+  std::vector<Step> successors(uint16_t pc, State s,
+                               std::vector<std::string>* notes) {
+    if (!program.code[pc]) {
+      throw WcetError("execution reaches 0x" + hexstr(pc) +
+                      ", which holds no code");
+    }
+    DecodedInstruction ins = decode(program.memory[pc]);
+    auto [p1, p2] = decodeParams(program.memory[pc]);
+    uint64_t cycles = instruction_set[ins.opcode].cycles;
+    auto operand = [&](InstructionParams p) {
+      return p.choice ? std::optional<uint16_t>(p.imm8) : s.get(p.reg);
+    };
+    uint16_t next = pc + 1;
+    switch (ins.opcode) {
+      case OP_HALT:
+        return {Step{true, 0, s, cycles, cycles}};
+      case OP_JMPZ:
+      case OP_JMPN: {
+        std::optional<uint16_t> value = operand(p1);
+        std::optional<bool> taken;
+        if (value) {
+          taken = ins.opcode == OP_JMPZ ? *value == 0 : (*value & 0x8000);
+        }
+        std::vector<Step> steps;
+        if (!taken || !*taken) {
+          steps.push_back(Step{false, next, s, cycles, cycles});
+        }
+        if (taken && !*taken) return steps;
+        uint64_t jump = cycles + JUMP_TAKEN_CYCLES;
+        std::optional<uint16_t> target = s.get(REG_HL);
+        if (!target) {
+          if (notes) {
+            notes->push_back("0x" + hexstr(pc) +
+                             ": jump to an unknown HL, taken as a return");
+          }
+          steps.push_back(Step{true, 0, s, jump, jump});
+        } else if (s.pushed) {
+          const WcetResult& callee = analyze(*target);
+          State after;
+          steps.push_back(Step{false, *s.pushed, after, jump + callee.best,
+                               jump + callee.worst});
+        } else {
+          steps.push_back(Step{false, *target, s, jump, jump});
+        }
+        return steps;
+      }
+      case OP_MW:
+        s.set(p1.reg, operand(p2));
+        break;
+      case OP_MWL:
+        s.hl_low = p1.imm8;
+        break;
+      case OP_MWH:
+        s.hl_high = p1.imm8;
+        break;
+      case OP_LW:
+        s.set(p1.reg, std::nullopt);
+        break;
+      case OP_ADD:
+      case OP_SUB:
+      case OP_AND:
+      case OP_ADDC:
+      case OP_NOT: {
+        std::optional<uint16_t> a = s.get(p1.reg), b = operand(p2);
+        std::optional<uint16_t> flags = s.get(REG_F);
+        if ((a || ins.opcode == OP_NOT) && b &&
+            (flags || ins.opcode != OP_ADDC)) {
+          AluResult result =
+              executeAlu(ins.opcode, a.value_or(0), *b, flags.value_or(0));
+          s.set(REG_F, result.flags);
+          s.set(p1.reg, result.value);
+        } else {
+          s.set(REG_F, std::nullopt);
+          s.set(p1.reg, std::nullopt);
+        }
+        break;
+      }
+      case OP_PUSH:
+        s.pushed = p1.choice ? std::optional<uint16_t>(p1.imm8)
+                   : p1.reg == REG_HL ? s.get(REG_HL)
+                                      : std::nullopt;
+        break;
+      case OP_POP:
+        s.set(p1.reg, std::nullopt);
+        s.pushed.reset();
+        break;
+      default:  // NOP, SW
+        break;
+    }
+    return {Step{false, next, s, cycles, cycles}};
+  }
+
+  // Propagates register contents to a fixed point, then takes the edges from
+  // the final states
+  Graph buildGraph(uint16_t entry) {
+    std::map<uint16_t, State> states = {{entry, State()}};
+    std::vector<uint16_t> work = {entry};
+    while (!work.empty()) {
+      uint16_t pc = work.back();
+      work.pop_back();
+      for (const Step& step : successors(pc, states[pc], nullptr)) {
+        if (step.exit) continue;
+        auto [state, added] = states.try_emplace(step.pc, step.state);
+        if (added) {
+          work.push_back(step.pc);
+          continue;
+        }
+        State joined = state->second;
+        joined.join(step.state);
+        if (!(joined == state->second)) {
+          state->second = joined;
+          work.push_back(step.pc);
+        }
+      }
+    }
+
+    Graph graph;
+    std::map<uint16_t, int32_t> node;
+    for (const auto& [pc, state] : states) {
+      node[pc] = graph.address.size();
+      graph.address.push_back(pc);
+    }
+    graph.entry = node[entry];
+    graph.out.resize(graph.address.size());
+    for (const auto& [pc, state] : states) {
+      for (const Step& step : successors(pc, state, &graph.notes)) {
+        graph.out[node[pc]].push_back(
+            Edge{step.exit ? EXIT : node[step.pc], step.best, step.worst});
+      }
+    }
+    return graph;
+  }
+
+  // A region is a loop body, or the whole routine, with the loops inside it
+  // collapsed into single units. Units are node numbers, loops come after
+  // the nodes.
+  struct Loop {
+    int32_t head;
+    int parent = -1;
+    std::vector<int32_t> body;
+    uint64_t bound = 0;
+    // leaving the loop: edges from entering the head to the target, and the
+    // unit and out edge inside the loop they leave through
+    std::vector<Edge> exits;
+    std::vector<std::pair<int32_t, size_t>> exit_from;
+    std::pair<int32_t, size_t> back;  // latch of the longest iteration
+    uint64_t iteration = 0;
+  };
+
+  struct Region {
+    int32_t head;
+    std::map<int32_t, uint64_t> best, worst;
+    // unit -> (previous unit, its out edge) on the longest path from head
+    std::map<int32_t, std::pair<int32_t, size_t>> pred;
+  };
+
+  struct Solver {
+    const Graph& graph;
+    const WcetProgram& program;
+    int32_t nodes;
+    std::vector<Loop> loops;
+    std::vector<int> loop_of;  // innermost loop of every node, -1 for none
+    std::vector<Region> regions;  // per loop, then the routine
+    std::vector<uint64_t> count, cycles;
+
+    Solver(const Graph& graph, const WcetProgram& program)
+        : graph(graph),
+          program(program),
+          nodes(graph.address.size()),
+          loop_of(nodes, -1),
+          count(nodes, 0),
+          cycles(nodes, 0) {}
+
+    std::string where(int32_t node) const {
+      return program.describe(graph.address[node]);
+    }
+
+    // the unit of region (a loop, -1 for the routine) node belongs to, or -1
+    // if it is outside
+    int32_t unitIn(int region, int32_t node) const {
+      if (node == EXIT) return -1;
+      int loop = loop_of[node];
+      if (loop == region) return node;
+      while (loop != -1 && loops[loop].parent != region) {
+        loop = loops[loop].parent;
+      }
+      return loop == -1 ? -1 : nodes + loop;
+    }
+
+    const std::vector<Edge>& out(int32_t unit) const {
+      return unit < nodes ? graph.out[unit] : loops[unit - nodes].exits;
+    }
+
+    void findLoops() {
+      // dominators, iteratively over the reverse postorder
+      std::vector<int32_t> order, rpo(nodes, -1);
+      std::vector<std::vector<int32_t>> preds(nodes);
+      std::vector<char> seen(nodes, false);
+      std::vector<std::pair<int32_t, size_t>> stack = {{graph.entry, 0}};
+      seen[graph.entry] = true;
+      while (!stack.empty()) {
+        auto& [node, next] = stack.back();
+        if (next < graph.out[node].size()) {
+          int32_t to = graph.out[node][next++].to;
+          if (to != EXIT && !seen[to]) {
+            seen[to] = true;
+            stack.push_back({to, 0});
+          }
+        } else {
+          order.push_back(node);
+          stack.pop_back();
+        }
+      }
+      std::reverse(order.begin(), order.end());
+      for (size_t i = 0; i < order.size(); i++) rpo[order[i]] = i;
+      for (int32_t node = 0; node < nodes; node++) {
+        for (const Edge& edge : graph.out[node]) {
+          if (edge.to != EXIT) preds[edge.to].push_back(node);
+        }
+      }
+      std::vector<int32_t> idom(nodes, -1);
+      idom[graph.entry] = graph.entry;
+      auto intersect = [&](int32_t a, int32_t b) {
+        while (a != b) {
+          while (rpo[a] > rpo[b]) a = idom[a];
+          while (rpo[b] > rpo[a]) b = idom[b];
+        }
+        return a;
+      };
+      for (bool changed = true; changed;) {
+        changed = false;
+        for (int32_t node : order) {
+          if (node == graph.entry) continue;
+          int32_t dom = -1;
+          for (int32_t pred : preds[node]) {
+            if (idom[pred] == -1) continue;
+            dom = dom == -1 ? pred : intersect(pred, dom);
+          }
+          if (dom != idom[node]) {
+            idom[node] = dom;
+            changed = true;
+          }
+        }
+      }
+      auto dominates = [&](int32_t a, int32_t b) {
+        for (;; b = idom[b]) {
+          if (a == b) return true;
+          if (b == graph.entry) return false;
+        }
+      };
+
+      // natural loops, one per head
+      std::map<int32_t, std::vector<int32_t>> latches;
+      for (int32_t node = 0; node < nodes; node++) {
+        for (const Edge& edge : graph.out[node]) {
+          if (edge.to != EXIT && dominates(edge.to, node)) {
+            latches[edge.to].push_back(node);
+          }
+        }
+      }
+      for (const auto& [head, sources] : latches) {
+        Loop loop;
+        loop.head = head;
+        std::vector<char> in(nodes, false);
+        in[head] = true;
+        std::vector<int32_t> work = sources;
+        while (!work.empty()) {
+          int32_t node = work.back();
+          work.pop_back();
+          if (in[node]) continue;
+          in[node] = true;
+          for (int32_t pred : preds[node]) work.push_back(pred);
+        }
+        for (int32_t node = 0; node < nodes; node++) {
+          if (in[node]) loop.body.push_back(node);
+        }
+        auto bound = program.bounds.find(graph.address[head]);
+        if (bound == program.bounds.end() || bound->second == 0) {
+          throw WcetError("loop at " + where(head) + " has no bound");
+        }
+        loop.bound = bound->second;
+        loops.push_back(std::move(loop));
+      }
+      // outer loops first, so that inner ones end up as loop_of
+      std::sort(loops.begin(), loops.end(), [](const Loop& a, const Loop& b) {
+        return a.body.size() > b.body.size();
+      });
+      for (size_t i = 0; i < loops.size(); i++) {
+        loops[i].parent = loop_of[loops[i].head];
+        for (int32_t node : loops[i].body) loop_of[node] = i;
+      }
+    }
+
+    // longest and shortest distances from the head over the region, which is
+    // acyclic once its loops are collapsed and edges back to the head dropped
+    void solveRegion(int index) {
+      Region& region = regions[index == -1 ? loops.size() : index];
+      region.head = unitIn(index, index == -1 ? graph.entry
+                                              : loops[index].head);
+      std::vector<int32_t> units;
+      std::map<int32_t, int> incoming;
+      std::vector<int32_t> work = {region.head};
+      incoming[region.head] = 0;
+      while (!work.empty()) {
+        int32_t unit = work.back();
+        work.pop_back();
+        units.push_back(unit);
+        for (const Edge& edge : out(unit)) {
+          int32_t to = unitIn(index, edge.to);
+          if (to == -1 || to == region.head) continue;
+          if (incoming[to]++ == 0) work.push_back(to);
+        }
+      }
+      std::vector<int32_t> ready = {region.head};
+      region.best[region.head] = region.worst[region.head] = 0;
+      size_t done = 0;
+      while (!ready.empty()) {
+        int32_t unit = ready.back();
+        ready.pop_back();
+        done++;
+        const std::vector<Edge>& edges = out(unit);
+        for (size_t k = 0; k < edges.size(); k++) {
+          int32_t to = unitIn(index, edges[k].to);
+          if (to == -1 || to == region.head) continue;
+          uint64_t best = region.best[unit] + edges[k].best;
+          uint64_t worst = region.worst[unit] + edges[k].worst;
+          if (!region.pred.contains(to)) {
+            region.best[to] = best;
+            region.worst[to] = worst;
+            region.pred[to] = {unit, k};
+          } else {
+            region.best[to] = std::min(region.best[to], best);
+            if (worst > region.worst[to]) {
+              region.worst[to] = worst;
+              region.pred[to] = {unit, k};
+            }
+          }
+          if (--incoming[to] == 0) ready.push_back(to);
+        }
+      }
+      if (done != units.size()) {
+        throw WcetError("control flow into the middle of a loop near " +
+                        where(index == -1 ? graph.entry : loops[index].head));
+      }
+      if (index == -1) return;
+
+      Loop& loop = loops[index];
+      bool latched = false;
+      for (int32_t unit : units) {
+        const std::vector<Edge>& edges = out(unit);
+        for (size_t k = 0; k < edges.size(); k++) {
+          if (unitIn(index, edges[k].to) != region.head) continue;
+          uint64_t iteration = region.worst[unit] + edges[k].worst;
+          if (!latched || iteration > loop.iteration) {
+            loop.iteration = iteration;
+            loop.back = {unit, k};
+            latched = true;
+          }
+        }
+      }
+      // the last time round leaves, all earlier ones take the longest way
+      uint64_t repeats = (loop.bound - 1) * loop.iteration;
+      for (int32_t unit : units) {
+        const std::vector<Edge>& edges = out(unit);
+        for (size_t k = 0; k < edges.size(); k++) {
+          if (unitIn(index, edges[k].to) != -1) continue;
+          loop.exits.push_back(
+              Edge{edges[k].to, region.best[unit] + edges[k].best,
+                   repeats + region.worst[unit] + edges[k].worst});
+          loop.exit_from.push_back({unit, k});
+        }
+      }
+    }
+
+    // adds the path from the head of region to unit, which it leaves through
+    // out edge k, times times to the counts
+    void expand(int index, int32_t unit, size_t k, uint64_t times) {
+      const Region& region = regions[index == -1 ? loops.size() : index];
+      while (true) {
+        if (unit < nodes) {
+          count[unit] += times;
+          cycles[unit] += times * graph.out[unit][k].worst;
+        } else {
+          int inner = unit - nodes;
+          const Loop& loop = loops[inner];
+          if (loop.bound > 1) {
+            expand(inner, loop.back.first, loop.back.second,
+                   times * (loop.bound - 1));
+          }
+          expand(inner, loop.exit_from[k].first, loop.exit_from[k].second,
+                 times);
+        }
+        if (unit == region.head) return;
+        std::tie(unit, k) = region.pred.at(unit);
+      }
+    }
+
+    WcetResult solve(std::vector<std::string> notes) {
+      findLoops();
+      regions.resize(loops.size() + 1);
+      // inner loops are smaller and come later
+      for (int i = loops.size(); i-- > 0;) solveRegion(i);
+      solveRegion(-1);
+
+      const Region& root = regions.back();
+      WcetResult result;
+      result.notes = std::move(notes);
+      std::optional<std::pair<int32_t, size_t>> last;
+      for (const auto& [unit, worst] : root.worst) {
+        const std::vector<Edge>& edges = out(unit);
+        for (size_t k = 0; k < edges.size(); k++) {
+          if (edges[k].to != EXIT) continue;
+          uint64_t best = root.best.at(unit) + edges[k].best;
+          uint64_t total = worst + edges[k].worst;
+          if (!last) {
+            result.best = best;
+            result.worst = total;
+            last = {unit, k};
+            continue;
+          }
+          result.best = std::min(result.best, best);
+          if (total > result.worst) {
+            result.worst = total;
+            last = {unit, k};
+          }
+        }
+      }
+      if (!last) {
+        throw WcetError("routine at " + where(graph.entry) +
+                        " never returns or halts");
+      }
+      expand(-1, last->first, last->second, 1);
+
+      for (int32_t node = 0; node < nodes; node++) {
+        if (count[node] == 0) continue;
+        WcetRun* run = result.path.empty() ? nullptr : &result.path.back();
+        if (run && run->last + 1 == graph.address[node] &&
+            run->count == count[node]) {
+          run->last++;
+          run->cycles += cycles[node];
+        } else {
+          result.path.push_back(WcetRun{graph.address[node],
+                                        graph.address[node], count[node],
+                                        cycles[node]});
+        }
+      }
+      return result;
+    }
+  };
+
+  WcetResult solve(const Graph& graph) {
+    return Solver(graph, program).solve(graph.notes);
+  }
+
+  const WcetProgram& program;
+  std::map<uint16_t, WcetResult> results;
+  std::set<uint16_t> active;
+};
+
+// Report for one routine. budget 0 means none.
+inline std::string formatWcet(const WcetProgram& program, uint16_t entry,
+                              const WcetResult& result, uint64_t budget) {
+  std::ostringstream out;
+  out << program.describe(entry) << ": best " << result.best << ", worst "
+      << result.worst << " cycles";
+  if (budget) out << " (budget " << budget << ")";
+  out << "\n";
+  for (const WcetRun& run : result.path) {
+    auto label = program.labels.find(run.first);
+    out << "  0x" << hexstr(run.first) << "-0x" << hexstr(run.last)
+        << std::setw(10) << run.count << "x" << std::setw(10) << run.cycles
+        << " cycles" << std::setw(5)
+        << (result.worst ? run.cycles * 100 / result.worst : 0) << "%"
+        << (label == program.labels.end() ? "" : "  " + label->second)
+        << "\n";
+  }
+  for (const std::string& note : result.notes) out << "  " << note << "\n";
+  return out.str();
+}
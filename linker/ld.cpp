@@ -0,0 +1,193 @@
+// bit16-ld: links relocatable .o16 objects produced by `asm -r` into a ROM
+#include <getopt.h>
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "../common/common.h"
+#include "../common/image.h"
+#include "../common/object.h"
+
+int main(int argc, char* argv[]) {
+  std::vector<std::string> input_file_names;
+  std::string output_file_name = "a.bin";
+  int base_address = 0;
+  bool print_map = false;
+  bool output_image = false;
+  std::string entry_symbol;
+
+  static struct option longOptions[] = {
+      {"input-file", required_argument, 0, 'i'},
+      {"output-file", required_argument, 0, 'o'},
+      {"base-address", required_argument, 0, 'b'},
+      {"map", no_argument, 0, 'm'},
+      {"image", no_argument, 0, 'g'},
+      {"entry", required_argument, 0, 'e'},
+      {"help", no_argument, 0, 'h'},
+      {0, 0, 0, 0}};
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "i:o:b:mge:h", longOptions, NULL)) !=
+         -1) {
+    switch (opt) {
+      case 'i':
+        input_file_names.push_back(optarg);
+        break;
+      case 'o':
+        output_file_name = optarg;
+        break;
+      case 'b': {
+        char* end;
+        unsigned long value = std::strtoul(optarg, &end, 0);
+        if (!isdigit(optarg[0]) || *end != '\0' || value > 0xffff) {
+          std::cerr << "Invalid address: " << optarg << std::endl;
+          std::cerr << "Usage: -b ADDRESS (0 TO 0xFFFF)" << std::endl;
+          return 1;
+        }
+        base_address = value;
+        break;
+      }
+      case 'm':
+        print_map = true;
+        break;
+      case 'g':
+        output_image = true;
+        break;
+      case 'e':
+        entry_symbol = optarg;
+        break;
+      case 'h':
+        // Display help menu
+        std::cout << "Usage: " << argv[0] << "  [options] object_file(s)..."
+                  << std::endl;
+        std::cout << "Options:" << std::endl;
+        std::cout << "  -i, --input-file FILE     Specify input .o16 file(s) "
+                     "(multiple allowed)"
+                  << std::endl;
+        std::cout << "  -o, --output-file FILE    Output ROM file (default: "
+                     "a.bin)"
+                  << std::endl;
+        std::cout << "  -b, --base-address ADDR   Address of the first object "
+                     "(default: 0)"
+                  << std::endl;
+        std::cout << "  -m, --map                 Print the symbol map"
+                  << std::endl;
+        std::cout << "  -g, --image               Output a segmented .img "
+                     "instead of a padded .bin"
+                  << std::endl;
+        std::cout << "  -e, --entry SYMBOL        Entry point recorded in the "
+                     ".img"
+                  << std::endl;
+        std::cout << "  -h, --help                Display help message"
+                  << std::endl;
+        return 0;
+      default:
+        std::cerr << "Use '" << argv[0] << " --help' for usage." << std::endl;
+        return 1;
+    }
+  }
+  for (int i = optind; i < argc; i++) input_file_names.push_back(argv[i]);
+
+  if (input_file_names.empty()) {
+    std::cerr << "At least one object file is required." << std::endl;
+    return 1;
+  }
+
+  // objects are placed one after another in command line order
+  std::vector<ObjectFile> objects(input_file_names.size());
+  std::vector<uint32_t> bases(input_file_names.size());
+  uint32_t address = base_address;
+  for (size_t i = 0; i < objects.size(); i++) {
+    if (!readObject(input_file_names[i], objects[i])) {
+      raiseError("Failed to read object " + input_file_names[i]);
+    }
+    bases[i] = address;
+    address += objects[i].code.size();
+  }
+  if (address > 0x10000) {
+    raiseError("Linked program ends at " + std::to_string(address) +
+               ", past the end of memory");
+  }
+
+  std::map<std::string, std::pair<uint16_t, size_t>> globals;
+  for (size_t i = 0; i < objects.size(); i++) {
+    for (const ObjectSymbol& sym : objects[i].symbols) {
+      if (sym.binding != SYMBOL_GLOBAL) continue;
+      if (globals.contains(sym.name)) {
+        raiseError("Duplicate symbol " + sym.name + " in " +
+                   input_file_names[globals[sym.name].second] + " and " +
+                   input_file_names[i]);
+      }
+      globals[sym.name] = std::make_pair(bases[i] + sym.value, i);
+    }
+  }
+
+  // like the assembler's .org padding, everything below the base is NOP
+  std::vector<uint16_t> image(address, 0);
+  for (size_t i = 0; i < objects.size(); i++) {
+    const ObjectFile& obj = objects[i];
+    std::copy(obj.code.begin(), obj.code.end(), image.begin() + bases[i]);
+    for (const ObjectRelocation& rel : obj.relocations) {
+      // not rel.offset + 1, which wraps for an offset near 2^32
+      if (rel.symbol >= obj.symbols.size() || obj.code.size() < 2 ||
+          rel.offset >= obj.code.size() - 1) {
+        raiseError("Malformed relocation in " + input_file_names[i]);
+      }
+      const ObjectSymbol& sym = obj.symbols[rel.symbol];
+      uint16_t value;
+      if (sym.binding == SYMBOL_UNDEFINED) {
+        if (!globals.contains(sym.name)) {
+          raiseError(input_file_names[i] + ": undefined reference to " +
+                     sym.name);
+        }
+        value = globals[sym.name].first;
+      } else {
+        value = bases[i] + sym.value;
+      }
+      // patch the imm8 fields of the MWH/MWL pair
+      uint16_t& high = image[bases[i] + rel.offset];
+      uint16_t& low = image[bases[i] + rel.offset + 1];
+      high = (high & ~IMM8_MASK) | (value >> 8);
+      low = (low & ~IMM8_MASK) | (value & IMM8_MASK);
+    }
+  }
+
+  if (!entry_symbol.empty() && !globals.contains(entry_symbol)) {
+    raiseError("Entry symbol " + entry_symbol + " is not a global symbol");
+  }
+  if (output_image) {
+    // the objects are contiguous, so they make up a single segment
+    std::vector<ImageSegment> segments = {ImageSegment{
+        static_cast<uint16_t>(base_address),
+        std::vector<uint16_t>(image.begin() + base_address, image.end())}};
+    if (!writeImage(output_file_name, segments, !entry_symbol.empty(),
+                    entry_symbol.empty() ? 0 : globals[entry_symbol].first)) {
+      raiseError("Error opening file: " + output_file_name);
+    }
+  } else {
+    std::ofstream binaryfile(output_file_name, std::ios::binary);
+    if (!binaryfile.is_open()) {
+      raiseError("Error opening file: " + output_file_name);
+    }
+    binaryfile.write(reinterpret_cast<const char*>(image.data()),
+                     image.size() * sizeof(uint16_t));
+    binaryfile.close();
+  }
+
+  if (print_map) {
+    for (size_t i = 0; i < objects.size(); i++) {
+      std::cout << hexstr(bases[i]) << " " << input_file_names[i] << "\n";
+      for (const ObjectSymbol& sym : objects[i].symbols) {
+        if (sym.binding == SYMBOL_UNDEFINED) continue;
+        std::cout << "  " << hexstr(bases[i] + sym.value) << " " << sym.name
+                  << (sym.binding == SYMBOL_GLOBAL ? " (global)" : "") << "\n";
+      }
+    }
+  }
+
+  return 0;
+}
@@ -1,20 +1,22 @@
-// MultiplyTwoNumbers.asm
+; MultiplyTwoNumbers.asm
 
-// section .data
-// result db 0         // Variable to store the result
-// number1 db 10       // First number
-// number2 db 5        // Second number
+; section .data
+; result db 0         ; Variable to store the result
+; number1 db 10       ; First number
+; number2 db 5        ; Second number
 
-// section .text
-// global _start
+; section .text
+; global _start
 
-.start 0x0000:
+.org 0x0000
+start:
    MW A, 0x05
    MW B, 0x20
 
    MW C, A
 
-.loop 0x0010:
+.org 0x0010
+loop:
     ADD A, B
     SUB C, 1
 
@@ -24,5 +26,6 @@
     @loop
     JMPZ 0
 
-.end 0x0020:
-    HALT   // Halt the program or continue with other instructions as needed
\ No newline at end of file
+.org 0x0020
+end:
+    HALT   ; Halt the program or continue with other instructions as needed
\ No newline at end of file
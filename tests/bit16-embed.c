@@ -0,0 +1,90 @@
+/* Drives a ROM through libbit16 the way an embedding host would, checking
+ * every step, for tests/smoke.sh:
+ *
+ *   bit16-embed ROM
+ *
+ * The ROM has to poll 0xC000 until the host stores N there, then sum N down
+ * to 1 in a loop at 0x0010, store the sum at 0xC001 and halt. Built as C
+ * against libbit16.so, so the header is also checked to be plain C. Prints
+ * the first failed check and exits 1. */
+#include <inttypes.h>
+#include <stdio.h>
+
+#include "../Bit16_Emulator/libbit16.h"
+
+#define LOOP 0x0010
+#define N 10
+
+static int failed;
+
+#define CHECK(condition)                                                       \
+  do {                                                                         \
+    if (!(condition) && !failed++) {                                           \
+      fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__,                \
+              #condition);                                                     \
+    }                                                                          \
+  } while (0)
+
+int main(int argc, char** argv) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s ROM\n", argv[0]);
+    return 1;
+  }
+  bit16_machine* machine = bit16_create();
+  CHECK(machine != NULL);
+  if (!machine) return 1;
+  CHECK(bit16_load_image(machine, "/nonexistent.bin") == BIT16_ERROR_IO);
+  CHECK(bit16_load_image(machine, argv[1]) == BIT16_OK);
+
+  /* the poll on 0xC000 can only end through the host */
+  bit16_stop_conditions stop = {NULL, 0, 1};
+  bit16_run_result result;
+  uint64_t cycles = 0;
+  CHECK(bit16_run(machine, 1000000, &stop, &result) == BIT16_OK);
+  CHECK(result.reason == BIT16_STOP_IDLE);
+  cycles += result.cycles;
+
+  uint16_t n = N;
+  CHECK(bit16_write_memory(machine, 0xc000, &n, 1) == BIT16_OK);
+  /* a run resumed from a breakpoint goes once around the loop before it
+   * stops there again, so the loop stops N times before the HALT */
+  uint16_t breakpoint = LOOP;
+  stop.breakpoints = &breakpoint;
+  stop.breakpoint_count = 1;
+  int stops = 0;
+  do {
+    CHECK(bit16_run(machine, 1000000, &stop, &result) == BIT16_OK);
+    cycles += result.cycles;
+    if (result.reason == BIT16_STOP_BREAKPOINT) {
+      CHECK(result.pc == LOOP);
+      stops++;
+    }
+  } while (result.reason == BIT16_STOP_BREAKPOINT && stops <= N);
+  CHECK(result.reason == BIT16_STOP_HALT);
+  CHECK(stops == N);
+  CHECK(bit16_cycles(machine) == cycles);
+
+  uint16_t sum = 0;
+  CHECK(bit16_read_memory(machine, 0xc001, &sum, 1) == BIT16_OK);
+  CHECK(sum == N * (N + 1) / 2);
+  uint16_t registers[BIT16_REGISTER_COUNT];
+  bit16_get_registers(machine, registers);
+  CHECK(registers[0] == sum);
+  CHECK(registers[BIT16_REG_PC] == result.pc);
+
+  CHECK(bit16_read_memory(machine, 0xffff, registers, 2) == BIT16_ERROR_RANGE);
+  stop.breakpoints = NULL;
+  CHECK(bit16_run(machine, 1, &stop, NULL) == BIT16_ERROR_ARGUMENT);
+
+  bit16_reset(machine);
+  bit16_get_registers(machine, registers);
+  CHECK(bit16_cycles(machine) == 0);
+  CHECK(registers[BIT16_REG_PC] == 0 && registers[BIT16_REG_SP] == 0xffff);
+  CHECK(bit16_read_memory(machine, 0xc001, &sum, 1) == BIT16_OK && sum == 0);
+
+  bit16_destroy(machine);
+  if (!failed) {
+    printf("%" PRIu64 " cycles, %d breakpoint stops\n", cycles, stops);
+  }
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,52 @@
+/* Runs a ROM to its HALT through libbit16 and prints what it computed, for
+ * tests/smoke.sh to compare between builds of the same program:
+ *
+ *   bit16-state ROM [MAX_CYCLES]
+ *
+ * The first line holds the registers and a checksum of memory from VRAM up
+ * to the stack, the second the cycles taken. PC, HL and the stack are left
+ * out, as they hold code addresses that move when the code does. Exits 1 if
+ * the program does not halt. */
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../Bit16_Emulator/libbit16.h"
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s ROM [MAX_CYCLES]\n", argv[0]);
+    return 1;
+  }
+  uint64_t max_cycles = argc > 2 ? strtoull(argv[2], NULL, 0) : 1000000;
+  bit16_machine* machine = bit16_create();
+  if (!machine || bit16_load_image(machine, argv[1]) != BIT16_OK) {
+    fprintf(stderr, "Cannot load %s\n", argv[1]);
+    return 1;
+  }
+  bit16_run_result result;
+  bit16_run(machine, max_cycles, NULL, &result);
+  if (result.reason != BIT16_STOP_HALT) {
+    fprintf(stderr, "%s did not halt, stopped at %04x\n", argv[1],
+            result.pc);
+    return 1;
+  }
+
+  static const char* names[] = {"A", "B", "C", "D", "E", "SR", "HL", "F"};
+  uint16_t registers[BIT16_REGISTER_COUNT];
+  bit16_get_registers(machine, registers);
+  for (int reg = 0; reg < 8; reg++) {
+    if (reg != 6) printf("%s=%04x ", names[reg], registers[reg]);
+  }
+  /* FNV-1a over 0x8000-0xFEFF */
+  static uint16_t memory[0x7f00];
+  bit16_read_memory(machine, 0x8000, memory, 0x7f00);
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < 0x7f00; i++) {
+    hash = (hash ^ memory[i]) * 16777619u;
+  }
+  printf("memory=%08" PRIx32 "\n", hash);
+  printf("%" PRIu64 " cycles\n", result.cycles);
+  bit16_destroy(machine);
+  return 0;
+}
@@ -0,0 +1,860 @@
+#!/usr/bin/env bash
+# Regression smoke checks: builds the tools into a scratch directory, runs them
+# on small programs and compares what they do with known results.
+#
+#   tests/smoke.sh [SECTION...]
+#
+# runs every section by default. CC and CXX override the compilers.
+set -u
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+E=$ROOT/Bit16_Emulator
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+CC=${CC:-cc}
+CXX=${CXX:-g++}
+failures=0
+section=
+
+fail() {
+  echo "FAIL $section: $*"
+  failures=$((failures + 1))
+}
+
+# build NAME ARGS...: compiles the tool NAME into $WORK, once
+build() {
+  local name=$1
+  shift
+  [ -x "$WORK/$name" ] && return 0
+  $CXX -std=c++20 -O2 -o "$WORK/$name" "$@" || {
+    fail "cannot build $name"
+    return 1
+  }
+}
+
+# assemble ARGS...: runs the assembler in $WORK, quietly
+assemble() {
+  build bit16-asm "$ROOT"/asm/*.cpp -lpthread || return 1
+  "$WORK/bit16-asm" "$@" > /dev/null || {
+    fail "bit16-asm $* failed"
+    return 1
+  }
+}
+
+# the emulator, as Bit16
+build_emulator() {
+  build Bit16 "$E"/{emu,Bus,cpu,kbd,screen,coverage,perfCounters}.cpp \
+    "$E"/{memoryChecker,idleLoop,throttle,multiCore,plugin,trace}.cpp \
+    "$E"/{gdbStub,romWatcher}.cpp -lncurses -lpthread -ldl
+}
+
+# tests/bit16-state.c on libbit16, as bit16-state
+build_state() {
+  build bit16-state "$ROOT"/tests/bit16-state.c \
+    "$E"/{libbit16,Bus,cpu,idleLoop,kbd,screen,memoryChecker}.cpp \
+    -lncurses -lpthread
+}
+
+# expect_status EXPECTED ACTUAL WHAT
+expect_status() {
+  [ "$2" -eq "$1" ] || fail "$3 exited with $2, expected $1"
+}
+
+# words FILE OFFSET COUNT: 16-bit words of FILE as hex, e.g. "002a 0007"
+words() {
+  od -An -tx2 -v -j $(($2 * 2)) -N $(($3 * 2)) "$1" | xargs
+}
+
+# bit16-fuzz: a check violation behind two exact RAM words is found, saved
+# and reported in the exit status
+smoke_fuzz() {
+  build bit16-fuzz "$E"/{fuzz,Bus,cpu,idleLoop,kbd,screen,memoryChecker}.cpp \
+    -lncurses || return
+  cat > magic.asm << 'EOF'
+; writes ROM, a --check violation, once RAM starts with 0x2A, 0x07
+    LI E, 0xc000
+    LW A, E
+    SUB A, 0x2a
+    JZ A, first
+    HALT
+first:
+    ADD E, 1
+    LW A, E
+    SUB A, 7
+    JZ A, second
+    HALT
+second:
+    SW 0, A
+    HALT
+EOF
+  assemble -i magic.asm || return
+  ./bit16-fuzz -i magic.bin -T ram -n 100000 -k -o findings > fuzz.log 2>&1
+  expect_status 2 $? bit16-fuzz
+  grep -q "findings 1," fuzz.log || fail "expected one finding: $(tail -1 fuzz.log)"
+  [ -f findings/crashes/check-000e ] &&
+    [ "$(words findings/crashes/check-000e 0 2)" = "002a 0007" ] ||
+    fail "no crash case starting 002a 0007 for the SW at 000e"
+}
+
+# bit16-conformance: the engines agree with the reference model
+smoke_conformance() {
+  build bit16-conformance "$E"/{conformance,Bus,cpu,idleLoop,memoryChecker}.cpp \
+    -lpthread || return
+  ./bit16-conformance -n 20000 -s 7 > conformance.log 2>&1
+  expect_status 0 $? bit16-conformance
+  grep -q "^20000 cases passed" conformance.log ||
+    fail "$(head -3 conformance.log)"
+}
+
+# device plugins: a program counts 100 IRQs of the sample timer, in process
+# and in a device process. Waiting for the next IRQ is skipped over unless -F,
+# which must not change the cycle count.
+smoke_plugins() {
+  build_emulator || return
+  build timer.so -shared -fPIC "$E"/plugins/timer.cpp || return
+  cat > irq.asm << 'EOF'
+; halts after the 100th timer IRQ, each one acknowledged by clearing 0xFE00
+    MW B, 0
+    MW C, 0
+    LI E, 0xfe00
+loop:
+    LI HL, wait
+wait:
+    LW A, E
+    JMPZ A
+    SW E, C
+    ADD B, 1
+    MW D, B
+    SUB D, 100
+    JN D, loop
+    HALT
+EOF
+  assemble -i irq.asm || return
+  local timer=./timer.so@0xfe10:2,irq=0,arg=1000 flags cycles
+  for flags in -F ""; do
+    ./Bit16 -i irq.bin -D $timer $flags -u > plugin.log 2>&1
+    expect_status 0 $? "Bit16 -D $flags"
+    grep -q "^100032 guest cycles, 25160 instructions" plugin.log ||
+      fail "in process $flags: $(tail -1 plugin.log)"
+  done
+  ./Bit16 -i irq.bin -D $timer,remote -u -m 1000000 > remote.log 2>&1
+  expect_status 0 $? "Bit16 -D ...,remote"
+  cycles=$(sed -n 's/^\([0-9]*\) guest cycles.*/\1/p' remote.log)
+  [ "${cycles:-0}" -ge 100000 ] && [ "$cycles" -lt 1000000 ] ||
+    fail "remote: no halt after 100 IRQs: $(tail -1 remote.log)"
+}
+
+# --trace and bit16-pipeline: the trace holds every instruction, and the
+# unpipelined timing matches the emulator's own cycle count
+smoke_pipeline() {
+  build_emulator || return
+  build bit16-pipeline "$E"/pipeline.cpp -lpthread || return
+  cat > sum.asm << 'EOF'
+; sums 100 down to 1 into A, storing every partial sum
+    MW A, 0
+    MW B, 100
+    LI E, 0xc000
+loop:
+    ADD A, B
+    SW E, A
+    SUB B, 1
+    JZ B, done
+    JMP loop
+done:
+    HALT
+EOF
+  assemble -i sum.asm || return
+  ./Bit16 -i sum.bin -u -t sum.b16t > trace.log 2>&1
+  expect_status 0 $? "Bit16 -t"
+  grep -q "^2311 guest cycles, 704 instructions" trace.log ||
+    fail "emulator: $(tail -1 trace.log)"
+  ./bit16-pipeline -f -p 2 sum.b16t > pipeline.log 2>&1
+  expect_status 0 $? bit16-pipeline
+  grep -q "^704 instructions, 100 taken jumps" pipeline.log &&
+    grep -q "^Pipelined: *907 cycles" pipeline.log &&
+    grep -q "^Unpipelined: *2311 cycles" pipeline.log ||
+    fail "$(head -4 pipeline.log)"
+}
+
+# bit16-asm -W and bit16-wcet: the worst case of a bounded loop is the cycle
+# count the emulator runs, and going over a budget fails
+smoke_wcet() {
+  build_emulator || return
+  build bit16-wcet "$E"/wcet.cpp || return
+  build bit16-asm "$ROOT"/asm/*.cpp -lpthread || return
+  cat > copy.asm << 'EOF'
+; copies 64 words from 0xC000 to 0xC100
+.bound copy_loop 64
+.budget copy 2000
+copy:
+    LI E, 0xc000
+    LI D, 0xc100
+    MW C, 64
+copy_loop:
+    LW A, E
+    SW D, A
+    ADD E, 1
+    ADD D, 1
+    SUB C, 1
+    JZ C, copied
+    JMP copy_loop
+copied:
+    HALT
+EOF
+  ./bit16-asm -d -W -i copy.asm > asm.log 2>&1
+  expect_status 0 $? "bit16-asm -W"
+  grep -q "^copy (0x0000): best 47, worst 1937 cycles" asm.log ||
+    fail "bit16-asm -W: $(head -1 asm.log)"
+  ./Bit16 -i copy.bin -u > run.log 2>&1
+  grep -q "^1937 guest cycles" run.log || fail "emulator: $(tail -1 run.log)"
+  ./bit16-wcet -b copy_loop:64 -r copy:2000 copy.bin > wcet.log 2>&1
+  expect_status 0 $? bit16-wcet
+  grep -q "worst 1937 cycles" wcet.log || fail "bit16-wcet: $(head -1 wcet.log)"
+  ./bit16-wcet -b copy_loop:64 -r copy:1900 copy.bin > /dev/null 2>&1
+  expect_status 1 $? "bit16-wcet over its budget"
+  sed -i 's/budget copy 2000/budget copy 1900/' copy.asm
+  ./bit16-asm -W -i copy.asm > /dev/null 2>&1
+  expect_status 1 $? "bit16-asm -W over its budget"
+}
+
+# rsp PACKET: sends a GDB remote protocol packet on fd 3, prints the reply
+rsp() {
+  local packet=$1 sum=0 i c reply
+  for ((i = 0; i < ${#packet}; i++)); do
+    printf -v c '%d' "'${packet:i:1}"
+    sum=$(((sum + c) & 255))
+  done
+  printf '$%s#%02x' "$packet" $sum >&3
+  IFS= read -r -t 5 -d '#' -u 3 reply || return 1
+  read -r -t 5 -n 2 -u 3
+  printf + >&3
+  echo "${reply##*\$}"
+}
+
+# --gdb: a debugger stops the program at a breakpoint, reads its registers
+# and lets it run to the end
+smoke_gdb() {
+  build_emulator || return
+  cat > regs.asm << 'EOF'
+; A = 5 + 7 at the breakpoint on done (0x0003)
+    MW A, 5
+    MW B, 7
+    ADD A, B
+done:
+    HALT
+EOF
+  assemble -i regs.asm || return
+  local port=$((20000 + RANDOM % 20000)) pid reply i
+  # A = 0x0c, B = 7, ..., PC = 3
+  local registers=0c000700000000000000000000000000ffff0300
+  # created up front, the background job may not have opened it yet
+  : > gdb.log
+  ./Bit16 -i regs.bin -g $port -u > gdb.log 2>&1 &
+  pid=$!
+  for ((i = 0; i < 50; i++)); do
+    grep -q "^Waiting for a debugger" gdb.log && break
+    sleep 0.1
+  done
+  exec 3<> /dev/tcp/127.0.0.1/$port || {
+    fail "cannot connect to port $port: $(tail -1 gdb.log)"
+    kill $pid
+    return
+  }
+  reply="$(rsp '?') $(rsp Z0,3,1) $(rsp c) $(rsp g) $(rsp c)"
+  exec 3>&-
+  [ "$reply" = "S05 OK T05swbreak:; $registers W00" ] || {
+    fail "replies: $reply"
+    kill $pid
+  }
+  wait $pid
+  expect_status 0 $? "Bit16 -g"
+  grep -q "^11 guest cycles, 3 instructions" gdb.log ||
+    fail "emulator: $(tail -1 gdb.log)"
+}
+
+# --watch: reassembling the ROM patches the loop a running program spins in,
+# which then halts
+smoke_watch() {
+  build_emulator || return
+  cat > spin.asm << 'EOF'
+; spins until the ROM is rewritten to set A in the loop
+spin:
+    MW A, 0
+    JZ A, spin
+    HALT
+EOF
+  assemble -i spin.asm || return
+  local pid i cycles
+  ./Bit16 -i spin.bin -w -H 1000000 -m 10000000 > watch.log 2>&1 &
+  pid=$!
+  for ((i = 0; i < 50; i++)); do
+    grep -q "^Device List" watch.log && break
+    sleep 0.1
+  done
+  sed -i 's/MW A, 0/MW A, 1/' spin.asm
+  # rewritten until seen, in case the watch had not started yet
+  for ((i = 0; i < 50; i++)); do
+    assemble -i spin.asm || break
+    sleep 0.1
+    grep -q "^Reloaded" watch.log || ! kill -0 $pid 2> /dev/null && break
+  done
+  wait $pid
+  expect_status 0 $? "Bit16 -w"
+  grep -q "^Reloaded the ROM, 1 words changed" watch.log ||
+    fail "no reload: $(tail -1 watch.log)"
+  cycles=$(sed -n 's/^\([0-9]*\) guest cycles.*/\1/p' watch.log)
+  [ "${cycles:-10000000}" -lt 10000000 ] ||
+    fail "no halt after the reload: $(tail -1 watch.log)"
+}
+
+# bit16-gen: every kernel is the same program for a seed, its source assembles
+# to the ROM it writes, and it halts under --check in a known cycle count
+smoke_gen() {
+  build_emulator || return
+  build bit16-gen "$E"/generator.cpp || return
+  local kernel words cycles
+  while read -r kernel words cycles; do
+    ./bit16-gen -s 42 -k $kernel -c 3 -o $kernel.asm > gen.log 2>&1 &&
+      ./bit16-gen -s 42 -k $kernel -c 3 -o $kernel-gen.bin >> gen.log 2>&1
+    expect_status 0 $? "bit16-gen -k $kernel"
+    [ "$(grep -c "^$words words written" gen.log)" -eq 2 ] ||
+      fail "$kernel: $(head -1 gen.log)"
+    assemble -i $kernel.asm || continue
+    cmp -s $kernel.bin $kernel-gen.bin ||
+      fail "$kernel: the source does not assemble to the generated ROM"
+    ./Bit16 -i $kernel.bin -k -u < /dev/null > run.log 2>&1
+    expect_status 0 $? "Bit16 -k on $kernel"
+    grep -q "^$cycles guest cycles" run.log ||
+      fail "$kernel: $(tail -1 run.log)"
+  done << 'EOF'
+alu 184 11034
+memory 370 199938
+stack 206 12728
+jump 258 12573
+EOF
+}
+
+# segmented .img ROMs: a program with a gap is stored as two segments and
+# runs, and segments that do not fit the 64K words are rejected, including a
+# length that wraps address + length around 2^32. bit16-wcet is built with
+# AddressSanitizer where the compiler has it, to catch writes past memory.
+smoke_image() {
+  build_emulator || return
+  cat > seg.asm << 'EOF'
+; jumps over 16K words of nothing
+    LI E, 0xc000
+    LI HL, far
+    JMPZ 0
+.org 0x4000
+far:
+    MW A, 42
+    SW E, A
+    HALT
+EOF
+  assemble -g -i seg.asm || return
+  [ "$(wc -c < seg.img)" -eq 44 ] || fail "seg.img is $(wc -c < seg.img) bytes"
+  ./Bit16 -i seg.img -k -u > image.log 2>&1
+  expect_status 0 $? "Bit16 on seg.img"
+  grep -q "^28 guest cycles, 9 instructions" image.log ||
+    fail "$(tail -1 image.log)"
+
+  local sanitize=-fsanitize=address image
+  $CXX $sanitize -x c++ -o /dev/null - <<< 'int main() {}' 2> /dev/null ||
+    sanitize=
+  build bit16-wcet-asan $sanitize "$E"/wcet.cpp || return
+  # "B16I", version 1, no entry, one segment, then the segment's address and
+  # length and 4 words of data
+  local header='B16I\x01\x00\x00\x00\x00\x00\x01\x00\x00\x00'
+  local data='\x01\x00\x02\x00\x03\x00\x04\x00'
+  printf "$header"'\xff\xff\x02\x00\xff\xff'"$data" > wrap.img
+  printf "$header"'\xfe\xff\x04\x00\x00\x00'"$data" > past-end.img
+  printf "$header"'\x00\x00\x08\x00\x00\x00'"$data" > truncated.img
+  for image in wrap past-end truncated; do
+    ./Bit16 -i $image.img -u > image.log 2>&1
+    expect_status 1 $? "Bit16 on $image.img"
+    grep -q "^Malformed ROM image" image.log ||
+      fail "$image.img: $(tail -1 image.log)"
+    ./bit16-wcet-asan $image.img > image.log 2>&1
+    expect_status 1 $? "bit16-wcet on $image.img"
+    grep -q "^Failed to load" image.log ||
+      fail "$image.img: $(grep -m1 ERROR image.log || tail -1 image.log)"
+  done
+}
+
+# --cache-dir: a second build is a hit with the same output, and an entry
+# with damaged counts or cut short is a miss that rebuilds it
+smoke_cache() {
+  build bit16-asm "$ROOT"/asm/*.cpp -lpthread || return
+  printf '    MW A, 1\n    ADD A, 2\n    HALT\n' > cached.asm
+  ./bit16-asm -C cache -i cached.asm > cache.log 2>&1 &&
+    cp cached.bin first.bin &&
+    ./bit16-asm -C cache -i cached.asm > cache.log 2>&1
+  expect_status 0 $? "bit16-asm -C"
+  grep -q "cached$" cache.log || fail "no hit: $(cat cache.log)"
+  cmp -s cached.bin first.bin || fail "a hit restored another .bin"
+  local entry damage
+  entry=$(echo cache/*.b16c)
+  # "B16C" u16 version u32 file_count, then ".bin" and its u32 size
+  for damage in "6 \xff\xff\xff\xff" "16 \xff\xff\xff\xff" "20 cut"; do
+    if [ "${damage#* }" = cut ]; then
+      truncate -s "${damage% *}" "$entry"
+    else
+      printf "${damage#* }" |
+        dd of="$entry" bs=1 seek="${damage% *}" conv=notrunc 2> /dev/null
+    fi
+    ./bit16-asm -C cache -i cached.asm > cache.log 2>&1
+    expect_status 0 $? "bit16-asm -C with the entry damaged at ${damage% *}"
+    grep -q "cached$" cache.log && fail "a damaged entry was a hit"
+    cmp -s cached.bin first.bin || fail "the rebuild differs"
+  done
+}
+
+# -d debug info: the emulator and bit16-wcet read the .dbg, and one with
+# damaged counts or a range longer than memory is refused
+smoke_debug() {
+  build_emulator || return
+  build bit16-wcet "$E"/wcet.cpp || return
+  cat > dbg.asm << 'EOF'
+; counts A down from 3
+start:
+    MW A, 3
+loop:
+    SUB A, 1
+    JZ A, done
+    JMP loop
+done:
+    HALT
+EOF
+  assemble -d -i dbg.asm || return
+  cp dbg.dbg good.dbg
+  ./Bit16 -i dbg.bin -L dbg.info > debug.log 2>&1
+  expect_status 0 $? "Bit16 -L"
+  grep -q "^SF:dbg.asm" dbg.info || fail "no dbg.asm in the lcov file"
+  ./bit16-wcet -b loop:3 -r start dbg.bin > debug.log 2>&1
+  expect_status 0 $? "bit16-wcet -r start"
+  local offset
+  # "B16D" u16 version, the u32 file, range and label counts, the file name
+  # dbg.asm, then the first range's u16 address and u32 length
+  for offset in 6 10 14 29; do
+    cp good.dbg dbg.dbg
+    printf '\xff\xff\xff\xff' |
+      dd of=dbg.dbg bs=1 seek=$offset conv=notrunc 2> /dev/null
+    ./Bit16 -i dbg.bin -L dbg.info > debug.log 2>&1
+    expect_status 1 $? "Bit16 -L with the .dbg damaged at $offset"
+    grep -q "^lcov export needs" debug.log ||
+      fail "damaged at $offset: $(tail -1 debug.log)"
+    ./bit16-wcet -b loop:3 -r start dbg.bin > debug.log 2>&1
+    expect_status 1 $? "bit16-wcet with the .dbg damaged at $offset"
+  done
+}
+
+# Every -O rewrite on its own, then the sample programs: the optimized build
+# has to compute the same registers and memory in no more cycles
+smoke_optimizer() {
+  build bit16-asm "$ROOT"/asm/*.cpp -lpthread || return
+  build_state || return
+  mkdir -p plain optimized
+  cat > reload.asm << 'EOF'
+; the second LI and @table reload what HL and D already hold
+    LI D, 0x1234
+    MWH 0x90
+    MWL 0x00
+    SW HL, D
+    LI D, 0x1234
+    MWH 0x90
+    MWL 0x00
+    LW A, HL
+    @table
+    LW B, HL
+    @table
+    LW C, HL
+    HALT
+table:
+    MW D, 7
+EOF
+  cat > next.asm << 'EOF'
+; jumps to the next instruction and MW X, X do nothing
+    MW A, 3
+    JMP next
+next:
+    MW A, A
+    ADD A, 1
+    JZ A, done
+done:
+    HALT
+EOF
+  cat > fold.asm << 'EOF'
+; constant ALU results whose flags nobody reads become plain loads
+    MW A, 20
+    ADD A, 5
+    MW B, 0x0f
+    AND B, 0x3c
+    MW C, 9
+    SUB C, 4
+    MW F, 0
+    HALT
+EOF
+  cat > unreachable.asm << 'EOF'
+; nothing after a JMP or HALT runs until the next label
+    MW A, 1
+    JMP over
+    MW A, 2
+    ADD A, 3
+over:
+    MW B, A
+    HALT
+    MW B, 9
+EOF
+  cat > dead.asm << 'EOF'
+; writes overwritten before anything reads them
+    MW A, 5
+    MW A, 6
+    MW C, 1
+    MW C, A
+    MWL 0x10
+    MWL 0x20
+    MWH 0x90
+    SW HL, C
+    HALT
+EOF
+  cat > call.asm << 'EOF'
+; CALL, RET and a loop around them
+    MW A, 0
+    MW B, 4
+loop:
+    CALL add3
+    SUB B, 1
+    JZ B, done
+    JMP loop
+done:
+    HALT
+add3:
+    ADD A, 3
+    RET
+EOF
+  cat > bank.asm << 'EOF'
+; MW SR, 1 looks dead before MW SR, 0, but selects the ports for SW
+    MW E, 0x10
+    MW A, 0x41
+    MW SR, 1
+    SW E, A
+    MW SR, 0
+    HALT
+EOF
+  local program name state
+  for program in {reload,next,fold,unreachable,dead,call,bank}.asm \
+    "$ROOT"/programs/*.asm; do
+    name=$(basename "$program" .asm)
+    cp "$program" plain/ && cp "$program" optimized/
+    assemble -i "plain/$name.asm" && assemble -O -i "optimized/$name.asm" ||
+      continue
+    for build in plain optimized; do
+      ./bit16-state "$build/$name.bin" > "$build/$name.state" ||
+        fail "$build $name did not halt"
+    done
+    state=$(head -1 plain/$name.state)
+    [ "$(head -1 optimized/$name.state)" = "$state" ] ||
+      fail "-O changed $name: $state, now $(head -1 optimized/$name.state)"
+    [ "$(sed 's/ .*//;1d' optimized/$name.state)" -le \
+      "$(sed 's/ .*//;1d' plain/$name.state)" ] ||
+      fail "-O made $name slower: $(tail -qn1 {plain,optimized}/$name.state)"
+  done
+  cmp -s plain/bank.bin optimized/bank.bin ||
+    fail "-O removed an SR write LW or SW depend on"
+  cmp -s plain/fold.bin optimized/fold.bin &&
+    fail "-O rewrote nothing, are the patterns still there?"
+}
+
+# Two modules linked into one ROM, then bad -b values and a relocation past
+# the end of its object
+smoke_link() {
+  build_state || return
+  local sanitize=-fsanitize=address
+  $CXX $sanitize -x c++ -o /dev/null - <<< 'int main() {}' 2> /dev/null ||
+    sanitize=
+  build bit16-ld-asan $sanitize "$ROOT"/linker/ld.cpp || return
+  cat > main.asm << 'EOF'
+; stores triple(14) at 0xC000
+.extern triple
+    MW A, 14
+    CALL triple
+    LI E, 0xc000
+    SW E, A
+    HALT
+EOF
+  cat > lib.asm << 'EOF'
+.global triple
+triple:
+    MW B, A
+    ADD A, B
+    ADD A, B
+    RET
+EOF
+  assemble -r -i main.asm -i lib.asm || return
+  ./bit16-ld-asan -m -o linked.bin main.o16 lib.o16 > link.log 2>&1
+  expect_status 0 $? bit16-ld
+  grep -q "^  [0-9a-f]* triple (global)" link.log ||
+    fail "map: $(cat link.log)"
+  ./bit16-state linked.bin > run.log 2>&1
+  expect_status 0 $? "bit16-state on linked.bin"
+  grep -q "^A=002a B=000e .* memory=" run.log && grep -q "^55 cycles" run.log ||
+    fail "$(cat run.log)"
+
+  local base
+  for base in 12abc 0x10000 99999999999; do
+    ./bit16-ld-asan -b $base main.o16 lib.o16 > link.log 2>&1
+    expect_status 1 $? "bit16-ld -b $base"
+    grep -q "^Usage: -b" link.log || fail "-b $base: $(tail -1 link.log)"
+  done
+  # the relocations are the last field, make the last one's offset 2^32 - 1
+  cp main.o16 bad.o16
+  printf '\xff\xff\xff\xff' | dd of=bad.o16 bs=1 conv=notrunc \
+    seek=$(($(wc -c < bad.o16) - 8)) 2> /dev/null
+  ./bit16-ld-asan -o bad.bin bad.o16 lib.o16 > link.log 2>&1
+  expect_status 1 $? "bit16-ld on a relocation past the end"
+  grep -q "Malformed relocation in bad.o16" link.log ||
+    fail "$(grep -m1 ERROR link.log || tail -1 link.log)"
+}
+
+# Two cores add to one counter under the spinlock. Core 0 halts only if no
+# increment was lost, however the host scheduled the threads
+smoke_multicore() {
+  build_emulator || return
+  cat > shared.asm << 'EOF'
+; each core adds 1 to the counter at 0xC000 200 times, holding the lock at
+; 0xFDFF around each read-modify-write, then sets its flag at 0xC001 + A
+    LI D, 0xfdff
+    LI E, 0xc000
+    MW B, 200
+lock:
+    LW C, D
+    JZ C, locked
+    JMP lock
+locked:
+    LW C, E
+    ADD C, 1
+    SW E, C
+    MW C, 0
+    SW D, C
+    SUB B, 1
+    JZ B, done
+    JMP lock
+done:
+    LI E, 0xc001
+    ADD E, A
+    MW C, 1
+    SW E, C
+    JZ A, join
+    HALT
+; core 0 waits for core 1, then halts if the counter reached 400
+join:
+    LI E, 0xc002
+wait:
+    LW C, E
+    JZ C, wait
+    LI E, 0xc000
+    LW C, E
+    LI D, 400
+    SUB C, D
+    JZ C, correct
+lost:
+    JMP lost
+correct:
+    HALT
+EOF
+  assemble -i shared.asm || return
+  local run
+  for run in 1 2 3 4 5; do
+    ./Bit16 -i shared.bin -n 2 -s -q 100 -u -m 1000000 > cores.log 2>&1
+    expect_status 0 $? "Bit16 -n 2, run $run"
+    grep -q "^Core 0: .*, halted$" cores.log &&
+      grep -q "^Core 1: .*, halted$" cores.log ||
+      fail "run $run lost an increment: $(grep ^Core cores.log | xargs)"
+  done
+}
+
+# -S writes while it assembles, but has to write the same files as a normal
+# run, also for a source longer than its read buffer
+smoke_stream() {
+  build bit16-asm "$ROOT"/asm/*.cpp -lpthread || return
+  {
+    echo "; forward jumps through 2000 blocks, 80K of source"
+    echo ".entry block1"
+    for i in $(seq 2000); do
+      [ "$i" -eq 1000 ] && echo ".org 0x4000"
+      printf 'block%d:\n    ADD A, %d\n    JZ A, block%d\n' \
+        "$i" $((i % 256)) $((i + 1))
+    done
+    printf 'block2001:\n    HALT\n'
+  } > big.asm
+  [ "$(wc -c < big.asm)" -gt 65536 ] || fail "big.asm fits one buffer"
+  local program name flags file
+  for program in big.asm "$ROOT"/programs/*.asm; do
+    name=$(basename "$program" .asm)
+    for flags in "" -g -c -d "-s 64"; do
+      rm -rf whole streamed
+      mkdir whole streamed
+      cp "$program" whole/ && cp "$program" streamed/
+      # from inside, as the .dbg records the source path
+      cd whole && assemble $flags -i "$name.asm"
+      cd ../streamed && assemble -S $flags -i "$name.asm"
+      cd ..
+      [ "$(ls whole)" = "$(ls streamed)" ] ||
+        fail "$name $flags: -S wrote $(ls streamed | xargs)"
+      for file in whole/*; do
+        cmp -s "$file" "streamed/${file#whole/}" ||
+          fail "$name $flags: -S changed ${file#whole/}"
+      done
+    done
+  done
+}
+
+# lcov line hits, first of a run cut short by -m and then merged with a full
+# run of the same ROM
+smoke_coverage() {
+  build_emulator || return
+  cat > cov.asm << 'EOF'
+; counts A down from 3, the MW B after HALT never runs
+start:
+    MW A, 3
+loop:
+    SUB A, 1
+    JZ A, done
+    JMP loop
+done:
+    HALT
+    MW B, 1
+EOF
+  assemble -d -i cov.asm || return
+  local runs
+  for runs in "-m 6:3,1 5,1 6,0 7,0 9,0 10,0 LH:2 LF:6" \
+    ":3,1 5,1 6,1 7,1 9,1 10,0 LH:5 LF:6"; do
+    ./Bit16 -i cov.bin -c cov.cov -L cov.info -u ${runs%%:*} > cov.log 2>&1
+    expect_status 0 $? "Bit16 -c -L ${runs%%:*}"
+    [ "$(grep '^DA:\|^L[HF]:' cov.info | sed 's/^DA://' | xargs)" = \
+      "${runs#*:}" ] || fail "${runs%%:*}: $(xargs < cov.info)"
+  done
+  grep -q "^SF:cov.asm$" cov.info || fail "no SF:cov.asm"
+}
+
+# -k stops with status 2 on each kind of guest bug, and not on the same
+# accesses done right
+smoke_check() {
+  build_emulator || return
+  printf '    LI E, 0xc000\n    LW A, E\n    HALT\n' > uninit.asm
+  printf '    MW E, 0x10\n    MW A, 1\n    SW E, A\n    HALT\n' > rom.asm
+  printf 'loop:\n    PUSH A\n    JMP loop\n' > overflow.asm
+  cat > clean.asm << 'EOF'
+    LI E, 0xc000
+    SW E, E
+    LW A, E
+    PUSH A
+    POP B
+    HALT
+EOF
+  local bug
+  for bug in "uninit:read of uninitialized memory c000 at PC 0003 (LW A,E)" \
+    "rom:write to ROM 0010 at PC 0002 (SW E,A)" \
+    "overflow:stack overflow, push to feff at PC 0000 (PUSH A)"; do
+    assemble -i ${bug%%:*}.asm || continue
+    ./Bit16 -i ${bug%%:*}.bin -k -u > check.log 2>&1
+    expect_status 2 $? "Bit16 -k on ${bug%%:*}.asm"
+    grep -qF "check: ${bug#*:}, cycle" check.log ||
+      fail "${bug%%:*}: $(grep -m1 ^check: check.log || tail -1 check.log)"
+  done
+  assemble -i clean.asm || return
+  ./Bit16 -i clean.bin -k -u > check.log 2>&1
+  expect_status 0 $? "Bit16 -k on clean.asm"
+  grep -q "^check:" check.log && fail "clean.asm: $(grep ^check: check.log)"
+}
+
+# -H paces the guest clock: the same cycles as a flat-out run, in real time
+# for both a busy loop and an idle one, sleeping rather than spinning
+smoke_throttle() {
+  build_emulator || return
+  cat > busy.asm << 'EOF'
+; a loop that cannot be fast-forwarded, 230017 cycles
+    MW A, 0
+    LI B, 10000
+    LI E, 0xc000
+loop:
+    ADD A, B
+    SW E, A
+    SUB B, 1
+    JZ B, done
+    JMP loop
+done:
+    HALT
+EOF
+  printf 'spin:\n    JMP spin\n' > idle.asm
+  assemble -i busy.asm && assemble -i idle.asm || return
+  # FLAGS:CYCLES:SECONDS:MAX_SECONDS, wall clock time as the emulator reports
+  local run flags cycles min max seconds cpu TIMEFORMAT=%U
+  for run in "busy.bin -u:230017:0:0.05" "busy.bin -H 1000000:230017:0.2:1" \
+    "idle.bin -H 1000000 -m 300000:300002:0.29:1"; do
+    IFS=: read -r flags cycles min max <<< "$run"
+    cpu=$({ time ./Bit16 -i $flags < /dev/null > throttle.log 2>&1; } 2>&1)
+    grep -q "^$cycles guest cycles" throttle.log ||
+      fail "$flags: $(tail -1 throttle.log)"
+    seconds=$(sed -n 's/.* in \([0-9.]*\) s:.*/\1/p' throttle.log)
+    awk "BEGIN { exit !(${seconds:-9} >= $min && ${seconds:-9} < $max) }" ||
+      fail "$flags took $seconds s"
+    # -H sleeps between slices instead of spinning
+    awk "BEGIN { exit !($cpu < 0.1) }" || fail "$flags used $cpu s of CPU"
+  done
+}
+
+# A C host drives a ROM through libbit16: an idle stop, input from the host,
+# breakpoint stops and resumes up to the HALT, then the results
+smoke_embed() {
+  build libbit16.so -shared -fPIC \
+    "$E"/{libbit16,Bus,cpu,idleLoop,kbd,screen,memoryChecker}.cpp || return
+  $CC -std=c99 -Wall -Werror -o bit16-embed "$ROOT"/tests/bit16-embed.c \
+    -L. -lbit16 -Wl,-rpath,"$WORK" || {
+    fail "cannot build bit16-embed"
+    return
+  }
+  cat > embed.asm << 'EOF'
+; waits for the host to store N at 0xC000, sums N down to 1 into A and
+; stores the sum at 0xC001
+    LI E, 0xc000
+wait:
+    LW B, E
+    JZ B, wait
+    MW A, 0
+.org 0x0010
+loop:
+    ADD A, B
+    SUB B, 1
+    JZ B, done
+    JMP loop
+done:
+    ADD E, 1
+    SW E, A
+    HALT
+EOF
+  assemble -i embed.asm || return
+  ./bit16-embed embed.bin > embed.log 2>&1
+  expect_status 0 $? bit16-embed
+  grep -q "^255 cycles, 10 breakpoint stops$" embed.log ||
+    fail "$(tail -1 embed.log)"
+}
+
+SECTIONS="fuzz conformance plugins pipeline wcet gdb watch gen image cache
+  debug optimizer link multicore stream coverage check throttle
+  embed"
+
+cd "$WORK" || exit 1
+for section in ${@:-$SECTIONS}; do
+  before=$failures
+  if ! declare -F "smoke_$section" > /dev/null; then
+    fail "no such section"
+    continue
+  fi
+  "smoke_$section"
+  [ $failures -eq $before ] && echo "ok   $section"
+done
+[ $failures -eq 0 ] || {
+  echo "$failures failed"
+  exit 1
+}